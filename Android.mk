@@ -6,5 +6,10 @@ LOCAL_SRC_FILES:= mkvparser.cpp \
                   mkvreader.cpp \
                   mkvmuxer.cpp \
                   mkvmuxerutil.cpp \
-                  mkvwriter.cpp
+                  mkvwriter.cpp \
+                  mkvbufferedwriter.cpp \
+                  mkvmemorywriter.cpp \
+                  mkvasyncwriter.cpp \
+                  mkvdirectwriter.cpp \
+                  mkvencryptor.cpp
 include $(BUILD_STATIC_LIBRARY)
@@ -8,6 +8,7 @@
 #ifndef LIBWEBM_COMMON_LIBWEBM_UTILS_H_
 #define LIBWEBM_COMMON_LIBWEBM_UTILS_H_
 
+#include <cstdint>
 #include <cstdio>
 #include <memory>
 #include <vector>
@@ -0,0 +1,392 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvasyncwriter.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace mkvmuxer {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+uint64 NanosecondsSince(const Clock::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+      .count();
+}
+
+}  // namespace
+
+struct AsyncMkvWriter::Queue {
+  // A buffer handed to the I/O thread.
+  struct Entry {
+    uint8* data;
+    int64 start;
+    uint32 length;
+  };
+
+  explicit Queue(int32 count)
+      : count(count),
+        storage(NULL),
+        free_buffers(NULL),
+        free_count(0),
+        entries(NULL),
+        head(0),
+        queued(0),
+        busy(false),
+        stop(false),
+        error(false) {}
+
+  ~Queue() {
+    delete[] storage;
+    delete[] free_buffers;
+    delete[] entries;
+  }
+
+  // Writes queued buffers to |writer| until |stop| is set and the queue is
+  // empty.
+  void Run(IMkvWriter* writer, Stats* stats);
+
+  std::mutex mutex;
+
+  // Signalled when a buffer is queued or |stop| is set.
+  std::condition_variable work;
+
+  // Signalled when the I/O thread has written a buffer.
+  std::condition_variable done;
+
+  std::thread thread;
+
+  const int32 count;
+
+  // Backing store for all the buffers.
+  uint8* storage;
+
+  // Buffers that are neither being filled nor queued.
+  uint8** free_buffers;
+  int32 free_count;
+
+  // Ring of |count| entries; |queued| of them are waiting from |head| on.
+  Entry* entries;
+  int32 head;
+  int32 queued;
+
+  // True while the I/O thread is writing a buffer.
+  bool busy;
+
+  bool stop;
+
+  // Set when the underlying writer fails; nothing is written after that.
+  bool error;
+};
+
+void AsyncMkvWriter::Queue::Run(IMkvWriter* writer, Stats* stats) {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (;;) {
+    while (queued == 0 && !stop)
+      work.wait(lock);
+
+    if (queued == 0)
+      return;
+
+    const Entry entry = entries[head];
+    head = (head + 1) % count;
+    --queued;
+    busy = true;
+
+    const bool skip = error;
+    lock.unlock();
+
+    bool seeked = false;
+    bool ok = true;
+    const Clock::time_point start = Clock::now();
+
+    if (!skip) {
+      if (writer->Position() != entry.start) {
+        seeked = true;
+        ok = writer->Position(entry.start) == 0;
+      }
+
+      if (ok)
+        ok = writer->Write(entry.data, entry.length) == 0;
+    }
+
+    const uint64 write_time = NanosecondsSince(start);
+    lock.lock();
+
+    if (!skip) {
+      if (ok) {
+        ++stats->buffers_written;
+        stats->bytes_written += entry.length;
+      } else {
+        error = true;
+      }
+
+      if (seeked)
+        ++stats->seeks;
+
+      stats->write_time += write_time;
+      if (write_time > stats->max_write_time)
+        stats->max_write_time = write_time;
+    }
+
+    free_buffers[free_count++] = entry.data;
+    busy = false;
+    done.notify_all();
+  }
+}
+
+AsyncMkvWriter::Stats::Stats()
+    : buffers_written(0),
+      bytes_written(0),
+      seeks(0),
+      stalls(0),
+      stall_time(0),
+      write_time(0),
+      max_write_time(0),
+      max_queue_depth(0) {}
+
+AsyncMkvWriter::AsyncMkvWriter()
+    : queue_(NULL),
+      writer_(NULL),
+      seekable_(false),
+      notify_enabled_(false),
+      buffer_size_(0),
+      failed_(false),
+      current_(NULL),
+      current_start_(0),
+      current_length_(0),
+      current_offset_(0) {}
+
+AsyncMkvWriter::~AsyncMkvWriter() { Close(); }
+
+int32 AsyncMkvWriter::Write(const void* buffer, uint32 length) {
+  if (!queue_ || failed_)
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  const uint8* data = static_cast<const uint8*>(buffer);
+
+  while (length > 0) {
+    if (current_offset_ == buffer_size_ &&
+        !Submit(current_start_ + buffer_size_)) {
+      return -1;
+    }
+
+    uint32 chunk_length = buffer_size_ - current_offset_;
+    if (chunk_length > length)
+      chunk_length = length;
+
+    memcpy(current_ + current_offset_, data, chunk_length);
+    current_offset_ += chunk_length;
+
+    if (current_offset_ > current_length_)
+      current_length_ = current_offset_;
+
+    data += chunk_length;
+    length -= chunk_length;
+  }
+
+  return 0;
+}
+
+bool AsyncMkvWriter::Open(IMkvWriter* writer, uint32 buffer_size,
+                          int32 buffer_count) {
+  if (writer == NULL || buffer_size == 0 || buffer_count < 2)
+    return false;
+
+  if (queue_)
+    return false;
+
+  const int64 position = writer->Position();
+  if (position < 0)
+    return false;
+
+  Queue* const queue = new (std::nothrow) Queue(buffer_count);  // NOLINT
+  if (queue == NULL)
+    return false;
+
+  const uint64 storage_size = static_cast<uint64>(buffer_size) * buffer_count;
+  queue->storage = new (std::nothrow) uint8[storage_size];  // NOLINT
+  queue->free_buffers = new (std::nothrow) uint8*[buffer_count];  // NOLINT
+  queue->entries = new (std::nothrow) Queue::Entry[buffer_count];  // NOLINT
+
+  if (!queue->storage || !queue->free_buffers || !queue->entries) {
+    delete queue;
+    return false;
+  }
+
+  // The first buffer is filled right away, the others start out free.
+  for (int32 i = 1; i < buffer_count; ++i)
+    queue->free_buffers[queue->free_count++] = queue->storage + i * buffer_size;
+
+  queue_ = queue;
+  writer_ = writer;
+  seekable_ = writer->Seekable();
+  notify_enabled_ = writer->ElementStartNotifyEnabled();
+  buffer_size_ = buffer_size;
+  failed_ = false;
+  current_ = queue->storage;
+  current_start_ = position;
+  current_length_ = 0;
+  current_offset_ = 0;
+  stats_ = Stats();
+
+  queue->thread = std::thread(&Queue::Run, queue, writer, &stats_);
+
+  return true;
+}
+
+bool AsyncMkvWriter::Flush() {
+  if (!queue_)
+    return false;
+
+  const int64 position = current_start_ + current_offset_;
+  Submit(position);
+
+  std::unique_lock<std::mutex> lock(queue_->mutex);
+
+  while (queue_->queued > 0 || queue_->busy)
+    queue_->done.wait(lock);
+
+  // The I/O thread is idle until the next buffer is queued. Leave the
+  // underlying writer at the current position, which is not the end of the
+  // written data after a seek back into the last buffer.
+  if (!queue_->error && writer_->Position() != position &&
+      writer_->Position(position)) {
+    queue_->error = true;
+  }
+
+  if (queue_->error)
+    failed_ = true;
+
+  return !failed_;
+}
+
+bool AsyncMkvWriter::Close() {
+  if (!queue_)
+    return true;
+
+  const bool flushed = Flush();
+
+  {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    queue_->stop = true;
+  }
+  queue_->work.notify_one();
+  queue_->thread.join();
+
+  delete queue_;
+  queue_ = NULL;
+  writer_ = NULL;
+  current_ = NULL;
+  buffer_size_ = 0;
+  current_length_ = 0;
+  current_offset_ = 0;
+
+  return flushed;
+}
+
+void AsyncMkvWriter::GetStats(Stats* stats) const {
+  if (stats == NULL)
+    return;
+
+  if (!queue_) {
+    *stats = stats_;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(queue_->mutex);
+  *stats = stats_;
+}
+
+bool AsyncMkvWriter::Submit(int64 position) {
+  std::unique_lock<std::mutex> lock(queue_->mutex);
+
+  if (current_length_ > 0) {
+    const int32 tail = (queue_->head + queue_->queued) % queue_->count;
+    Queue::Entry& entry = queue_->entries[tail];
+    entry.data = current_;
+    entry.start = current_start_;
+    entry.length = current_length_;
+    ++queue_->queued;
+
+    if (queue_->queued > stats_.max_queue_depth)
+      stats_.max_queue_depth = queue_->queued;
+
+    queue_->work.notify_one();
+
+    if (queue_->free_count == 0) {
+      // Every buffer is queued: wait for the I/O thread to catch up.
+      const Clock::time_point start = Clock::now();
+
+      while (queue_->free_count == 0)
+        queue_->done.wait(lock);
+
+      ++stats_.stalls;
+      stats_.stall_time += NanosecondsSince(start);
+    }
+
+    current_ = queue_->free_buffers[--queue_->free_count];
+  }
+
+  current_start_ = position;
+  current_length_ = 0;
+  current_offset_ = 0;
+
+  if (queue_->error)
+    failed_ = true;
+
+  return !failed_;
+}
+
+int64 AsyncMkvWriter::Position() const {
+  if (!queue_)
+    return 0;
+
+  return current_start_ + current_offset_;
+}
+
+int32 AsyncMkvWriter::Position(int64 position) {
+  if (!queue_ || !seekable_ || position < 0)
+    return -1;
+
+  if (position >= current_start_ &&
+      position <= current_start_ + static_cast<int64>(current_length_)) {
+    current_offset_ = static_cast<uint32>(position - current_start_);
+    return 0;
+  }
+
+  return Submit(position) ? 0 : -1;
+}
+
+bool AsyncMkvWriter::Seekable() const { return queue_ ? seekable_ : false; }
+
+void AsyncMkvWriter::ElementStartNotify(uint64 element_id, int64 position) {
+  if (queue_)
+    writer_->ElementStartNotify(element_id, position);
+}
+
+bool AsyncMkvWriter::ElementStartNotifyEnabled() const {
+  return queue_ ? notify_enabled_ : false;
+}
+
+}  // namespace mkvmuxer
@@ -0,0 +1,130 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVASYNCWRITER_HPP
+#define MKVASYNCWRITER_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// IMkvWriter decorator that moves the writes to another writer onto a
+// background I/O thread. Writes are collected in one of a fixed number of
+// buffers; full buffers are queued for the I/O thread, which writes them out
+// in order. The muxer's thread only waits when every buffer is queued, which
+// happens when the storage cannot keep up (see Stats).
+//
+// Seeks that land inside the buffer being filled update it in place. Other
+// seeks queue the buffer and start a new one at the new position; the I/O
+// thread seeks the underlying writer before writing it, so seek-back patches
+// reach the output in the order they were made.
+//
+// Errors of the underlying writer are reported by a later Write(), Flush()
+// or Close() on the muxer's thread. The underlying writer must not be used
+// by anyone else until Close() returns. ElementStartNotify() is forwarded on
+// the muxer's thread, possibly while the I/O thread is writing.
+class AsyncMkvWriter : public IMkvWriter {
+ public:
+  static const uint32 kDefaultBufferSize = 1024 * 1024;
+  static const int32 kDefaultBufferCount = 4;
+
+  // Backpressure and I/O latency counters. Times are in nanoseconds.
+  struct Stats {
+    Stats();
+
+    // Buffers and octets written by the I/O thread.
+    uint64 buffers_written;
+    uint64 bytes_written;
+
+    // Seeks made by the I/O thread on the underlying writer.
+    uint64 seeks;
+
+    // Number of times the muxer's thread had to wait for a free buffer, and
+    // the total time it waited.
+    uint64 stalls;
+    uint64 stall_time;
+
+    // Time spent in the underlying writer per buffer.
+    uint64 write_time;
+    uint64 max_write_time;
+
+    // Largest number of buffers waiting for the I/O thread.
+    int32 max_queue_depth;
+  };
+
+  AsyncMkvWriter();
+  virtual ~AsyncMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+  virtual bool ElementStartNotifyEnabled() const;
+
+  // Starts the I/O thread writing to |writer|, which must outlive this object
+  // or the next call to Close(). |buffer_count| buffers of |buffer_size|
+  // octets are allocated; at least two are needed so that one can be filled
+  // while another is written. Returns true on success.
+  bool Open(IMkvWriter* writer, uint32 buffer_size = kDefaultBufferSize,
+            int32 buffer_count = kDefaultBufferCount);
+
+  // Queues the buffered data and waits until the I/O thread has written
+  // everything. Returns true if all data was written.
+  bool Flush();
+
+  // Flushes, stops the I/O thread and releases the buffers. Returns true if
+  // all data was written.
+  bool Close();
+
+  // Copies the counters collected since Open() to |stats|.
+  void GetStats(Stats* stats) const;
+
+ private:
+  // State shared with the I/O thread.
+  struct Queue;
+
+  // Hands |current_| to the I/O thread and waits for a free buffer that
+  // starts at |position|. Returns false on error.
+  bool Submit(int64 position);
+
+  Queue* queue_;
+
+  // Underlying writer. Only the I/O thread writes to it while it runs.
+  IMkvWriter* writer_;
+
+  // Values of |writer_->Seekable()| and |writer_->ElementStartNotifyEnabled()|
+  // when opened.
+  bool seekable_;
+  bool notify_enabled_;
+
+  uint32 buffer_size_;
+
+  // Set once an error of the I/O thread has been seen; Write() fails from
+  // then on.
+  bool failed_;
+
+  // Buffer being filled, its position in the output, the number of valid
+  // octets in it and the current write offset, which is less than
+  // |current_length_| after a seek back into it.
+  uint8* current_;
+  int64 current_start_;
+  uint32 current_length_;
+  uint32 current_offset_;
+
+  // Counters, updated under the queue's lock while the I/O thread runs.
+  Stats stats_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(AsyncMkvWriter);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVASYNCWRITER_HPP
@@ -0,0 +1,167 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvbufferedwriter.hpp"
+
+#include <cstring>
+#include <new>
+
+namespace mkvmuxer {
+
+BufferedMkvWriter::BufferedMkvWriter()
+    : writer_(NULL),
+      buffer_(NULL),
+      buffer_size_(0),
+      buffer_start_(0),
+      buffer_length_(0),
+      buffer_offset_(0) {}
+
+BufferedMkvWriter::~BufferedMkvWriter() { Close(); }
+
+int32 BufferedMkvWriter::Write(const void* buffer, uint32 length) {
+  if (!writer_)
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  if (length > buffer_size_ - buffer_offset_) {
+    if (!Flush())
+      return -1;
+
+    // Too large to buffer: pass it straight through.
+    if (length >= buffer_size_) {
+      const int32 status = writer_->Write(buffer, length);
+
+      if (status)
+        return status;
+
+      buffer_start_ += length;
+      return 0;
+    }
+  }
+
+  memcpy(buffer_ + buffer_offset_, buffer, length);
+  buffer_offset_ += length;
+
+  if (buffer_offset_ > buffer_length_)
+    buffer_length_ = buffer_offset_;
+
+  return 0;
+}
+
+bool BufferedMkvWriter::Open(IMkvWriter* writer, uint32 buffer_size) {
+  if (writer == NULL || buffer_size == 0)
+    return false;
+
+  if (writer_)
+    return false;
+
+  const int64 position = writer->Position();
+  if (position < 0)
+    return false;
+
+  buffer_ = new (std::nothrow) uint8[buffer_size];  // NOLINT
+  if (buffer_ == NULL)
+    return false;
+
+  writer_ = writer;
+  buffer_size_ = buffer_size;
+  buffer_start_ = position;
+  buffer_length_ = 0;
+  buffer_offset_ = 0;
+
+  return true;
+}
+
+bool BufferedMkvWriter::Flush() {
+  if (!writer_)
+    return false;
+
+  if (buffer_length_ == 0)
+    return true;
+
+  if (writer_->Write(buffer_, buffer_length_))
+    return false;
+
+  // Leave the underlying writer at the current position, which is not the
+  // end of the buffered data after a seek back into the buffer.
+  const int64 position = buffer_start_ + buffer_offset_;
+
+  if (buffer_offset_ != buffer_length_ && writer_->Position(position))
+    return false;
+
+  buffer_start_ = position;
+  buffer_length_ = 0;
+  buffer_offset_ = 0;
+
+  return true;
+}
+
+bool BufferedMkvWriter::Close() {
+  if (!writer_)
+    return true;
+
+  const bool flushed = Flush();
+
+  delete[] buffer_;
+  buffer_ = NULL;
+  buffer_size_ = 0;
+  buffer_length_ = 0;
+  buffer_offset_ = 0;
+  writer_ = NULL;
+
+  return flushed;
+}
+
+int64 BufferedMkvWriter::Position() const {
+  if (!writer_)
+    return 0;
+
+  return buffer_start_ + buffer_offset_;
+}
+
+int32 BufferedMkvWriter::Position(int64 position) {
+  if (!writer_ || position < 0)
+    return -1;
+
+  if (position >= buffer_start_ &&
+      position <= buffer_start_ + static_cast<int64>(buffer_length_)) {
+    buffer_offset_ = static_cast<uint32>(position - buffer_start_);
+    return 0;
+  }
+
+  if (!Flush())
+    return -1;
+
+  const int32 status = writer_->Position(position);
+
+  if (status)
+    return status;
+
+  buffer_start_ = position;
+  return 0;
+}
+
+bool BufferedMkvWriter::Seekable() const {
+  return writer_ ? writer_->Seekable() : false;
+}
+
+void BufferedMkvWriter::ElementStartNotify(uint64 element_id, int64 position) {
+  if (writer_)
+    writer_->ElementStartNotify(element_id, position);
+}
+
+bool BufferedMkvWriter::ElementStartNotifyEnabled() const {
+  return writer_ ? writer_->ElementStartNotifyEnabled() : false;
+}
+
+}  // namespace mkvmuxer
@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVBUFFEREDWRITER_HPP
+#define MKVBUFFEREDWRITER_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// IMkvWriter decorator that collects writes in an in-memory buffer and passes
+// them on to another writer in large blocks. Seeks that land inside the
+// buffered data, such as the cluster size updates made by the muxer, are
+// applied to the buffer without touching the underlying writer.
+//
+// Buffered data is written out when the buffer fills up, when a seek leaves
+// the buffered range, and on Flush() or Close(). Call Close() (or Flush())
+// before closing the underlying writer to find out whether the final write
+// succeeded.
+class BufferedMkvWriter : public IMkvWriter {
+ public:
+  static const uint32 kDefaultBufferSize = 1024 * 1024;
+
+  BufferedMkvWriter();
+  virtual ~BufferedMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+  virtual bool ElementStartNotifyEnabled() const;
+
+  // Starts buffering writes to |writer|, which must outlive this object or
+  // the next call to Close(). |buffer_size| is the size of the buffer in
+  // bytes. Returns true on success.
+  bool Open(IMkvWriter* writer, uint32 buffer_size = kDefaultBufferSize);
+
+  // Writes out the buffered data. Returns true on success.
+  bool Flush();
+
+  // Flushes and releases the buffer. Returns true if all data was written.
+  bool Close();
+
+ private:
+  // Underlying writer.
+  IMkvWriter* writer_;
+
+  uint8* buffer_;
+  uint32 buffer_size_;
+
+  // Position of |buffer_| in the output.
+  int64 buffer_start_;
+
+  // Number of valid bytes in |buffer_|.
+  uint32 buffer_length_;
+
+  // Current write offset in |buffer_|; less than |buffer_length_| after a
+  // seek back into the buffered data.
+  uint32 buffer_offset_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(BufferedMkvWriter);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVBUFFEREDWRITER_HPP
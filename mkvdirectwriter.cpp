@@ -0,0 +1,314 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvdirectwriter.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace mkvmuxer {
+
+namespace {
+
+uint32 AlignUp(uint32 value) {
+  return (value + DirectMkvWriter::kAlignment - 1) &
+         ~(DirectMkvWriter::kAlignment - 1);
+}
+
+#ifndef _WIN32
+// Turns O_DIRECT off for |fd|. Returns true on success.
+bool DisableDirectIo(int fd) {
+#ifdef O_DIRECT
+  const int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+#endif
+
+}  // namespace
+
+DirectMkvWriter::DirectMkvWriter()
+    : fd_(-1),
+      direct_(false),
+      memory_(NULL),
+      buffer_(NULL),
+      buffer_size_(0),
+      block_(NULL),
+      buffer_start_(0),
+      buffer_length_(0),
+      position_(0) {}
+
+DirectMkvWriter::~DirectMkvWriter() { Close(); }
+
+int32 DirectMkvWriter::Write(const void* buffer, uint32 length) {
+  if (fd_ < 0)
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  const uint8* data = static_cast<const uint8*>(buffer);
+
+  if (position_ < buffer_start_) {
+    // |buffer_start_| is aligned, so the patch ends on a block boundary.
+    uint32 patch_length = length;
+    if (position_ + patch_length > buffer_start_)
+      patch_length = static_cast<uint32>(buffer_start_ - position_);
+
+    if (!Patch(data, patch_length))
+      return -1;
+
+    data += patch_length;
+    length -= patch_length;
+  }
+
+  while (length > 0) {
+    uint32 offset = static_cast<uint32>(position_ - buffer_start_);
+
+    if (offset == buffer_size_) {
+      if (!WriteAt(buffer_, buffer_size_, buffer_start_))
+        return -1;
+
+      buffer_start_ += buffer_size_;
+      buffer_length_ = 0;
+      offset = 0;
+    }
+
+    uint32 chunk_length = buffer_size_ - offset;
+    if (chunk_length > length)
+      chunk_length = length;
+
+    memcpy(buffer_ + offset, data, chunk_length);
+    position_ += chunk_length;
+
+    if (offset + chunk_length > buffer_length_)
+      buffer_length_ = offset + chunk_length;
+
+    data += chunk_length;
+    length -= chunk_length;
+  }
+
+  return 0;
+}
+
+bool DirectMkvWriter::Open(const char* filename, uint32 buffer_size) {
+  if (filename == NULL || buffer_size == 0)
+    return false;
+
+  if (fd_ >= 0)
+    return false;
+
+#ifdef _WIN32
+  (void)buffer_size;
+  return false;
+#else
+  if (buffer_size > 0x80000000U)
+    return false;
+
+  buffer_size = AlignUp(buffer_size);
+
+  // Written blocks are read back for patching, so open for reading too.
+  const int flags = O_RDWR | O_CREAT | O_TRUNC;
+  const mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+  int fd = -1;
+  bool direct = false;
+
+#ifdef O_DIRECT
+  fd = open(filename, flags | O_DIRECT, mode);
+  direct = fd >= 0;
+#endif
+
+  // The file system may not support direct I/O.
+  if (fd < 0)
+    fd = open(filename, flags, mode);
+
+  if (fd < 0)
+    return false;
+
+  void* memory = NULL;
+  if (posix_memalign(&memory, kAlignment, buffer_size + kAlignment)) {
+    close(fd);
+    return false;
+  }
+
+  fd_ = fd;
+  direct_ = direct;
+  memory_ = memory;
+  buffer_ = static_cast<uint8*>(memory);
+  buffer_size_ = buffer_size;
+  block_ = buffer_ + buffer_size;
+  buffer_start_ = 0;
+  buffer_length_ = 0;
+  position_ = 0;
+
+  return true;
+#endif
+}
+
+bool DirectMkvWriter::Flush() {
+  if (fd_ < 0)
+    return false;
+
+#ifdef _WIN32
+  return false;
+#else
+  if (buffer_length_ > 0) {
+    // Pad the partial block at the end; the padding is truncated below.
+    const uint32 length = AlignUp(buffer_length_);
+    memset(buffer_ + buffer_length_, 0, length - buffer_length_);
+
+    if (!WriteAt(buffer_, length, buffer_start_))
+      return false;
+  }
+
+  return ftruncate(fd_, buffer_start_ + buffer_length_) == 0;
+#endif
+}
+
+bool DirectMkvWriter::Close() {
+  if (fd_ < 0)
+    return true;
+
+  bool closed = Flush();
+
+#ifndef _WIN32
+  if (close(fd_))
+    closed = false;
+#endif
+
+  free(memory_);
+  memory_ = NULL;
+  buffer_ = NULL;
+  block_ = NULL;
+  buffer_size_ = 0;
+  buffer_length_ = 0;
+  fd_ = -1;
+  direct_ = false;
+
+  return closed;
+}
+
+int64 DirectMkvWriter::Position() const {
+  if (fd_ < 0)
+    return 0;
+
+  return position_;
+}
+
+int32 DirectMkvWriter::Position(int64 position) {
+  if (fd_ < 0 || position < 0)
+    return -1;
+
+  // Seeking past the end would leave a gap to fill in.
+  if (position > buffer_start_ + static_cast<int64>(buffer_length_))
+    return -1;
+
+  position_ = position;
+  return 0;
+}
+
+bool DirectMkvWriter::Seekable() const { return true; }
+
+void DirectMkvWriter::ElementStartNotify(uint64, int64) {}
+
+bool DirectMkvWriter::WriteAt(const uint8* data, uint32 length, int64 offset) {
+#ifdef _WIN32
+  (void)data;
+  (void)length;
+  (void)offset;
+  return false;
+#else
+  while (length > 0) {
+    const ssize_t bytes_written = pwrite(fd_, data, length, offset);
+
+    if (bytes_written < 0) {
+      if (errno == EINTR)
+        continue;
+
+      // Some file systems accept O_DIRECT in open() but not in write().
+      if (errno == EINVAL && direct_ && DisableDirectIo(fd_)) {
+        direct_ = false;
+        continue;
+      }
+
+      return false;
+    }
+
+    data += bytes_written;
+    length -= static_cast<uint32>(bytes_written);
+    offset += bytes_written;
+  }
+
+  return true;
+#endif
+}
+
+bool DirectMkvWriter::Patch(const uint8* data, uint32 length) {
+#ifdef _WIN32
+  (void)data;
+  (void)length;
+  return false;
+#else
+  while (length > 0) {
+    const int64 block_start = position_ & ~static_cast<int64>(kAlignment - 1);
+    const uint32 offset = static_cast<uint32>(position_ - block_start);
+
+    uint32 patch_length = kAlignment - offset;
+    if (patch_length > length)
+      patch_length = length;
+
+    // Blocks before |buffer_start_| are complete, so a partial patch needs
+    // the rest of the block from the file.
+    if (patch_length < kAlignment) {
+      uint32 bytes_read = 0;
+
+      while (bytes_read < kAlignment) {
+        const ssize_t status = pread(fd_, block_ + bytes_read,
+                                     kAlignment - bytes_read,
+                                     block_start + bytes_read);
+        if (status < 0 && errno == EINTR)
+          continue;
+        if (status < 0 && errno == EINVAL && direct_ && DisableDirectIo(fd_)) {
+          direct_ = false;
+          continue;
+        }
+        if (status <= 0)
+          return false;
+        bytes_read += static_cast<uint32>(status);
+      }
+    }
+
+    memcpy(block_ + offset, data, patch_length);
+
+    if (!WriteAt(block_, kAlignment, block_start))
+      return false;
+
+    position_ += patch_length;
+    data += patch_length;
+    length -= patch_length;
+  }
+
+  return true;
+#endif
+}
+
+}  // namespace mkvmuxer
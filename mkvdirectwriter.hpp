@@ -0,0 +1,100 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVDIRECTWRITER_HPP
+#define MKVDIRECTWRITER_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// File writer that bypasses the page cache. On Linux the file is opened with
+// O_DIRECT and written in large blocks from an aligned buffer, so that many
+// concurrent recordings do not compete for the page cache. Where O_DIRECT is
+// not available, or the file system rejects it, the writer falls back to
+// ordinary buffered I/O; direct() tells which one is in use. Not available on
+// Windows, where Open() fails.
+//
+// The end of the output is collected in the aligned buffer. Seeks back into
+// data that has already been written, such as the cluster size and cues
+// updates made by the muxer, read the affected blocks, patch them and write
+// them back. The partial block at the end of the output is padded for
+// writing, and the file is truncated to its real size by Flush() and Close().
+class DirectMkvWriter : public IMkvWriter {
+ public:
+  // Alignment of file offsets, lengths and memory used for direct I/O.
+  static const uint32 kAlignment = 4096;
+  static const uint32 kDefaultBufferSize = 1024 * 1024;
+
+  DirectMkvWriter();
+  virtual ~DirectMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Creates or truncates |filename|. |buffer_size| is rounded up to a multiple
+  // of kAlignment. Returns true on success.
+  bool Open(const char* filename, uint32 buffer_size = kDefaultBufferSize);
+
+  // Writes out the buffered data and sets the file to its final size. Returns
+  // true on success.
+  bool Flush();
+
+  // Flushes and closes the file. Returns true if all data was written.
+  bool Close();
+
+  // Returns true if the file is written with O_DIRECT.
+  bool direct() const { return direct_; }
+
+ private:
+  // Writes |length| octets of |data| at |offset|. Returns false on error.
+  bool WriteAt(const uint8* data, uint32 length, int64 offset);
+
+  // Replaces data that has already been written out, starting at |position_|,
+  // with |length| octets of |data|, one block at a time. Returns false on
+  // error.
+  bool Patch(const uint8* data, uint32 length);
+
+  // File descriptor, or -1 when closed.
+  int fd_;
+
+  // True while the file is written with O_DIRECT.
+  bool direct_;
+
+  // Aligned allocation holding |buffer_| followed by |block_|.
+  void* memory_;
+
+  // Buffer for the end of the output.
+  uint8* buffer_;
+  uint32 buffer_size_;
+
+  // Aligned scratch block for patching written data.
+  uint8* block_;
+
+  // File offset of |buffer_|, a multiple of |buffer_size_|. Everything before
+  // it has been written out.
+  int64 buffer_start_;
+
+  // Number of valid octets in |buffer_|; the output ends at |buffer_start_| +
+  // |buffer_length_|.
+  uint32 buffer_length_;
+
+  // Current write position.
+  int64 position_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(DirectMkvWriter);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVDIRECTWRITER_HPP
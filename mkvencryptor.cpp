@@ -0,0 +1,669 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvencryptor.hpp"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <bcrypt.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "bcrypt")
+#endif
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+// The AES-NI code is compiled for x86 with GCC, Clang and MSVC, and only
+// used when the processor supports it.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MKVMUXER_HAVE_AESNI
+#define MKVMUXER_AESNI_TARGET __attribute__((target("aes,sse2")))
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER)
+#define MKVMUXER_HAVE_AESNI
+#define MKVMUXER_AESNI_TARGET
+#include <emmintrin.h>
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace mkvmuxer {
+
+namespace {
+
+const int32 kRounds = 10;
+
+// Number of blocks encrypted at once by AES-NI, which keeps the pipeline of
+// the AES unit busy.
+const int32 kAesNiBlocks = 8;
+
+uint8 MultiplyBy2(uint8 value) {
+  return static_cast<uint8>((value << 1) ^ ((value & 0x80) ? 0x1b : 0));
+}
+
+uint32 LoadBigEndian32(const uint8* buf) {
+  return (static_cast<uint32>(buf[0]) << 24) |
+         (static_cast<uint32>(buf[1]) << 16) |
+         (static_cast<uint32>(buf[2]) << 8) | buf[3];
+}
+
+void StoreBigEndian32(uint32 value, uint8* buf) {
+  buf[0] = static_cast<uint8>(value >> 24);
+  buf[1] = static_cast<uint8>(value >> 16);
+  buf[2] = static_cast<uint8>(value >> 8);
+  buf[3] = static_cast<uint8>(value);
+}
+
+uint64 LoadBigEndian64(const uint8* buf) {
+  return (static_cast<uint64>(LoadBigEndian32(buf)) << 32) |
+         LoadBigEndian32(buf + 4);
+}
+
+void StoreBigEndian64(uint64 value, uint8* buf) {
+  StoreBigEndian32(static_cast<uint32>(value >> 32), buf);
+  StoreBigEndian32(static_cast<uint32>(value), buf + 4);
+}
+
+// The portable implementation is bit-sliced: the 64 octets of
+// kSlicedBlocks blocks are held in 8 words, the i-th of which holds bit i of
+// every octet. It only uses logical operations and shifts, with no table
+// lookups or branches that depend on the key or the data, so unlike a
+// table-based implementation its timing does not leak them through the
+// cache.
+const int32 kSlicedBlocks = 4;
+const int32 kSlicedSize = 16 * kSlicedBlocks;
+
+// Multipliers that repeat a mask of one 16 bit lane, the bits of a block, or
+// of one 4 bit nibble, the bits of a column, across a word.
+const uint64 kEachLane = 0x0001000100010001ULL;
+const uint64 kEachNibble = 0x1111111111111111ULL;
+
+uint64 LoadLittleEndian64(const uint8* buf) {
+  uint64 value = 0;
+  for (int32 i = 7; i >= 0; --i)
+    value = (value << 8) | buf[i];
+  return value;
+}
+
+void StoreLittleEndian64(uint64 value, uint8* buf) {
+  for (int32 i = 0; i < 8; ++i, value >>= 8)
+    buf[i] = static_cast<uint8>(value);
+}
+
+// Transposes the 8x8 bit matrix whose rows are the octets of |value|.
+uint64 TransposeBits(uint64 value) {
+  uint64 t = (value ^ (value >> 7)) & 0x00aa00aa00aa00aaULL;
+  value ^= t ^ (t << 7);
+  t = (value ^ (value >> 14)) & 0x0000cccc0000ccccULL;
+  value ^= t ^ (t << 14);
+  t = (value ^ (value >> 28)) & 0x00000000f0f0f0f0ULL;
+  value ^= t ^ (t << 28);
+  return value;
+}
+
+// Transposes the 8x8 octet matrix whose rows are the 8 |words|.
+void TransposeOctets(uint64* words) {
+  const uint64 kMasks[3] = {0x00000000ffffffffULL, 0x0000ffff0000ffffULL,
+                            0x00ff00ff00ff00ffULL};
+  for (int32 level = 0; level < 3; ++level) {
+    const int32 distance = 4 >> level;
+    const int32 shift = 8 * distance;
+    for (int32 i = 0; i < 8; ++i) {
+      if (i & distance)
+        continue;
+      const uint64 t = ((words[i] >> shift) ^ words[i + distance]) &
+                       kMasks[level];
+      words[i + distance] ^= t;
+      words[i] ^= t << shift;
+    }
+  }
+}
+
+// Slices the kSlicedSize octets of |in| into |slices|: bit j of slices[i]
+// is bit i of in[j].
+void Slice(const uint8* in, uint64* slices) {
+  for (int32 i = 0; i < 8; ++i)
+    slices[i] = TransposeBits(LoadLittleEndian64(in + 8 * i));
+  TransposeOctets(slices);
+}
+
+// Reverses Slice().
+void Unslice(const uint64* slices, uint8* out) {
+  uint64 words[8];
+  memcpy(words, slices, sizeof(words));
+  TransposeOctets(words);
+  for (int32 i = 0; i < 8; ++i)
+    StoreLittleEndian64(TransposeBits(words[i]), out + 8 * i);
+}
+
+// The S-box inverts in GF(2^8) through the isomorphic tower field
+// GF(2^4)[y] / (y^2 + y + z^3), with GF(2^4) = GF(2)[z] / (z^4 + z + 1), which
+// takes far fewer logical operations than inverting in the AES field.
+
+// Multiplies the sliced elements of GF(2^4) |a| and |b| and stores the
+// products at |out|, which may be either of them.
+void Multiply16(const uint64* a, const uint64* b, uint64* out) {
+  const uint64 c0 = a[0] & b[0];
+  const uint64 c1 = (a[0] & b[1]) ^ (a[1] & b[0]);
+  const uint64 c2 = (a[0] & b[2]) ^ (a[1] & b[1]) ^ (a[2] & b[0]);
+  const uint64 c3 =
+      (a[0] & b[3]) ^ (a[1] & b[2]) ^ (a[2] & b[1]) ^ (a[3] & b[0]);
+  const uint64 c4 = (a[1] & b[3]) ^ (a[2] & b[2]) ^ (a[3] & b[1]);
+  const uint64 c5 = (a[2] & b[3]) ^ (a[3] & b[2]);
+  const uint64 c6 = a[3] & b[3];
+
+  // z^4 = z + 1, z^5 = z^2 + z and z^6 = z^3 + z^2.
+  out[0] = c0 ^ c4;
+  out[1] = c1 ^ c4 ^ c5;
+  out[2] = c2 ^ c5 ^ c6;
+  out[3] = c3 ^ c6;
+}
+
+// Squares the sliced elements of GF(2^4) |a| and stores the result at |out|,
+// which may be |a|.
+void Square16(const uint64* a, uint64* out) {
+  const uint64 r0 = a[0] ^ a[2];
+  const uint64 r2 = a[1] ^ a[3];
+  out[1] = a[2];
+  out[3] = a[3];
+  out[0] = r0;
+  out[2] = r2;
+}
+
+// Inverts the sliced elements of GF(2^4) |a|, as a^14, and stores the
+// result at |out|, which may be |a|. 0 is left as 0.
+void Invert16(const uint64* a, uint64* out) {
+  uint64 x2[4], x3[4], x12[4];
+  Square16(a, x2);
+  Multiply16(x2, a, x3);
+  Square16(x3, x12);
+  Square16(x12, x12);
+  Multiply16(x12, x2, out);
+}
+
+// Applies the S-box to the sliced octets: the inverse in GF(2^8), with 0 left
+// as 0, followed by the affine transformation.
+void SubBytes(uint64* state) {
+  const uint64* const x = state;
+
+  // Change to the tower field, where the element is a * y + b.
+  uint64 t[8];
+  t[0] = x[0] ^ x[5] ^ x[7];
+  t[1] = x[2];
+  t[2] = x[2] ^ x[3] ^ x[4] ^ x[5] ^ x[6] ^ x[7];
+  t[3] = x[3] ^ x[4];
+  t[4] = x[4] ^ x[5] ^ x[6];
+  t[5] = x[1] ^ x[4] ^ x[6] ^ x[7];
+  t[6] = x[2] ^ x[3] ^ x[5] ^ x[7];
+  t[7] = x[5] ^ x[7];
+  const uint64* const b = t;
+  const uint64* const a = t + 4;
+
+  // 1 / (a * y + b) = a * d * y + (a + b) * d, with
+  // d = 1 / (z^3 * a^2 + a * b + b^2).
+  uint64 d[4];
+  uint64 b2[4];
+  Multiply16(a, b, d);
+  Square16(b, b2);
+  d[0] ^= b2[0] ^ a[2];
+  d[1] ^= b2[1] ^ a[1] ^ a[2] ^ a[3];
+  d[2] ^= b2[2] ^ a[1];
+  d[3] ^= b2[3] ^ a[0] ^ a[2] ^ a[3];
+  Invert16(d, d);
+
+  uint64 sum[4];
+  for (int32 i = 0; i < 4; ++i)
+    sum[i] = a[i] ^ b[i];
+  uint64 u[8];
+  Multiply16(sum, d, u);
+  Multiply16(a, d, u + 4);
+
+  // Change back to the AES field and apply the affine transformation, then
+  // add 0x63.
+  state[0] = ~(u[0] ^ u[2] ^ u[6]);
+  state[1] = ~(u[0] ^ u[1] ^ u[2] ^ u[3] ^ u[4] ^ u[5]);
+  state[2] = u[0] ^ u[3] ^ u[5] ^ u[6];
+  state[3] = u[0] ^ u[2] ^ u[5];
+  state[4] = u[0] ^ u[1] ^ u[3] ^ u[4] ^ u[5];
+  state[5] = ~(u[1] ^ u[2] ^ u[3] ^ u[5] ^ u[6] ^ u[7]);
+  state[6] = ~(u[4] ^ u[6] ^ u[7]);
+  state[7] = u[1] ^ u[2];
+}
+
+// Octet r + 4 * c of each block, row r of column c, sits at bit r + 4 * c of
+// the block's 16 bit lane.
+void ShiftRows(uint64* state) {
+  for (int32 i = 0; i < 8; ++i) {
+    const uint64 x = state[i];
+    state[i] = (x & (0x1111 * kEachLane)) |
+               ((x >> 4) & (0x0222 * kEachLane)) |
+               ((x << 12) & (0x2000 * kEachLane)) |
+               ((x >> 8) & (0x0044 * kEachLane)) |
+               ((x << 8) & (0x4400 * kEachLane)) |
+               ((x >> 12) & (0x0008 * kEachLane)) |
+               ((x << 4) & (0x8880 * kEachLane));
+  }
+}
+
+// Returns |x| with row r of each column set to row r + |rows| (mod 4).
+uint64 RotateRows(uint64 x, int32 rows) {
+  const uint64 low = ((1 << (4 - rows)) - 1) * kEachNibble;
+  return ((x >> rows) & low) | ((x << (4 - rows)) & ~low);
+}
+
+// Row r of each column becomes 2 * a[r] + 3 * a[r + 1] + a[r + 2] + a[r + 3],
+// computed as 2 * (a[r] + a[r + 1]) + a[r + 1] + a[r + 2] + a[r + 3].
+void MixColumns(uint64* state) {
+  uint64 sum[8];
+  uint64 rest[8];
+  for (int32 i = 0; i < 8; ++i) {
+    const uint64 next = RotateRows(state[i], 1);
+    sum[i] = state[i] ^ next;
+    rest[i] = next ^ RotateRows(state[i], 2) ^ RotateRows(state[i], 3);
+  }
+
+  // Multiplying by 2 shifts the bits up and adds 0x1b for the top bit.
+  state[0] = sum[7] ^ rest[0];
+  state[1] = sum[0] ^ sum[7] ^ rest[1];
+  state[2] = sum[1] ^ rest[2];
+  state[3] = sum[2] ^ sum[7] ^ rest[3];
+  state[4] = sum[3] ^ sum[7] ^ rest[4];
+  state[5] = sum[4] ^ rest[5];
+  state[6] = sum[5] ^ rest[6];
+  state[7] = sum[6] ^ rest[7];
+}
+
+void AddRoundKey(const uint64* round_key, uint64* state) {
+  for (int32 i = 0; i < 8; ++i)
+    state[i] ^= round_key[i];
+}
+
+// Applies the S-box to each octet of |word|.
+uint32 SubWord(uint32 word) {
+  uint8 octets[kSlicedSize] = {0};
+  StoreBigEndian32(word, octets);
+  uint64 state[8];
+  Slice(octets, state);
+  SubBytes(state);
+  Unslice(state, octets);
+  return LoadBigEndian32(octets);
+}
+
+// Stores the key stream of the kSlicedBlocks counter blocks made of the 8
+// octets of |prefix| and |counter| onwards at |key_stream|. |round_keys|
+// holds the sliced round keys.
+void EncryptCounterBlocks(const uint64* round_keys, const uint8* prefix,
+                          uint64 counter, uint8* key_stream) {
+  for (int32 i = 0; i < kSlicedBlocks; ++i) {
+    memcpy(key_stream + 16 * i, prefix, 8);
+    StoreBigEndian64(counter + i, key_stream + 16 * i + 8);
+  }
+
+  uint64 state[8];
+  Slice(key_stream, state);
+  AddRoundKey(round_keys, state);
+  for (int32 round = 1; round <= kRounds; ++round) {
+    SubBytes(state);
+    ShiftRows(state);
+    // The last round has no MixColumns.
+    if (round < kRounds)
+      MixColumns(state);
+    AddRoundKey(round_keys + 8 * round, state);
+  }
+  Unslice(state, key_stream);
+}
+
+// XORs |length| octets of |in| with |key_stream| and stores them at |out|.
+void XorKeyStream(const uint8* key_stream, const uint8* in, uint8* out,
+                  uint64 length) {
+  for (uint64 i = 0; i < length; ++i)
+    out[i] = in[i] ^ key_stream[i];
+}
+
+// Fills the |length| octets of |buf| from the random number generator of the
+// operating system. Returns true on success.
+bool ReadSystemRandom(uint8* buf, uint64 length) {
+#ifdef _WIN32
+  return BCRYPT_SUCCESS(BCryptGenRandom(NULL, buf, static_cast<ULONG>(length),
+                                        BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+#else
+#if defined(__linux__) && defined(__NR_getrandom)
+  uint64 filled = 0;
+  while (filled < length) {
+    const long status = syscall(__NR_getrandom, buf + filled,
+                                static_cast<size_t>(length - filled), 0);
+    if (status < 0) {
+      if (errno == EINTR)
+        continue;
+      // Kernels older than 3.17; read /dev/urandom instead.
+      break;
+    }
+    filled += status;
+  }
+  if (filled == length)
+    return true;
+#endif
+
+  const int fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  uint64 read_length = 0;
+  while (read_length < length) {
+    const ssize_t status =
+        read(fd, buf + read_length, static_cast<size_t>(length - read_length));
+    if (status < 0 && errno == EINTR)
+      continue;
+    if (status <= 0)
+      break;
+    read_length += status;
+  }
+  close(fd);
+  return read_length == length;
+#endif
+}
+
+#ifdef MKVMUXER_HAVE_AESNI
+bool HasAesNi() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 25)) != 0;
+#else
+  unsigned int eax = 0;
+  unsigned int ebx = 0;
+  unsigned int ecx = 0;
+  unsigned int edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ecx & bit_AES) != 0;
+#endif
+}
+
+// Returns the counter block made of |prefix|, the first 8 octets in memory
+// order, and the big-endian |counter|.
+MKVMUXER_AESNI_TARGET
+__m128i CounterBlock(int64 prefix, uint64 counter) {
+  uint8 buf[8];
+  StoreBigEndian64(counter, buf);
+  int64 counter_bytes;
+  memcpy(&counter_bytes, buf, sizeof(counter_bytes));
+  return _mm_set_epi64x(counter_bytes, prefix);
+}
+
+// Encrypts |block_count| blocks of |in| in counter mode with AES-NI, with
+// the counter blocks made of |prefix| and |counter| onwards.
+MKVMUXER_AESNI_TARGET
+void ProcessBlocksAesNi(const uint8* round_key_bytes, const uint8* prefix,
+                        uint64 counter, const uint8* in, uint8* out,
+                        uint64 block_count) {
+  __m128i keys[kRounds + 1];
+  for (int32 i = 0; i <= kRounds; ++i) {
+    keys[i] = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(round_key_bytes + 16 * i));
+  }
+
+  int64 prefix_bytes;
+  memcpy(&prefix_bytes, prefix, sizeof(prefix_bytes));
+
+  while (block_count >= static_cast<uint64>(kAesNiBlocks)) {
+    __m128i blocks[kAesNiBlocks];
+    for (int32 j = 0; j < kAesNiBlocks; ++j) {
+      blocks[j] =
+          _mm_xor_si128(CounterBlock(prefix_bytes, counter + j), keys[0]);
+    }
+
+    for (int32 round = 1; round < kRounds; ++round) {
+      for (int32 j = 0; j < kAesNiBlocks; ++j)
+        blocks[j] = _mm_aesenc_si128(blocks[j], keys[round]);
+    }
+
+    for (int32 j = 0; j < kAesNiBlocks; ++j) {
+      const __m128i key_stream = _mm_aesenclast_si128(blocks[j], keys[kRounds]);
+      const __m128i data =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 16 * j));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * j),
+                       _mm_xor_si128(data, key_stream));
+    }
+
+    counter += kAesNiBlocks;
+    in += 16 * kAesNiBlocks;
+    out += 16 * kAesNiBlocks;
+    block_count -= kAesNiBlocks;
+  }
+
+  for (; block_count > 0; --block_count) {
+    __m128i block = _mm_xor_si128(CounterBlock(prefix_bytes, counter), keys[0]);
+    for (int32 round = 1; round < kRounds; ++round)
+      block = _mm_aesenc_si128(block, keys[round]);
+    block = _mm_aesenclast_si128(block, keys[kRounds]);
+
+    const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_xor_si128(data, block));
+
+    ++counter;
+    in += 16;
+    out += 16;
+  }
+}
+#endif  // MKVMUXER_HAVE_AESNI
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////
+//
+// AesCtrCipher Class
+
+AesCtrCipher::AesCtrCipher() : hardware_enabled_(false) {
+  memset(round_keys_, 0, sizeof(round_keys_));
+  memset(round_key_bytes_, 0, sizeof(round_key_bytes_));
+  set_hardware_enabled(true);
+}
+
+bool AesCtrCipher::Init(const uint8* key, uint64 length) {
+  if (!key || length != static_cast<uint64>(kKeySize))
+    return false;
+
+  uint32 words[4 * (kRounds + 1)];
+  uint32 round_constant = 0x01;
+
+  for (int32 i = 0; i < 4; ++i)
+    words[i] = LoadBigEndian32(key + 4 * i);
+
+  for (int32 i = 4; i < 4 * (kRounds + 1); ++i) {
+    uint32 word = words[i - 1];
+
+    if (i % 4 == 0) {
+      // RotWord, SubWord and the round constant.
+      word = SubWord((word << 8) | (word >> 24));
+      word ^= round_constant << 24;
+      round_constant = MultiplyBy2(static_cast<uint8>(round_constant));
+    }
+
+    words[i] = words[i - 4] ^ word;
+  }
+
+  for (int32 i = 0; i < 4 * (kRounds + 1); ++i)
+    StoreBigEndian32(words[i], round_key_bytes_ + 4 * i);
+
+  // Every block of the sliced state takes the same round key.
+  for (int32 round = 0; round <= kRounds; ++round) {
+    uint8 octets[kSlicedSize];
+    for (int32 i = 0; i < kSlicedBlocks; ++i)
+      memcpy(octets + 16 * i, round_key_bytes_ + 16 * round, 16);
+    Slice(octets, round_keys_ + 8 * round);
+  }
+
+  return true;
+}
+
+void AesCtrCipher::Process(const uint8* counter_block, uint64 offset,
+                           const uint8* in, uint8* out, uint64 length) const {
+  uint64 counter = LoadBigEndian64(counter_block + 8) + offset / kBlockSize;
+  const uint64 skip = offset % kBlockSize;
+
+  uint8 key_stream[kSlicedSize];
+
+  // Rest of a block that was partly used.
+  if (skip > 0 && length > 0) {
+    EncryptCounterBlocks(round_keys_, counter_block, counter++, key_stream);
+
+    const uint64 size =
+        (length < kBlockSize - skip) ? length : kBlockSize - skip;
+    XorKeyStream(key_stream + skip, in, out, size);
+    in += size;
+    out += size;
+    length -= size;
+  }
+
+#ifdef MKVMUXER_HAVE_AESNI
+  const uint64 block_count = length / kBlockSize;
+  if (hardware_enabled_ && block_count > 0) {
+    ProcessBlocksAesNi(round_key_bytes_, counter_block, counter, in, out,
+                       block_count);
+    counter += block_count;
+    in += block_count * kBlockSize;
+    out += block_count * kBlockSize;
+    length -= block_count * kBlockSize;
+  }
+#endif
+
+  while (length > 0) {
+    EncryptCounterBlocks(round_keys_, counter_block, counter, key_stream);
+    counter += kSlicedBlocks;
+
+    const uint64 size = (length < static_cast<uint64>(kSlicedSize))
+                            ? length
+                            : static_cast<uint64>(kSlicedSize);
+    XorKeyStream(key_stream, in, out, size);
+    in += size;
+    out += size;
+    length -= size;
+  }
+}
+
+void AesCtrCipher::set_hardware_enabled(bool enabled) {
+#ifdef MKVMUXER_HAVE_AESNI
+  hardware_enabled_ = enabled && HasAesNi();
+#else
+  (void)enabled;
+  hardware_enabled_ = false;
+#endif
+}
+
+///////////////////////////////////////////////////////////////
+//
+// FrameEncryptor Class
+
+FrameEncryptor::FrameEncryptor() : next_iv_(0) {}
+
+bool FrameEncryptor::Init(const uint8* key, uint64 length, uint64 first_iv) {
+  if (!cipher_.Init(key, length))
+    return false;
+
+  next_iv_ = first_iv;
+  return true;
+}
+
+bool FrameEncryptor::GenerateIv(uint64* iv) {
+  if (!iv)
+    return false;
+
+  uint8 buf[kIvSize];
+  if (!ReadSystemRandom(buf, sizeof(buf)))
+    return false;
+
+  *iv = LoadBigEndian64(buf);
+  return true;
+}
+
+uint64 FrameEncryptor::EncryptedSize(uint64 length, bool encrypted,
+                                     int32 partition_count) {
+  if (!encrypted)
+    return 1 + length;
+
+  uint64 size = 1 + kIvSize + length;
+  if (partition_count > 0)
+    size += 1 + 4 * static_cast<uint64>(partition_count);
+  return size;
+}
+
+bool FrameEncryptor::Encrypt(const uint8* frame, uint64 length,
+                             bool encrypted, const uint32* partition_offsets,
+                             int32 partition_count, uint8* out) {
+  if (!frame || length == 0 || !out || partition_count < 0 ||
+      partition_count > kMaxPartitions ||
+      (partition_count > 0 && (!encrypted || !partition_offsets))) {
+    return false;
+  }
+
+  if (!encrypted) {
+    out[0] = 0;
+    memcpy(out + 1, frame, static_cast<size_t>(length));
+    return true;
+  }
+
+  uint64 previous_offset = 0;
+  for (int32 i = 0; i < partition_count; ++i) {
+    if (partition_offsets[i] < previous_offset || partition_offsets[i] > length)
+      return false;
+    previous_offset = partition_offsets[i];
+  }
+
+  uint8 counter_block[AesCtrCipher::kBlockSize] = {0};
+  StoreBigEndian64(next_iv_++, counter_block);
+
+  out[0] = kEncryptedFrame;
+  memcpy(out + 1, counter_block, kIvSize);
+  uint8* data = out + 1 + kIvSize;
+
+  if (partition_count == 0) {
+    cipher_.Process(counter_block, 0, frame, data, length);
+    return true;
+  }
+
+  out[0] |= kPartitionedFrame;
+  *data++ = static_cast<uint8>(partition_count);
+  for (int32 i = 0; i < partition_count; ++i, data += 4)
+    StoreBigEndian32(partition_offsets[i], data);
+
+  // Even partitions are clear and odd ones encrypted, as a single stream.
+  uint64 start = 0;
+  uint64 stream_offset = 0;
+  for (int32 i = 0; i <= partition_count; ++i) {
+    const uint64 end = (i < partition_count) ? partition_offsets[i] : length;
+
+    if (i % 2 == 0) {
+      memcpy(data + start, frame + start, static_cast<size_t>(end - start));
+    } else {
+      cipher_.Process(counter_block, stream_offset, frame + start,
+                      data + start, end - start);
+      stream_offset += end - start;
+    }
+
+    start = end;
+  }
+
+  return true;
+}
+
+}  // namespace mkvmuxer
@@ -0,0 +1,121 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVENCRYPTOR_HPP
+#define MKVENCRYPTOR_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// AES-128 in counter mode. The key stream for a 16 octet counter block is
+// the encryption of the block, then of the block with its last 8 octets, a
+// big-endian counter, incremented by one, and so on. Encryption and
+// decryption are the same operation.
+//
+// On x86 processors with the AES instructions the key stream is computed
+// several blocks at a time with AES-NI; elsewhere a portable bit-sliced
+// implementation is used. Neither looks up tables with the key or the data,
+// so their timing does not reveal the key through the cache.
+class AesCtrCipher {
+ public:
+  static const int32 kKeySize = 16;
+  static const int32 kBlockSize = 16;
+
+  AesCtrCipher();
+  ~AesCtrCipher() {}
+
+  // Expands |key|, which must be kKeySize octets long. Returns true on
+  // success.
+  bool Init(const uint8* key, uint64 length);
+
+  // XORs |length| octets of |in| with the key stream of |counter_block|,
+  // starting |offset| octets into the stream, and stores the result at |out|.
+  // |in| and |out| may be the same buffer. Init() must have succeeded.
+  void Process(const uint8* counter_block, uint64 offset, const uint8* in,
+               uint8* out, uint64 length) const;
+
+  // Turns the AES-NI implementation on or off. It can only be turned on when
+  // the processor supports it, which is the default.
+  void set_hardware_enabled(bool enabled);
+  bool hardware_enabled() const { return hardware_enabled_; }
+
+ private:
+  // Round keys of the expanded key, bit-sliced for the portable
+  // implementation and as octets for AES-NI.
+  uint64 round_keys_[88];
+  uint8 round_key_bytes_[176];
+
+  bool hardware_enabled_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(AesCtrCipher);
+};
+
+// Encrypts frames into the encrypted block format of the WebM encryption
+// specification. Each encrypted frame starts with a signal byte, followed by
+// an 8 octet IV and, for a partitioned frame, the partition count and the
+// 32-bit big-endian partition offsets. The data follows in the clear or
+// encrypted with AES-CTR, using the IV followed by a block counter of 0 as
+// the first counter block. The encrypted partitions of a frame are encrypted
+// as one stream. Frames left in the clear only get a signal byte of 0.
+class FrameEncryptor {
+ public:
+  static const int32 kIvSize = 8;
+  static const int32 kMaxPartitions = 255;
+
+  // Bits of the signal byte.
+  static const uint8 kEncryptedFrame = 0x01;
+  static const uint8 kPartitionedFrame = 0x02;
+
+  FrameEncryptor();
+  ~FrameEncryptor() {}
+
+  // Sets the kKeySize octet |key|, and the IV of the first frame. Every
+  // encrypted frame takes the next IV, so IVs are not reused with one key
+  // as long as the frames of a key start from different IVs. Returns true on
+  // success.
+  bool Init(const uint8* key, uint64 length, uint64 first_iv);
+
+  // Returns the size of the encrypted form of |length| octets, which are
+  // left in the clear if |encrypted| is false, and otherwise divided in
+  // |partition_count| partitions.
+  static uint64 EncryptedSize(uint64 length, bool encrypted,
+                              int32 partition_count);
+
+  // Stores the encrypted form of the |length| octets of |frame| at |out|,
+  // which must have room for EncryptedSize() octets. If |partition_count|
+  // is not 0, the |partition_offsets| split the frame in partitions that
+  // alternate between clear and encrypted, starting with a clear one. The
+  // offsets must be in increasing order and not beyond |length|. Returns
+  // true on success.
+  bool Encrypt(const uint8* frame, uint64 length, bool encrypted,
+               const uint32* partition_offsets, int32 partition_count,
+               uint8* out);
+
+  // Sets |iv| to a random IV from the random number generator of the
+  // operating system, which is suitable as the first IV of a key. Returns
+  // false if no such generator is available.
+  static bool GenerateIv(uint64* iv);
+
+  // IV of the next encrypted frame.
+  void set_next_iv(uint64 next_iv) { next_iv_ = next_iv; }
+  uint64 next_iv() const { return next_iv_; }
+
+  AesCtrCipher* cipher() { return &cipher_; }
+
+ private:
+  AesCtrCipher cipher_;
+  uint64 next_iv_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(FrameEncryptor);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVENCRYPTOR_HPP
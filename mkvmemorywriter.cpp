@@ -0,0 +1,110 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#include "mkvmemorywriter.hpp"
+
+#include <cstring>
+#include <new>
+
+namespace mkvmuxer {
+
+namespace {
+
+// Smallest buffer allocated on the first write.
+const uint64 kMinCapacity = 64 * 1024;
+
+}  // namespace
+
+MemoryMkvWriter::MemoryMkvWriter()
+    : data_(NULL), capacity_(0), size_(0), position_(0) {}
+
+MemoryMkvWriter::~MemoryMkvWriter() { delete[] data_; }
+
+int32 MemoryMkvWriter::Write(const void* buffer, uint32 length) {
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  const uint64 end = position_ + length;
+
+  if (end > capacity_) {
+    // Grow geometrically so that appending stays linear overall.
+    uint64 capacity = (capacity_ < kMinCapacity) ? kMinCapacity : capacity_;
+    while (capacity < end)
+      capacity *= 2;
+
+    if (!Reserve(capacity))
+      return -1;
+  }
+
+  memcpy(data_ + position_, buffer, length);
+  position_ = end;
+
+  if (position_ > size_)
+    size_ = position_;
+
+  return 0;
+}
+
+bool MemoryMkvWriter::Reserve(uint64 capacity) {
+  if (capacity <= capacity_)
+    return true;
+
+  uint8* const data =
+      new (std::nothrow) uint8[static_cast<size_t>(capacity)];  // NOLINT
+  if (!data)
+    return false;
+
+  if (size_ > 0)
+    memcpy(data, data_, static_cast<size_t>(size_));
+
+  delete[] data_;
+  data_ = data;
+  capacity_ = capacity;
+  return true;
+}
+
+uint8* MemoryMkvWriter::Release(uint64* length) {
+  if (!length)
+    return NULL;
+
+  *length = size_;
+  uint8* const data = (size_ > 0) ? data_ : NULL;
+
+  if (!data)
+    delete[] data_;
+
+  data_ = NULL;
+  capacity_ = 0;
+  size_ = 0;
+  position_ = 0;
+  return data;
+}
+
+void MemoryMkvWriter::Clear() {
+  size_ = 0;
+  position_ = 0;
+}
+
+int64 MemoryMkvWriter::Position() const { return position_; }
+
+int32 MemoryMkvWriter::Position(int64 position) {
+  if (position < 0 || static_cast<uint64>(position) > size_)
+    return -1;
+
+  position_ = position;
+  return 0;
+}
+
+bool MemoryMkvWriter::Seekable() const { return true; }
+
+void MemoryMkvWriter::ElementStartNotify(uint64, int64) {}
+
+}  // namespace mkvmuxer
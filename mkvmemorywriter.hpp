@@ -0,0 +1,66 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#ifndef MKVMEMORYWRITER_HPP
+#define MKVMEMORYWRITER_HPP
+
+#include "mkvmuxer.hpp"
+#include "mkvmuxertypes.hpp"
+
+namespace mkvmuxer {
+
+// Seekable IMkvWriter that stores the output in a growable in-memory buffer.
+// Seeking back to patch sizes, cues and the segment size updates the buffer
+// in place. Release() hands the buffer to the caller without copying it.
+class MemoryMkvWriter : public IMkvWriter {
+ public:
+  MemoryMkvWriter();
+  virtual ~MemoryMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Makes room for at least |capacity| octets of output, to avoid growing the
+  // buffer while muxing. Returns true on success.
+  bool Reserve(uint64 capacity);
+
+  // Returns ownership of the output to the caller, who must free it with
+  // delete[], and stores its size in |length|. The writer is left empty.
+  // Returns NULL if nothing has been written.
+  uint8* Release(uint64* length);
+
+  // Discards the output and starts over.
+  void Clear();
+
+  // The output so far. |data()| is valid until the next Write(), Reserve(),
+  // Release() or Clear().
+  const uint8* data() const { return data_; }
+  uint64 size() const { return size_; }
+
+ private:
+  uint8* data_;
+
+  // Number of octets allocated for |data_|.
+  uint64 capacity_;
+
+  // Number of octets written; the end of the output.
+  uint64 size_;
+
+  // Current write position, at most |size_|.
+  uint64 position_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MemoryMkvWriter);
+};
+
+}  // end namespace mkvmuxer
+
+#endif  // MKVMEMORYWRITER_HPP
@@ -15,6 +15,8 @@
 #include <ctime>
 #include <new>
 
+#include "mkvencryptor.hpp"
+#include "mkvmemorywriter.hpp"
 #include "mkvmuxerutil.hpp"
 #include "mkvparser.hpp"
 #include "mkvwriter.hpp"
@@ -55,6 +57,230 @@ bool StrCpy(const char* src, char** dst_ptr) {
   strcpy(dst, src);  // NOLINT
   return true;
 }
+
+// Fills exactly |size| octets with Void elements. A single Void element
+// cannot take every size, as the coded size of its length grows by one octet
+// at some lengths; those sizes are split in two. Returns true on success.
+bool WriteVoidElements(IMkvWriter* writer, uint64 size) {
+  if (size < 2)
+    return false;
+
+  if (WriteVoidElement(writer, size) == size)
+    return true;
+
+  return WriteVoidElement(writer, 2) == 2 &&
+         WriteVoidElement(writer, size - 2) == size - 2;
+}
+
+// Writes the data collected in |source| to |writer| and clears |source|.
+// Returns true on success.
+bool WriteMemory(IMkvWriter* writer, MemoryMkvWriter* source) {
+  const uint8* data = source->data();
+  uint64 remaining = source->size();
+  bool written = true;
+
+  while (remaining > 0) {
+    const uint32 length = (remaining > 0x80000000ULL)
+                              ? 0x80000000U
+                              : static_cast<uint32>(remaining);
+    if (writer->Write(data, length)) {
+      written = false;
+      break;
+    }
+    data += length;
+    remaining -= length;
+  }
+
+  source->Clear();
+  return written;
+}
+}  // namespace
+
+SegmentStats::SegmentStats() { Init(); }
+
+void SegmentStats::Init() {
+  for (int32 i = 0; i < kElementClassCount; ++i)
+    bytes[i] = 0;
+
+  clusters = 0;
+  blocks = 0;
+  frames = 0;
+
+  min_cluster_blocks = 0;
+  max_cluster_blocks = 0;
+  min_cluster_frames = 0;
+  max_cluster_frames = 0;
+  min_cluster_size = 0;
+  max_cluster_size = 0;
+  min_cluster_duration = 0;
+  max_cluster_duration = 0;
+  total_cluster_duration = 0;
+
+  max_queued_frames = 0;
+  queued_frames_sum = 0;
+  queued_frames_samples = 0;
+
+  seek_backs = 0;
+}
+
+#ifdef MKVMUXER_ENABLE_STATS
+// Statistics of a Segment, with the counters of the cluster being written.
+class SegmentStatsCollector {
+ public:
+  SegmentStatsCollector() : cluster_frames(0) {}
+
+  SegmentStats stats;
+  uint64 cluster_frames;
+};
+#endif  // MKVMUXER_ENABLE_STATS
+
+namespace {
+
+#ifdef MKVMUXER_ENABLE_STATS
+// Updates the range [|*min_value|, |*max_value|] with |value|. |first| tells
+// that the range is empty.
+void UpdateRange(uint64 value, bool first, uint64* min_value,
+                 uint64* max_value) {
+  if (first || value < *min_value)
+    *min_value = value;
+  if (first || value > *max_value)
+    *max_value = value;
+}
+
+// Counts the block that |cluster| has just written for the |frame_count|
+// |frames|. |payload_size| and |blocks_added| are the values of |cluster|
+// before the block was added.
+void CountBlock(SegmentStatsCollector* collector, const Cluster* cluster,
+                uint64 payload_size, int32 blocks_added,
+                const Frame* const* frames, int32 frame_count) {
+  if (collector == NULL)
+    return;
+
+  SegmentStats& stats = collector->stats;
+
+  // The first block also wrote the cluster's Timecode element.
+  uint64 size = cluster->payload_size() - payload_size;
+  if (blocks_added == 0)
+    size -= EbmlElementSize(kMkvTimecode, cluster->timecode());
+
+  uint64 data_size = 0;
+  for (int32 i = 0; i < frame_count; ++i)
+    data_size += frames[i]->length() + frames[i]->additional_length();
+
+  uint64 header_size = size - data_size;
+
+  if (frame_count == 1 && !frames[0]->CanBeSimpleBlock()) {
+    // The BlockGroup ID is one octet, followed by its size coded in as few
+    // octets as possible.
+    int32 coded_size = 1;
+    while (coded_size < 8 &&
+           GetCodedUIntSize(size - 1 - coded_size) != coded_size) {
+      ++coded_size;
+    }
+
+    const uint64 block_payload_size = 4 + frames[0]->length();
+    header_size = 1 + coded_size +
+                  EbmlMasterElementSize(kMkvBlock, block_payload_size) + 4;
+    stats.bytes[SegmentStats::kBlockGroupElements] +=
+        size - header_size - data_size;
+  }
+
+  stats.bytes[SegmentStats::kBlockHeaders] += header_size;
+  stats.bytes[SegmentStats::kFrameData] += data_size;
+  ++stats.blocks;
+  stats.frames += frame_count;
+  collector->cluster_frames += frame_count;
+}
+
+// Counts the block that |cluster| has just copied from |block|.
+// |payload_size| and |blocks_added| are the values of |cluster| before the
+// block was added.
+void CountCopiedBlock(SegmentStatsCollector* collector, const Cluster* cluster,
+                      uint64 payload_size, int32 blocks_added,
+                      const mkvparser::Block* block) {
+  if (collector == NULL)
+    return;
+
+  SegmentStats& stats = collector->stats;
+
+  // The first block also wrote the cluster's Timecode element.
+  uint64 size = cluster->payload_size() - payload_size;
+  if (blocks_added == 0)
+    size -= EbmlElementSize(kMkvTimecode, cluster->timecode());
+
+  const int32 frame_count = block->GetFrameCount();
+  uint64 data_size = 0;
+  for (int32 i = 0; i < frame_count; ++i)
+    data_size += block->GetFrame(i).len;
+
+  stats.bytes[SegmentStats::kBlockHeaders] += size - data_size;
+  stats.bytes[SegmentStats::kFrameData] += data_size;
+  ++stats.blocks;
+  stats.frames += frame_count;
+  collector->cluster_frames += frame_count;
+}
+
+// Counts |cluster| once all of its blocks are written. |end_time| is the
+// time in nanoseconds at which the cluster ends.
+void CountCluster(SegmentStatsCollector* collector, const Cluster* cluster,
+                  uint64 end_time) {
+  if (collector == NULL || cluster == NULL || cluster->blocks_added() == 0)
+    return;
+
+  SegmentStats& stats = collector->stats;
+  const bool first = stats.clusters == 0;
+
+  const uint64 start_time = cluster->timecode() * cluster->timecode_scale();
+  const uint64 duration = end_time > start_time ? end_time - start_time : 0;
+  const uint64 size = cluster->Size();
+
+  stats.bytes[SegmentStats::kClusterHeaders] +=
+      size - cluster->payload_size() +
+      EbmlElementSize(kMkvTimecode, cluster->timecode());
+
+  UpdateRange(cluster->blocks_added(), first, &stats.min_cluster_blocks,
+              &stats.max_cluster_blocks);
+  UpdateRange(collector->cluster_frames, first, &stats.min_cluster_frames,
+              &stats.max_cluster_frames);
+  UpdateRange(size, first, &stats.min_cluster_size, &stats.max_cluster_size);
+  UpdateRange(duration, first, &stats.min_cluster_duration,
+              &stats.max_cluster_duration);
+  stats.total_cluster_duration += duration;
+
+  ++stats.clusters;
+  collector->cluster_frames = 0;
+}
+
+void CountQueuedFrames(SegmentStatsCollector* collector, int32 queued) {
+  if (collector == NULL)
+    return;
+
+  SegmentStats& stats = collector->stats;
+  const uint64 depth = static_cast<uint64>(queued);
+
+  if (depth > stats.max_queued_frames)
+    stats.max_queued_frames = depth;
+  stats.queued_frames_sum += depth;
+  ++stats.queued_frames_samples;
+}
+
+// Counts a seek back made through |writer|, which only happens when it is
+// seekable.
+void CountSeekBack(SegmentStatsCollector* collector, const IMkvWriter* writer) {
+  if (collector && writer && writer->Seekable())
+    ++collector->stats.seek_backs;
+}
+#else
+// Without MKVMUXER_ENABLE_STATS the instrumentation compiles to nothing.
+inline void CountBlock(SegmentStatsCollector*, const Cluster*, uint64, int32,
+                       const Frame* const*, int32) {}
+inline void CountCopiedBlock(SegmentStatsCollector*, const Cluster*, uint64,
+                             int32, const mkvparser::Block*) {}
+inline void CountCluster(SegmentStatsCollector*, const Cluster*, uint64) {}
+inline void CountQueuedFrames(SegmentStatsCollector*, int32) {}
+inline void CountSeekBack(SegmentStatsCollector*, const IMkvWriter*) {}
+#endif  // MKVMUXER_ENABLE_STATS
+
 }  // namespace
 
 ///////////////////////////////////////////////////////////////
@@ -65,6 +291,31 @@ IMkvWriter::IMkvWriter() {}
 
 IMkvWriter::~IMkvWriter() {}
 
+IMkvChunkSink::IMkvChunkSink() {}
+
+IMkvChunkSink::~IMkvChunkSink() {}
+
+int32 IMkvWriter::WriteV(const WriteBuffer* buffers, int32 count) {
+  if (buffers == NULL || count < 0)
+    return -1;
+
+  for (int32 i = 0; i < count; ++i) {
+    if (buffers[i].length == 0)
+      continue;
+
+    const int32 status = Write(buffers[i].data, buffers[i].length);
+
+    if (status)
+      return status;
+  }
+
+  return 0;
+}
+
+bool IMkvWriter::ElementStartNotifyEnabled() const { return false; }
+
+int64 IMkvWriter::CopyFrom(mkvparser::IMkvReader*, int64, int64) { return 0; }
+
 bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version) {
   // Level 0
   uint64 size = EbmlElementSize(kMkvEBMLVersion, 1ULL);
@@ -101,26 +352,57 @@ bool WriteEbmlHeader(IMkvWriter* writer) {
 
 bool ChunkedCopy(mkvparser::IMkvReader* source, mkvmuxer::IMkvWriter* dst,
                  mkvmuxer::int64 start, int64 size) {
-  // TODO(vigneshv): Check if this is a reasonable value.
-  const uint32 kBufSize = 2048;
-  uint8* buf = new uint8[kBufSize];
+  if (!source || !dst || start < 0 || size < 0)
+    return false;
+
+  // Let the writer copy what it can, such as kernel copies between files.
+  const int64 copied = dst->CopyFrom(source, start, size);
+  if (copied < 0 || copied > size)
+    return false;
+
+  start += copied;
+  size -= copied;
+
+  if (size == 0)
+    return true;
+
+  const int64 kBufSize = 1024 * 1024;
+  const uint32 buf_size =
+      static_cast<uint32>((size > kBufSize) ? kBufSize : size);
+  uint8* const buf = new (std::nothrow) uint8[buf_size];  // NOLINT
+  if (!buf)
+    return false;
+
+  bool ok = true;
   int64 offset = start;
   while (size > 0) {
-    const int64 read_len = (size > kBufSize) ? kBufSize : size;
-    if (source->Read(offset, static_cast<long>(read_len), buf))
-      return false;
-    dst->Write(buf, static_cast<uint32>(read_len));
+    const uint32 read_len =
+        static_cast<uint32>((size > buf_size) ? buf_size : size);
+    if (source->Read(offset, static_cast<long>(read_len), buf) ||
+        dst->Write(buf, read_len)) {
+      ok = false;
+      break;
+    }
     offset += read_len;
     size -= read_len;
   }
+
   delete[] buf;
-  return true;
+  return ok;
 }
 
 ///////////////////////////////////////////////////////////////
 //
 // Frame Class
 
+Frame::BufferRef::BufferRef()
+    : storage(NULL),
+      capacity(0),
+      borrowed(false),
+      retain(NULL),
+      release(NULL),
+      opaque(NULL) {}
+
 Frame::Frame()
     : add_id_(0),
       additional_(NULL),
@@ -133,65 +415,218 @@ Frame::Frame()
       timestamp_(0),
       discard_padding_(0),
       reference_block_timestamp_(0),
-      reference_block_timestamp_set_(false) {}
+      reference_block_timestamp_set_(false),
+      encrypted_(true),
+      encryption_partitions_(NULL),
+      encryption_partition_count_(0),
+      encryption_partitions_capacity_(0) {}
 
 Frame::~Frame() {
-  delete[] frame_;
-  delete[] additional_;
+  ReleaseBuffer(&frame_, &frame_ref_);
+  ReleaseBuffer(&additional_, &additional_ref_);
+  delete[] frame_ref_.storage;
+  delete[] additional_ref_.storage;
+  delete[] encryption_partitions_;
 }
 
 bool Frame::CopyFrom(const Frame& frame) {
-  delete[] frame_;
-  frame_ = NULL;
   length_ = 0;
-  if (frame.length() > 0 && frame.frame() != NULL &&
-      !Init(frame.frame(), frame.length())) {
-    return false;
+  if (frame.length() > 0 && frame.frame() != NULL) {
+    if (!ShareBuffer(frame.frame(), frame.length(), frame.frame_ref_, &frame_,
+                     &frame_ref_)) {
+      return false;
+    }
+    length_ = frame.length();
+  } else {
+    ReleaseBuffer(&frame_, &frame_ref_);
   }
   add_id_ = 0;
-  delete[] additional_;
-  additional_ = NULL;
   additional_length_ = 0;
-  if (frame.additional_length() > 0 && frame.additional() != NULL &&
-      !AddAdditionalData(frame.additional(), frame.additional_length(),
-                         frame.add_id())) {
-    return false;
+  if (frame.additional_length() > 0 && frame.additional() != NULL) {
+    if (!ShareBuffer(frame.additional(), frame.additional_length(),
+                     frame.additional_ref_, &additional_, &additional_ref_)) {
+      return false;
+    }
+    additional_length_ = frame.additional_length();
+    add_id_ = frame.add_id();
+  } else {
+    ReleaseBuffer(&additional_, &additional_ref_);
   }
+  return CopyPropertiesFrom(frame);
+}
+
+bool Frame::BorrowFrom(const Frame& frame) {
+  ReleaseBuffer(&frame_, &frame_ref_);
+  length_ = 0;
+  if (frame.length() > 0 && frame.frame() != NULL) {
+    frame_ = frame.frame();
+    frame_ref_.borrowed = true;
+    length_ = frame.length();
+  }
+  ReleaseBuffer(&additional_, &additional_ref_);
+  add_id_ = 0;
+  additional_length_ = 0;
+  if (frame.additional_length() > 0 && frame.additional() != NULL) {
+    additional_ = frame.additional();
+    additional_ref_.borrowed = true;
+    additional_length_ = frame.additional_length();
+    add_id_ = frame.add_id();
+  }
+  return CopyPropertiesFrom(frame);
+}
+
+bool Frame::CopyPropertiesFrom(const Frame& frame) {
   duration_ = frame.duration();
   is_key_ = frame.is_key();
   track_number_ = frame.track_number();
   timestamp_ = frame.timestamp();
   discard_padding_ = frame.discard_padding();
+  reference_block_timestamp_ = frame.reference_block_timestamp();
+  reference_block_timestamp_set_ = frame.reference_block_timestamp_set();
+  encrypted_ = frame.encrypted();
+  return SetEncryptionPartitions(frame.encryption_partitions(),
+                                 frame.encryption_partition_count());
+}
+
+void Frame::Reset() {
+  ReleaseBuffer(&frame_, &frame_ref_);
+  ReleaseBuffer(&additional_, &additional_ref_);
+  add_id_ = 0;
+  additional_length_ = 0;
+  duration_ = 0;
+  is_key_ = false;
+  length_ = 0;
+  track_number_ = 0;
+  timestamp_ = 0;
+  discard_padding_ = 0;
+  reference_block_timestamp_ = 0;
+  reference_block_timestamp_set_ = false;
+  encrypted_ = true;
+  encryption_partition_count_ = 0;
+}
+
+bool Frame::SetEncryptionPartitions(const uint32* offsets, int32 count) {
+  if (count < 0 || count > FrameEncryptor::kMaxPartitions ||
+      (count > 0 && !offsets)) {
+    return false;
+  }
+
+  if (count > encryption_partitions_capacity_) {
+    uint32* const partitions = new (std::nothrow) uint32[count];  // NOLINT
+    if (!partitions)
+      return false;
+
+    delete[] encryption_partitions_;
+    encryption_partitions_ = partitions;
+    encryption_partitions_capacity_ = count;
+  }
+
+  for (int32 i = 0; i < count; ++i)
+    encryption_partitions_[i] = offsets[i];
+  encryption_partition_count_ = count;
   return true;
 }
 
 bool Frame::Init(const uint8* frame, uint64 length) {
-  uint8* const data =
-      new (std::nothrow) uint8[static_cast<size_t>(length)];  // NOLINT
-  if (!data)
+  if (!CopyBuffer(frame, length, &frame_, &frame_ref_))
     return false;
 
-  delete[] frame_;
-  frame_ = data;
   length_ = length;
-
-  memcpy(frame_, frame, static_cast<size_t>(length_));
   return true;
 }
 
 bool Frame::AddAdditionalData(const uint8* additional, uint64 length,
                               uint64 add_id) {
-  uint8* const data =
-      new (std::nothrow) uint8[static_cast<size_t>(length)];  // NOLINT
-  if (!data)
+  if (!CopyBuffer(additional, length, &additional_, &additional_ref_))
     return false;
 
-  delete[] additional_;
-  additional_ = data;
   additional_length_ = length;
   add_id_ = add_id;
+  return true;
+}
+
+bool Frame::Borrow(const uint8* frame, uint64 length,
+                   FrameBufferCallback retain, FrameBufferCallback release,
+                   void* opaque) {
+  if (!frame || length == 0)
+    return false;
 
-  memcpy(additional_, additional, static_cast<size_t>(additional_length_));
+  ReleaseBuffer(&frame_, &frame_ref_);
+  frame_ = frame;
+  length_ = length;
+  frame_ref_.borrowed = true;
+  frame_ref_.retain = retain;
+  frame_ref_.release = release;
+  frame_ref_.opaque = opaque;
+  return true;
+}
+
+bool Frame::BorrowAdditionalData(const uint8* additional, uint64 length,
+                                 uint64 add_id, FrameBufferCallback retain,
+                                 FrameBufferCallback release, void* opaque) {
+  if (!additional || length == 0)
+    return false;
+
+  ReleaseBuffer(&additional_, &additional_ref_);
+  additional_ = additional;
+  additional_length_ = length;
+  add_id_ = add_id;
+  additional_ref_.borrowed = true;
+  additional_ref_.retain = retain;
+  additional_ref_.release = release;
+  additional_ref_.opaque = opaque;
+  return true;
+}
+
+void Frame::ReleaseBuffer(const uint8** data, BufferRef* ref) {
+  if (ref->borrowed && ref->release)
+    ref->release(ref->opaque);
+
+  ref->borrowed = false;
+  ref->retain = NULL;
+  ref->release = NULL;
+  ref->opaque = NULL;
+  *data = NULL;
+}
+
+bool Frame::CopyBuffer(const uint8* source, uint64 length, const uint8** data,
+                       BufferRef* ref) {
+  if (length > ref->capacity) {
+    uint8* const storage =
+        new (std::nothrow) uint8[static_cast<size_t>(length)];  // NOLINT
+    if (!storage)
+      return false;
+
+    ReleaseBuffer(data, ref);
+    delete[] ref->storage;
+    ref->storage = storage;
+    ref->capacity = length;
+  } else {
+    ReleaseBuffer(data, ref);
+  }
+
+  if (length > 0) {
+    memcpy(ref->storage, source, static_cast<size_t>(length));
+    *data = ref->storage;
+  }
+  return true;
+}
+
+bool Frame::ShareBuffer(const uint8* source, uint64 length,
+                        const BufferRef& source_ref, const uint8** data,
+                        BufferRef* ref) {
+  if (!source_ref.borrowed || !source_ref.retain)
+    return CopyBuffer(source, length, data, ref);
+
+  // Take the new reference before dropping the old one, which may be to the
+  // same buffer.
+  source_ref.retain(source_ref.opaque);
+  ReleaseBuffer(data, ref);
+  *data = source;
+  ref->borrowed = true;
+  ref->retain = source_ref.retain;
+  ref->release = source_ref.release;
+  ref->opaque = source_ref.opaque;
   return true;
 }
 
@@ -299,27 +734,70 @@ uint64 CuePoint::Size() const {
 //
 // Cues Class
 
+namespace {
+
+// Number of values stored per CuePoint in the temporary file of Cues.
+const int32 kSpilledCueFields = 5;
+
+// Number of CuePoints Cues reads back from its temporary file at once.
+const int32 kSpilledCueBatch = 64;
+
+void CueToRecord(const CuePoint& cue, uint64* record) {
+  record[0] = cue.time();
+  record[1] = cue.track();
+  record[2] = cue.cluster_pos();
+  record[3] = cue.block_number();
+  record[4] = cue.output_block_number();
+}
+
+void RecordToCue(const uint64* record, CuePoint* cue) {
+  cue->set_time(record[0]);
+  cue->set_track(record[1]);
+  cue->set_cluster_pos(record[2]);
+  cue->set_block_number(record[3]);
+  cue->set_output_block_number(record[4] != 0);
+}
+
+// Seeks to the record of the CuePoint at |index| of a temporary file of Cues.
+// Returns 0 on success.
+int SeekToSpilledCue(FILE* file, int32 index) {
+  const int64 position =
+      static_cast<int64>(index) * kSpilledCueFields * sizeof(uint64);
+#ifdef _MSC_VER
+  return _fseeki64(file, position, SEEK_SET);
+#else
+  return fseeko(file, static_cast<off_t>(position), SEEK_SET);
+#endif
+}
+
+}  // namespace
+
 Cues::Cues()
     : cue_entries_capacity_(0),
       cue_entries_size_(0),
       cue_entries_(NULL),
+      max_cues_in_memory_(0),
+      spill_file_(NULL),
+      spilled_size_(0),
+      spilled_payload_size_(0),
       output_block_number_(true) {}
 
 Cues::~Cues() {
   if (cue_entries_) {
-    for (int32 i = 0; i < cue_entries_size_; ++i) {
-      CuePoint* const cue = cue_entries_[i];
-      delete cue;
-    }
+    for (int32 i = 0; i < cue_entries_capacity_; ++i)
+      delete cue_entries_[i];
     delete[] cue_entries_;
   }
+  if (spill_file_)
+    fclose(spill_file_);
 }
 
 bool Cues::AddCue(CuePoint* cue) {
-  if (!cue)
+  if (!cue || max_cues_in_memory_ > 0)
     return false;
 
-  if ((cue_entries_size_ + 1) > cue_entries_capacity_) {
+  const int32 count = cue_entries_size_ - spilled_size_;
+  if ((count + 1) > cue_entries_capacity_) {
     // Add more CuePoints.
     const int32 new_capacity =
         (!cue_entries_capacity_) ? 2 : cue_entries_capacity_ * 2;
@@ -332,9 +810,8 @@ bool Cues::AddCue(CuePoint* cue) {
     if (!cues)
       return false;
 
-    for (int32 i = 0; i < cue_entries_size_; ++i) {
-      cues[i] = cue_entries_[i];
-    }
+    for (int32 i = 0; i < new_capacity; ++i)
+      cues[i] = (i < cue_entries_capacity_) ? cue_entries_[i] : NULL;
 
     delete[] cue_entries_;
 
@@ -343,7 +820,42 @@ bool Cues::AddCue(CuePoint* cue) {
   }
 
   cue->set_output_block_number(output_block_number_);
-  cue_entries_[cue_entries_size_++] = cue;
+  cue_entries_[count] = cue;
+  ++cue_entries_size_;
+  return true;
+}
+
+bool Cues::AddCueCopy(const CuePoint& cue) {
+  if (max_cues_in_memory_ == 0) {
+    CuePoint* const copy = new (std::nothrow) CuePoint();  // NOLINT
+    if (!copy)
+      return false;
+
+    *copy = cue;
+    if (!AddCue(copy)) {
+      delete copy;
+      return false;
+    }
+    return true;
+  }
+
+  if (cue_entries_size_ - spilled_size_ >= max_cues_in_memory_ &&
+      !SpillCues()) {
+    return false;
+  }
+
+  // SpillCues() keeps the objects of the spilled cue points for reuse, and
+  // the array was allocated for |max_cues_in_memory_| of them.
+  const int32 count = cue_entries_size_ - spilled_size_;
+  if (!cue_entries_[count]) {
+    cue_entries_[count] = new (std::nothrow) CuePoint();  // NOLINT
+    if (!cue_entries_[count])
+      return false;
+  }
+
+  *cue_entries_[count] = cue;
+  cue_entries_[count]->set_output_block_number(output_block_number_);
+  ++cue_entries_size_;
   return true;
 }
 
@@ -351,16 +863,97 @@ CuePoint* Cues::GetCueByIndex(int32 index) const {
   if (cue_entries_ == NULL)
     return NULL;
 
-  if (index >= cue_entries_size_)
+  if (index < spilled_size_ || index >= cue_entries_size_)
     return NULL;
 
-  return cue_entries_[index];
+  return cue_entries_[index - spilled_size_];
+}
+
+bool Cues::GetCue(int32 index, CuePoint* cue) const {
+  if (!cue || index < 0 || index >= cue_entries_size_)
+    return false;
+
+  if (index >= spilled_size_) {
+    *cue = *cue_entries_[index - spilled_size_];
+    return true;
+  }
+
+  uint64 record[kSpilledCueFields];
+  if (!ReadSpilledCues(index, 1, record))
+    return false;
+
+  RecordToCue(record, cue);
+  return true;
+}
+
+bool Cues::SetMaxCuesInMemory(int32 max_cues_in_memory) {
+  if (max_cues_in_memory < 0 || cue_entries_size_ > 0)
+    return false;
+
+  if (max_cues_in_memory > cue_entries_capacity_) {
+    CuePoint** const cues =
+        new (std::nothrow) CuePoint*[max_cues_in_memory];  // NOLINT
+    if (!cues)
+      return false;
+
+    for (int32 i = 0; i < max_cues_in_memory; ++i)
+      cues[i] = NULL;
+
+    delete[] cue_entries_;
+    cue_entries_ = cues;
+    cue_entries_capacity_ = max_cues_in_memory;
+  }
+
+  max_cues_in_memory_ = max_cues_in_memory;
+  return true;
+}
+
+bool Cues::OffsetClusterPositions(uint64 offset) {
+  const int32 count = cue_entries_size_ - spilled_size_;
+  for (int32 i = 0; i < count; ++i) {
+    CuePoint* const cue = cue_entries_[i];
+    cue->set_cluster_pos(cue->cluster_pos() + offset);
+  }
+
+  if (!spill_file_)
+    return true;
+
+  uint64 records[kSpilledCueBatch * kSpilledCueFields];
+  uint64 payload_size = 0;
+  CuePoint cue;
+
+  for (int32 i = 0; i < spilled_size_; i += kSpilledCueBatch) {
+    const int32 batch = (spilled_size_ - i < kSpilledCueBatch)
+                            ? spilled_size_ - i
+                            : kSpilledCueBatch;
+    if (!ReadSpilledCues(i, batch, records))
+      return false;
+
+    for (int32 j = 0; j < batch; ++j) {
+      uint64* const record = &records[j * kSpilledCueFields];
+      RecordToCue(record, &cue);
+      cue.set_cluster_pos(cue.cluster_pos() + offset);
+      payload_size += cue.Size();
+      CueToRecord(cue, record);
+    }
+
+    const size_t record_count = batch * kSpilledCueFields;
+    if (SeekToSpilledCue(spill_file_, i) ||
+        fwrite(records, sizeof(records[0]), record_count, spill_file_) !=
+            record_count) {
+      return false;
+    }
+  }
+
+  spilled_payload_size_ = payload_size;
+  return true;
 }
 
 uint64 Cues::Size() {
-  uint64 size = 0;
-  for (int32 i = 0; i < cue_entries_size_; ++i)
-    size += GetCueByIndex(i)->Size();
+  uint64 size = spilled_payload_size_;
+  const int32 count = cue_entries_size_ - spilled_size_;
+  for (int32 i = 0; i < count; ++i)
+    size += cue_entries_[i]->Size();
   size += EbmlMasterElementSize(kMkvCues, size);
   return size;
 }
@@ -369,15 +962,10 @@ bool Cues::Write(IMkvWriter* writer) const {
   if (!writer)
     return false;
 
-  uint64 size = 0;
-  for (int32 i = 0; i < cue_entries_size_; ++i) {
-    const CuePoint* const cue = GetCueByIndex(i);
-
-    if (!cue)
-      return false;
-
-    size += cue->Size();
-  }
+  const int32 count = cue_entries_size_ - spilled_size_;
+  uint64 size = spilled_payload_size_;
+  for (int32 i = 0; i < count; ++i)
+    size += cue_entries_[i]->Size();
 
   if (!WriteEbmlMasterElement(writer, kMkvCues, size))
     return false;
@@ -386,10 +974,25 @@ bool Cues::Write(IMkvWriter* writer) const {
   if (payload_position < 0)
     return false;
 
-  for (int32 i = 0; i < cue_entries_size_; ++i) {
-    const CuePoint* const cue = GetCueByIndex(i);
+  uint64 records[kSpilledCueBatch * kSpilledCueFields];
+  CuePoint cue;
+
+  for (int32 i = 0; i < spilled_size_; i += kSpilledCueBatch) {
+    const int32 batch = (spilled_size_ - i < kSpilledCueBatch)
+                            ? spilled_size_ - i
+                            : kSpilledCueBatch;
+    if (!ReadSpilledCues(i, batch, records))
+      return false;
+
+    for (int32 j = 0; j < batch; ++j) {
+      RecordToCue(&records[j * kSpilledCueFields], &cue);
+      if (!cue.Write(writer))
+        return false;
+    }
+  }
 
-    if (!cue->Write(writer))
+  for (int32 i = 0; i < count; ++i) {
+    if (!cue_entries_[i]->Write(writer))
       return false;
   }
 
@@ -403,6 +1006,42 @@ bool Cues::Write(IMkvWriter* writer) const {
   return true;
 }
 
+bool Cues::SpillCues() {
+  if (!spill_file_) {
+    spill_file_ = tmpfile();
+    if (!spill_file_)
+      return false;
+  }
+
+  if (SeekToSpilledCue(spill_file_, spilled_size_))
+    return false;
+
+  const int32 count = cue_entries_size_ - spilled_size_;
+  uint64 record[kSpilledCueFields];
+
+  for (int32 i = 0; i < count; ++i) {
+    CueToRecord(*cue_entries_[i], record);
+    if (fwrite(record, sizeof(record[0]), kSpilledCueFields, spill_file_) !=
+        static_cast<size_t>(kSpilledCueFields)) {
+      return false;
+    }
+    spilled_payload_size_ += cue_entries_[i]->Size();
+  }
+
+  spilled_size_ = cue_entries_size_;
+  return true;
+}
+
+bool Cues::ReadSpilledCues(int32 index, int32 count, uint64* records) const {
+  if (!spill_file_ || index < 0 || count < 0 || index + count > spilled_size_)
+    return false;
+
+  const size_t record_count = count * kSpilledCueFields;
+  return !SeekToSpilledCue(spill_file_, index) &&
+         fread(records, sizeof(records[0]), record_count, spill_file_) ==
+             record_count;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // ContentEncAESSettings Class
@@ -568,9 +1207,11 @@ Track::Track(unsigned int* seed)
       default_duration_(0),
       codec_private_length_(0),
       content_encoding_entries_(NULL),
-      content_encoding_entries_size_(0) {}
+      content_encoding_entries_size_(0),
+      encryptor_(NULL) {}
 
 Track::~Track() {
+  delete encryptor_;
   delete[] codec_id_;
   delete[] codec_private_;
   delete[] language_;
@@ -612,6 +1253,11 @@ bool Track::AddContentEncoding() {
   return true;
 }
 
+void Track::set_encryptor(FrameEncryptor* encryptor) {
+  delete encryptor_;
+  encryptor_ = encryptor;
+}
+
 ContentEncoding* Track::GetContentEncodingByIndex(uint32 index) const {
   if (content_encoding_entries_ == NULL)
     return NULL;
@@ -985,10 +1631,22 @@ uint64 VideoTrack::VideoPayloadSize() const {
 // AudioTrack Class
 
 AudioTrack::AudioTrack(unsigned int* seed)
-    : Track(seed), bit_depth_(0), channels_(1), sample_rate_(0.0) {}
+    : Track(seed),
+      bit_depth_(0),
+      channels_(1),
+      sample_rate_(0.0),
+      max_laced_frames_(0) {}
 
 AudioTrack::~AudioTrack() {}
 
+bool AudioTrack::SetMaxLacedFrames(int32 max_laced_frames) {
+  if (max_laced_frames < 0 || max_laced_frames > kMaxLacedFrames)
+    return false;
+
+  max_laced_frames_ = max_laced_frames;
+  return true;
+}
+
 uint64 AudioTrack::PayloadSize() const {
   const uint64 parent_size = Track::PayloadSize();
 
@@ -1050,7 +1708,10 @@ const char Tracks::kVp10CodecId[] = "V_VP10";
 Tracks::Tracks()
     : track_entries_(NULL),
       track_entries_size_(0),
-      wrote_tracks_(false) {}
+      wrote_tracks_(false) {
+  for (uint64 i = 0; i <= kMaxTrackNumber; ++i)
+    tracks_by_number_[i] = NULL;
+}
 
 Tracks::~Tracks() {
   if (track_entries_) {
@@ -1076,16 +1737,23 @@ bool Tracks::AddTrack(Track* track, int32 number) {
 
   uint32 track_num = number;
 
-  if (track_num > 0) {
-    // Check to make sure a track does not already have |track_num|.
-    for (uint32 i = 0; i < track_entries_size_; ++i) {
-      if (track_entries_[i]->number() == track_num)
-        return false;
-    }
-  }
+  // Check to make sure a track does not already have |track_num|.
+  if (track_num > 0 && GetTrackByNumber(track_num))
+    return false;
 
   const uint32 count = track_entries_size_ + 1;
 
+  // Find the lowest availible track number > 0.
+  if (track_num == 0) {
+    track_num = count;
+
+    while (track_num <= kMaxTrackNumber && GetTrackByNumber(track_num))
+      track_num++;
+
+    if (track_num > kMaxTrackNumber)
+      return false;
+  }
+
   Track** const track_entries = new (std::nothrow) Track*[count];  // NOLINT
   if (!track_entries)
     return false;
@@ -1096,28 +1764,12 @@ bool Tracks::AddTrack(Track* track, int32 number) {
 
   delete[] track_entries_;
 
-  // Find the lowest availible track number > 0.
-  if (track_num == 0) {
-    track_num = count;
-
-    // Check to make sure a track does not already have |track_num|.
-    bool exit = false;
-    do {
-      exit = true;
-      for (uint32 i = 0; i < track_entries_size_; ++i) {
-        if (track_entries[i]->number() == track_num) {
-          track_num++;
-          exit = false;
-          break;
-        }
-      }
-    } while (!exit);
-  }
   track->set_number(track_num);
 
   track_entries_ = track_entries;
   track_entries_[track_entries_size_] = track;
   track_entries_size_ = count;
+  tracks_by_number_[track_num] = track;
   return true;
 }
 
@@ -1132,6 +1784,13 @@ const Track* Tracks::GetTrackByIndex(uint32 index) const {
 }
 
 Track* Tracks::GetTrackByNumber(uint64 track_number) const {
+  if (track_number > 0 && track_number <= kMaxTrackNumber) {
+    Track* const track = tracks_by_number_[track_number];
+    if (track && track->number() == track_number)
+      return track;
+  }
+
+  // The number of a track may have been changed after it was added.
   const int32 count = track_entries_size();
   for (int32 i = 0; i < count; ++i) {
     if (track_entries_[i]->number() == track_number)
@@ -1144,7 +1803,7 @@ Track* Tracks::GetTrackByNumber(uint64 track_number) const {
 bool Tracks::TrackIsAudio(uint64 track_number) const {
   const Track* const track = GetTrackByNumber(track_number);
 
-  if (track->type() == kAudio)
+  if (track && track->type() == kAudio)
     return true;
 
   return false;
@@ -1153,7 +1812,7 @@ bool Tracks::TrackIsAudio(uint64 track_number) const {
 bool Tracks::TrackIsVideo(uint64 track_number) const {
   const Track* const track = GetTrackByNumber(track_number);
 
-  if (track->type() == kVideo)
+  if (track && track->type() == kVideo)
     return true;
 
   return false;
@@ -1763,7 +2422,9 @@ Cluster::Cluster(uint64 timecode, int64 cues_pos, uint64 timecode_scale)
       size_position_(-1),
       timecode_(timecode),
       timecode_scale_(timecode_scale),
-      writer_(NULL) {}
+      writer_(NULL),
+      buffer_(NULL),
+      blocks_(NULL) {}
 
 Cluster::~Cluster() {}
 
@@ -1777,10 +2438,44 @@ bool Cluster::Init(IMkvWriter* ptr_writer) {
 
 bool Cluster::AddFrame(const Frame* const frame) { return DoWriteFrame(frame); }
 
+bool Cluster::AddLacedFrames(const Frame* const* frames, int32 frame_count) {
+  if (!frames || frame_count < 1)
+    return false;
+
+  if (frame_count == 1)
+    return DoWriteFrame(frames[0]);
+
+  if (!PreWriteBlock())
+    return false;
+
+  const uint64 element_size =
+      WriteLacedFrames(block_writer(), frames, frame_count, this);
+  if (element_size == 0)
+    return false;
+
+  PostWriteBlock(element_size);
+  return true;
+}
+
+bool Cluster::CopyBlock(mkvparser::IMkvReader* reader,
+                        const mkvparser::Block* block, uint64 track_number,
+                        uint64 abs_timecode) {
+  if (!PreWriteBlock())
+    return false;
+
+  const uint64 element_size = WriteBlockFromReader(
+      block_writer(), reader, block, track_number, abs_timecode, this);
+  if (element_size == 0)
+    return false;
+
+  PostWriteBlock(element_size);
+  return true;
+}
+
 bool Cluster::AddFrame(const uint8* data, uint64 length, uint64 track_number,
                        uint64 abs_timecode, bool is_key) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(abs_timecode);
@@ -1797,8 +2492,9 @@ bool Cluster::AddFrameWithAdditional(const uint8* data, uint64 length,
     return false;
   }
   Frame frame;
-  if (!frame.Init(data, length) ||
-      !frame.AddAdditionalData(additional, additional_length, add_id)) {
+  if (!frame.Borrow(data, length, NULL, NULL, NULL) ||
+      !frame.BorrowAdditionalData(additional, additional_length, add_id, NULL,
+                                  NULL, NULL)) {
     return false;
   }
   frame.set_track_number(track_number);
@@ -1812,7 +2508,7 @@ bool Cluster::AddFrameWithDiscardPadding(const uint8* data, uint64 length,
                                          uint64 track_number,
                                          uint64 abs_timecode, bool is_key) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
     return false;
   frame.set_discard_padding(discard_padding);
   frame.set_track_number(track_number);
@@ -1824,7 +2520,7 @@ bool Cluster::AddFrameWithDiscardPadding(const uint8* data, uint64 length,
 bool Cluster::AddMetadata(const uint8* data, uint64 length, uint64 track_number,
                           uint64 abs_timecode, uint64 duration_timecode) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(abs_timecode);
@@ -1836,10 +2532,26 @@ bool Cluster::AddMetadata(const uint8* data, uint64 length, uint64 track_number,
 void Cluster::AddPayloadSize(uint64 size) { payload_size_ += size; }
 
 bool Cluster::Finalize() {
-  if (!writer_ || finalized_ || size_position_ == -1)
+  if (!writer_ || finalized_ || !header_written_)
     return false;
 
-  if (writer_->Seekable()) {
+  if (buffer_) {
+    if (buffer_->size() != payload_size_)
+      return false;
+
+    if (WriteID(writer_, kMkvCluster))
+      return false;
+
+    size_position_ = writer_->Position();
+
+    if (WriteUInt(writer_, payload_size_))
+      return false;
+
+    if (!WriteMemory(writer_, buffer_))
+      return false;
+  } else if (!WriteBlocks()) {
+    return false;
+  } else if (writer_->Seekable()) {
     const int64 pos = writer_->Position();
 
     if (writer_->Position(size_position_))
@@ -1858,11 +2570,25 @@ bool Cluster::Finalize() {
 }
 
 uint64 Cluster::Size() const {
+  // A buffered cluster is written with the smallest coded size, all others
+  // with 8 octets.
   const uint64 element_size =
-      EbmlMasterElementSize(kMkvCluster, 0xFFFFFFFFFFFFFFFFULL) + payload_size_;
+      EbmlMasterElementSize(kMkvCluster,
+                            buffer_ ? payload_size_ : 0xFFFFFFFFFFFFFFFFULL) +
+      payload_size_;
   return element_size;
 }
 
+bool Cluster::WriteBlocks() {
+  MemoryMkvWriter* const blocks = blocks_;
+  blocks_ = NULL;
+
+  if (!blocks)
+    return true;
+
+  return writer_ && WriteMemory(writer_, blocks);
+}
+
 bool Cluster::PreWriteBlock() {
   if (finalized_)
     return false;
@@ -1898,7 +2624,7 @@ bool Cluster::DoWriteFrame(const Frame* const frame) {
   if (!PreWriteBlock())
     return false;
 
-  const uint64 element_size = WriteFrame(writer_, frame, this);
+  const uint64 element_size = WriteFrame(block_writer(), frame, this);
   if (element_size == 0)
     return false;
 
@@ -1906,22 +2632,40 @@ bool Cluster::DoWriteFrame(const Frame* const frame) {
   return true;
 }
 
+IMkvWriter* Cluster::block_writer() const {
+  if (buffer_)
+    return buffer_;
+
+  if (blocks_)
+    return blocks_;
+
+  return writer_;
+}
+
 bool Cluster::WriteClusterHeader() {
   if (finalized_)
     return false;
 
-  if (WriteID(writer_, kMkvCluster))
-    return false;
+  IMkvWriter* writer = writer_;
 
-  // Save for later.
-  size_position_ = writer_->Position();
+  if (buffer_) {
+    // Finalize() writes the ID and the size once the size is known.
+    buffer_->Clear();
+    writer = buffer_;
+  } else {
+    if (WriteID(writer_, kMkvCluster))
+      return false;
 
-  // Write "unknown" (EBML coded -1) as cluster size value. We need to write 8
-  // bytes because we do not know how big our cluster will be.
-  if (SerializeInt(writer_, kEbmlUnknownValue, 8))
-    return false;
+    // Save for later.
+    size_position_ = writer_->Position();
+
+    // Write "unknown" (EBML coded -1) as cluster size value. We need to write
+    // 8 bytes because we do not know how big our cluster will be.
+    if (SerializeInt(writer_, kEbmlUnknownValue, 8))
+      return false;
+  }
 
-  if (!WriteEbmlElement(writer_, kMkvTimecode, timecode()))
+  if (!WriteEbmlElement(writer, kMkvTimecode, timecode()))
     return false;
   AddPayloadSize(EbmlElementSize(kMkvTimecode, timecode()));
   header_written_ = true;
@@ -1986,11 +2730,8 @@ bool SeekHead::Finalize(IMkvWriter* writer) const {
       }
     }
 
-    const uint64 total_entry_size = kSeekEntryCount * MaxEntrySize();
-    const uint64 total_size =
-        EbmlMasterElementSize(kMkvSeekHead, total_entry_size) +
-        total_entry_size;
-    const int64 size_left = total_size - (writer->Position() - start_pos_);
+    const int64 size_left =
+        ReservedSize() - (writer->Position() - start_pos_);
 
     const uint64 bytes_written = WriteVoidElement(writer, size_left);
     if (!bytes_written)
@@ -2003,19 +2744,39 @@ bool SeekHead::Finalize(IMkvWriter* writer) const {
   return true;
 }
 
-bool SeekHead::Write(IMkvWriter* writer) {
-  const uint64 entry_size = kSeekEntryCount * MaxEntrySize();
-  const uint64 size = EbmlMasterElementSize(kMkvSeekHead, entry_size);
+uint64 SeekHead::Size() const {
+  uint64 payload_size = 0;
+
+  for (int32 i = 0; i < kSeekEntryCount; ++i) {
+    if (seek_entry_id_[i] != 0) {
+      const uint64 entry_size =
+          EbmlElementSize(kMkvSeekID, static_cast<uint64>(seek_entry_id_[i])) +
+          EbmlElementSize(kMkvSeekPosition, seek_entry_pos_[i]);
+      payload_size += EbmlMasterElementSize(kMkvSeek, entry_size) + entry_size;
+    }
+  }
+
+  if (payload_size == 0)
+    return 0;
+
+  return EbmlMasterElementSize(kMkvSeekHead, payload_size) + payload_size;
+}
 
+bool SeekHead::Write(IMkvWriter* writer) {
   start_pos_ = writer->Position();
 
-  const uint64 bytes_written = WriteVoidElement(writer, size + entry_size);
+  const uint64 bytes_written = WriteVoidElement(writer, ReservedSize());
   if (!bytes_written)
     return false;
 
   return true;
 }
 
+uint64 SeekHead::ReservedSize() const {
+  const uint64 entry_size = kSeekEntryCount * MaxEntrySize();
+  return EbmlMasterElementSize(kMkvSeekHead, entry_size) + entry_size;
+}
+
 bool SeekHead::AddSeekEntry(uint32 id, uint64 pos) {
   for (int32 i = 0; i < kSeekEntryCount; ++i) {
     if (seek_entry_id_[i] == 0) {
@@ -2230,21 +2991,41 @@ Segment::Segment()
       chunk_writer_header_(NULL),
       chunking_(false),
       chunking_base_name_(NULL),
-      cluster_list_(NULL),
-      cluster_list_capacity_(0),
-      cluster_list_size_(0),
+      chunk_sink_(NULL),
+      chunk_buffer_cluster_(NULL),
+      chunk_buffer_cues_(NULL),
+      chunk_buffer_header_(NULL),
+      cluster_(NULL),
+      cluster_count_(0),
+      finished_clusters_size_(0),
+      first_cluster_size_position_(-1),
       cues_position_(kAfterClusters),
+      cues_reserve_size_(0),
+      cues_reserve_position_(-1),
       cues_track_(0),
       force_new_cluster_(false),
       frames_(NULL),
       frames_capacity_(0),
+      frames_head_(0),
       frames_size_(0),
+      frame_pool_(NULL),
+      frame_pool_size_(0),
+      laced_frames_(NULL),
+      laced_frames_capacity_(0),
+      laced_frames_size_(0),
+      block_frame_buffer_(NULL),
+      block_frame_buffer_size_(0),
+      encryption_buffer_(NULL),
+      encryption_buffer_size_(0),
       has_video_(false),
       header_written_(false),
       last_block_duration_(0),
       last_timestamp_(0),
       max_cluster_duration_(kDefaultMaxClusterDuration),
       max_cluster_size_(0),
+      buffer_clusters_(false),
+      cluster_buffer_(NULL),
+      batching_(false),
       mode_(kFile),
       new_cuepoint_(false),
       output_cues_(true),
@@ -2254,31 +3035,47 @@ Segment::Segment()
       doc_type_version_written_(0),
       writer_cluster_(NULL),
       writer_cues_(NULL),
-      writer_header_(NULL) {
+      writer_header_(NULL),
+      stats_(NULL) {
   const time_t curr_time = time(NULL);
   seed_ = static_cast<unsigned int>(curr_time);
 #ifdef _WIN32
   srand(seed_);
 #endif
+#ifdef MKVMUXER_ENABLE_STATS
+  stats_ = new (std::nothrow) SegmentStatsCollector();  // NOLINT
+#endif
 }
 
 Segment::~Segment() {
-  if (cluster_list_) {
-    for (int32 i = 0; i < cluster_list_size_; ++i) {
-      Cluster* const cluster = cluster_list_[i];
-      delete cluster;
-    }
-    delete[] cluster_list_;
-  }
+#ifdef MKVMUXER_ENABLE_STATS
+  delete stats_;
+#endif
+  delete cluster_;
 
   if (frames_) {
     for (int32 i = 0; i < frames_size_; ++i) {
-      Frame* const frame = frames_[i];
+      Frame* const frame = GetQueuedFrame(i);
       delete frame;
     }
     delete[] frames_;
   }
 
+  if (frame_pool_) {
+    for (int32 i = 0; i < frame_pool_size_; ++i)
+      delete frame_pool_[i];
+    delete[] frame_pool_;
+  }
+
+  if (laced_frames_) {
+    for (int32 i = 0; i < laced_frames_capacity_; ++i)
+      delete laced_frames_[i];
+    delete[] laced_frames_;
+  }
+
+  delete[] block_frame_buffer_;
+  delete[] encryption_buffer_;
+  delete cluster_buffer_;
   delete[] chunk_name_;
   delete[] chunking_base_name_;
 
@@ -2294,44 +3091,31 @@ Segment::~Segment() {
     chunk_writer_header_->Close();
     delete chunk_writer_header_;
   }
-}
 
-void Segment::MoveCuesBeforeClustersHelper(uint64 diff, int32 index,
-                                           uint64* cues_size) {
-  CuePoint* const cue_point = cues_.GetCueByIndex(index);
-  if (cue_point == NULL)
-    return;
-  const uint64 old_cue_point_size = cue_point->Size();
-  const uint64 cluster_pos = cue_point->cluster_pos() + diff;
-  cue_point->set_cluster_pos(cluster_pos);  // update the new cluster position
-  // New size of the cue is computed as follows
-  //    Let a = current sum of size of all CuePoints
-  //    Let b = Increase in Cue Point's size due to this iteration
-  //    Let c = Increase in size of Cues Element's length due to this iteration
-  //            (This is computed as CodedSize(a + b) - CodedSize(a))
-  //    Let d = b + c. Now d is the |diff| passed to the next recursive call.
-  //    Let e = a + b. Now e is the |cues_size| passed to the next recursive
-  //                   call.
-  const uint64 cue_point_size_diff = cue_point->Size() - old_cue_point_size;
-  const uint64 cue_size_diff =
-      GetCodedUIntSize(*cues_size + cue_point_size_diff) -
-      GetCodedUIntSize(*cues_size);
-  *cues_size += cue_point_size_diff;
-  diff = cue_size_diff + cue_point_size_diff;
-  if (diff > 0) {
-    for (int32 i = 0; i < cues_.cue_entries_size(); ++i) {
-      MoveCuesBeforeClustersHelper(diff, i, cues_size);
-    }
-  }
+  delete chunk_buffer_cluster_;
+  delete chunk_buffer_cues_;
+  delete chunk_buffer_header_;
 }
 
-void Segment::MoveCuesBeforeClusters() {
-  const uint64 current_cue_size = cues_.Size();
-  uint64 cue_size = 0;
-  for (int32 i = 0; i < cues_.cue_entries_size(); ++i)
-    cue_size += cues_.GetCueByIndex(i)->Size();
-  for (int32 i = 0; i < cues_.cue_entries_size(); ++i)
-    MoveCuesBeforeClustersHelper(current_cue_size, i, &cue_size);
+bool Segment::MoveCuesBeforeClusters() {
+  // Every cluster moves down by the size of the Cues element, which in turn
+  // depends on the cluster positions stored in the cue points. Start from the
+  // size with the current positions and shift the cue points until the size
+  // stops changing. Each pass is linear in the number of cue points, and as
+  // the size can only grow it settles after a few passes.
+  uint64 cues_size = cues_.Size();
+  uint64 shift = 0;
+
+  for (;;) {
+    if (!cues_.OffsetClusterPositions(cues_size - shift))
+      return false;
+    shift = cues_size;
+
+    const uint64 new_cues_size = cues_.Size();
+    if (new_cues_size == cues_size)
+      break;
+    cues_size = new_cues_size;
+  }
 
   // Adjust the Seek Entry to reflect the change in position
   // of Cluster and Cues
@@ -2347,6 +3131,7 @@ void Segment::MoveCuesBeforeClusters() {
                           seek_head_.GetPosition(cluster_index));
   seek_head_.SetSeekEntry(cluster_index, kMkvCluster,
                           cues_.Size() + seek_head_.GetPosition(cues_index));
+  return true;
 }
 
 bool Segment::Init(IMkvWriter* ptr_writer) {
@@ -2361,17 +3146,21 @@ bool Segment::Init(IMkvWriter* ptr_writer) {
 
 bool Segment::CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
                                             IMkvWriter* writer) {
-  if (!writer->Seekable() || chunking_)
+  if (!writer->Seekable() || chunking_ || cues_position_ == kBeforeClusters ||
+      !cluster_)
     return false;
   const int64 cluster_offset =
-      cluster_list_[0]->size_position() - GetUIntSize(kMkvCluster);
+      ((cluster_count_ > 1) ? first_cluster_size_position_
+                            : cluster_->size_position()) -
+      GetUIntSize(kMkvCluster);
 
   // Copy the headers.
   if (!ChunkedCopy(reader, writer, 0, cluster_offset))
     return false;
 
   // Recompute cue positions and seek entries.
-  MoveCuesBeforeClusters();
+  if (!MoveCuesBeforeClusters())
+    return false;
 
   // Write cues and seek entries.
   // TODO(vigneshv): As of now, it's safe to call seek_head_.Finalize() for the
@@ -2380,6 +3169,7 @@ bool Segment::CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
   // to write() or some such.
   if (!cues_.Write(writer) || !seek_head_.Finalize(writer))
     return false;
+  CountSeekBack(stats_, writer);
 
   // Copy the Clusters.
   if (!ChunkedCopy(reader, writer, cluster_offset,
@@ -2392,25 +3182,72 @@ bool Segment::CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
   if (writer->Position(size_position_) ||
       WriteUIntSize(writer, segment_size, 8) || writer->Position(pos))
     return false;
+  CountSeekBack(stats_, writer);
+  return true;
+}
+
+bool Segment::ReserveCuesSpace(uint64 size) {
+  // The reserved space must at least hold an empty Void element.
+  if (header_written_ || size < 2)
+    return false;
+
+  cues_reserve_size_ = size;
   return true;
 }
 
+uint64 Segment::EstimateCuesSize(uint64 duration_ns,
+                                 uint64 cue_interval_ns) const {
+  if (cue_interval_ns == 0)
+    return 0;
+
+  const uint64 cue_count = duration_ns / cue_interval_ns + 1;
+  const uint64 max_time = duration_ns / segment_info_.timecode_scale();
+
+  // CuePoint, CueTime, CueTrackPositions, CueTrack, CueClusterPosition and
+  // CueBlockNumber, with room for 8 octet cluster positions and 4 octet block
+  // numbers. CueBlockNumber has a 2 octet ID.
+  const uint64 cue_point_size = 2 + (2 + GetUIntSize(max_time)) + 2 + 3 +
+                                (2 + 8) + (3 + 4);
+  const uint64 payload_size = cue_count * cue_point_size;
+
+  return EbmlMasterElementSize(kMkvCues, payload_size) + payload_size;
+}
+
 bool Segment::Finalize() {
   if (WriteFramesAll() < 0)
     return false;
 
+  if (cluster_) {
+    if (!WriteLacedFrames(cluster_))
+      return false;
+
+    CountCluster(stats_, cluster_, last_timestamp_ + last_block_duration_);
+  }
+
+  if (mode_ == kLive && cluster_) {
+    // Write out the last cluster.
+    if (buffer_clusters_ && !cluster_->Finalize())
+      return false;
+
+    if (chunking_ &&
+        !CloseClusterChunk(last_timestamp_ + last_block_duration_)) {
+      return false;
+    }
+  }
+
   if (mode_ == kFile) {
-    if (cluster_list_size_ > 0) {
+    if (cluster_) {
       // Update last cluster's size
-      Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
-
-      if (!old_cluster || !old_cluster->Finalize())
+      if (!cluster_->Finalize())
         return false;
+
+      if (!buffer_clusters_)
+        CountSeekBack(stats_, writer_cluster_);
     }
 
-    if (chunking_ && chunk_writer_cluster_) {
-      chunk_writer_cluster_->Close();
-      chunk_count_++;
+    if (chunking_ &&
+        !CloseClusterChunk(last_timestamp_ + last_block_duration_)) {
+      return false;
     }
 
     const double duration =
@@ -2420,34 +3257,59 @@ bool Segment::Finalize() {
     if (!segment_info_.Finalize(writer_header_))
       return false;
 
-    if (output_cues_)
-      if (!seek_head_.AddSeekEntry(kMkvCues, MaxOffset()))
+    if (duration > 0.0)
+      CountSeekBack(stats_, writer_header_);
+
+    // Write the Cues into the reserved space if they fit, leaving no gap
+    // too small for a Void element.
+    const uint64 cues_size = output_cues_ ? cues_.Size() : 0;
+    const bool cues_in_reserve =
+        output_cues_ && cues_reserve_position_ >= 0 &&
+        (cues_size == cues_reserve_size_ ||
+         cues_size + 2 <= cues_reserve_size_);
+
+    if (output_cues_) {
+      const int64 cues_offset = cues_in_reserve
+                                    ? cues_reserve_position_ - payload_pos_
+                                    : MaxOffset();
+      if (!seek_head_.AddSeekEntry(kMkvCues, cues_offset))
         return false;
+    }
 
-    if (chunking_) {
-      if (!chunk_writer_cues_)
+    if (chunking_ && !OpenChunk(IMkvChunkSink::kCues))
+      return false;
+
+    cluster_end_offset_ = writer_cluster_->Position();
+
+    // Write the seek headers and cues
+    if (cues_in_reserve) {
+      const int64 pos = writer_cues_->Position();
+
+      if (writer_cues_->Position(cues_reserve_position_))
         return false;
 
-      char* name = NULL;
-      if (!UpdateChunkName("cues", &name))
+      if (!cues_.Write(writer_cues_))
         return false;
 
-      const bool cues_open = chunk_writer_cues_->Open(name);
-      delete[] name;
-      if (!cues_open)
+      const uint64 void_size = cues_reserve_size_ - cues_size;
+      if (void_size > 0 && !WriteVoidElements(writer_cues_, void_size))
         return false;
-    }
 
-    cluster_end_offset_ = writer_cluster_->Position();
+      if (writer_cues_->Position(pos))
+        return false;
 
-    // Write the seek headers and cues
-    if (output_cues_)
+      CountSeekBack(stats_, writer_cues_);
+      cues_position_ = kBeforeClusters;
+    } else if (output_cues_) {
       if (!cues_.Write(writer_cues_))
         return false;
+    }
 
     if (!seek_head_.Finalize(writer_header_))
       return false;
 
+    CountSeekBack(stats_, writer_header_);
+
     if (writer_header_->Seekable()) {
       if (size_position_ == -1)
         return false;
@@ -2468,6 +3330,7 @@ bool Segment::Finalize() {
           return false;
 
         doc_type_version_written_ = doc_type_version_;
+        CountSeekBack(stats_, writer_header_);
       }
 
       if (writer_header_->Position(size_position_))
@@ -2478,19 +3341,56 @@ bool Segment::Finalize() {
 
       if (writer_header_->Position(pos))
         return false;
+
+      CountSeekBack(stats_, writer_header_);
+    }
+
+#ifdef MKVMUXER_ENABLE_STATS
+    if (stats_) {
+      SegmentStats& stats = stats_->stats;
+
+      if (writer_header_->Seekable()) {
+        const uint64 seek_head_size = seek_head_.Size();
+        stats.bytes[SegmentStats::kSeekHead] = seek_head_size;
+        stats.bytes[SegmentStats::kVoid] =
+            seek_head_.ReservedSize() - seek_head_size;
+      }
+
+      stats.bytes[SegmentStats::kCues] = cues_size;
+      if (cues_reserve_position_ >= 0) {
+        stats.bytes[SegmentStats::kVoid] +=
+            cues_in_reserve ? cues_reserve_size_ - cues_size
+                            : cues_reserve_size_;
+      }
     }
+#endif  // MKVMUXER_ENABLE_STATS
 
     if (chunking_) {
       // Do not close any writers until the segment size has been written,
       // otherwise the size may be off.
-      if (!chunk_writer_cues_ || !chunk_writer_header_)
+      if (!CloseChunk(IMkvChunkSink::kCues, 0,
+                      last_timestamp_ + last_block_duration_)) {
         return false;
+      }
 
-      chunk_writer_cues_->Close();
-      chunk_writer_header_->Close();
+      if (writer_header_->Seekable() &&
+          !CloseChunk(IMkvChunkSink::kHeader, 0, 0)) {
+        return false;
+      }
     }
   }
 
+#ifdef MKVMUXER_ENABLE_STATS
+  if (stats_ && !chunking_) {
+    // Everything that is not counted by class is in the headers.
+    SegmentStats& stats = stats_->stats;
+    uint64 other_size = MaxOffset() + payload_pos_;
+    for (int32 i = 0; i < SegmentStats::kOther; ++i)
+      other_size -= stats.bytes[i];
+    stats.bytes[SegmentStats::kOther] = other_size;
+  }
+#endif  // MKVMUXER_ENABLE_STATS
+
   return true;
 }
 
@@ -2522,29 +3422,31 @@ uint64 Segment::AddVideoTrack(int32 width, int32 height, int32 number) {
   track->set_width(width);
   track->set_height(height);
 
-  tracks_.AddTrack(track, number);
+  if (!tracks_.AddTrack(track, number)) {
+    delete track;
+    return 0;
+  }
   has_video_ = true;
 
   return track->number();
 }
 
 bool Segment::AddCuePoint(uint64 timestamp, uint64 track) {
-  if (cluster_list_size_ < 1)
-    return false;
-
-  const Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+  const Cluster* const cluster = cluster_;
   if (!cluster)
     return false;
 
-  CuePoint* const cue = new (std::nothrow) CuePoint();  // NOLINT
-  if (!cue)
-    return false;
+  CuePoint cue;
 
-  cue->set_time(timestamp / segment_info_.timecode_scale());
-  cue->set_block_number(cluster->blocks_added());
-  cue->set_cluster_pos(cluster->position_for_cues());
-  cue->set_track(track);
-  if (!cues_.AddCue(cue))
+  // A frame held back for lacing goes in the block after the last one.
+  const bool laced = laced_frames_size_ > 0 &&
+                     laced_frames_[0]->track_number() == track;
+
+  cue.set_time(timestamp / segment_info_.timecode_scale());
+  cue.set_block_number(cluster->blocks_added() + (laced ? 1 : 0));
+  cue.set_cluster_pos(cluster->position_for_cues());
+  cue.set_track(track);
+  if (!cues_.AddCueCopy(cue))
     return false;
 
   new_cuepoint_ = false;
@@ -2561,7 +3463,10 @@ uint64 Segment::AddAudioTrack(int32 sample_rate, int32 channels, int32 number) {
   track->set_sample_rate(sample_rate);
   track->set_channels(channels);
 
-  tracks_.AddTrack(track, number);
+  if (!tracks_.AddTrack(track, number)) {
+    delete track;
+    return 0;
+  }
 
   return track->number();
 }
@@ -2572,7 +3477,7 @@ bool Segment::AddFrame(const uint8* data, uint64 length, uint64 track_number,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(timestamp);
@@ -2589,8 +3494,9 @@ bool Segment::AddFrameWithAdditional(const uint8* data, uint64 length,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length) ||
-      !frame.AddAdditionalData(additional, additional_length, add_id)) {
+  if (!frame.Borrow(data, length, NULL, NULL, NULL) ||
+      !frame.BorrowAdditionalData(additional, additional_length, add_id, NULL,
+                                  NULL, NULL)) {
     return false;
   }
   frame.set_track_number(track_number);
@@ -2606,58 +3512,258 @@ bool Segment::AddFrameWithDiscardPadding(const uint8* data, uint64 length,
   if (!data)
     return false;
 
-  Frame frame;
-  if (!frame.Init(data, length))
+  Frame frame;
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
+    return false;
+  frame.set_discard_padding(discard_padding);
+  frame.set_track_number(track_number);
+  frame.set_timestamp(timestamp);
+  frame.set_is_key(is_key);
+  return AddGenericFrame(&frame);
+}
+
+bool Segment::AddMetadata(const uint8* data, uint64 length, uint64 track_number,
+                          uint64 timestamp_ns, uint64 duration_ns) {
+  if (!data)
+    return false;
+
+  Frame frame;
+  if (!frame.Borrow(data, length, NULL, NULL, NULL))
+    return false;
+  frame.set_track_number(track_number);
+  frame.set_timestamp(timestamp_ns);
+  frame.set_duration(duration_ns);
+  frame.set_is_key(true);  // All metadata blocks are keyframes.
+  return AddGenericFrame(&frame);
+}
+
+bool Segment::AddGenericFrame(const Frame* frame) {
+  if (!frame)
+    return false;
+
+  if (!CheckHeaderInfo())
+    return false;
+
+  // Check for non-monotonically increasing timestamps.
+  if (frame->timestamp() < last_timestamp_)
+    return false;
+
+  // Check if the track number is valid.
+  const Track* const track = tracks_.GetTrackByNumber(frame->track_number());
+  if (!track)
+    return false;
+
+  return DoAddGenericFrame(frame, track);
+}
+
+bool Segment::AddFrames(const Frame* const* frames, int32 frame_count) {
+  if (!frames || frame_count < 0)
+    return false;
+
+  if (frame_count == 0)
+    return true;
+
+  if (!CheckHeaderInfo())
+    return false;
+
+  uint64 timestamp = last_timestamp_;
+  for (int32 i = 0; i < frame_count; ++i) {
+    const Frame* const frame = frames[i];
+    // IsValid() is checked when the frame is written, after the reference
+    // block timestamp has been filled in.
+    if (!frame || !frame->frame() || frame->length() == 0 ||
+        frame->timestamp() < timestamp ||
+        !tracks_.GetTrackByNumber(frame->track_number())) {
+      return false;
+    }
+    timestamp = frame->timestamp();
+  }
+
+  // Element start notification needs every block to be serialized at its
+  // position in the output.
+  const bool batching =
+      !buffer_clusters_ && !writer_cluster_->ElementStartNotifyEnabled();
+  if (batching && !SetBatching(true))
+    return false;
+
+  bool added = true;
+  for (int32 i = 0; i < frame_count && added; ++i) {
+    const Frame* const frame = frames[i];
+    added = DoAddGenericFrame(frame,
+                              tracks_.GetTrackByNumber(frame->track_number()));
+  }
+
+  if (batching && !SetBatching(false))
+    return false;
+
+  return added;
+}
+
+bool Segment::CopyBlock(mkvparser::IMkvReader* reader,
+                        const mkvparser::Block* block, uint64 track_number,
+                        uint64 timestamp) {
+  if (!reader || !block || block->GetFrameCount() < 1)
+    return false;
+
+  if (!CheckHeaderInfo())
+    return false;
+
+  // Check for non-monotonically increasing timestamps.
+  if (timestamp < last_timestamp_)
+    return false;
+
+  const Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track)
+    return false;
+
+  const bool audio = track->type() == Tracks::kAudio;
+  const bool relace =
+      audio && static_cast<const AudioTrack*>(track)->max_laced_frames() > 1;
+  if (block->GetDiscardPadding() != 0 || track->encryptor() ||
+      (audio && has_video_ && !force_new_cluster_) || relace) {
+    return AddBlockFrames(reader, block, track, timestamp);
+  }
+
+  if (!DoNewClusterProcessing(track_number, timestamp, block->IsKey()))
+    return false;
+
+  Cluster* const cluster = cluster_;
+  if (!cluster || !WriteLacedFrames(cluster))
     return false;
-  frame.set_discard_padding(discard_padding);
-  frame.set_track_number(track_number);
-  frame.set_timestamp(timestamp);
-  frame.set_is_key(is_key);
-  return AddGenericFrame(&frame);
+
+  const uint64 payload_size = cluster->payload_size();
+  const int32 blocks_added = cluster->blocks_added();
+  if (!cluster->CopyBlock(reader, block, track_number, timestamp))
+    return false;
+
+  CountCopiedBlock(stats_, cluster, payload_size, blocks_added, block);
+
+  if (new_cuepoint_ && cues_track_ == track_number) {
+    if (!AddCuePoint(timestamp, cues_track_))
+      return false;
+  }
+
+  last_timestamp_ = timestamp;
+  last_track_timestamp_[track_number - 1] = timestamp;
+  last_block_duration_ = 0;
+  CountQueuedFrames(stats_, frames_size_);
+
+  return true;
 }
 
-bool Segment::AddMetadata(const uint8* data, uint64 length, uint64 track_number,
-                          uint64 timestamp_ns, uint64 duration_ns) {
-  if (!data)
+bool Segment::AddBlockFrames(mkvparser::IMkvReader* reader,
+                             const mkvparser::Block* block, const Track* track,
+                             uint64 timestamp) {
+  const int32 frame_count = block->GetFrameCount();
+
+  for (int32 i = 0; i < frame_count; ++i) {
+    const mkvparser::Block::Frame& block_frame = block->GetFrame(i);
+    if (block_frame.len <= 0)
+      return false;
+
+    if (block_frame.len > block_frame_buffer_size_) {
+      uint8* const buffer =
+          new (std::nothrow) uint8[block_frame.len];  // NOLINT
+      if (!buffer)
+        return false;
+
+      delete[] block_frame_buffer_;
+      block_frame_buffer_ = buffer;
+      block_frame_buffer_size_ = block_frame.len;
+    }
+
+    if (block_frame.Read(reader, block_frame_buffer_))
+      return false;
+
+    // Frames that are held back are copied, so the buffer can be reused.
+    Frame frame;
+    if (!frame.Borrow(block_frame_buffer_, block_frame.len, NULL, NULL, NULL))
+      return false;
+    frame.set_track_number(track->number());
+    // The frames of a laced block follow each other at DefaultDuration
+    // intervals.
+    frame.set_timestamp(timestamp + i * track->default_duration());
+    frame.set_is_key(block->IsKey());
+    frame.set_discard_padding(block->GetDiscardPadding());
+
+    if (!DoAddGenericFrame(&frame, track))
+      return false;
+  }
+
+  return true;
+}
+
+bool Segment::SetTrackEncryption(uint64 track_number, const uint8* key_id,
+                                 uint64 key_id_length, const uint8* key,
+                                 uint64 key_length) {
+  // The ContentEncoding element is written with the track header.
+  if (header_written_)
     return false;
 
-  Frame frame;
-  if (!frame.Init(data, length))
+  Track* const track = tracks_.GetTrackByNumber(track_number);
+  if (!track || track->encryptor())
     return false;
-  frame.set_track_number(track_number);
-  frame.set_timestamp(timestamp_ns);
-  frame.set_duration(duration_ns);
-  frame.set_is_key(true);  // All metadata blocks are keyframes.
-  return AddGenericFrame(&frame);
-}
 
-bool Segment::AddGenericFrame(const Frame* frame) {
-  if (!frame)
+  FrameEncryptor* const encryptor =
+      new (std::nothrow) FrameEncryptor();  // NOLINT
+  if (!encryptor)
     return false;
 
-  if (!CheckHeaderInfo())
+  // Start from an IV of the system's random number generator, so that other
+  // files encrypted with the same key do not reuse its key stream.
+  uint64 first_iv = 0;
+  if (!FrameEncryptor::GenerateIv(&first_iv) ||
+      !encryptor->Init(key, key_length, first_iv)) {
+    delete encryptor;
     return false;
+  }
 
-  // Check for non-monotonically increasing timestamps.
-  if (frame->timestamp() < last_timestamp_)
+  if (!track->AddContentEncoding()) {
+    delete encryptor;
     return false;
+  }
 
-  // Check if the track number is valid.
-  if (!tracks_.GetTrackByNumber(frame->track_number()))
+  ContentEncoding* const encoding =
+      track->GetContentEncodingByIndex(track->content_encoding_entries_size() -
+                                       1);
+  if (!encoding || !encoding->SetEncryptionID(key_id, key_id_length)) {
+    delete encryptor;
     return false;
+  }
+
+  track->set_encryptor(encryptor);
+  return true;
+}
 
+bool Segment::DoAddGenericFrame(const Frame* frame, const Track* track) {
   if (frame->discard_padding() != 0)
     doc_type_version_ = 4;
 
+  // Like |reference_frame| below, |encrypted_frame| is only used during this
+  // call; frames that are held back are copied.
+  Frame encrypted_frame;
+  if (track->encryptor()) {
+    if (!EncryptFrame(frame, track, &encrypted_frame))
+      return false;
+    frame = &encrypted_frame;
+  }
+
   // If the segment has a video track hold onto audio frames to make sure the
   // audio that is associated with the start time of a video key-frame is
   // muxed into the same cluster.
-  if (has_video_ && tracks_.TrackIsAudio(frame->track_number()) &&
+  if (has_video_ && track->type() == Tracks::kAudio &&
       !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (!new_frame || !new_frame->CopyFrom(*frame))
+    // Frames with borrowed data are queued without copying the data when the
+    // owner provided a retain callback.
+    Frame* const new_frame = GetFrameFromPool();
+    if (!new_frame)
       return false;
-    return QueueFrame(new_frame);
+    if (!new_frame->CopyFrom(*frame) || !QueueFrame(new_frame)) {
+      ReturnFrameToPool(new_frame);
+      return false;
+    }
+    CountQueuedFrames(stats_, frames_size_);
+    return true;
   }
 
   if (!DoNewClusterProcessing(frame->track_number(), frame->timestamp(),
@@ -2665,28 +3771,24 @@ bool Segment::AddGenericFrame(const Frame* frame) {
     return false;
   }
 
-  if (cluster_list_size_ < 1)
-    return false;
-
-  Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+  Cluster* const cluster = cluster_;
   if (!cluster)
     return false;
 
   // If the Frame is not a SimpleBlock, then set the reference_block_timestamp
-  // if it is not set already.
-  bool frame_created = false;
+  // if it is not set already. The data of |frame| is only needed for the
+  // duration of this call, so |reference_frame| borrows it.
+  Frame reference_frame;
   if (!frame->CanBeSimpleBlock() && !frame->is_key() &&
       !frame->reference_block_timestamp_set()) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (!new_frame->CopyFrom(*frame))
+    if (!reference_frame.BorrowFrom(*frame))
       return false;
-    new_frame->set_reference_block_timestamp(
+    reference_frame.set_reference_block_timestamp(
         last_track_timestamp_[frame->track_number() - 1]);
-    frame = new_frame;
-    frame_created = true;
+    frame = &reference_frame;
   }
 
-  if (!cluster->AddFrame(frame))
+  if (!WriteFrameToCluster(cluster, frame))
     return false;
 
   if (new_cuepoint_ && cues_track_ == frame->track_number()) {
@@ -2697,17 +3799,45 @@ bool Segment::AddGenericFrame(const Frame* frame) {
   last_timestamp_ = frame->timestamp();
   last_track_timestamp_[frame->track_number() - 1] = frame->timestamp();
   last_block_duration_ = frame->duration();
-
-  if (frame_created)
-    delete frame;
+  CountQueuedFrames(stats_, frames_size_);
 
   return true;
 }
 
+bool Segment::EncryptFrame(const Frame* frame, const Track* track,
+                           Frame* encrypted_frame) {
+  if (!frame->frame() || frame->length() == 0)
+    return false;
+
+  const uint64 size = FrameEncryptor::EncryptedSize(
+      frame->length(), frame->encrypted(),
+      frame->encryption_partition_count());
+
+  if (size > encryption_buffer_size_) {
+    uint8* const buffer = new (std::nothrow) uint8[size];  // NOLINT
+    if (!buffer)
+      return false;
+
+    delete[] encryption_buffer_;
+    encryption_buffer_ = buffer;
+    encryption_buffer_size_ = size;
+  }
+
+  if (!track->encryptor()->Encrypt(
+          frame->frame(), frame->length(), frame->encrypted(),
+          frame->encryption_partitions(), frame->encryption_partition_count(),
+          encryption_buffer_)) {
+    return false;
+  }
+
+  return encrypted_frame->BorrowFrom(*frame) &&
+         encrypted_frame->Borrow(encryption_buffer_, size, NULL, NULL, NULL);
+}
+
 void Segment::OutputCues(bool output_cues) { output_cues_ = output_cues; }
 
 bool Segment::SetChunking(bool chunking, const char* filename) {
-  if (chunk_count_ > 0)
+  if (chunk_count_ > 0 || chunk_sink_)
     return false;
 
   if (chunking) {
@@ -2732,9 +3862,6 @@ bool Segment::SetChunking(bool chunking, const char* filename) {
     delete[] chunking_base_name_;
     chunking_base_name_ = temp;
 
-    if (!UpdateChunkName("chk", &chunk_name_))
-      return false;
-
     if (!chunk_writer_cluster_) {
       chunk_writer_cluster_ = new (std::nothrow) MkvWriter();  // NOLINT
       if (!chunk_writer_cluster_)
@@ -2753,35 +3880,132 @@ bool Segment::SetChunking(bool chunking, const char* filename) {
         return false;
     }
 
-    if (!chunk_writer_cluster_->Open(chunk_name_))
+    if (!OpenChunk(IMkvChunkSink::kCluster) ||
+        !OpenChunk(IMkvChunkSink::kHeader)) {
+      return false;
+    }
+
+    writer_cluster_ = chunk_writer_cluster_;
+    writer_cues_ = chunk_writer_cues_;
+    writer_header_ = chunk_writer_header_;
+  }
+
+  chunking_ = chunking;
+
+  return true;
+}
+
+bool Segment::SetChunkSink(IMkvChunkSink* sink) {
+  if (!sink || chunking_ || header_written_)
+    return false;
+
+  if (!chunk_buffer_cluster_) {
+    chunk_buffer_cluster_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_cluster_)
+      return false;
+  }
+
+  if (!chunk_buffer_cues_) {
+    chunk_buffer_cues_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_cues_)
+      return false;
+  }
+
+  if (!chunk_buffer_header_) {
+    chunk_buffer_header_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!chunk_buffer_header_)
+      return false;
+  }
+
+  chunk_sink_ = sink;
+  writer_cluster_ = chunk_buffer_cluster_;
+  writer_cues_ = chunk_buffer_cues_;
+  writer_header_ = chunk_buffer_header_;
+  chunking_ = true;
+
+  return true;
+}
+
+bool Segment::OpenChunk(IMkvChunkSink::ChunkKind kind) {
+  // The buffers for |chunk_sink_| are cleared when a chunk is complete.
+  if (chunk_sink_)
+    return true;
+
+  if (kind == IMkvChunkSink::kCluster) {
+    return chunk_writer_cluster_ && UpdateChunkName("chk", &chunk_name_) &&
+           chunk_writer_cluster_->Open(chunk_name_);
+  }
+
+  if (kind == IMkvChunkSink::kCues) {
+    if (!chunk_writer_cues_)
       return false;
 
-    const size_t header_length = strlen(filename) + strlen(".hdr") + 1;
-    char* const header = new (std::nothrow) char[header_length];  // NOLINT
-    if (!header)
+    char* name = NULL;
+    if (!UpdateChunkName("cues", &name))
       return false;
 
+    const bool cues_open = chunk_writer_cues_->Open(name);
+    delete[] name;
+    return cues_open;
+  }
+
+  if (!chunk_writer_header_)
+    return false;
+
+  const size_t header_length = strlen(chunking_base_name_) + strlen(".hdr") + 1;
+  char* const header = new (std::nothrow) char[header_length];  // NOLINT
+  if (!header)
+    return false;
+
 #ifdef _MSC_VER
-    strcpy_s(header, header_length - strlen(".hdr"), chunking_base_name_);
-    strcat_s(header, header_length, ".hdr");
+  strcpy_s(header, header_length - strlen(".hdr"), chunking_base_name_);
+  strcat_s(header, header_length, ".hdr");
 #else
-    strcpy(header, chunking_base_name_);
-    strcat(header, ".hdr");
+  strcpy(header, chunking_base_name_);
+  strcat(header, ".hdr");
 #endif
-    if (!chunk_writer_header_->Open(header)) {
-      delete[] header;
+  const bool header_open = chunk_writer_header_->Open(header);
+  delete[] header;
+  return header_open;
+}
+
+bool Segment::CloseChunk(IMkvChunkSink::ChunkKind kind, uint64 start_time,
+                         uint64 end_time) {
+  if (!chunk_sink_) {
+    MkvWriter* const writer =
+        (kind == IMkvChunkSink::kCluster)
+            ? chunk_writer_cluster_
+            : (kind == IMkvChunkSink::kCues) ? chunk_writer_cues_
+                                             : chunk_writer_header_;
+    if (!writer)
       return false;
-    }
-
-    writer_cluster_ = chunk_writer_cluster_;
-    writer_cues_ = chunk_writer_cues_;
-    writer_header_ = chunk_writer_header_;
 
-    delete[] header;
+    writer->Close();
+    return true;
   }
 
-  chunking_ = chunking;
+  MemoryMkvWriter* const buffer =
+      (kind == IMkvChunkSink::kCluster)
+          ? chunk_buffer_cluster_
+          : (kind == IMkvChunkSink::kCues) ? chunk_buffer_cues_
+                                           : chunk_buffer_header_;
+  const int32 index = (kind == IMkvChunkSink::kHeader) ? 0 : chunk_count_;
+  const bool delivered = chunk_sink_->OnChunk(
+      kind, index, buffer->data(), buffer->size(), start_time, end_time);
+  buffer->Clear();
+
+  return delivered;
+}
 
+bool Segment::CloseClusterChunk(uint64 end_time) {
+  uint64 start_time = 0;
+  if (cluster_)
+    start_time = cluster_->timecode() * cluster_->timecode_scale();
+
+  if (!CloseChunk(IMkvChunkSink::kCluster, start_time, end_time))
+    return false;
+
+  chunk_count_++;
   return true;
 }
 
@@ -2800,6 +4024,14 @@ Track* Segment::GetTrackByNumber(uint64 track_number) const {
   return tracks_.GetTrackByNumber(track_number);
 }
 
+const SegmentStats* Segment::GetStats() const {
+#ifdef MKVMUXER_ENABLE_STATS
+  if (stats_)
+    return &stats_->stats;
+#endif
+  return NULL;
+}
+
 bool Segment::WriteSegmentHeader() {
   UpdateDocTypeVersion();
 
@@ -2859,11 +4091,16 @@ bool Segment::WriteSegmentHeader() {
       return false;
   }
 
-  if (chunking_ && (mode_ == kLive || !writer_header_->Seekable())) {
-    if (!chunk_writer_header_)
+  if (cues_reserve_size_ > 0 && output_cues_ && mode_ == kFile &&
+      !chunking_ && writer_header_->Seekable()) {
+    cues_reserve_position_ = writer_header_->Position();
+    if (!WriteVoidElements(writer_header_, cues_reserve_size_))
       return false;
+  }
 
-    chunk_writer_header_->Close();
+  if (chunking_ && (mode_ == kLive || !writer_header_->Seekable())) {
+    if (!CloseChunk(IMkvChunkSink::kHeader, 0, 0))
+      return false;
   }
 
   header_written_ = true;
@@ -2884,7 +4121,7 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
   // should only be followed once, the first time we attempt to write
   // a frame.
 
-  if (cluster_list_size_ <= 0)
+  if (!cluster_)
     return 1;
 
   // There exists at least one cluster. We must compare the frame to
@@ -2895,8 +4132,7 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
   const uint64 timecode_scale = segment_info_.timecode_scale();
   const uint64 frame_timecode = frame_timestamp_ns / timecode_scale;
 
-  const Cluster* const last_cluster = cluster_list_[cluster_list_size_ - 1];
-  const uint64 last_cluster_timecode = last_cluster->timecode();
+  const uint64 last_cluster_timecode = cluster_->timecode();
 
   // For completeness we test for the case when the frame's timecode
   // is less than the cluster's timecode.  Although in principle that
@@ -2936,7 +4172,7 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
   // cluster is created when the size of the current cluster exceeds a
   // threshold.
 
-  const uint64 cluster_size = last_cluster->payload_size();
+  const uint64 cluster_size = cluster_->payload_size();
 
   if (max_cluster_size_ > 0 && cluster_size >= max_cluster_size_)
     return 1;
@@ -2947,52 +4183,29 @@ int Segment::TestFrame(uint64 track_number, uint64 frame_timestamp_ns,
 }
 
 bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
-  const int32 new_size = cluster_list_size_ + 1;
-
-  if (new_size > cluster_list_capacity_) {
-    // Add more clusters.
-    const int32 new_capacity =
-        (cluster_list_capacity_ <= 0) ? 1 : cluster_list_capacity_ * 2;
-    Cluster** const clusters =
-        new (std::nothrow) Cluster*[new_capacity];  // NOLINT
-    if (!clusters)
-      return false;
-
-    for (int32 i = 0; i < cluster_list_size_; ++i) {
-      clusters[i] = cluster_list_[i];
-    }
-
-    delete[] cluster_list_;
-
-    cluster_list_ = clusters;
-    cluster_list_capacity_ = new_capacity;
-  }
-
   if (!WriteFramesLessThan(frame_timestamp_ns))
     return false;
 
-  if (mode_ == kFile) {
-    if (cluster_list_size_ > 0) {
-      // Update old cluster's size
-      Cluster* const old_cluster = cluster_list_[cluster_list_size_ - 1];
+  // Laces do not span clusters.
+  if (cluster_ && !WriteLacedFrames(cluster_))
+    return false;
+
+  if (cluster_ && !cluster_->WriteBlocks())
+    return false;
 
-      if (!old_cluster || !old_cluster->Finalize())
+  if (mode_ == kFile || buffer_clusters_) {
+    if (cluster_) {
+      // Update old cluster's size, or write it out if it is buffered.
+      if (!cluster_->Finalize())
         return false;
-    }
 
-    if (output_cues_)
-      new_cuepoint_ = true;
+      if (!buffer_clusters_)
+        CountSeekBack(stats_, writer_cluster_);
+    }
   }
 
-  if (chunking_ && cluster_list_size_ > 0) {
-    chunk_writer_cluster_->Close();
-    chunk_count_++;
-
-    if (!UpdateChunkName("chk", &chunk_name_))
-      return false;
-    if (!chunk_writer_cluster_->Open(chunk_name_))
-      return false;
-  }
+  if (mode_ == kFile && output_cues_)
+    new_cuepoint_ = true;
 
   const uint64 timecode_scale = segment_info_.timecode_scale();
   const uint64 frame_timecode = frame_timestamp_ns / timecode_scale;
@@ -3000,7 +4213,7 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
   uint64 cluster_timecode = frame_timecode;
 
   if (frames_size_ > 0) {
-    const Frame* const f = frames_[0];  // earliest queued frame
+    const Frame* const f = GetQueuedFrame(0);  // earliest queued frame
     const uint64 ns = f->timestamp();
     const uint64 tc = ns / timecode_scale;
 
@@ -3008,20 +4221,74 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
       cluster_timecode = tc;
   }
 
-  Cluster*& cluster = cluster_list_[cluster_list_size_];
+  if (cluster_) {
+    CountCluster(stats_, cluster_, cluster_timecode * timecode_scale);
+
+    if (chunking_ && (!CloseClusterChunk(cluster_timecode * timecode_scale) ||
+                      !OpenChunk(IMkvChunkSink::kCluster))) {
+      return false;
+    }
+
+    // The old cluster is complete; only its size and, for the first
+    // cluster, its position are needed from now on.
+    finished_clusters_size_ += cluster_->Size();
+    if (cluster_count_ == 1)
+      first_cluster_size_position_ = cluster_->size_position();
+
+    delete cluster_;
+    cluster_ = NULL;
+  }
+
   const int64 offset = MaxOffset();
-  cluster = new (std::nothrow) Cluster(cluster_timecode,  // NOLINT
-                                       offset, segment_info_.timecode_scale());
+  Cluster* const cluster =
+      new (std::nothrow) Cluster(cluster_timecode,  // NOLINT
+                                 offset, segment_info_.timecode_scale());
   if (!cluster)
     return false;
 
-  if (!cluster->Init(writer_cluster_))
+  if (!cluster->Init(writer_cluster_)) {
+    delete cluster;
     return false;
+  }
+
+  if (buffer_clusters_) {
+    if (!cluster_buffer_) {
+      cluster_buffer_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+      if (!cluster_buffer_)
+        return false;
+    }
+    cluster->set_buffer(cluster_buffer_);
+  } else if (batching_) {
+    cluster->set_blocks_buffer(cluster_buffer_);
+  }
 
-  cluster_list_size_ = new_size;
+  cluster_ = cluster;
+  ++cluster_count_;
   return true;
 }
 
+bool Segment::SetBatching(bool batching) {
+  batching_ = batching;
+
+  if (batching && !cluster_buffer_) {
+    cluster_buffer_ = new (std::nothrow) MemoryMkvWriter();  // NOLINT
+    if (!cluster_buffer_) {
+      batching_ = false;
+      return false;
+    }
+  }
+
+  if (!cluster_)
+    return true;
+
+  if (batching) {
+    cluster_->set_blocks_buffer(cluster_buffer_);
+    return true;
+  }
+
+  return cluster_->WriteBlocks();
+}
+
 bool Segment::DoNewClusterProcessing(uint64 track_number,
                                      uint64 frame_timestamp_ns, bool is_key) {
   for (;;) {
@@ -3138,10 +4405,9 @@ int64 Segment::MaxOffset() {
   int64 offset = writer_header_->Position() - payload_pos_;
 
   if (chunking_) {
-    for (int32 i = 0; i < cluster_list_size_; ++i) {
-      Cluster* const cluster = cluster_list_[i];
-      offset += cluster->Size();
-    }
+    offset += finished_clusters_size_;
+    if (cluster_)
+      offset += cluster_->Size();
 
     if (writer_cues_)
       offset += writer_cues_->Position();
@@ -3164,39 +4430,77 @@ bool Segment::QueueFrame(Frame* frame) {
     if (!frames)
       return false;
 
+    Frame** const frame_pool =
+        new (std::nothrow) Frame*[new_capacity];  // NOLINT
+    if (!frame_pool) {
+      delete[] frames;
+      return false;
+    }
+
     for (int32 i = 0; i < frames_size_; ++i) {
-      frames[i] = frames_[i];
+      frames[i] = GetQueuedFrame(i);
+    }
+
+    for (int32 i = 0; i < frame_pool_size_; ++i) {
+      frame_pool[i] = frame_pool_[i];
     }
 
     delete[] frames_;
     frames_ = frames;
     frames_capacity_ = new_capacity;
+    frames_head_ = 0;
+
+    delete[] frame_pool_;
+    frame_pool_ = frame_pool;
   }
 
-  frames_[frames_size_++] = frame;
+  frames_[(frames_head_ + frames_size_) % frames_capacity_] = frame;
+  ++frames_size_;
 
   return true;
 }
 
+Frame* Segment::GetQueuedFrame(int32 index) const {
+  return frames_[(frames_head_ + index) % frames_capacity_];
+}
+
+Frame* Segment::GetFrameFromPool() {
+  if (frame_pool_size_ > 0)
+    return frame_pool_[--frame_pool_size_];
+
+  return new (std::nothrow) Frame();  // NOLINT
+}
+
+void Segment::ReturnFrameToPool(Frame* frame) {
+  // Every frame is either queued or pooled, so the pool only overflows when
+  // growing the frame list failed.
+  if (frame_pool_size_ >= frames_capacity_) {
+    delete frame;
+    return;
+  }
+
+  frame->Reset();
+  frame_pool_[frame_pool_size_++] = frame;
+}
+
 int Segment::WriteFramesAll() {
   if (frames_ == NULL)
     return 0;
 
-  if (cluster_list_size_ < 1)
-    return -1;
-
-  Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
+  Cluster* const cluster = cluster_;
 
   if (!cluster)
     return -1;
 
-  for (int32 i = 0; i < frames_size_; ++i) {
-    Frame*& frame = frames_[i];
+  const int result = frames_size_;
+
+  while (frames_size_ > 0) {
+    Frame* const frame = GetQueuedFrame(0);
     // TODO(jzern/vigneshv): using Segment::AddGenericFrame here would limit the
     // places where |doc_type_version_| needs to be updated.
     if (frame->discard_padding() != 0)
       doc_type_version_ = 4;
-    if (!cluster->AddFrame(frame))
+    if (!WriteFrameToCluster(cluster, frame))
       return -1;
 
     if (new_cuepoint_ && cues_track_ == frame->track_number()) {
@@ -3209,42 +4513,136 @@ int Segment::WriteFramesAll() {
       last_track_timestamp_[frame->track_number() - 1] = frame->timestamp();
     }
 
-    delete frame;
-    frame = NULL;
+    frames_head_ = (frames_head_ + 1) % frames_capacity_;
+    --frames_size_;
+    ReturnFrameToPool(frame);
   }
 
-  const int result = frames_size_;
-  frames_size_ = 0;
+  frames_head_ = 0;
 
   return result;
 }
 
-bool Segment::WriteFramesLessThan(uint64 timestamp) {
-  // Check |cluster_list_size_| to see if this is the first cluster. If it is
-  // the first cluster the audio frames that are less than the first video
-  // timesatmp will be written in a later step.
-  if (frames_size_ > 0 && cluster_list_size_ > 0) {
-    if (!frames_)
+bool Segment::WriteFrameToCluster(Cluster* cluster, const Frame* frame) {
+  const Track* const track = tracks_.GetTrackByNumber(frame->track_number());
+  if (!track)
+    return false;
+
+  // Readers derive the timestamps of laced frames from DefaultDuration, so
+  // tracks without one are not laced.
+  int32 max_laced_frames = 0;
+  if (track->type() == Tracks::kAudio && track->default_duration() > 0) {
+    max_laced_frames =
+        static_cast<const AudioTrack*>(track)->max_laced_frames();
+  }
+
+  const bool lace = max_laced_frames > 1 && frame->CanBeSimpleBlock();
+
+  if (laced_frames_size_ > 0) {
+    const Frame* const first = laced_frames_[0];
+
+    // Frames that do not follow on from the lace at DefaultDuration
+    // intervals would be read back at the wrong time.
+    const uint64 lace_timestamp =
+        first->timestamp() + laced_frames_size_ * track->default_duration();
+
+    if (!lace || first->track_number() != frame->track_number() ||
+        first->is_key() != frame->is_key() ||
+        frame->timestamp() != lace_timestamp ||
+        laced_frames_size_ >= max_laced_frames) {
+      if (!WriteLacedFrames(cluster))
+        return false;
+    }
+  }
+
+  if (!lace) {
+    const uint64 payload_size = cluster->payload_size();
+    const int32 blocks_added = cluster->blocks_added();
+    if (!cluster->AddFrame(frame))
+      return false;
+
+    CountBlock(stats_, cluster, payload_size, blocks_added, &frame, 1);
+    return true;
+  }
+
+  if (max_laced_frames > laced_frames_capacity_) {
+    Frame** const frames =
+        new (std::nothrow) Frame*[max_laced_frames];  // NOLINT
+    if (!frames)
+      return false;
+
+    for (int32 i = 0; i < max_laced_frames; ++i)
+      frames[i] = (i < laced_frames_capacity_) ? laced_frames_[i] : NULL;
+
+    delete[] laced_frames_;
+    laced_frames_ = frames;
+    laced_frames_capacity_ = max_laced_frames;
+  }
+
+  Frame*& laced_frame = laced_frames_[laced_frames_size_];
+  if (!laced_frame) {
+    laced_frame = new (std::nothrow) Frame();  // NOLINT
+    if (!laced_frame)
       return false;
+  }
+
+  // The data of |frame| may only be valid for the duration of this call.
+  if (!laced_frame->CopyFrom(*frame))
+    return false;
+  ++laced_frames_size_;
+
+  if (laced_frames_size_ == max_laced_frames)
+    return WriteLacedFrames(cluster);
+
+  return true;
+}
+
+bool Segment::WriteLacedFrames(Cluster* cluster) {
+  if (laced_frames_size_ == 0)
+    return true;
 
-    Cluster* const cluster = cluster_list_[cluster_list_size_ - 1];
-    if (!cluster)
+  if (!cluster)
+    return false;
+
+  const uint64 payload_size = cluster->payload_size();
+  const int32 blocks_added = cluster->blocks_added();
+  const bool written =
+      cluster->AddLacedFrames(laced_frames_, laced_frames_size_);
+  if (written) {
+    CountBlock(stats_, cluster, payload_size, blocks_added, laced_frames_,
+               laced_frames_size_);
+  }
+
+  // Keep the buffers, but drop borrowed data.
+  for (int32 i = 0; i < laced_frames_size_; ++i)
+    laced_frames_[i]->Reset();
+  laced_frames_size_ = 0;
+
+  return written;
+}
+
+bool Segment::WriteFramesLessThan(uint64 timestamp) {
+  // Check |cluster_| to see if this is the first cluster. If it is the first
+  // cluster the audio frames that are less than the first video timesatmp
+  // will be written in a later step.
+  if (frames_size_ > 0 && cluster_) {
+    if (!frames_)
       return false;
 
-    int32 shift_left = 0;
+    Cluster* const cluster = cluster_;
 
     // TODO(fgalligan): Change this to use the durations of frames instead of
     // the next frame's start time if the duration is accurate.
-    for (int32 i = 1; i < frames_size_; ++i) {
-      const Frame* const frame_curr = frames_[i];
+    while (frames_size_ > 1) {
+      const Frame* const frame_curr = GetQueuedFrame(1);
 
       if (frame_curr->timestamp() > timestamp)
         break;
 
-      const Frame* const frame_prev = frames_[i - 1];
+      Frame* const frame_prev = GetQueuedFrame(0);
       if (frame_prev->discard_padding() != 0)
         doc_type_version_ = 4;
-      if (!cluster->AddFrame(frame_prev))
+      if (!WriteFrameToCluster(cluster, frame_prev))
         return false;
 
       if (new_cuepoint_ && cues_track_ == frame_prev->track_number()) {
@@ -3252,26 +4650,15 @@ bool Segment::WriteFramesLessThan(uint64 timestamp) {
           return false;
       }
 
-      ++shift_left;
       if (frame_prev->timestamp() > last_timestamp_) {
         last_timestamp_ = frame_prev->timestamp();
         last_track_timestamp_[frame_prev->track_number() - 1] =
             frame_prev->timestamp();
       }
 
-      delete frame_prev;
-    }
-
-    if (shift_left > 0) {
-      if (shift_left >= frames_size_)
-        return false;
-
-      const int32 new_frames_size = frames_size_ - shift_left;
-      for (int32 i = 0; i < new_frames_size; ++i) {
-        frames_[i] = frames_[i + shift_left];
-      }
-
-      frames_size_ = new_frames_size;
+      frames_head_ = (frames_head_ + 1) % frames_capacity_;
+      --frames_size_;
+      ReturnFrameToPool(frame_prev);
     }
   }
 
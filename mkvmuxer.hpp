@@ -9,22 +9,97 @@
 #ifndef MKVMUXER_HPP
 #define MKVMUXER_HPP
 
+#include <cstdio>
+
 #include "mkvmuxertypes.hpp"
 
 // For a description of the WebM elements see
 // http://www.webmproject.org/code/specs/container/.
 
 namespace mkvparser {
+class Block;
 class IMkvReader;
 }  // end namespace
 
 namespace mkvmuxer {
 
+class FrameEncryptor;
+class MemoryMkvWriter;
 class MkvWriter;
 class Segment;
+class SegmentStatsCollector;
 
 const uint64 kMaxTrackNumber = 126;
 
+// Largest number of frames that can be laced into one block.
+const int32 kMaxLacedFrames = 256;
+
+// A block of memory passed to IMkvWriter::WriteV().
+struct WriteBuffer {
+  const void* data;
+  uint32 length;
+};
+
+// Muxer statistics collected by a Segment. Statistics are only gathered when
+// the library is built with MKVMUXER_ENABLE_STATS defined; otherwise
+// Segment::GetStats() returns NULL and no counting code is compiled in.
+// Sizes are in octets and durations in nanoseconds. Per cluster values are
+// counted when a cluster is complete, and the element classes are final once
+// Segment::Finalize() has returned.
+struct SegmentStats {
+  // Classes of the octets in the output. |kBlockHeaders| covers the
+  // SimpleBlock, BlockGroup and Block element headers and the track number,
+  // timecode, flags and lace header of each block; |kBlockGroupElements| the
+  // other children of BlockGroups, except for the BlockAdditional payload,
+  // which is counted as |kFrameData|. |kClusterHeaders| covers the Cluster
+  // element header and the Timecode element. |kOther| is everything else: the
+  // EBML header, the Segment header, Info, Tracks, Chapters and Tags. It is
+  // not counted for chunked output.
+  enum ElementClass {
+    kBlockHeaders = 0,
+    kBlockGroupElements = 1,
+    kFrameData = 2,
+    kClusterHeaders = 3,
+    kCues = 4,
+    kSeekHead = 5,
+    kVoid = 6,
+    kOther = 7,
+    kElementClassCount = 8
+  };
+
+  SegmentStats();
+  void Init();
+
+  uint64 bytes[kElementClassCount];
+
+  uint64 clusters;
+  uint64 blocks;
+  uint64 frames;
+
+  // Range of the complete clusters. The sums over all clusters follow from
+  // the counters above, and from |bytes| for the sizes.
+  uint64 min_cluster_blocks;
+  uint64 max_cluster_blocks;
+  uint64 min_cluster_frames;
+  uint64 max_cluster_frames;
+  uint64 min_cluster_size;
+  uint64 max_cluster_size;
+  uint64 min_cluster_duration;
+  uint64 max_cluster_duration;
+  uint64 total_cluster_duration;
+
+  // Number of audio frames held back to be muxed with video, sampled each
+  // time a frame is added. The mean depth is |queued_frames_sum| divided by
+  // |queued_frames_samples|.
+  uint64 max_queued_frames;
+  uint64 queued_frames_sum;
+  uint64 queued_frames_samples;
+
+  // Seeks back into data that has already been written to update it, such as
+  // cluster and segment sizes, the duration, the SeekHead and reserved Cues.
+  uint64 seek_backs;
+};
+
 ///////////////////////////////////////////////////////////////
 // Interface used by the mkvmuxer to write out the Mkv data.
 class IMkvWriter {
@@ -32,6 +107,12 @@ class IMkvWriter {
   // Writes out |len| bytes of |buf|. Returns 0 on success.
   virtual int32 Write(const void* buf, uint32 len) = 0;
 
+  // Writes out the |count| buffers in |buffers| in order, as if each had been
+  // passed to Write(). Returns 0 on success. The default implementation calls
+  // Write() once per buffer; writers that can gather the buffers into a single
+  // output operation should override it.
+  virtual int32 WriteV(const WriteBuffer* buffers, int32 count);
+
   // Returns the offset of the output position from the beginning of the
   // output.
   virtual int64 Position() const = 0;
@@ -43,12 +124,26 @@ class IMkvWriter {
   virtual bool Seekable() const = 0;
 
   // Element start notification. Called whenever an element identifier is about
-  // to be written to the stream. |element_id| is the element identifier, and
-  // |position| is the location in the WebM stream where the first octet of the
-  // element identifier will be written.
+  // to be written to the stream, if ElementStartNotifyEnabled() returns true.
+  // |element_id| is the element identifier, and |position| is the location in
+  // the WebM stream where the first octet of the element identifier will be
+  // written.
   // Note: the |MkvId| enumeration in webmids.hpp defines element values.
   virtual void ElementStartNotify(uint64 element_id, int64 position) = 0;
 
+  // Returns true if the writer wants ElementStartNotify() calls. Notifications
+  // are opt-in because each one costs a Position() call; the default
+  // implementation returns false.
+  virtual bool ElementStartNotifyEnabled() const;
+
+  // Copies up to |size| octets of |source|, starting at offset |start|, to
+  // the current position without going through Write(). Returns the number of
+  // octets copied, which is less than |size| when the caller should copy the
+  // rest, or -1 if the output was left in an unknown state. The default
+  // implementation copies nothing; writers opt in by overriding it.
+  virtual int64 CopyFrom(mkvparser::IMkvReader* source, int64 start,
+                         int64 size);
+
  protected:
   IMkvWriter();
   virtual ~IMkvWriter();
@@ -57,6 +152,31 @@ class IMkvWriter {
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvWriter);
 };
 
+///////////////////////////////////////////////////////////////
+// Interface used by the mkvmuxer to hand out the chunks of a segment that is
+// chunked in memory. See Segment::SetChunkSink().
+class IMkvChunkSink {
+ public:
+  enum ChunkKind { kHeader = 0, kCluster = 1, kCues = 2 };
+
+  // Receives the |size| octets of |data| of a complete chunk of |kind|. |data|
+  // is only valid for the duration of the call. |index| is the number of
+  // cluster chunks before this one, and 0 for the header chunk. |start_time|
+  // and |end_time| are in nanoseconds: the time range of the cluster for a
+  // cluster chunk, of the whole segment for the Cues chunk and both 0 for the
+  // header chunk. Returns false to make the muxing call that completed the
+  // chunk fail.
+  virtual bool OnChunk(ChunkKind kind, int32 index, const uint8* data,
+                       uint64 size, uint64 start_time, uint64 end_time) = 0;
+
+ protected:
+  IMkvChunkSink();
+  virtual ~IMkvChunkSink();
+
+ private:
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(IMkvChunkSink);
+};
+
 // Writes out the EBML header for a WebM file. This function must be called
 // before any other libwebm writing functions are called.
 bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version);
@@ -69,6 +189,10 @@ bool WriteEbmlHeader(IMkvWriter* writer);
 bool ChunkedCopy(mkvparser::IMkvReader* source, IMkvWriter* dst, int64 start,
                  int64 size);
 
+// Callback used by Frame to manage the lifetime of borrowed frame data.
+// |opaque| is the value passed to Frame::Borrow().
+typedef void (*FrameBufferCallback)(void* opaque);
+
 ///////////////////////////////////////////////////////////////
 // Class to hold data the will be written to a block.
 class Frame {
@@ -80,12 +204,43 @@ class Frame {
   // failure, this frame's existing contents may be lost.
   bool CopyFrom(const Frame& frame);
 
+  // Like CopyFrom(), but points this frame at the data of |frame| without
+  // copying it or calling its |retain| callback, so |frame| must keep the
+  // data until this frame is reset or destroyed. Returns true on success.
+  bool BorrowFrom(const Frame& frame);
+
+  // Resets the frame to its default state and releases borrowed data. Memory
+  // allocated for copies of the data is kept for reuse by Init(),
+  // AddAdditionalData() and CopyFrom().
+  void Reset();
+
   // Copies |frame| data into |frame_|. Returns true on success.
   bool Init(const uint8* frame, uint64 length);
 
   // Copies |additional| data into |additional_|. Returns true on success.
   bool AddAdditionalData(const uint8* additional, uint64 length, uint64 add_id);
 
+  // Sets |frame_| to |frame| without copying the data, which must remain
+  // valid until |release| is called. The frame takes over one reference to
+  // the data: |release| is called with |opaque| once the frame no longer uses
+  // it. CopyFrom() shares the data with the copy after calling |retain| with
+  // |opaque|, and copies the data when |retain| is NULL. Either callback may
+  // be NULL. Returns true on success.
+  bool Borrow(const uint8* frame, uint64 length, FrameBufferCallback retain,
+              FrameBufferCallback release, void* opaque);
+
+  // Sets |additional_| to |additional| without copying the data. See
+  // Borrow(). Returns true on success.
+  bool BorrowAdditionalData(const uint8* additional, uint64 length,
+                            uint64 add_id, FrameBufferCallback retain,
+                            FrameBufferCallback release, void* opaque);
+
+  // Copies the |count| partition offsets used when the frame is encrypted,
+  // which split it in partitions that alternate between clear and encrypted.
+  // A |count| of 0 encrypts the whole frame. See FrameEncryptor::Encrypt().
+  // Returns true on success.
+  bool SetEncryptionPartitions(const uint32* offsets, int32 count);
+
   // Returns true if the frame has valid parameters.
   bool IsValid() const;
 
@@ -115,13 +270,58 @@ class Frame {
   bool reference_block_timestamp_set() const {
     return reference_block_timestamp_set_;
   }
+  void set_encrypted(bool encrypted) { encrypted_ = encrypted; }
+  bool encrypted() const { return encrypted_; }
+  const uint32* encryption_partitions() const {
+    return encryption_partitions_;
+  }
+  int32 encryption_partition_count() const {
+    return encryption_partition_count_;
+  }
 
  private:
+  // Storage and lifetime callbacks of |frame_| or |additional_|.
+  struct BufferRef {
+    BufferRef();
+
+    // Owned copy of the data, kept after the data is dropped so that it can be
+    // reused by the next copy.
+    uint8* storage;
+    uint64 capacity;
+
+    // Set while the data is a buffer passed to Borrow() or
+    // BorrowAdditionalData().
+    bool borrowed;
+    FrameBufferCallback retain;
+    FrameBufferCallback release;
+    void* opaque;
+  };
+
+  // Copies everything but the frame and additional data from |frame|.
+  // Returns true on success.
+  bool CopyPropertiesFrom(const Frame& frame);
+
+  // Releases |data| if it is borrowed, and sets it to NULL.
+  static void ReleaseBuffer(const uint8** data, BufferRef* ref);
+
+  // Points |data| at a copy of the |length| octets of |source|, reusing
+  // |ref->storage| if it is large enough. Returns true on success.
+  static bool CopyBuffer(const uint8* source, uint64 length, const uint8** data,
+                         BufferRef* ref);
+
+  // Points |data| at the |length| octets of |source|. Shares the buffer if
+  // |source_ref| allows it, and copies it otherwise. Returns true on success.
+  static bool ShareBuffer(const uint8* source, uint64 length,
+                          const BufferRef& source_ref, const uint8** data,
+                          BufferRef* ref);
+
   // Id of the Additional data.
   uint64 add_id_;
 
-  // Pointer to additional data. Owned by this class.
-  uint8* additional_;
+  // Pointer to additional data. Points to |additional_ref_.storage| unless
+  // |additional_ref_.borrowed| is true.
+  const uint8* additional_;
+  BufferRef additional_ref_;
 
   // Length of the additional data.
   uint64 additional_length_;
@@ -129,8 +329,10 @@ class Frame {
   // Duration of the frame in nanoseconds.
   uint64 duration_;
 
-  // Pointer to the data. Owned by this class.
-  uint8* frame_;
+  // Pointer to the data. Points to |frame_ref_.storage| unless
+  // |frame_ref_.borrowed| is true.
+  const uint8* frame_;
+  BufferRef frame_ref_;
 
   // Flag telling if the data should set the key flag of a block.
   bool is_key_;
@@ -153,6 +355,17 @@ class Frame {
   // Flag indicating if |reference_block_timestamp_| has been set.
   bool reference_block_timestamp_set_;
 
+  // Flag telling if the frame is encrypted when its track is. Frames that are
+  // not are stored in the clear, after a signal byte.
+  bool encrypted_;
+
+  // Partition offsets of the encrypted frame. The first
+  // |encryption_partition_count_| of the |encryption_partitions_capacity_|
+  // entries are in use.
+  uint32* encryption_partitions_;
+  int32 encryption_partition_count_;
+  int32 encryption_partitions_capacity_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Frame);
 };
 
@@ -201,8 +414,6 @@ class CuePoint {
   // If true the muxer will write out the block number for the cue if the
   // block number is different than the default of 1. Default is set to true.
   bool output_block_number_;
-
-  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(CuePoint);
 };
 
 ///////////////////////////////////////////////////////////////
@@ -212,19 +423,43 @@ class Cues {
   Cues();
   ~Cues();
 
-  // Adds a cue point to the Cues element. Returns true on success.
+  // Adds a cue point to the Cues element, which takes ownership of |cue|.
+  // Fails once SetMaxCuesInMemory() is set; use AddCueCopy() then. Returns
+  // true on success.
   bool AddCue(CuePoint* cue);
 
+  // Adds a copy of |cue| to the Cues element. Returns true on success.
+  bool AddCueCopy(const CuePoint& cue);
+
   // Returns the cue point by index. Returns NULL if there is no cue point
-  // match.
+  // match, or if the cue point was moved to the temporary file of
+  // SetMaxCuesInMemory().
   CuePoint* GetCueByIndex(int32 index) const;
 
+  // Copies the cue point at |index| to |cue|, reading it back from the
+  // temporary file of SetMaxCuesInMemory() if needed. Returns true on success.
+  bool GetCue(int32 index, CuePoint* cue) const;
+
+  // Adds |offset| to the cluster position of every cue point. Returns true on
+  // success.
+  bool OffsetClusterPositions(uint64 offset);
+
   // Returns the total size of the Cues element
   uint64 Size();
 
   // Output the Cues element to the writer. Returns true on success.
   bool Write(IMkvWriter* writer) const;
 
+  // Limits the number of cue points kept in memory. Once that many are held,
+  // they are appended to a temporary file and read back by Write(), so that
+  // the memory used by the Cues of long recordings stays bounded. Cue points
+  // must then be added with AddCueCopy(), and GetCueByIndex() pointers are
+  // only valid until the next cue point is added. 0, the default, keeps every
+  // cue point in memory. Must be called before the first cue point is added.
+  // Returns true on success.
+  bool SetMaxCuesInMemory(int32 max_cues_in_memory);
+  int32 max_cues_in_memory() const { return max_cues_in_memory_; }
+
   int32 cue_entries_size() const { return cue_entries_size_; }
   void set_output_block_number(bool output_block_number) {
     output_block_number_ = output_block_number;
@@ -232,15 +467,34 @@ class Cues {
   bool output_block_number() const { return output_block_number_; }
 
  private:
+  // Appends the cue points in memory to |spill_file_|, and keeps their
+  // objects for the next cue points. Returns true on success.
+  bool SpillCues();
+
+  // Reads the |count| records of the spilled cue points from |index| on into
+  // |records|. Returns true on success.
+  bool ReadSpilledCues(int32 index, int32 count, uint64* records) const;
+
   // Number of allocated elements in |cue_entries_|.
   int32 cue_entries_capacity_;
 
-  // Number of CuePoints in |cue_entries_|.
+  // Number of CuePoints, including the ones in |spill_file_|.
   int32 cue_entries_size_;
 
-  // CuePoint list.
+  // CuePoint list, without the first |spilled_size_| CuePoints. Entries past
+  // the CuePoints in memory are NULL, or CuePoints kept for reuse after
+  // SpillCues().
   CuePoint** cue_entries_;
 
+  // See SetMaxCuesInMemory().
+  int32 max_cues_in_memory_;
+
+  // Temporary file holding the first |spilled_size_| CuePoints, or NULL, and
+  // the sum of their sizes.
+  FILE* spill_file_;
+  int32 spilled_size_;
+  uint64 spilled_payload_size_;
+
   // If true the muxer will write out the block number for the cue if the
   // block number is different than the default of 1. Default is set to true.
   bool output_block_number_;
@@ -281,7 +535,7 @@ class ContentEncAESSettings {
 // ContentEncoding element
 // Elements used to describe if the track data has been encrypted or
 // compressed with zlib or header stripping.
-// Currently only whole frames can be encrypted with AES. This dictates that
+// Only encryption with AES is supported. This dictates that
 // ContentEncodingOrder will be 0, ContentEncodingScope will be 1,
 // ContentEncodingType will be 1, and ContentEncAlgo will be 5.
 class ContentEncoding {
@@ -390,6 +644,11 @@ class Track {
     return content_encoding_entries_size_;
   }
 
+  // Sets the encryptor of the frames of the track, which takes ownership of
+  // |encryptor|. See Segment::SetTrackEncryption().
+  void set_encryptor(FrameEncryptor* encryptor);
+  FrameEncryptor* encryptor() const { return encryptor_; }
+
  private:
   // Track element names.
   char* codec_id_;
@@ -413,6 +672,9 @@ class Track {
   // Number of ContentEncoding elements added.
   uint32 content_encoding_entries_size_;
 
+  // Encryptor of the frames of the track, or NULL.
+  FrameEncryptor* encryptor_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Track);
 };
 
@@ -513,12 +775,27 @@ class AudioTrack : public Track {
   void set_sample_rate(double sample_rate) { sample_rate_ = sample_rate; }
   double sample_rate() const { return sample_rate_; }
 
+  // Sets the number of consecutive frames of the track that the Segment may
+  // lace into one SimpleBlock, which saves the block overhead of each frame.
+  // Laced frames share the timestamp of the first frame; readers derive the
+  // others from the DefaultDuration element, so tracks are only laced when
+  // default_duration() is set, and a frame whose timestamp is not the
+  // DefaultDuration after the previous one ends the lace. Frames that cannot
+  // be written as SimpleBlocks, and frames of other tracks, also end the
+  // lace. 0 or 1, the default, turns lacing off. Returns false if
+  // |max_laced_frames| is not in the range [0, kMaxLacedFrames].
+  bool SetMaxLacedFrames(int32 max_laced_frames);
+  int32 max_laced_frames() const { return max_laced_frames_; }
+
  private:
   // Audio track element names.
   uint64 bit_depth_;
   uint64 channels_;
   double sample_rate_;
 
+  // Number of frames laced into one block.
+  int32 max_laced_frames_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(AudioTrack);
 };
 
@@ -551,10 +828,12 @@ class Tracks {
   // if there is no track match.
   Track* GetTrackByNumber(uint64 track_number) const;
 
-  // Returns true if the track number is an audio track.
+  // Returns true if the track number is an audio track. Returns false if there
+  // is no track match.
   bool TrackIsAudio(uint64 track_number) const;
 
-  // Returns true if the track number is a video track.
+  // Returns true if the track number is a video track. Returns false if there
+  // is no track match.
   bool TrackIsVideo(uint64 track_number) const;
 
   // Output the Tracks element to the writer. Returns true on success.
@@ -569,6 +848,10 @@ class Tracks {
   // Number of Track elements added.
   uint32 track_entries_size_;
 
+  // Track elements indexed by the track number assigned in AddTrack(). Entry 0
+  // is unused.
+  Track* tracks_by_number_[kMaxTrackNumber + 1];
+
   // Whether or not Tracks element has already been written via IMkvWriter.
   mutable bool wrote_tracks_;
 
@@ -861,10 +1144,39 @@ class Cluster {
 
   bool Init(IMkvWriter* ptr_writer);
 
+  // Collects the cluster in |buffer| instead of writing it out block by block.
+  // Finalize() then writes the whole cluster through |writer_| with its exact
+  // size, so the size never needs to be updated with a seek. |buffer| is not
+  // owned and must remain valid until Finalize(). Must be called before any
+  // frames are added.
+  void set_buffer(MemoryMkvWriter* buffer) { buffer_ = buffer; }
+
+  // Collects the blocks added from now on in |blocks| instead of writing them
+  // out one at a time, until WriteBlocks() is called. |blocks| is not owned
+  // and must remain valid until then. Has no effect on a cluster that is
+  // buffered with set_buffer(), and must not be used when |writer_| has
+  // element start notification enabled, as the blocks are serialized at the
+  // wrong position.
+  void set_blocks_buffer(MemoryMkvWriter* blocks) { blocks_ = blocks; }
+
+  // Writes the blocks collected since set_blocks_buffer() through |writer_|
+  // in a single call, and stops collecting them. Returns true on success.
+  bool WriteBlocks();
+
   // Adds a frame to be output in the file. The frame is written out through
   // |writer_| if successful. Returns true on success.
   bool AddFrame(const Frame* frame);
 
+  // Adds |frame_count| frames of one track to be output in the file as a
+  // single laced SimpleBlock. See WriteLacedFrames(). Returns true on success.
+  bool AddLacedFrames(const Frame* const* frames, int32 frame_count);
+
+  // Adds |block|, read from |reader|, as a SimpleBlock of |track_number| at
+  // |abs_timecode|, expressed in nanoseconds. See WriteBlockFromReader().
+  // Returns true on success.
+  bool CopyBlock(mkvparser::IMkvReader* reader, const mkvparser::Block* block,
+                 uint64 track_number, uint64 abs_timecode);
+
   // Adds a frame to be output in the file. The frame is written out through
   // |writer_| if successful. Returns true on success.
   // Inputs:
@@ -933,7 +1245,8 @@ class Cluster {
   void AddPayloadSize(uint64 size);
 
   // Closes the cluster so no more data can be written to it. Will update the
-  // cluster's size if |writer_| is seekable. Returns true on success.
+  // cluster's size if |writer_| is seekable, or write out the buffered cluster
+  // if set_buffer() was called. Returns true on success.
   bool Finalize();
 
   // Returns the size in bytes for the entire Cluster element.
@@ -963,6 +1276,9 @@ class Cluster {
   // Does some verification and calls WriteFrame.
   bool DoWriteFrame(const Frame* const frame);
 
+  // Returns the writer that blocks are serialized to.
+  IMkvWriter* block_writer() const;
+
   // Outputs the Cluster header to |writer_|. Returns true on success.
   bool WriteClusterHeader();
 
@@ -993,6 +1309,14 @@ class Cluster {
   // Pointer to the writer object. Not owned by this class.
   IMkvWriter* writer_;
 
+  // Buffer that collects the cluster's payload until Finalize(), or NULL when
+  // the cluster is written out as frames are added. Not owned by this class.
+  MemoryMkvWriter* buffer_;
+
+  // Buffer that collects blocks until WriteBlocks(), or NULL. Not owned by
+  // this class.
+  MemoryMkvWriter* blocks_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Cluster);
 };
 
@@ -1014,6 +1338,11 @@ class SeekHead {
   // Writes out SeekHead and SeekEntry elements. Returns true on success.
   bool Finalize(IMkvWriter* writer) const;
 
+  // Returns the size in bytes of the SeekHead element written by Finalize(),
+  // or 0 if there are no seek entries. The rest of the space reserved by
+  // Write() is filled with a Void element.
+  uint64 Size() const;
+
   // Returns the id of the Seek Entry at the given index. Returns -1 if index is
   // out of range.
   uint32 GetId(int index) const;
@@ -1030,6 +1359,9 @@ class SeekHead {
   // a SeekHead element later. Returns true on success.
   bool Write(IMkvWriter* writer);
 
+  // Returns the size in bytes of the space reserved by Write().
+  uint64 ReservedSize() const;
+
   // We are going to put a cap on the number of Seek Entries.
   const static int32 kSeekEntryCount = 5;
 
@@ -1217,6 +1549,38 @@ class Segment {
   //   frame: frame object
   bool AddGenericFrame(const Frame* frame);
 
+  // Writes |frame_count| frames to the output medium, as if each had been
+  // passed to AddGenericFrame(). The frames must be in timestamp order. The
+  // data, track numbers and timestamps of the whole batch are checked before
+  // any frame is added. The blocks that go into the same cluster are
+  // collected and written out in a single call to the writer, unless element
+  // start notification is enabled. Returns true on success.
+  bool AddFrames(const Frame* const* frames, int32 frame_count);
+
+  // Writes |block| of a parsed file, read from |reader|, to the output medium
+  // as a block of |track_number| at |timestamp|, expressed in nanoseconds.
+  // Only the block header is rewritten; the lace header and the frame data
+  // are copied from |reader| without being decoded into Frames, by the
+  // kernel when the writer allows it (see MkvWriter::set_kernel_copy_source()).
+  // Blocks that cannot be copied this way are split into their frames and
+  // added as by AddGenericFrame(): blocks with discard padding, audio blocks
+  // held back for a video key frame, and blocks of tracks the muxer laces or
+  // encrypts itself. Returns true on success.
+  bool CopyBlock(mkvparser::IMkvReader* reader, const mkvparser::Block* block,
+                 uint64 track_number, uint64 timestamp);
+
+  // Encrypts the frames of |track_number| with AES-CTR as described by the
+  // WebM encryption specification, with the 16 octet |key|, and sets
+  // |key_id| as the ContentEncKeyID of the track. The frames are encrypted
+  // whole unless Frame::SetEncryptionPartitions() or Frame::set_encrypted()
+  // say otherwise. The IVs of the frames count up from a random value of the
+  // operating system's random number generator, and the call fails if there
+  // is none. Must be called before the first frame is added. Returns true on
+  // success.
+  bool SetTrackEncryption(uint64 track_number, const uint8* key_id,
+                          uint64 key_id_length, const uint8* key,
+                          uint64 key_length);
+
   // Adds a VP8 video track to the segment. Returns the number of the track on
   // success, 0 on error. |number| is the number to use for the video track.
   // |number| must be >= 0. If |number| == 0 then the muxer will decide on
@@ -1237,6 +1601,22 @@ class Segment {
   bool CopyAndMoveCuesBeforeClusters(mkvparser::IMkvReader* reader,
                                      IMkvWriter* writer);
 
+  // Reserves |size| octets for the Cues element between the headers and the
+  // first Cluster, written as a Void element. If the Cues fit, Finalize()
+  // writes them into the reserved space, which avoids the copy made by
+  // CopyAndMoveCuesBeforeClusters(), and cues_position() becomes
+  // |kBeforeClusters|. Otherwise the Cues are written after the Clusters as
+  // usual and CopyAndMoveCuesBeforeClusters() can still be used. Only
+  // applies in |kFile| mode with a seekable writer and chunking disabled.
+  // Must be called before any frames are added. Returns true on success.
+  bool ReserveCuesSpace(uint64 size);
+
+  // Returns a size for ReserveCuesSpace() that holds the Cues of a segment
+  // lasting |duration_ns| with a cue point every |cue_interval_ns|, at the
+  // current timecode scale. The estimate allows for the largest cluster
+  // positions, so it is generous for small files.
+  uint64 EstimateCuesSize(uint64 duration_ns, uint64 cue_interval_ns) const;
+
   // Sets which track to use for the Cues element. Must have added the track
   // before calling this function. Returns true on success. |track_number| is
   // returned by the Add track functions.
@@ -1251,6 +1631,10 @@ class Segment {
   // Cues element. May finalize the SeekHead element. Returns true on success.
   bool Finalize();
 
+  // Returns the statistics collected so far, or NULL if the library was built
+  // without MKVMUXER_ENABLE_STATS.
+  const SegmentStats* GetStats() const;
+
   // Returns the Cues object.
   Cues* GetCues() { return &cues_; }
 
@@ -1276,6 +1660,17 @@ class Segment {
   // That will force the interface to be dependent on files.
   bool SetChunking(bool chunking, const char* filename);
 
+  // Turns on chunking like SetChunking(), but collects each chunk in memory
+  // and passes it to |sink| once it is complete instead of writing files:
+  // each cluster chunk as soon as the next cluster starts or the segment is
+  // finalized, the Cues chunk when the segment is finalized, and the header
+  // chunk once the segment header is written in |kLive| mode, or when the
+  // segment is finalized in |kFile| mode, as the header is then updated with
+  // the segment size and duration. |sink| is not owned and must remain valid
+  // until Finalize() returns. Must be called before any frames are added, and
+  // not together with SetChunking(). Returns true on success.
+  bool SetChunkSink(IMkvChunkSink* sink);
+
   bool chunking() const { return chunking_; }
   uint64 cues_track() const { return cues_track_; }
   void set_max_cluster_duration(uint64 max_cluster_duration) {
@@ -1288,6 +1683,17 @@ class Segment {
   uint64 max_cluster_size() const { return max_cluster_size_; }
   void set_mode(Mode mode) { mode_ = mode; }
   Mode mode() const { return mode_; }
+
+  // Sets whether each cluster is collected in memory and written out with its
+  // exact size once it is complete, in both modes. Cluster sizes are then
+  // known and minimally coded even when the writer is not seekable, at the
+  // cost of holding one cluster in memory. Elements inside a buffered cluster
+  // are not reported through IMkvWriter::ElementStartNotify(). Must be set
+  // before any frames are added.
+  void set_buffer_clusters(bool buffer_clusters) {
+    buffer_clusters_ = buffer_clusters;
+  }
+  bool buffer_clusters() const { return buffer_clusters_; }
   CuesPosition cues_position() const { return cues_position_; }
   bool output_cues() const { return output_cues_; }
   const SegmentInfo* segment_info() const { return &segment_info_; }
@@ -1301,6 +1707,20 @@ class Segment {
   // Sets |doc_type_version_| based on the current element requirements.
   void UpdateDocTypeVersion();
 
+  // Starts a chunk of |kind|: opens its file, unless the chunks are passed to
+  // |chunk_sink_|. Returns true on success.
+  bool OpenChunk(IMkvChunkSink::ChunkKind kind);
+
+  // Completes the chunk of |kind|: closes its file, or passes its data to
+  // |chunk_sink_| with the time range from |start_time| to |end_time| in
+  // nanoseconds. Returns true on success.
+  bool CloseChunk(IMkvChunkSink::ChunkKind kind, uint64 start_time,
+                  uint64 end_time);
+
+  // Completes the chunk of the last cluster, which ends at |end_time| in
+  // nanoseconds, and counts it. Returns true on success.
+  bool CloseClusterChunk(uint64 end_time);
+
   // Sets |name| according to how many chunks have been written. |ext| is the
   // file extension. |name| must be deleted by the calling app. Returns true
   // on success.
@@ -1314,6 +1734,16 @@ class Segment {
   // Adds the frame to our frame array.
   bool QueueFrame(Frame* frame);
 
+  // Returns the queued frame at |index|, where 0 is the oldest frame.
+  Frame* GetQueuedFrame(int32 index) const;
+
+  // Returns a frame from |frame_pool_|, or a new frame if the pool is empty.
+  // Returns NULL on error.
+  Frame* GetFrameFromPool();
+
+  // Resets |frame| and returns it to |frame_pool_|.
+  void ReturnFrameToPool(Frame* frame);
+
   // Output all frames that are queued. Returns -1 on error, otherwise
   // it returns the number of frames written.
   int WriteFramesAll();
@@ -1323,6 +1753,36 @@ class Segment {
   // queued.
   bool WriteFramesLessThan(uint64 timestamp);
 
+  // Adds |frame|, which belongs to |track|, after the checks made by
+  // AddGenericFrame() and AddFrames(). Returns true on success.
+  bool DoAddGenericFrame(const Frame* frame, const Track* track);
+
+  // Encrypts |frame| with the encryptor of |track| into |encryption_buffer_|,
+  // and sets |encrypted_frame| to borrow the result. Returns true on success.
+  bool EncryptFrame(const Frame* frame, const Track* track,
+                    Frame* encrypted_frame);
+
+  // Reads the frames of |block| from |reader| and adds each of them as a
+  // Frame of |track|, the first at |timestamp| and the others the track's
+  // DefaultDuration apart. Used by CopyBlock() for the blocks it cannot copy.
+  // Returns true on success.
+  bool AddBlockFrames(mkvparser::IMkvReader* reader,
+                      const mkvparser::Block* block, const Track* track,
+                      uint64 timestamp);
+
+  // Starts or stops collecting the blocks of the last cluster in
+  // |cluster_buffer_|. Stopping writes out the collected blocks. Returns true
+  // on success.
+  bool SetBatching(bool batching);
+
+  // Outputs |frame| to |cluster|, or holds it back to be laced with the frames
+  // that follow if its track is laced. Returns true on success.
+  bool WriteFrameToCluster(Cluster* cluster, const Frame* frame);
+
+  // Outputs the frames held back for lacing to |cluster|. Returns true on
+  // success and if there are no frames held back.
+  bool WriteLacedFrames(Cluster* cluster);
+
   // Outputs the segment header, Segment Information element, SeekHead element,
   // and Tracks element to |writer_|.
   bool WriteSegmentHeader();
@@ -1347,18 +1807,8 @@ class Segment {
   bool DoNewClusterProcessing(uint64 track_num, uint64 timestamp_ns, bool key);
 
   // Adjusts Cue Point values (to place Cues before Clusters) so that they
-  // reflect the correct offsets.
-  void MoveCuesBeforeClusters();
-
-  // This function recursively computes the correct cluster offsets (this is
-  // done to move the Cues before Clusters). It recursively updates the change
-  // in size (which indicates a change in cluster offset) until no sizes change.
-  // Parameters:
-  // diff - indicates the difference in size of the Cues element that needs to
-  //        accounted for.
-  // index - index in the list of Cues which is currently being adjusted.
-  // cue_size - sum of size of all the CuePoint elements.
-  void MoveCuesBeforeClustersHelper(uint64 diff, int index, uint64* cue_size);
+  // reflect the correct offsets. Returns true on success.
+  bool MoveCuesBeforeClusters();
 
   // Seeds the random number generator used to make UIDs.
   unsigned int seed_;
@@ -1396,21 +1846,40 @@ class Segment {
   // Base filename for the chunked files.
   char* chunking_base_name_;
 
+  // Receives the chunks instead of files when set. Not owned by this class.
+  IMkvChunkSink* chunk_sink_;
+
+  // Buffers that collect the cluster, Cues and header chunks for
+  // |chunk_sink_|.
+  MemoryMkvWriter* chunk_buffer_cluster_;
+  MemoryMkvWriter* chunk_buffer_cues_;
+  MemoryMkvWriter* chunk_buffer_header_;
+
   // File position offset where the Clusters end.
   int64 cluster_end_offset_;
 
-  // List of clusters.
-  Cluster** cluster_list_;
+  // The cluster being written, or NULL before the first one. Clusters are
+  // deleted once complete, keeping only what MaxOffset() and
+  // CopyAndMoveCuesBeforeClusters() need.
+  Cluster* cluster_;
 
-  // Number of cluster pointers allocated in the cluster list.
-  int32 cluster_list_capacity_;
+  // Number of clusters created.
+  int32 cluster_count_;
 
-  // Number of clusters in the cluster list.
-  int32 cluster_list_size_;
+  // Sum of the sizes of the complete clusters.
+  uint64 finished_clusters_size_;
+
+  // Position of the size of the first cluster once it is complete, or -1.
+  int64 first_cluster_size_position_;
 
   // Indicates whether Cues should be written before or after Clusters
   CuesPosition cues_position_;
 
+  // Number of octets reserved for the Cues by ReserveCuesSpace(), and the
+  // file position of the reserved space, or -1 if nothing was reserved.
+  uint64 cues_reserve_size_;
+  int64 cues_reserve_position_;
+
   // Track number that is associated with the cues element for this segment.
   uint64 cues_track_;
 
@@ -1420,15 +1889,42 @@ class Segment {
   // List of stored audio frames. These variables are used to store frames so
   // the muxer can follow the guideline "Audio blocks that contain the video
   // key frame's timecode should be in the same cluster as the video key frame
-  // block."
+  // block." The list is a circular buffer, which starts at |frames_head_|.
   Frame** frames_;
 
   // Number of frame pointers allocated in the frame list.
   int32 frames_capacity_;
 
+  // Index of the oldest frame in the frame list.
+  int32 frames_head_;
+
   // Number of frames in the frame list.
   int32 frames_size_;
 
+  // Frames that have been written out, kept with their buffers for reuse by
+  // the frame list. Holds up to |frames_capacity_| frames.
+  Frame** frame_pool_;
+
+  // Number of frames in the frame pool.
+  int32 frame_pool_size_;
+
+  // Frames of one laced audio track that have not been written out yet. The
+  // first |laced_frames_size_| of the |laced_frames_capacity_| entries are in
+  // use; the others are NULL or kept with their buffers for reuse.
+  Frame** laced_frames_;
+  int32 laced_frames_capacity_;
+  int32 laced_frames_size_;
+
+  // Buffer that AddBlockFrames() reads frames into, reused from one frame to
+  // the next.
+  uint8* block_frame_buffer_;
+  int64 block_frame_buffer_size_;
+
+  // Buffer that EncryptFrame() encrypts frames into, reused from one frame to
+  // the next.
+  uint8* encryption_buffer_;
+  uint64 encryption_buffer_size_;
+
   // Flag telling if a video track has been added to the segment.
   bool has_video_;
 
@@ -1454,6 +1950,18 @@ class Segment {
   // the muxer will decide the size.
   uint64 max_cluster_size_;
 
+  // Flag telling if clusters are buffered in |cluster_buffer_| and written
+  // out once complete.
+  bool buffer_clusters_;
+
+  // Buffer shared by the clusters when |buffer_clusters_| is true, and
+  // otherwise by the blocks of a batch of frames in AddFrames().
+  MemoryMkvWriter* cluster_buffer_;
+
+  // Flag telling if the blocks of the last cluster are collected in
+  // |cluster_buffer_| by AddFrames().
+  bool batching_;
+
   // The mode that segment is in. If set to |kLive| the writer must not
   // seek backwards.
   Mode mode_;
@@ -1487,6 +1995,9 @@ class Segment {
   IMkvWriter* writer_cues_;
   IMkvWriter* writer_header_;
 
+  // Statistics, or NULL when built without MKVMUXER_ENABLE_STATS.
+  SegmentStatsCollector* stats_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Segment);
 };
 
@@ -20,6 +20,7 @@
 #include <ctime>
 #include <new>
 
+#include "mkvparser.hpp"
 #include "mkvwriter.hpp"
 #include "webmids.hpp"
 
@@ -35,6 +36,149 @@ namespace {
 // Date elements are always 8 octets in size.
 const int kDateElementSize = 8;
 
+// Room for an element ID, a coded size and an 8 octet value.
+const int32 kMaxElementBufferSize = 24;
+
+// Room for the BlockGroup and Block element headers, the track number, the
+// timecode and the flags that precede the frame data of a block.
+const int32 kMaxBlockHeaderSize = 2 * kMaxElementBufferSize;
+
+// Room for the BlockAdditions, BlockMore, BlockAddID and BlockAdditional
+// headers, and for the DiscardPadding, ReferenceBlock and BlockDuration
+// elements that may follow the frame data of a block.
+const int32 kMaxBlockTrailerSize = 6 * kMaxElementBufferSize;
+
+// Room for the frame count and the sizes of all but the last frame of a
+// laced block. EBML lacing needs at most 8 octets per size, and Xiph lacing
+// is only used when it is smaller.
+const int32 kMaxLaceHeaderSize = 1 + 8 * (kMaxLacedFrames - 1);
+
+// Block data up to this size is read into a buffer on the stack and written
+// together with the block header, which takes fewer system calls than a
+// copy by the kernel.
+const int64 kMaxBufferedBlockCopy = 16 * 1024;
+
+// Stores |value| in Big Endian order in the |size| octets at |buf|.
+void SerializeIntToBuffer(int64 value, int32 size, uint8* buf) {
+  for (int32 i = 1; i <= size; ++i) {
+    const int32 byte_count = size - i;
+    const int32 bit_count = byte_count * 8;
+
+    buf[i - 1] = static_cast<uint8>(value >> bit_count);
+  }
+}
+
+// Stores the EBML coded form of |value| at |buf|. |size| is the size of the
+// coded number, or 0 to use the smallest size that fits |value|. Returns the
+// number of octets stored, or 0 on error.
+int32 CodedUIntToBuffer(uint64 value, int32 size, uint8* buf) {
+  if (size < 0 || size > 8)
+    return 0;
+
+  if (size > 0) {
+    const uint64 bit = 1LL << (size * 7);
+
+    if (value > (bit - 2))
+      return 0;
+
+    value |= bit;
+  } else {
+    size = 1;
+    int64 bit;
+
+    for (;;) {
+      bit = 1LL << (size * 7);
+      const uint64 max = bit - 2;
+
+      if (value <= max)
+        break;
+
+      ++size;
+    }
+
+    if (size > 8)
+      return 0;
+
+    value |= bit;
+  }
+
+  SerializeIntToBuffer(value, size, buf);
+  return size;
+}
+
+// Calls |IMkvWriter::ElementStartNotify| for an element that starts at
+// |position| in the output, and stores the ID and the coded payload |size| of
+// the element at |buf|. Returns the number of octets stored, or 0 on error.
+int32 ElementHeaderToBuffer(IMkvWriter* writer, int64 position, uint64 type,
+                            uint64 size, uint8* buf) {
+  if (writer->ElementStartNotifyEnabled())
+    writer->ElementStartNotify(type, position);
+
+  const int32 id_size = GetUIntSize(type);
+  SerializeIntToBuffer(type, id_size, buf);
+
+  const int32 size_size =
+      CodedUIntToBuffer(size, GetCodedUIntSize(size), buf + id_size);
+  if (size_size == 0)
+    return 0;
+
+  return id_size + size_size;
+}
+
+// As above, for an element that starts at the current writer position.
+int32 ElementHeaderToBuffer(IMkvWriter* writer, uint64 type, uint64 size,
+                            uint8* buf) {
+  const int64 position =
+      writer->ElementStartNotifyEnabled() ? writer->Position() : 0;
+  return ElementHeaderToBuffer(writer, position, type, size, buf);
+}
+
+// Stores an unsigned integer element that starts at |position| at |buf|.
+// Returns the number of octets stored, or 0 on error.
+int32 UIntElementToBuffer(IMkvWriter* writer, int64 position, uint64 type,
+                          uint64 value, uint8* buf) {
+  const int32 size = GetUIntSize(value);
+  const int32 header_size =
+      ElementHeaderToBuffer(writer, position, type, size, buf);
+
+  if (header_size == 0)
+    return 0;
+
+  SerializeIntToBuffer(value, size, buf + header_size);
+  return header_size + size;
+}
+
+// Stores a signed integer element that starts at |position| at |buf|. Returns
+// the number of octets stored, or 0 on error.
+int32 IntElementToBuffer(IMkvWriter* writer, int64 position, uint64 type,
+                         int64 value, uint8* buf) {
+  const int32 size = GetIntSize(value);
+  const int32 header_size =
+      ElementHeaderToBuffer(writer, position, type, size, buf);
+
+  if (header_size == 0)
+    return 0;
+
+  SerializeIntToBuffer(value, size, buf + header_size);
+  return header_size + size;
+}
+
+// Stores the track number, timecode and flags that start the payload of a
+// Block or SimpleBlock at |buf|. Returns the number of octets stored, or 0 on
+// error.
+int32 BlockHeaderToBuffer(uint64 track_number, int64 timecode, uint8 flags,
+                          uint8* buf) {
+  const int32 track_size = CodedUIntToBuffer(track_number, 0, buf);
+
+  if (track_size == 0)
+    return 0;
+
+  SerializeIntToBuffer(timecode, 2, buf + track_size);
+  buf[track_size + 2] = flags;
+
+  return track_size + 3;
+}
+
 uint64 WriteBlock(IMkvWriter* writer, const Frame* const frame, int64 timecode,
                   uint64 timecode_scale) {
   uint64 block_additional_elem_size = 0;
@@ -87,90 +231,220 @@ uint64 WriteBlock(IMkvWriter* writer, const Frame* const frame, int64 timecode,
       block_elem_size + block_additions_elem_size + block_duration_elem_size +
       discard_padding_elem_size + reference_block_elem_size;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockGroup,
-                              block_group_payload_size)) {
-    return 0;
-  }
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlock, block_payload_size))
-    return 0;
+  // Serialize everything but the frame data and the BlockAdditional payload
+  // so that the block goes out in a single WriteV() call.
+  const int64 position =
+      writer->ElementStartNotifyEnabled() ? writer->Position() : 0;
 
-  if (WriteUInt(writer, frame->track_number()))
+  uint8 header[kMaxBlockHeaderSize];
+  int32 header_size = ElementHeaderToBuffer(writer, position, kMkvBlockGroup,
+                                            block_group_payload_size, header);
+  if (header_size == 0)
     return 0;
 
-  if (SerializeInt(writer, timecode, 2))
+  int32 size = ElementHeaderToBuffer(writer, position + header_size, kMkvBlock,
+                                     block_payload_size, header + header_size);
+  if (size == 0)
     return 0;
+  header_size += size;
 
   // For a Block, flags is always 0.
-  if (SerializeInt(writer, 0, 1))
+  size = BlockHeaderToBuffer(frame->track_number(), timecode, 0,
+                             header + header_size);
+  if (size == 0)
     return 0;
+  header_size += size;
 
-  if (writer->Write(frame->frame(), static_cast<uint32>(frame->length())))
-    return 0;
+  uint8 trailer[kMaxBlockTrailerSize];
+  int32 additions_size = 0;
+  int64 trailer_position = position + header_size + frame->length();
 
   if (frame->additional()) {
-    if (!WriteEbmlMasterElement(writer, kMkvBlockAdditions,
-                                block_additions_payload_size)) {
+    size = ElementHeaderToBuffer(writer, trailer_position, kMkvBlockAdditions,
+                                 block_additions_payload_size, trailer);
+    if (size == 0)
       return 0;
-    }
+    additions_size += size;
 
-    if (!WriteEbmlMasterElement(writer, kMkvBlockMore, block_more_payload_size))
+    size = ElementHeaderToBuffer(writer, trailer_position + additions_size,
+                                 kMkvBlockMore, block_more_payload_size,
+                                 trailer + additions_size);
+    if (size == 0)
       return 0;
+    additions_size += size;
 
-    if (!WriteEbmlElement(writer, kMkvBlockAddID, frame->add_id()))
+    size = UIntElementToBuffer(writer, trailer_position + additions_size,
+                               kMkvBlockAddID, frame->add_id(),
+                               trailer + additions_size);
+    if (size == 0)
       return 0;
+    additions_size += size;
 
-    if (!WriteEbmlElement(writer, kMkvBlockAdditional, frame->additional(),
-                          frame->additional_length())) {
+    size = ElementHeaderToBuffer(writer, trailer_position + additions_size,
+                                 kMkvBlockAdditional,
+                                 frame->additional_length(),
+                                 trailer + additions_size);
+    if (size == 0)
       return 0;
-    }
+    additions_size += size;
+
+    trailer_position += additions_size + frame->additional_length();
   }
 
-  if (frame->discard_padding() != 0 &&
-      !WriteEbmlElement(writer, kMkvDiscardPadding, frame->discard_padding())) {
-    return false;
+  int32 trailer_size = additions_size;
+
+  if (frame->discard_padding() != 0) {
+    size = IntElementToBuffer(writer, trailer_position, kMkvDiscardPadding,
+                              frame->discard_padding(), trailer + trailer_size);
+    if (size == 0)
+      return 0;
+    trailer_size += size;
+    trailer_position += size;
   }
 
-  if (!frame->is_key() &&
-      !WriteEbmlElement(writer, kMkvReferenceBlock,
-                        reference_block_timestamp)) {
-    return false;
+  if (!frame->is_key()) {
+    size = UIntElementToBuffer(writer, trailer_position, kMkvReferenceBlock,
+                               reference_block_timestamp,
+                               trailer + trailer_size);
+    if (size == 0)
+      return 0;
+    trailer_size += size;
+    trailer_position += size;
   }
 
-  if (duration > 0 && !WriteEbmlElement(writer, kMkvBlockDuration, duration)) {
-    return false;
+  if (duration > 0) {
+    size = UIntElementToBuffer(writer, trailer_position, kMkvBlockDuration,
+                               duration, trailer + trailer_size);
+    if (size == 0)
+      return 0;
+    trailer_size += size;
   }
+
+  const WriteBuffer buffers[] = {
+      {header, static_cast<uint32>(header_size)},
+      {frame->frame(), static_cast<uint32>(frame->length())},
+      {trailer, static_cast<uint32>(additions_size)},
+      {frame->additional(), static_cast<uint32>(frame->additional_length())},
+      {trailer + additions_size,
+       static_cast<uint32>(trailer_size - additions_size)}};
+
+  if (writer->WriteV(buffers, sizeof(buffers) / sizeof(buffers[0])))
+    return 0;
+
   return EbmlMasterElementSize(kMkvBlockGroup, block_group_payload_size) +
          block_group_payload_size;
 }
 
 uint64 WriteSimpleBlock(IMkvWriter* writer, const Frame* const frame,
                         int64 timecode) {
-  if (WriteID(writer, kMkvSimpleBlock))
-    return 0;
+  const uint64 size = frame->length() + 4;
 
-  const int32 size = static_cast<int32>(frame->length()) + 4;
-  if (WriteUInt(writer, size))
+  uint8 header[kMaxBlockHeaderSize];
+  int32 header_size =
+      ElementHeaderToBuffer(writer, kMkvSimpleBlock, size, header);
+  if (header_size == 0)
     return 0;
 
-  if (WriteUInt(writer, static_cast<uint64>(frame->track_number())))
+  const uint8 flags = frame->is_key() ? 0x80 : 0;
+  const int32 block_header_size = BlockHeaderToBuffer(
+      frame->track_number(), timecode, flags, header + header_size);
+  if (block_header_size == 0)
     return 0;
+  header_size += block_header_size;
+
+  const WriteBuffer buffers[] = {
+      {header, static_cast<uint32>(header_size)},
+      {frame->frame(), static_cast<uint32>(frame->length())}};
 
-  if (SerializeInt(writer, timecode, 2))
+  if (writer->WriteV(buffers, 2))
     return 0;
 
-  uint64 flags = 0;
-  if (frame->is_key())
-    flags |= 0x80;
+  return GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + 4 +
+         frame->length();
+}
 
-  if (SerializeInt(writer, flags, 1))
-    return 0;
+// Returns the size of the shortest EBML lace coding of the signed difference
+// |value|, or 0 if it does not fit in 8 octets.
+int32 GetCodedIntSize(int64 value) {
+  for (int32 size = 1; size <= 8; ++size) {
+    const int64 max = (1LL << (size * 7 - 1)) - 1;
+    if (value >= -max && value <= max)
+      return size;
+  }
+  return 0;
+}
+
+// Stores the lace header for |frames| at |buf| and the lacing bits of the
+// block flags in |lacing|. Fixed-size lacing is used when the frames are all
+// the same size, otherwise the smaller of Xiph and EBML lacing. Returns the
+// number of octets stored, or 0 on error.
+int32 LaceHeaderToBuffer(const Frame* const* frames, int32 frame_count,
+                         uint8* lacing, uint8* buf) {
+  bool fixed = true;
+  uint64 xiph_size = 1;
+  uint64 ebml_size = 1 + GetCodedUIntSize(frames[0]->length());
+
+  // The size of the last frame follows from the block size.
+  for (int32 i = 0; i < frame_count - 1; ++i) {
+    const uint64 length = frames[i]->length();
+    xiph_size += length / 255 + 1;
+
+    if (frames[i + 1]->length() != length)
+      fixed = false;
+
+    if (i > 0) {
+      const int32 size =
+          GetCodedIntSize(static_cast<int64>(length - frames[i - 1]->length()));
+      if (size == 0)
+        return 0;
+      ebml_size += size;
+    }
+  }
+
+  buf[0] = static_cast<uint8>(frame_count - 1);
+
+  if (fixed) {
+    *lacing = 0x04;
+    return 1;
+  }
+
+  int32 size = 1;
+
+  if (xiph_size <= ebml_size) {
+    *lacing = 0x02;
+
+    for (int32 i = 0; i < frame_count - 1; ++i) {
+      uint64 length = frames[i]->length();
+
+      for (; length >= 255; length -= 255)
+        buf[size++] = 255;
+      buf[size++] = static_cast<uint8>(length);
+    }
 
-  if (writer->Write(frame->frame(), static_cast<uint32>(frame->length())))
+    return size;
+  }
+
+  *lacing = 0x06;
+
+  const int32 first_size = CodedUIntToBuffer(
+      frames[0]->length(), GetCodedUIntSize(frames[0]->length()), buf + size);
+  if (first_size == 0)
     return 0;
+  size += first_size;
 
-  return GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + 4 +
-         frame->length();
+  for (int32 i = 1; i < frame_count - 1; ++i) {
+    const int64 difference =
+        static_cast<int64>(frames[i]->length() - frames[i - 1]->length());
+    const int32 difference_size = GetCodedIntSize(difference);
+
+    // Signed values are stored with a bias that makes them non-negative.
+    const uint64 bias = (1ULL << (difference_size * 7 - 1)) - 1;
+    if (!CodedUIntToBuffer(difference + bias, difference_size, buf + size))
+      return 0;
+    size += difference_size;
+  }
+
+  return size;
 }
 
 }  // namespace
@@ -316,18 +590,13 @@ int32 SerializeInt(IMkvWriter* writer, int64 value, int32 size) {
   if (!writer || size < 1 || size > 8)
     return -1;
 
-  for (int32 i = 1; i <= size; ++i) {
-    const int32 byte_count = size - i;
-    const int32 bit_count = byte_count * 8;
-
-    const int64 bb = value >> bit_count;
-    const uint8 b = static_cast<uint8>(bb);
+  uint8 buf[8];
+  SerializeIntToBuffer(value, size, buf);
 
-    const int32 status = writer->Write(&b, 1);
+  const int32 status = writer->Write(buf, size);
 
-    if (status < 0)
-      return status;
-  }
+  if (status < 0)
+    return status;
 
   return 0;
 }
@@ -345,17 +614,13 @@ int32 SerializeFloat(IMkvWriter* writer, float f) {
   } value;
   value.f = f;
 
-  for (int32 i = 1; i <= 4; ++i) {
-    const int32 byte_count = 4 - i;
-    const int32 bit_count = byte_count * 8;
-
-    const uint8 byte = static_cast<uint8>(value.u32 >> bit_count);
+  uint8 buf[4];
+  SerializeIntToBuffer(value.u32, 4, buf);
 
-    const int32 status = writer->Write(&byte, 1);
+  const int32 status = writer->Write(buf, 4);
 
-    if (status < 0)
-      return status;
-  }
+  if (status < 0)
+    return status;
 
   return 0;
 }
@@ -373,41 +638,26 @@ int32 WriteUIntSize(IMkvWriter* writer, uint64 value, int32 size) {
   if (!writer || size < 0 || size > 8)
     return -1;
 
-  if (size > 0) {
-    const uint64 bit = 1LL << (size * 7);
-
-    if (value > (bit - 2))
-      return -1;
-
-    value |= bit;
-  } else {
-    size = 1;
-    int64 bit;
+  uint8 buf[8];
+  const int32 coded_size = CodedUIntToBuffer(value, size, buf);
 
-    for (;;) {
-      bit = 1LL << (size * 7);
-      const uint64 max = bit - 2;
-
-      if (value <= max)
-        break;
-
-      ++size;
-    }
+  if (coded_size == 0)
+    return -1;
 
-    if (size > 8)
-      return false;
+  const int32 status = writer->Write(buf, coded_size);
 
-    value |= bit;
-  }
+  if (status < 0)
+    return status;
 
-  return SerializeInt(writer, value, size);
+  return 0;
 }
 
 int32 WriteID(IMkvWriter* writer, uint64 type) {
   if (!writer)
     return -1;
 
-  writer->ElementStartNotify(type, writer->Position());
+  if (writer->ElementStartNotifyEnabled())
+    writer->ElementStartNotify(type, writer->Position());
 
   const int32 size = GetUIntSize(type);
 
@@ -418,10 +668,13 @@ bool WriteEbmlMasterElement(IMkvWriter* writer, uint64 type, uint64 size) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
+  uint8 buf[kMaxElementBufferSize];
+  const int32 header_size = ElementHeaderToBuffer(writer, type, size, buf);
+
+  if (header_size == 0)
     return false;
 
-  if (WriteUInt(writer, size))
+  if (writer->Write(buf, header_size))
     return false;
 
   return true;
@@ -431,14 +684,16 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, uint64 value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
+  const int64 position =
+      writer->ElementStartNotifyEnabled() ? writer->Position() : 0;
 
-  const uint64 size = GetUIntSize(value);
-  if (WriteUInt(writer, size))
+  uint8 buf[kMaxElementBufferSize];
+  const int32 size = UIntElementToBuffer(writer, position, type, value, buf);
+
+  if (size == 0)
     return false;
 
-  if (SerializeInt(writer, value, static_cast<int32>(size)))
+  if (writer->Write(buf, size))
     return false;
 
   return true;
@@ -448,14 +703,16 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, int64 value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return 0;
+  const int64 position =
+      writer->ElementStartNotifyEnabled() ? writer->Position() : 0;
 
-  const uint64 size = GetIntSize(value);
-  if (WriteUInt(writer, size))
+  uint8 buf[kMaxElementBufferSize];
+  const int32 size = IntElementToBuffer(writer, position, type, value, buf);
+
+  if (size == 0)
     return false;
 
-  if (SerializeInt(writer, value, static_cast<int32>(size)))
+  if (writer->Write(buf, size))
     return false;
 
   return true;
@@ -465,13 +722,23 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, float value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
+  uint8 buf[kMaxElementBufferSize];
+  const int32 header_size = ElementHeaderToBuffer(writer, type, 4, buf);
 
-  if (WriteUInt(writer, 4))
+  if (header_size == 0)
     return false;
 
-  if (SerializeFloat(writer, value))
+  // This union is merely used to avoid a reinterpret_cast from float& to
+  // uint32& which will result in violation of strict aliasing.
+  union U32 {
+    uint32 u32;
+    float f;
+  } bits;
+  bits.f = value;
+
+  SerializeIntToBuffer(bits.u32, 4, buf + header_size);
+
+  if (writer->Write(buf, header_size + 4))
     return false;
 
   return true;
@@ -481,11 +748,15 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, const char* value) {
   if (!writer || !value)
     return false;
 
-  if (WriteID(writer, type))
+  const uint64 length = strlen(value);
+
+  uint8 buf[kMaxElementBufferSize];
+  const int32 header_size = ElementHeaderToBuffer(writer, type, length, buf);
+
+  if (header_size == 0)
     return false;
 
-  const uint64 length = strlen(value);
-  if (WriteUInt(writer, length))
+  if (writer->Write(buf, header_size))
     return false;
 
   if (writer->Write(value, static_cast<const uint32>(length)))
@@ -499,10 +770,13 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, const uint8* value,
   if (!writer || !value || size < 1)
     return false;
 
-  if (WriteID(writer, type))
+  uint8 buf[kMaxElementBufferSize];
+  const int32 header_size = ElementHeaderToBuffer(writer, type, size, buf);
+
+  if (header_size == 0)
     return false;
 
-  if (WriteUInt(writer, size))
+  if (writer->Write(buf, header_size))
     return false;
 
   if (writer->Write(value, static_cast<uint32>(size)))
@@ -515,13 +789,16 @@ bool WriteEbmlDateElement(IMkvWriter* writer, uint64 type, int64 value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
+  uint8 buf[kMaxElementBufferSize];
+  const int32 header_size =
+      ElementHeaderToBuffer(writer, type, kDateElementSize, buf);
 
-  if (WriteUInt(writer, kDateElementSize))
+  if (header_size == 0)
     return false;
 
-  if (SerializeInt(writer, value, kDateElementSize))
+  SerializeIntToBuffer(value, kDateElementSize, buf + header_size);
+
+  if (writer->Write(buf, header_size + kDateElementSize))
     return false;
 
   return true;
@@ -548,6 +825,129 @@ uint64 WriteFrame(IMkvWriter* writer, const Frame* const frame,
                         cluster->timecode_scale());
 }
 
+uint64 WriteLacedFrames(IMkvWriter* writer, const Frame* const* frames,
+                        int32 frame_count, Cluster* cluster) {
+  if (!writer || !frames || frame_count < 2 || frame_count > kMaxLacedFrames ||
+      !cluster || !cluster->timecode_scale())
+    return 0;
+
+  const Frame* const first = frames[0];
+  uint64 frames_size = 0;
+
+  for (int32 i = 0; i < frame_count; ++i) {
+    const Frame* const frame = frames[i];
+    if (!frame || !frame->IsValid() || !frame->CanBeSimpleBlock() ||
+        frame->track_number() != first->track_number() ||
+        frame->is_key() != first->is_key())
+      return 0;
+    frames_size += frame->length();
+  }
+
+  // The block takes the timecode of the first frame.
+  const int64 relative_timecode = cluster->GetRelativeTimecode(
+      first->timestamp() / cluster->timecode_scale());
+  if (relative_timecode < 0 || relative_timecode > kMaxBlockTimecode)
+    return 0;
+
+  uint8 lace_header[kMaxLaceHeaderSize];
+  uint8 lacing = 0;
+  const int32 lace_header_size =
+      LaceHeaderToBuffer(frames, frame_count, &lacing, lace_header);
+  if (lace_header_size == 0)
+    return 0;
+
+  const uint64 size = 4 + lace_header_size + frames_size;
+
+  uint8 header[kMaxBlockHeaderSize];
+  int32 header_size =
+      ElementHeaderToBuffer(writer, kMkvSimpleBlock, size, header);
+  if (header_size == 0)
+    return 0;
+
+  const uint8 flags = (first->is_key() ? 0x80 : 0) | lacing;
+  const int32 block_header_size = BlockHeaderToBuffer(
+      first->track_number(), relative_timecode, flags, header + header_size);
+  if (block_header_size == 0)
+    return 0;
+  header_size += block_header_size;
+
+  WriteBuffer buffers[kMaxLacedFrames + 2];
+  buffers[0].data = header;
+  buffers[0].length = static_cast<uint32>(header_size);
+  buffers[1].data = lace_header;
+  buffers[1].length = static_cast<uint32>(lace_header_size);
+
+  for (int32 i = 0; i < frame_count; ++i) {
+    buffers[i + 2].data = frames[i]->frame();
+    buffers[i + 2].length = static_cast<uint32>(frames[i]->length());
+  }
+
+  if (writer->WriteV(buffers, frame_count + 2))
+    return 0;
+
+  return GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + size;
+}
+
+uint64 WriteBlockFromReader(IMkvWriter* writer, mkvparser::IMkvReader* reader,
+                            const mkvparser::Block* block, uint64 track_number,
+                            uint64 timestamp, Cluster* cluster) {
+  if (!writer || !reader || !block || !cluster || !cluster->timecode_scale())
+    return 0;
+
+  const int64 relative_timecode =
+      cluster->GetRelativeTimecode(timestamp / cluster->timecode_scale());
+  if (relative_timecode < 0 || relative_timecode > kMaxBlockTimecode)
+    return 0;
+
+  // The source block starts with its track number, the timecode and the
+  // flags, which are replaced. Everything after them is copied.
+  long track_size = 0;  // NOLINT
+  if (mkvparser::ReadUInt(reader, block->m_start, track_size) <= 0)
+    return 0;
+
+  const int64 data_start = block->m_start + track_size + 3;
+  const int64 data_size = block->m_size - track_size - 3;
+  if (data_size <= 0)
+    return 0;
+
+  uint8 flags = static_cast<uint8>(block->GetLacing() << 1);
+  if (block->IsKey())
+    flags |= 0x80;
+  if (block->IsInvisible())
+    flags |= 0x08;
+
+  const uint64 size = GetCodedUIntSize(track_number) + 3 + data_size;
+
+  uint8 header[kMaxBlockHeaderSize];
+  int32 header_size =
+      ElementHeaderToBuffer(writer, kMkvSimpleBlock, size, header);
+  if (header_size == 0)
+    return 0;
+
+  const int32 block_header_size = BlockHeaderToBuffer(
+      track_number, relative_timecode, flags, header + header_size);
+  if (block_header_size == 0)
+    return 0;
+  header_size += block_header_size;
+
+  if (data_size <= kMaxBufferedBlockCopy) {
+    uint8 data[kMaxBufferedBlockCopy];
+    if (reader->Read(data_start, static_cast<long>(data_size), data))  // NOLINT
+      return 0;
+
+    const WriteBuffer buffers[] = {
+        {header, static_cast<uint32>(header_size)},
+        {data, static_cast<uint32>(data_size)}};
+    if (writer->WriteV(buffers, 2))
+      return 0;
+  } else if (writer->Write(header, header_size) ||
+             !ChunkedCopy(reader, writer, data_start, data_size)) {
+    return 0;
+  }
+
+  return GetUIntSize(kMkvSimpleBlock) + GetCodedUIntSize(size) + size;
+}
+
 uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
   if (!writer)
     return false;
@@ -570,10 +970,17 @@ uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
   if (WriteUInt(writer, void_entry_size))
     return 0;
 
-  const uint8 value = 0;
-  for (int32 i = 0; i < static_cast<int32>(void_entry_size); ++i) {
-    if (writer->Write(&value, 1))
+  uint8 zeros[256];
+  memset(zeros, 0, sizeof(zeros));
+
+  uint64 remaining = void_entry_size;
+  while (remaining > 0) {
+    const uint32 length = (remaining > sizeof(zeros))
+                              ? static_cast<uint32>(sizeof(zeros))
+                              : static_cast<uint32>(remaining);
+    if (writer->Write(zeros, length))
       return 0;
+    remaining -= length;
   }
 
   const int64 stop_position = writer->Position();
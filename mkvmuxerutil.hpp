@@ -47,8 +47,8 @@ int32 WriteUIntSize(IMkvWriter* writer, uint64 value, int32 size);
 // Output an Mkv master element. Returns true if the element was written.
 bool WriteEbmlMasterElement(IMkvWriter* writer, uint64 value, uint64 size);
 
-// Outputs an Mkv ID, calls |IMkvWriter::ElementStartNotify|, and passes the
-// ID to |SerializeInt|. Returns 0 on success.
+// Outputs an Mkv ID, calls |IMkvWriter::ElementStartNotify| if the writer has
+// enabled it, and passes the ID to |SerializeInt|. Returns 0 on success.
 int32 WriteID(IMkvWriter* writer, uint64 type);
 
 // Output an Mkv non-master element. Returns true if the element was written.
@@ -65,6 +65,25 @@ bool WriteEbmlDateElement(IMkvWriter* writer, uint64 type, int64 value);
 uint64 WriteFrame(IMkvWriter* writer, const Frame* const frame,
                   Cluster* cluster);
 
+// Outputs |frame_count| frames of one track as a single laced SimpleBlock
+// with the timecode of the first frame. The frames must all be able to go in
+// a SimpleBlock and have the same key frame flag. |frame_count| must be in
+// the range [2, kMaxLacedFrames]. Returns the size of the SimpleBlock, or 0
+// on error.
+uint64 WriteLacedFrames(IMkvWriter* writer, const Frame* const* frames,
+                        int32 frame_count, Cluster* cluster);
+
+// Outputs |block|, read from |reader|, as a SimpleBlock of |track_number|
+// with the timestamp |timestamp|, expressed in nanoseconds. The key frame,
+// invisible and lacing flags are kept. Only the block header is rebuilt: the
+// lace header and the frame data are copied from |reader| as they are with
+// ChunkedCopy(), by the kernel when |writer| allows it (see
+// MkvWriter::set_kernel_copy_source()). Returns the size of the SimpleBlock,
+// or 0 on error.
+uint64 WriteBlockFromReader(IMkvWriter* writer, mkvparser::IMkvReader* reader,
+                            const mkvparser::Block* block, uint64 track_number,
+                            uint64 timestamp, Cluster* cluster);
+
 // Output a void element. |size| must be the entire size in bytes that will be
 // void. The function will calculate the size of the void header and subtract
 // it from |size|.
@@ -16,9 +16,14 @@
 #include <cassert>
 #include <climits>
 #include <cmath>
+#include <cstddef>
 #include <cstring>
 #include <new>
 
+#ifdef MKVPARSER_ENABLE_STATS
+#include <chrono>
+#endif
+
 #include "webmids.hpp"
 
 #ifdef _MSC_VER
@@ -38,6 +43,150 @@ inline bool isinf(double val) { return std::isinf(val); }
 
 IMkvReader::~IMkvReader() {}
 
+SegmentStats::SegmentStats() { Init(); }
+
+void SegmentStats::Init() {
+  for (int i = 0; i < kReadSiteCount; ++i) {
+    read_calls[i] = 0;
+    read_bytes[i] = 0;
+  }
+
+  clusters_parsed = 0;
+  blocks_parsed = 0;
+
+  for (int i = 0; i < 4; ++i)
+    blocks_by_lacing[i] = 0;
+
+  allocations = 0;
+
+  parse_headers_time = 0;
+  load_cluster_time = 0;
+  cues_load_time = 0;
+}
+
+namespace {
+
+#ifdef MKVPARSER_ENABLE_STATS
+// Call site of the reads made on this thread. The EBML integer readers set it
+// for the duration of their reads, whichever reader they are given, so that
+// the reader of a Segment does not have to be told apart from others.
+thread_local int g_read_site = SegmentStats::kReadPayload;
+
+// Reader installed between a Segment and the client's reader when statistics
+// are enabled. Reads are attributed to |g_read_site|.
+class StatsReader : public IMkvReader {
+  StatsReader(const StatsReader&);
+  StatsReader& operator=(const StatsReader&);
+
+ public:
+  explicit StatsReader(IMkvReader* pReader) : m_pReader(pReader) {}
+  virtual ~StatsReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    ++m_stats.read_calls[g_read_site];
+    m_stats.read_bytes[g_read_site] += len;
+    return m_pReader->Read(pos, len, buf);
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    return m_pReader->Length(total, available);
+  }
+
+  IMkvReader* const m_pReader;
+  SegmentStats m_stats;
+};
+
+// Attributes reads made on this thread to |site| while in scope.
+class ReadSiteScope {
+  ReadSiteScope(const ReadSiteScope&);
+  ReadSiteScope& operator=(const ReadSiteScope&);
+
+ public:
+  explicit ReadSiteScope(int site) : m_prev_site(g_read_site) {
+    g_read_site = site;
+  }
+
+  ~ReadSiteScope() { g_read_site = m_prev_site; }
+
+ private:
+  const int m_prev_site;
+};
+
+SegmentStats* MutableStats(const Segment* pSegment) {
+  if (pSegment == NULL)
+    return NULL;
+
+  return const_cast<SegmentStats*>(pSegment->GetStats());
+}
+
+// Adds the time spent in scope to |*pSegment->GetStats().*counter|.
+class StatsTimer {
+  StatsTimer(const StatsTimer&);
+  StatsTimer& operator=(const StatsTimer&);
+
+ public:
+  StatsTimer(const Segment* pSegment, long long SegmentStats::*counter)
+      : m_pStats(MutableStats(pSegment)),
+        m_counter(counter),
+        m_start(std::chrono::steady_clock::now()) {}
+
+  ~StatsTimer() {
+    if (m_pStats == NULL)
+      return;
+
+    const std::chrono::steady_clock::duration elapsed =
+        std::chrono::steady_clock::now() - m_start;
+    m_pStats->*m_counter +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  }
+
+ private:
+  SegmentStats* const m_pStats;
+  long long SegmentStats::*const m_counter;
+  const std::chrono::steady_clock::time_point m_start;
+};
+
+void CountAllocation(const Segment* pSegment) {
+  SegmentStats* const pStats = MutableStats(pSegment);
+
+  if (pStats)
+    ++pStats->allocations;
+}
+
+void CountCluster(const Segment* pSegment) {
+  SegmentStats* const pStats = MutableStats(pSegment);
+
+  if (pStats)
+    ++pStats->clusters_parsed;
+}
+
+void CountBlock(const Segment* pSegment, int lacing) {
+  SegmentStats* const pStats = MutableStats(pSegment);
+
+  if (pStats) {
+    ++pStats->blocks_parsed;
+    ++pStats->blocks_by_lacing[lacing & 3];
+  }
+}
+#else
+// Without MKVPARSER_ENABLE_STATS the instrumentation compiles to nothing.
+class ReadSiteScope {
+ public:
+  explicit ReadSiteScope(int) {}
+};
+
+class StatsTimer {
+ public:
+  StatsTimer(const Segment*, long long SegmentStats::*) {}
+};
+
+inline void CountAllocation(const Segment*) {}
+inline void CountCluster(const Segment*) {}
+inline void CountBlock(const Segment*, int) {}
+#endif  // MKVPARSER_ENABLE_STATS
+
+}  // namespace
+
 template <typename Type>
 Type* SafeArrayAlloc(unsigned long long num_elements,
                      unsigned long long element_size) {
@@ -65,6 +214,8 @@ long long ReadUInt(IMkvReader* pReader, long long pos, long& len) {
   if (!pReader || pos < 0)
     return E_FILE_FORMAT_INVALID;
 
+  const ReadSiteScope site(SegmentStats::kReadSize);
+
   len = 1;
   unsigned char b;
   int status = pReader->Read(pos, 1, &b);
@@ -121,6 +272,8 @@ long long ReadID(IMkvReader* pReader, long long pos, long& len) {
   if (pReader == NULL || pos < 0)
     return E_FILE_FORMAT_INVALID;
 
+  const ReadSiteScope site(SegmentStats::kReadId);
+
   // Read the first byte. The length in bytes of the ID is determined by
   // finding the first set bit in the first byte of the ID.
   unsigned char temp_byte = 0;
@@ -181,6 +334,8 @@ long long GetUIntLength(IMkvReader* pReader, long long pos, long& len) {
   if (status < 0 || (total >= 0 && available > total))
     return E_FILE_FORMAT_INVALID;
 
+  const ReadSiteScope site(SegmentStats::kReadLength);
+
   len = 1;
 
   if (pos >= available)
@@ -489,6 +644,488 @@ bool Match(IMkvReader* pReader, long long& pos, unsigned long expected_id,
   return true;
 }
 
+namespace {
+
+// Payload types understood by ParseElementFields().
+enum ElementType {
+  kTypeUInt,  // long long; values with the high bit set are rejected
+  kTypeUID,  // unsigned long long, all 64 bits
+  kTypeInt,  // long long
+  kTypeFloat,  // double
+  kTypeString,  // char*, NUL terminated, owned by the caller on success
+  kTypeBinary,  // ElementBinary, owned by the caller on success
+  kTypeMaster,  // ElementRange; the payload is not decoded
+  kTypeCount  // long; number of occurrences
+};
+
+// Constraint applied to decoded values. kCheckSkipEmpty ignores children
+// with an empty payload, so the field keeps its previous value.
+enum ElementCheck {
+  kCheckNone,
+  kCheckPositive,
+  kCheckNonNegative,
+  kCheckSkipEmpty
+};
+
+struct ElementBinary {
+  unsigned char* data;
+  size_t size;
+};
+
+struct ElementRange {
+  long long start;  // absolute position of the payload
+  long long size;
+};
+
+// One schema entry: element |id| found inside a |parent| master element is
+// decoded as |type| into the field at |offset| of the parent's fields struct.
+struct ElementSchema {
+  unsigned long id;
+  unsigned long parent;
+  ElementType type;
+  ElementCheck check;
+  size_t offset;
+};
+
+// Fields structs, one per parent element. Their initial values are the
+// element defaults.
+struct SegmentInfoFields {
+  long long timecode_scale;
+  double duration;
+  char* muxing_app;
+  char* writing_app;
+  char* title;
+};
+
+struct TrackEntryFields {
+  ElementRange video;
+  ElementRange audio;
+  ElementRange content_encodings;
+  unsigned long long uid;
+  long long number;
+  long long type;
+  long long default_duration;
+  long long lacing;
+  long long codec_delay;
+  long long seek_pre_roll;
+  char* name;
+  char* language;
+  char* codec_id;
+  char* codec_name;
+  ElementBinary codec_private;
+};
+
+struct VideoFields {
+  long long width;
+  long long height;
+  long long display_width;
+  long long display_height;
+  long long display_unit;
+  long long stereo_mode;
+  double rate;
+};
+
+struct AudioFields {
+  double rate;
+  long long channels;
+  long long bit_depth;
+};
+
+struct CuePointFields {
+  long long time;
+  long track_positions;
+};
+
+struct CueTrackPositionsFields {
+  long long track;
+  long long cluster_position;
+  long long block_number;
+};
+
+struct ChapterDisplayFields {
+  char* string;
+  char* language;
+  char* country;
+};
+
+struct SimpleTagFields {
+  char* name;
+  char* string;
+};
+
+#define MKVPARSER_FIELD(type, field) offsetof(type, field)
+
+const ElementSchema kElementSchema[] = {
+    // Segment Information
+    {mkvmuxer::kMkvTimecodeScale, mkvmuxer::kMkvInfo, kTypeUInt,
+     kCheckPositive, MKVPARSER_FIELD(SegmentInfoFields, timecode_scale)},
+    {mkvmuxer::kMkvDuration, mkvmuxer::kMkvInfo, kTypeFloat,
+     kCheckNonNegative, MKVPARSER_FIELD(SegmentInfoFields, duration)},
+    {mkvmuxer::kMkvMuxingApp, mkvmuxer::kMkvInfo, kTypeString, kCheckNone,
+     MKVPARSER_FIELD(SegmentInfoFields, muxing_app)},
+    {mkvmuxer::kMkvWritingApp, mkvmuxer::kMkvInfo, kTypeString, kCheckNone,
+     MKVPARSER_FIELD(SegmentInfoFields, writing_app)},
+    {mkvmuxer::kMkvTitle, mkvmuxer::kMkvInfo, kTypeString, kCheckNone,
+     MKVPARSER_FIELD(SegmentInfoFields, title)},
+
+    // TrackEntry
+    {mkvmuxer::kMkvVideo, mkvmuxer::kMkvTrackEntry, kTypeMaster, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, video)},
+    {mkvmuxer::kMkvAudio, mkvmuxer::kMkvTrackEntry, kTypeMaster, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, audio)},
+    {mkvmuxer::kMkvContentEncodings, mkvmuxer::kMkvTrackEntry, kTypeMaster,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, content_encodings)},
+    {mkvmuxer::kMkvTrackUID, mkvmuxer::kMkvTrackEntry, kTypeUID, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, uid)},
+    {mkvmuxer::kMkvTrackNumber, mkvmuxer::kMkvTrackEntry, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, number)},
+    {mkvmuxer::kMkvTrackType, mkvmuxer::kMkvTrackEntry, kTypeUInt, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, type)},
+    {mkvmuxer::kMkvDefaultDuration, mkvmuxer::kMkvTrackEntry, kTypeUInt,
+     kCheckNonNegative, MKVPARSER_FIELD(TrackEntryFields, default_duration)},
+    {mkvmuxer::kMkvFlagLacing, mkvmuxer::kMkvTrackEntry, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, lacing)},
+    {mkvmuxer::kMkvCodecDelay, mkvmuxer::kMkvTrackEntry, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, codec_delay)},
+    {mkvmuxer::kMkvSeekPreRoll, mkvmuxer::kMkvTrackEntry, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, seek_pre_roll)},
+    {mkvmuxer::kMkvName, mkvmuxer::kMkvTrackEntry, kTypeString, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, name)},
+    {mkvmuxer::kMkvLanguage, mkvmuxer::kMkvTrackEntry, kTypeString,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, language)},
+    {mkvmuxer::kMkvCodecID, mkvmuxer::kMkvTrackEntry, kTypeString, kCheckNone,
+     MKVPARSER_FIELD(TrackEntryFields, codec_id)},
+    {mkvmuxer::kMkvCodecName, mkvmuxer::kMkvTrackEntry, kTypeString,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, codec_name)},
+    {mkvmuxer::kMkvCodecPrivate, mkvmuxer::kMkvTrackEntry, kTypeBinary,
+     kCheckNone, MKVPARSER_FIELD(TrackEntryFields, codec_private)},
+
+    // Video
+    {mkvmuxer::kMkvPixelWidth, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckPositive, MKVPARSER_FIELD(VideoFields, width)},
+    {mkvmuxer::kMkvPixelHeight, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckPositive, MKVPARSER_FIELD(VideoFields, height)},
+    {mkvmuxer::kMkvDisplayWidth, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckPositive, MKVPARSER_FIELD(VideoFields, display_width)},
+    {mkvmuxer::kMkvDisplayHeight, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckPositive, MKVPARSER_FIELD(VideoFields, display_height)},
+    {mkvmuxer::kMkvDisplayUnit, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckNonNegative, MKVPARSER_FIELD(VideoFields, display_unit)},
+    {mkvmuxer::kMkvStereoMode, mkvmuxer::kMkvVideo, kTypeUInt,
+     kCheckNonNegative, MKVPARSER_FIELD(VideoFields, stereo_mode)},
+    {mkvmuxer::kMkvFrameRate, mkvmuxer::kMkvVideo, kTypeFloat, kCheckPositive,
+     MKVPARSER_FIELD(VideoFields, rate)},
+
+    // Audio
+    {mkvmuxer::kMkvSamplingFrequency, mkvmuxer::kMkvAudio, kTypeFloat,
+     kCheckPositive, MKVPARSER_FIELD(AudioFields, rate)},
+    {mkvmuxer::kMkvChannels, mkvmuxer::kMkvAudio, kTypeUInt, kCheckPositive,
+     MKVPARSER_FIELD(AudioFields, channels)},
+    {mkvmuxer::kMkvBitDepth, mkvmuxer::kMkvAudio, kTypeUInt, kCheckPositive,
+     MKVPARSER_FIELD(AudioFields, bit_depth)},
+
+    // CuePoint
+    {mkvmuxer::kMkvCueTime, mkvmuxer::kMkvCuePoint, kTypeUInt,
+     kCheckNonNegative, MKVPARSER_FIELD(CuePointFields, time)},
+    {mkvmuxer::kMkvCueTrackPositions, mkvmuxer::kMkvCuePoint, kTypeCount,
+     kCheckNone, MKVPARSER_FIELD(CuePointFields, track_positions)},
+
+    // CueTrackPositions
+    {mkvmuxer::kMkvCueTrack, mkvmuxer::kMkvCueTrackPositions, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(CueTrackPositionsFields, track)},
+    {mkvmuxer::kMkvCueClusterPosition, mkvmuxer::kMkvCueTrackPositions,
+     kTypeUInt, kCheckNone,
+     MKVPARSER_FIELD(CueTrackPositionsFields, cluster_position)},
+    {mkvmuxer::kMkvCueBlockNumber, mkvmuxer::kMkvCueTrackPositions, kTypeUInt,
+     kCheckNone, MKVPARSER_FIELD(CueTrackPositionsFields, block_number)},
+
+    // ChapterDisplay
+    {mkvmuxer::kMkvChapString, mkvmuxer::kMkvChapterDisplay, kTypeString,
+     kCheckSkipEmpty, MKVPARSER_FIELD(ChapterDisplayFields, string)},
+    {mkvmuxer::kMkvChapLanguage, mkvmuxer::kMkvChapterDisplay, kTypeString,
+     kCheckSkipEmpty, MKVPARSER_FIELD(ChapterDisplayFields, language)},
+    {mkvmuxer::kMkvChapCountry, mkvmuxer::kMkvChapterDisplay, kTypeString,
+     kCheckSkipEmpty, MKVPARSER_FIELD(ChapterDisplayFields, country)},
+
+    // SimpleTag
+    {mkvmuxer::kMkvTagName, mkvmuxer::kMkvSimpleTag, kTypeString,
+     kCheckSkipEmpty, MKVPARSER_FIELD(SimpleTagFields, name)},
+    {mkvmuxer::kMkvTagString, mkvmuxer::kMkvSimpleTag, kTypeString,
+     kCheckSkipEmpty, MKVPARSER_FIELD(SimpleTagFields, string)},
+};
+
+#undef MKVPARSER_FIELD
+
+const size_t kElementSchemaSize =
+    sizeof(kElementSchema) / sizeof(kElementSchema[0]);
+
+const ElementSchema* FindElementSchema(unsigned long parent,
+                                       unsigned long id) {
+  for (size_t i = 0; i < kElementSchemaSize; ++i) {
+    const ElementSchema& e = kElementSchema[i];
+
+    if (e.id == id && e.parent == parent)
+      return &e;
+  }
+
+  return NULL;
+}
+
+template <typename T>
+T& FieldAt(void* fields, size_t offset) {
+  return *reinterpret_cast<T*>(static_cast<unsigned char*>(fields) + offset);
+}
+
+// Frees the strings and buffers of |parent|'s entries stored in |fields|.
+void ReleaseElementFields(unsigned long parent, void* fields) {
+  for (size_t i = 0; i < kElementSchemaSize; ++i) {
+    const ElementSchema& e = kElementSchema[i];
+
+    if (e.parent != parent)
+      continue;
+
+    if (e.type == kTypeString) {
+      char*& str = FieldAt<char*>(fields, e.offset);
+      delete[] str;
+      str = NULL;
+    } else if (e.type == kTypeBinary) {
+      ElementBinary& bin = FieldAt<ElementBinary>(fields, e.offset);
+      delete[] bin.data;
+      bin.data = NULL;
+      bin.size = 0;
+    }
+  }
+}
+
+// Reads an EBML variable size integer from |buf|. |is_id| keeps the length
+// marker bits and limits the length to 4 bytes, as ReadID() does. Returns the
+// value, or E_FILE_FORMAT_INVALID.
+long long DecodeVarInt(const unsigned char* buf, long long avail, bool is_id,
+                       long& len) {
+  if (avail < 1 || buf[0] == 0)
+    return E_FILE_FORMAT_INVALID;
+
+  const unsigned char b = buf[0];
+  unsigned char m = 0x80;
+  len = 1;
+
+  while (!(b & m)) {
+    m >>= 1;
+    ++len;
+  }
+
+  if ((is_id && len > 4) || len > avail)
+    return E_FILE_FORMAT_INVALID;
+
+  long long result = is_id ? b : (b & ~m);
+
+  for (long i = 1; i < len; ++i) {
+    result <<= 8;
+    result |= buf[i];
+  }
+
+  return result;
+}
+
+long DecodeElementField(const ElementSchema& e, const unsigned char* buf,
+                        long long size, long long start, void* fields) {
+  switch (e.type) {
+    case kTypeUInt:
+    case kTypeUID:
+    case kTypeInt: {
+      // A UID may be empty; other integers follow UnserializeUInt().
+      if (size > 8 || (size < 1 && e.type != kTypeUID))
+        return E_FILE_FORMAT_INVALID;
+
+      unsigned long long value =
+          (e.type == kTypeInt && (buf[0] & 0x80)) ? ~0ULL : 0;
+
+      for (long long i = 0; i < size; ++i)
+        value = (value << 8) | buf[i];
+
+      if (e.type == kTypeUID) {
+        FieldAt<unsigned long long>(fields, e.offset) = value;
+        return 0;
+      }
+
+      const long long v = static_cast<long long>(value);
+
+      if (e.type == kTypeUInt && v < 0)
+        return E_FILE_FORMAT_INVALID;
+
+      if ((e.check == kCheckPositive && v <= 0) ||
+          (e.check == kCheckNonNegative && v < 0)) {
+        return E_FILE_FORMAT_INVALID;
+      }
+
+      FieldAt<long long>(fields, e.offset) = v;
+      return 0;
+    }
+
+    case kTypeFloat: {
+      if (size != 4 && size != 8)
+        return E_FILE_FORMAT_INVALID;
+
+      double value;
+
+      if (size == 4) {
+        unsigned long bits = 0;
+
+        for (int i = 0; i < 4; ++i)
+          bits = (bits << 8) | buf[i];
+
+        const unsigned int bits32 = static_cast<unsigned int>(bits);
+        float f;
+        memcpy(&f, &bits32, 4);
+        value = f;
+      } else {
+        unsigned long long bits = 0;
+
+        for (int i = 0; i < 8; ++i)
+          bits = (bits << 8) | buf[i];
+
+        memcpy(&value, &bits, 8);
+      }
+
+      if (mkvparser::isinf(value) || mkvparser::isnan(value))
+        return E_FILE_FORMAT_INVALID;
+
+      if ((e.check == kCheckPositive && value <= 0) ||
+          (e.check == kCheckNonNegative && value < 0)) {
+        return E_FILE_FORMAT_INVALID;
+      }
+
+      FieldAt<double>(fields, e.offset) = value;
+      return 0;
+    }
+
+    case kTypeString: {
+      char*& str = FieldAt<char*>(fields, e.offset);
+      delete[] str;
+      str = SafeArrayAlloc<char>(1, size + 1);
+
+      if (str == NULL)
+        return E_FILE_FORMAT_INVALID;
+
+      memcpy(str, buf, static_cast<size_t>(size));
+      str[size] = '\0';
+      return 0;
+    }
+
+    case kTypeBinary: {
+      ElementBinary& bin = FieldAt<ElementBinary>(fields, e.offset);
+      delete[] bin.data;
+      bin.data = NULL;
+      bin.size = 0;
+
+      if (size == 0)
+        return 0;
+
+      bin.data = SafeArrayAlloc<unsigned char>(1, size);
+
+      if (bin.data == NULL)
+        return -1;
+
+      memcpy(bin.data, buf, static_cast<size_t>(size));
+      bin.size = static_cast<size_t>(size);
+      return 0;
+    }
+
+    case kTypeMaster: {
+      ElementRange& range = FieldAt<ElementRange>(fields, e.offset);
+      range.start = start;
+      range.size = size;
+      return 0;
+    }
+
+    case kTypeCount:
+      ++FieldAt<long>(fields, e.offset);
+      return 0;
+  }
+
+  return E_FILE_FORMAT_INVALID;
+}
+
+// Decodes the children of the |parent| master element whose payload spans
+// [start, start + size) into |fields|, following kElementSchema. The payload
+// is read with a single IMkvReader::Read() call, and children not listed in
+// the schema are skipped. On failure the strings and buffers stored in
+// |fields| are released.
+long ParseElementFields(IMkvReader* pReader, long long start, long long size,
+                        unsigned long parent, void* fields) {
+  if (pReader == NULL || start < 0 || size < 0 || size >= LONG_MAX)
+    return E_FILE_FORMAT_INVALID;
+
+  if (size == 0)
+    return 0;
+
+  unsigned char stack_buf[256];
+  unsigned char* heap_buf = NULL;
+  unsigned char* buf = stack_buf;
+
+  if (size > static_cast<long long>(sizeof(stack_buf))) {
+    heap_buf = SafeArrayAlloc<unsigned char>(1, size);
+
+    if (heap_buf == NULL)
+      return -1;
+
+    buf = heap_buf;
+  }
+
+  long status = pReader->Read(start, static_cast<long>(size), buf);
+
+  if (status)
+    status = (status < 0) ? status : E_BUFFER_NOT_FULL;
+
+  long long pos = 0;
+
+  while (status == 0 && pos < size) {
+    long len;
+
+    const long long id = DecodeVarInt(buf + pos, size - pos, true, len);
+
+    if (id < 0) {
+      status = E_FILE_FORMAT_INVALID;
+      break;
+    }
+
+    pos += len;  // consume id
+
+    const long long payload_size =
+        DecodeVarInt(buf + pos, size - pos, false, len);
+
+    if (payload_size < 0) {
+      status = E_FILE_FORMAT_INVALID;
+      break;
+    }
+
+    pos += len;  // consume size
+
+    if (payload_size > size - pos) {
+      status = E_FILE_FORMAT_INVALID;
+      break;
+    }
+
+    const ElementSchema* const e =
+        FindElementSchema(parent, static_cast<unsigned long>(id));
+
+    if (e && (payload_size > 0 || e->check != kCheckSkipEmpty))
+      status = DecodeElementField(*e, buf + pos, payload_size, start + pos,
+                                  fields);
+
+    pos += payload_size;  // consume payload
+  }
+
+  delete[] heap_buf;
+
+  if (status)
+    ReleaseElementFields(parent, fields);
+
+  return status;
+}
+
+}  // namespace
+
 EBMLHeader::EBMLHeader() : m_docType(NULL) { Init(); }
 
 EBMLHeader::~EBMLHeader() { delete[] m_docType; }
@@ -508,48 +1145,147 @@ void EBMLHeader::Init() {
   m_docTypeReadVersion = 1;
 }
 
-long long EBMLHeader::Parse(IMkvReader* pReader, long long& pos) {
-  if (!pReader)
+namespace {
+
+// Returns true when the EBML ID at |pos| starts what looks like an EBML
+// header. Bytes that are not available yet are given the benefit of the
+// doubt; EBMLHeader::Parse() validates the whole header later.
+bool IsEBMLHeaderCandidate(IMkvReader* pReader, long long pos,
+                           long long available) {
+  pos += 4;  // consume id
+
+  if (pos >= available)
+    return true;
+
+  long len;
+
+  const long long result = GetUIntLength(pReader, pos, len);
+
+  if (result < 0 || len < 1 || len > 8)
+    return false;
+
+  if (pos + len > available)
+    return true;
+
+  const long long size = ReadUInt(pReader, pos, len);
+
+  if (size < 0)
+    return false;
+
+  pos += len;  // consume size field
+
+  if (size == 0 || pos >= available)
+    return true;
+
+  // Every EBML header child ID starts with 0x42, except CRC-32 and Void.
+  unsigned char b;
+
+  if (pReader->Read(pos, 1, &b))
+    return true;
+
+  return b == 0x42 || b == 0xBF || b == mkvmuxer::kMkvVoid;
+}
+
+}  // namespace
+
+long long FindEBMLHeader(IMkvReader* pReader, long long pos,
+                         long long max_bytes) {
+  if (pReader == NULL || pos < 0 || max_bytes < 0)
     return E_FILE_FORMAT_INVALID;
 
   long long total, available;
 
-  long status = pReader->Length(&total, &available);
+  const long length_status = pReader->Length(&total, &available);
 
-  if (status < 0)  // error
-    return status;
+  if (length_status < 0)  // error
+    return length_status;
+
+  const unsigned char kEbmlId[4] = {0x1A, 0x45, 0xDF, 0xA3};
+  const long kWindowSize = 4096;
+  unsigned char window[kWindowSize];
+
+  const long long scan_stop =
+      (max_bytes > LLONG_MAX - pos) ? LLONG_MAX : pos + max_bytes;
 
-  pos = 0;
+  // Candidates must start before |scan_stop|, but the ID itself may extend
+  // past it.
+  const long long read_stop =
+      (available < scan_stop + 3) ? available : scan_stop + 3;
 
-  // Scan until we find what looks like the first byte of the EBML header.
-  const long long kMaxScanBytes = (available >= 1024) ? 1024 : available;
-  const unsigned char kEbmlByte0 = 0x1A;
-  unsigned char scan_byte = 0;
+  while (pos < scan_stop && read_stop - pos >= 4) {
+    const long long remaining = read_stop - pos;
+    const long len = (remaining > kWindowSize) ? kWindowSize
+                                               : static_cast<long>(remaining);
 
-  while (pos < kMaxScanBytes) {
-    status = pReader->Read(pos, 1, &scan_byte);
+    const int status = pReader->Read(pos, len, window);
 
     if (status < 0)  // error
       return status;
     else if (status > 0)
       return E_BUFFER_NOT_FULL;
 
-    if (scan_byte == kEbmlByte0)
-      break;
+    // Candidates are found with memchr(), which the C library vectorizes,
+    // instead of reading one byte at a time through the reader.
+    const unsigned char* p = window;
+    const unsigned char* const last = window + len - 3;
 
-    ++pos;
+    while (p < last) {
+      p = static_cast<const unsigned char*>(
+          memchr(p, kEbmlId[0], static_cast<size_t>(last - p)));
+
+      if (p == NULL)
+        break;
+
+      const long long candidate = pos + (p - window);
+
+      if (candidate >= scan_stop)
+        return E_FILE_FORMAT_INVALID;
+
+      if (memcmp(p, kEbmlId, sizeof(kEbmlId)) == 0 &&
+          IsEBMLHeaderCandidate(pReader, candidate, available)) {
+        return candidate;
+      }
+
+      ++p;
+    }
+
+    // Overlap windows so that IDs spanning two windows are found.
+    pos += len - 3;
   }
 
-  long len = 0;
-  const long long ebml_id = ReadID(pReader, pos, len);
+  if (pos >= scan_stop || (total >= 0 && available >= total))
+    return E_FILE_FORMAT_INVALID;
+
+  return E_BUFFER_NOT_FULL;
+}
 
-  // TODO(tomfinegan): Move Matroska ID constants into a common namespace.
-  if (len != 4 || ebml_id != mkvmuxer::kMkvEBML)
+long long EBMLHeader::Parse(IMkvReader* pReader, long long& pos) {
+  if (!pReader)
     return E_FILE_FORMAT_INVALID;
 
+  long long total, available;
+
+  long status = pReader->Length(&total, &available);
+
+  if (status < 0)  // error
+    return status;
+
+  // Skip up to 1KB of leading junk before the EBML header.
+  const long long kMaxScanBytes = 1024;
+
+  pos = FindEBMLHeader(pReader, 0, kMaxScanBytes);
+
+  if (pos < 0) {
+    const long long error = pos;
+    pos = 0;
+    return error;
+  }
+
   // Move read pos forward to the EBML header size field.
   pos += 4;
 
+  long len = 0;
+
   // Read length of size field.
   long long result = GetUIntLength(pReader, pos, len);
 
@@ -675,7 +1411,9 @@ Segment::Segment(IMkvReader* pReader, long long elem_start,
       m_clusters(NULL),
       m_clusterCount(0),
       m_clusterPreloadCount(0),
-      m_clusterSize(0) {}
+      m_clusterSize(0),
+      m_pStatsReader(NULL),
+      m_pStats(NULL) {}
 
 Segment::~Segment() {
   const long count = m_clusterCount + m_clusterPreloadCount;
@@ -696,6 +1434,9 @@ Segment::~Segment() {
   delete m_pChapters;
   delete m_pTags;
   delete m_pSeekHead;
+#ifdef MKVPARSER_ENABLE_STATS
+  delete static_cast<StatsReader*>(m_pStatsReader);
+#endif
 }
 
 long long Segment::CreateInstance(IMkvReader* pReader, long long pos,
@@ -795,9 +1536,24 @@ long long Segment::CreateInstance(IMkvReader* pReader, long long pos,
       else if ((pos + size) > total)
         size = -1;
 
+#ifdef MKVPARSER_ENABLE_STATS
+      StatsReader* const pStatsReader = new (std::nothrow) StatsReader(pReader);
+      if (pStatsReader == NULL)
+        return E_PARSE_FAILED;
+
+      pSegment = new (std::nothrow) Segment(pStatsReader, idpos, pos, size);
+      if (pSegment == NULL) {
+        delete pStatsReader;
+        return E_PARSE_FAILED;
+      }
+
+      pSegment->m_pStatsReader = pStatsReader;
+      pSegment->m_pStats = &pStatsReader->m_stats;
+#else
       pSegment = new (std::nothrow) Segment(pReader, idpos, pos, size);
       if (pSegment == NULL)
         return E_PARSE_FAILED;
+#endif
 
       return 0;  // success
     }
@@ -816,6 +1572,8 @@ long long Segment::CreateInstance(IMkvReader* pReader, long long pos,
 }
 
 long long Segment::ParseHeaders() {
+  const StatsTimer timer(this, &SegmentStats::parse_headers_time);
+
   // Outermost (level 0) segment object has been constructed,
   // and pos designates start of payload.  We need to find the
   // inner (level 1) elements.
@@ -1022,6 +1780,8 @@ long long Segment::ParseHeaders() {
 }
 
 long Segment::LoadCluster(long long& pos, long& len) {
+  const StatsTimer timer(this, &SegmentStats::load_cluster_time);
+
   for (;;) {
     const long result = DoLoadCluster(pos, len);
 
@@ -1310,14 +2070,11 @@ long Segment::DoLoadClusterUnknownSize(long long& pos, long& len) {
   if (m_pos >= 0 || m_pUnknownSize == NULL)
     return E_PARSE_FAILED;
 
-  const long status = m_pUnknownSize->Parse(pos, len);
+  const long status = m_pUnknownSize->ResolveElementSize(pos, len);
 
   if (status < 0)  // error or underflow
     return status;
 
-  if (status == 0)  // parsed a block
-    return 2;  // continue parsing
-
   const long long start = m_pUnknownSize->m_element_start;
   const long long size = m_pUnknownSize->GetElementSize();
 
@@ -1351,6 +2108,8 @@ bool Segment::AppendCluster(Cluster* pCluster) {
     if (qq == NULL)
       return false;
 
+    CountAllocation(this);
+
     Cluster** q = qq;
     Cluster** p = m_clusters;
     Cluster** const pp = p + count;
@@ -1407,6 +2166,8 @@ bool Segment::PreloadCluster(Cluster* pCluster, ptrdiff_t idx) {
     Cluster** const qq = new (std::nothrow) Cluster*[n];
     if (qq == NULL)
       return false;
+
+    CountAllocation(this);
     Cluster** q = qq;
 
     Cluster** p = m_clusters;
@@ -1920,6 +2681,8 @@ bool Cues::PreloadCuePoint(long& cue_points_size, long long pos) const {
     if (qq == NULL)
       return false;
 
+    CountAllocation(m_pSegment);
+
     CuePoint** q = qq;  // beginning of target
 
     CuePoint** p = m_cue_points;  // beginning of source
@@ -1938,11 +2701,15 @@ bool Cues::PreloadCuePoint(long& cue_points_size, long long pos) const {
   if (pCP == NULL)
     return false;
 
+  CountAllocation(m_pSegment);
+
   m_cue_points[m_preload_count++] = pCP;
   return true;
 }
 
 bool Cues::LoadCuePoint() const {
+  const StatsTimer timer(m_pSegment, &SegmentStats::cues_load_time);
+
   const long long stop = m_start + m_size;
 
   if (m_pos >= stop)
@@ -1993,6 +2760,7 @@ bool Cues::LoadCuePoint() const {
       m_pos = stop;
       return false;
     }
+    CountAllocation(m_pSegment);  // track positions
     ++m_count;
     --m_preload_count;
 
@@ -2301,43 +3069,24 @@ bool CuePoint::Load(IMkvReader* pReader) {
 
   const long long element_size = stop - element_start;
 
-  long long pos = pos_;
-
   // First count number of track positions
 
-  while (pos < stop) {
-    long len;
-
-    const long long id = ReadID(pReader, pos, len);
-    if ((id < 0) || (pos + len > stop)) {
-      return false;
-    }
-
-    pos += len;  // consume ID
-
-    const long long size = ReadUInt(pReader, pos, len);
-    if ((size < 0) || (pos + len > stop)) {
-      return false;
-    }
-
-    pos += len;  // consume Size field
-    if ((pos + size) > stop) {
-      return false;
-    }
-
-    if (id == mkvmuxer::kMkvCueTime)
-      m_timecode = UnserializeUInt(pReader, pos, size);
+  CuePointFields fields;
+  fields.time = -1;
+  fields.track_positions = 0;
 
-    else if (id == mkvmuxer::kMkvCueTrackPositions)
-      ++m_track_positions_count;
-
-    pos += size;  // consume payload
+  if (ParseElementFields(pReader, pos_, stop - pos_, mkvmuxer::kMkvCuePoint,
+                         &fields)) {
+    return false;
   }
 
-  if (m_timecode < 0 || m_track_positions_count <= 0) {
+  if (fields.time < 0 || fields.track_positions <= 0) {
     return false;
   }
 
+  m_timecode = fields.time;
+  m_track_positions_count = static_cast<size_t>(fields.track_positions);
+
   // os << "CuePoint::Load(cont'd): idpos=" << idpos
   //   << " timecode=" << m_timecode
   //   << endl;
@@ -2349,7 +3098,7 @@ bool CuePoint::Load(IMkvReader* pReader) {
   // Now parse track positions
 
   TrackPosition* p = m_track_positions;
-  pos = pos_;
+  long long pos = pos_;
 
   while (pos < stop) {
     long len;
@@ -2389,43 +3138,20 @@ bool CuePoint::Load(IMkvReader* pReader) {
 
 bool CuePoint::TrackPosition::Parse(IMkvReader* pReader, long long start_,
                                     long long size_) {
-  const long long stop = start_ + size_;
-  long long pos = start_;
-
-  m_track = -1;
-  m_pos = -1;
-  m_block = 1;  // default
-
-  while (pos < stop) {
-    long len;
-
-    const long long id = ReadID(pReader, pos, len);
-    if ((id < 0) || ((pos + len) > stop)) {
-      return false;
-    }
-
-    pos += len;  // consume ID
-
-    const long long size = ReadUInt(pReader, pos, len);
-    if ((size < 0) || ((pos + len) > stop)) {
-      return false;
-    }
-
-    pos += len;  // consume Size field
-    if ((pos + size) > stop) {
-      return false;
-    }
-
-    if (id == mkvmuxer::kMkvCueTrack)
-      m_track = UnserializeUInt(pReader, pos, size);
-    else if (id == mkvmuxer::kMkvCueClusterPosition)
-      m_pos = UnserializeUInt(pReader, pos, size);
-    else if (id == mkvmuxer::kMkvCueBlockNumber)
-      m_block = UnserializeUInt(pReader, pos, size);
+  CueTrackPositionsFields fields;
+  fields.track = -1;
+  fields.cluster_position = -1;
+  fields.block_number = 1;  // default
 
-    pos += size;  // consume payload
+  if (ParseElementFields(pReader, start_, size_,
+                         mkvmuxer::kMkvCueTrackPositions, &fields)) {
+    return false;
   }
 
+  m_track = fields.track;
+  m_pos = fields.cluster_position;
+  m_block = fields.block_number;
+
   if ((m_pos < 0) || (m_track <= 0)) {
     return false;
   }
@@ -2539,41 +3265,31 @@ const Cluster* Segment::GetNext(const Cluster* pCurr) {
 
   assert(m_clusterPreloadCount > 0);
 
-  long long pos = pCurr->m_element_start;
-
-  assert(m_size >= 0);  // TODO
-  const long long stop = m_start + m_size;  // end of segment
-
-  {
-    long len;
+  long long stop = m_start + m_size;  // end of segment
 
-    long long result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);
-    assert((pos + len) <= stop);  // TODO
-    if (result != 0)
-      return NULL;
+  if (m_size < 0) {
+    long long total, avail;
 
-    const long long id = ReadID(m_pReader, pos, len);
-    if (id != mkvmuxer::kMkvCluster)
+    if (m_pReader->Length(&total, &avail) < 0)
       return NULL;
 
-    pos += len;  // consume ID
+    stop = (total >= 0) ? total : avail;
+  }
 
-    // Read Size
-    result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);  // TODO
-    assert((pos + len) <= stop);  // TODO
+  long long pos;
 
-    const long long size = ReadUInt(m_pReader, pos, len);
-    assert(size > 0);  // TODO
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
+  {
+    long len;
 
-    pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
+    // A cluster of unknown size is parsed to its end, recording its block
+    // entries on the way.
+    if (pCurr->ResolveElementSize(pos, len) < 0)
+      return NULL;
 
-    // Pos now points to start of payload
+    pos = pCurr->m_element_start + pCurr->m_element_size;
 
-    pos += size;  // consume payload
+    if (pos > stop)
+      return NULL;
   }
 
   long long off_next = 0;
@@ -2603,8 +3319,10 @@ const Cluster* Segment::GetNext(const Cluster* pCurr) {
     const long long size = ReadUInt(m_pReader, pos, len);
     assert(size >= 0);  // TODO
 
+    const long long unknown_size = (1LL << (7 * len)) - 1;
+
     pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
+    assert((size == unknown_size) || ((pos + size) <= stop));  // TODO
 
     // Pos now points to start of payload
 
@@ -2627,6 +3345,32 @@ const Cluster* Segment::GetNext(const Cluster* pCurr) {
       }
     }
 
+    if (size == unknown_size) {
+      // Only clusters may have an unknown size. This one has no block
+      // entries, so parse it to find where it ends.
+      if (id != mkvmuxer::kMkvCluster)
+        return NULL;
+
+      Cluster* const pEmpty = Cluster::Create(this, -1, idpos - m_start);
+      if (pEmpty == NULL)
+        return NULL;
+
+      long long pos_;
+      long len_;
+
+      const long status = pEmpty->ResolveElementSize(pos_, len_);
+      const long long element_stop =
+          pEmpty->m_element_start + pEmpty->m_element_size;
+
+      delete pEmpty;
+
+      if (status < 0 || element_stop < pos || element_stop > stop)
+        return NULL;
+
+      pos = element_stop;
+      continue;
+    }
+
     pos += size;  // consume payload
   }
 
@@ -2735,88 +3479,17 @@ long Segment::ParseNext(const Cluster* pCurr, const Cluster*& pResult,
 
   // interrogate curr cluster
 
-  pos = pCurr->m_element_start;
-
-  if (pCurr->m_element_size >= 0)
-    pos += pCurr->m_element_size;
-  else {
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
-
-    long long result = GetUIntLength(m_pReader, pos, len);
-
-    if (result < 0)  // error
-      return static_cast<long>(result);
-
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
-
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
-
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
-
-    const long long id = ReadUInt(m_pReader, pos, len);
-
-    if (id != mkvmuxer::kMkvCluster)
-      return -1;
-
-    pos += len;  // consume ID
-
-    // Read Size
-
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
-
-    result = GetUIntLength(m_pReader, pos, len);
-
-    if (result < 0)  // error
-      return static_cast<long>(result);
-
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
-
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
-
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
-
-    const long long size = ReadUInt(m_pReader, pos, len);
-
-    if (size < 0)  // error
-      return static_cast<long>(size);
-
-    pos += len;  // consume size field
-
-    const long long unknown_size = (1LL << (7 * len)) - 1;
-
-    if (size == unknown_size)  // TODO: should never happen
-      return E_FILE_FORMAT_INVALID;  // TODO: resolve this
+  // A preloaded cluster of unknown size is parsed to its end, recording its
+  // block entries on the way.
+  status = pCurr->ResolveElementSize(pos, len);
 
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
-
-    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
-
-    // Pos now points to start of payload
+  if (status < 0)  // error or underflow
+    return status;
 
-    pos += size;  // consume payload (that is, the current cluster)
-    if (segment_stop >= 0 && pos > segment_stop)
-      return E_FILE_FORMAT_INVALID;
+  pos = pCurr->m_element_start + pCurr->m_element_size;
 
-    // By consuming the payload, we are assuming that the curr
-    // cluster isn't interesting.  That is, we don't bother checking
-    // whether the payload of the curr cluster is less than what
-    // happens to be available (obtained via IMkvReader::Length).
-    // Presumably the caller has already dispensed with the current
-    // cluster, and really does want the next cluster.
-  }
+  if (segment_stop >= 0 && pos > segment_stop)
+    return E_FILE_FORMAT_INVALID;
 
   // pos now points to just beyond the last fully-loaded cluster
 
@@ -3216,6 +3889,8 @@ const Chapters* Segment::GetChapters() const { return m_pChapters; }
 const Tags* Segment::GetTags() const { return m_pTags; }
 const SeekHead* Segment::GetSeekHead() const { return m_pSeekHead; }
 
+const SegmentStats* Segment::GetStats() const { return m_pStats; }
+
 long long Segment::GetDuration() const {
   assert(m_pInfo);
   return m_pInfo->GetDuration();
@@ -3647,43 +4322,21 @@ void Chapters::Display::Clear() {
 
 long Chapters::Display::Parse(IMkvReader* pReader, long long pos,
                               long long size) {
-  const long long stop = pos + size;
+  ChapterDisplayFields fields;
+  fields.string = NULL;
+  fields.language = NULL;
+  fields.country = NULL;
 
-  while (pos < stop) {
-    long long id, size;
-
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (size == 0)  // No payload.
-      continue;
-
-    if (id == mkvmuxer::kMkvChapString) {
-      status = UnserializeString(pReader, pos, size, m_string);
+  const long status = ParseElementFields(pReader, pos, size,
+                                         mkvmuxer::kMkvChapterDisplay, &fields);
 
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvChapLanguage) {
-      status = UnserializeString(pReader, pos, size, m_language);
-
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvChapCountry) {
-      status = UnserializeString(pReader, pos, size, m_country);
-
-      if (status)
-        return status;
-    }
-
-    pos += size;
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  if (status)
+    return status;
+
+  m_string = fields.string;
+  m_language = fields.language;
+  m_country = fields.country;
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
   return 0;
 }
 
@@ -3917,38 +4570,19 @@ void Tags::SimpleTag::Clear() {
 
 long Tags::SimpleTag::Parse(IMkvReader* pReader, long long pos,
                             long long size) {
-  const long long stop = pos + size;
-
-  while (pos < stop) {
-    long long id, size;
-
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (size == 0)  // weird
-      continue;
-
-    if (id == mkvmuxer::kMkvTagName) {
-      status = UnserializeString(pReader, pos, size, m_tag_name);
+  SimpleTagFields fields;
+  fields.name = NULL;
+  fields.string = NULL;
 
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvTagString) {
-      status = UnserializeString(pReader, pos, size, m_tag_string);
+  const long status = ParseElementFields(pReader, pos, size,
+                                         mkvmuxer::kMkvSimpleTag, &fields);
 
-      if (status)
-        return status;
-    }
+  if (status)
+    return status;
 
-    pos += size;
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  m_tag_name = fields.name;
+  m_tag_string = fields.string;
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
   return 0;
 }
 
@@ -3979,67 +4613,29 @@ long SegmentInfo::Parse() {
   assert(m_pWritingAppAsUTF8 == NULL);
   assert(m_pTitleAsUTF8 == NULL);
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
-
-  long long pos = m_start;
-  const long long stop = m_start + m_size;
-
-  m_timecodeScale = 1000000;
-  m_duration = -1;
+  SegmentInfoFields fields;
+  fields.timecode_scale = 1000000;
+  fields.duration = -1;
+  fields.muxing_app = NULL;
+  fields.writing_app = NULL;
+  fields.title = NULL;
 
-  while (pos < stop) {
-    long long id, size;
-
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (id == mkvmuxer::kMkvTimecodeScale) {
-      m_timecodeScale = UnserializeUInt(pReader, pos, size);
-
-      if (m_timecodeScale <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvDuration) {
-      const long status = UnserializeFloat(pReader, pos, size, m_duration);
-
-      if (status < 0)
-        return status;
-
-      if (m_duration < 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvMuxingApp) {
-      const long status =
-          UnserializeString(pReader, pos, size, m_pMuxingAppAsUTF8);
-
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvWritingApp) {
-      const long status =
-          UnserializeString(pReader, pos, size, m_pWritingAppAsUTF8);
-
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvTitle) {
-      const long status = UnserializeString(pReader, pos, size, m_pTitleAsUTF8);
-
-      if (status)
-        return status;
-    }
+  const long status = ParseElementFields(m_pSegment->m_pReader, m_start,
+                                         m_size, mkvmuxer::kMkvInfo, &fields);
 
-    pos += size;
+  if (status)
+    return status;
 
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  m_timecodeScale = fields.timecode_scale;
+  m_duration = fields.duration;
+  m_pMuxingAppAsUTF8 = fields.muxing_app;
+  m_pWritingAppAsUTF8 = fields.writing_app;
+  m_pTitleAsUTF8 = fields.title;
 
   const double rollover_check = m_duration * m_timecodeScale;
   if (rollover_check > LLONG_MAX)
     return E_FILE_FORMAT_INVALID;
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
-
   return 0;
 }
 
@@ -4990,81 +5586,24 @@ long VideoTrack::Parse(Segment* pSegment, const Info& info,
   if (info.type != Track::kVideo)
     return -1;
 
-  long long width = 0;
-  long long height = 0;
-  long long display_width = 0;
-  long long display_height = 0;
-  long long display_unit = 0;
-  long long stereo_mode = 0;
-
-  double rate = 0.0;
-
-  IMkvReader* const pReader = pSegment->m_pReader;
-
   const Settings& s = info.settings;
   assert(s.start >= 0);
   assert(s.size >= 0);
 
-  long long pos = s.start;
-  assert(pos >= 0);
-
-  const long long stop = pos + s.size;
-
-  while (pos < stop) {
-    long long id, size;
-
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (id == mkvmuxer::kMkvPixelWidth) {
-      width = UnserializeUInt(pReader, pos, size);
-
-      if (width <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvPixelHeight) {
-      height = UnserializeUInt(pReader, pos, size);
-
-      if (height <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvDisplayWidth) {
-      display_width = UnserializeUInt(pReader, pos, size);
-
-      if (display_width <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvDisplayHeight) {
-      display_height = UnserializeUInt(pReader, pos, size);
-
-      if (display_height <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvDisplayUnit) {
-      display_unit = UnserializeUInt(pReader, pos, size);
-
-      if (display_unit < 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvStereoMode) {
-      stereo_mode = UnserializeUInt(pReader, pos, size);
-
-      if (stereo_mode < 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvFrameRate) {
-      const long status = UnserializeFloat(pReader, pos, size, rate);
-
-      if (status < 0)
-        return status;
-
-      if (rate <= 0)
-        return E_FILE_FORMAT_INVALID;
-    }
+  VideoFields fields;
+  fields.width = 0;
+  fields.height = 0;
+  fields.display_width = 0;
+  fields.display_height = 0;
+  fields.display_unit = 0;
+  fields.stereo_mode = 0;
+  fields.rate = 0.0;
 
-    pos += size;  // consume payload
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  const long status = ParseElementFields(pSegment->m_pReader, s.start, s.size,
+                                         mkvmuxer::kMkvVideo, &fields);
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
+  if (status)
+    return status;
 
   VideoTrack* const pTrack =
       new (std::nothrow) VideoTrack(pSegment, element_start, element_size);
@@ -5072,20 +5611,20 @@ long VideoTrack::Parse(Segment* pSegment, const Info& info,
   if (pTrack == NULL)
     return -1;  // generic error
 
-  const int status = info.Copy(pTrack->m_info);
+  const int copy_status = info.Copy(pTrack->m_info);
 
-  if (status) {  // error
+  if (copy_status) {  // error
     delete pTrack;
-    return status;
+    return copy_status;
   }
 
-  pTrack->m_width = width;
-  pTrack->m_height = height;
-  pTrack->m_display_width = display_width;
-  pTrack->m_display_height = display_height;
-  pTrack->m_display_unit = display_unit;
-  pTrack->m_stereo_mode = stereo_mode;
-  pTrack->m_rate = rate;
+  pTrack->m_width = fields.width;
+  pTrack->m_height = fields.height;
+  pTrack->m_display_width = fields.display_width;
+  pTrack->m_display_height = fields.display_height;
+  pTrack->m_display_unit = fields.display_unit;
+  pTrack->m_stereo_mode = fields.stereo_mode;
+  pTrack->m_rate = fields.rate;
 
   pResult = pTrack;
   return 0;  // success
@@ -5215,56 +5754,20 @@ long AudioTrack::Parse(Segment* pSegment, const Info& info,
   if (info.type != Track::kAudio)
     return -1;
 
-  IMkvReader* const pReader = pSegment->m_pReader;
-
   const Settings& s = info.settings;
   assert(s.start >= 0);
   assert(s.size >= 0);
 
-  long long pos = s.start;
-  assert(pos >= 0);
-
-  const long long stop = pos + s.size;
-
-  double rate = 8000.0;  // MKV default
-  long long channels = 1;
-  long long bit_depth = 0;
-
-  while (pos < stop) {
-    long long id, size;
-
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (id == mkvmuxer::kMkvSamplingFrequency) {
-      status = UnserializeFloat(pReader, pos, size, rate);
-
-      if (status < 0)
-        return status;
-
-      if (rate <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvChannels) {
-      channels = UnserializeUInt(pReader, pos, size);
-
-      if (channels <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvBitDepth) {
-      bit_depth = UnserializeUInt(pReader, pos, size);
-
-      if (bit_depth <= 0)
-        return E_FILE_FORMAT_INVALID;
-    }
+  AudioFields fields;
+  fields.rate = 8000.0;  // MKV default
+  fields.channels = 1;
+  fields.bit_depth = 0;
 
-    pos += size;  // consume payload
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  const long status = ParseElementFields(pSegment->m_pReader, s.start, s.size,
+                                         mkvmuxer::kMkvAudio, &fields);
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
+  if (status)
+    return status;
 
   AudioTrack* const pTrack =
       new (std::nothrow) AudioTrack(pSegment, element_start, element_size);
@@ -5272,16 +5775,16 @@ long AudioTrack::Parse(Segment* pSegment, const Info& info,
   if (pTrack == NULL)
     return -1;  // generic error
 
-  const int status = info.Copy(pTrack->m_info);
+  const int copy_status = info.Copy(pTrack->m_info);
 
-  if (status) {
+  if (copy_status) {
     delete pTrack;
-    return status;
+    return copy_status;
   }
 
-  pTrack->m_rate = rate;
-  pTrack->m_channels = channels;
-  pTrack->m_bitDepth = bit_depth;
+  pTrack->m_rate = fields.rate;
+  pTrack->m_channels = fields.channels;
+  pTrack->m_bitDepth = fields.bit_depth;
 
   pResult = pTrack;
   return 0;  // success
@@ -5403,160 +5906,74 @@ long Tracks::ParseTrackEntry(long long track_start, long long track_size,
   if (pResult)
     return -1;
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  TrackEntryFields fields;
+  fields.video.start = -1;
+  fields.video.size = -1;
+  fields.audio.start = -1;
+  fields.audio.size = -1;
+  fields.content_encodings.start = -1;
+  fields.content_encodings.size = -1;
+  fields.uid = 0;
+  fields.number = 0;
+  fields.type = 0;
+  fields.default_duration = 0;
+  fields.lacing = 1;  // default is true
+  fields.codec_delay = 0;
+  fields.seek_pre_roll = 0;
+  fields.name = NULL;
+  fields.language = NULL;
+  fields.codec_id = NULL;
+  fields.codec_name = NULL;
+  fields.codec_private.data = NULL;
+  fields.codec_private.size = 0;
+
+  const long status =
+      ParseElementFields(m_pSegment->m_pReader, track_start, track_size,
+                         mkvmuxer::kMkvTrackEntry, &fields);
 
-  long long pos = track_start;
-  const long long track_stop = track_start + track_size;
+  if (status)
+    return status;
 
+  // Track::Info owns the strings and codec private data from here on.
   Track::Info info;
 
-  info.type = 0;
-  info.number = 0;
-  info.uid = 0;
-  info.defaultDuration = 0;
-
-  Track::Settings v;
-  v.start = -1;
-  v.size = -1;
-
-  Track::Settings a;
-  a.start = -1;
-  a.size = -1;
-
-  Track::Settings e;  // content_encodings_settings;
-  e.start = -1;
-  e.size = -1;
-
-  long long lacing = 1;  // default is true
-
-  while (pos < track_stop) {
-    long long id, size;
-
-    const long status = ParseElementHeader(pReader, pos, track_stop, id, size);
-
-    if (status < 0)  // error
-      return status;
-
-    if (size < 0)
-      return E_FILE_FORMAT_INVALID;
-
-    const long long start = pos;
-
-    if (id == mkvmuxer::kMkvVideo) {
-      v.start = start;
-      v.size = size;
-    } else if (id == mkvmuxer::kMkvAudio) {
-      a.start = start;
-      a.size = size;
-    } else if (id == mkvmuxer::kMkvContentEncodings) {
-      e.start = start;
-      e.size = size;
-    } else if (id == mkvmuxer::kMkvTrackUID) {
-      if (size > 8)
-        return E_FILE_FORMAT_INVALID;
-
-      info.uid = 0;
-
-      long long pos_ = start;
-      const long long pos_end = start + size;
-
-      while (pos_ != pos_end) {
-        unsigned char b;
-
-        const int status = pReader->Read(pos_, 1, &b);
-
-        if (status)
-          return status;
-
-        info.uid <<= 8;
-        info.uid |= b;
-
-        ++pos_;
-      }
-    } else if (id == mkvmuxer::kMkvTrackNumber) {
-      const long long num = UnserializeUInt(pReader, pos, size);
-
-      if ((num <= 0) || (num > 127))
-        return E_FILE_FORMAT_INVALID;
-
-      info.number = static_cast<long>(num);
-    } else if (id == mkvmuxer::kMkvTrackType) {
-      const long long type = UnserializeUInt(pReader, pos, size);
-
-      if ((type <= 0) || (type > 254))
-        return E_FILE_FORMAT_INVALID;
-
-      info.type = static_cast<long>(type);
-    } else if (id == mkvmuxer::kMkvName) {
-      const long status =
-          UnserializeString(pReader, pos, size, info.nameAsUTF8);
-
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvLanguage) {
-      const long status = UnserializeString(pReader, pos, size, info.language);
-
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvDefaultDuration) {
-      const long long duration = UnserializeUInt(pReader, pos, size);
-
-      if (duration < 0)
-        return E_FILE_FORMAT_INVALID;
-
-      info.defaultDuration = static_cast<unsigned long long>(duration);
-    } else if (id == mkvmuxer::kMkvCodecID) {
-      const long status = UnserializeString(pReader, pos, size, info.codecId);
+  info.nameAsUTF8 = fields.name;
+  info.language = fields.language;
+  info.codecId = fields.codec_id;
+  info.codecNameAsUTF8 = fields.codec_name;
+  info.codecPrivate = fields.codec_private.data;
+  info.codecPrivateSize = fields.codec_private.size;
 
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvFlagLacing) {
-      lacing = UnserializeUInt(pReader, pos, size);
-
-      if ((lacing < 0) || (lacing > 1))
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == mkvmuxer::kMkvCodecPrivate) {
-      delete[] info.codecPrivate;
-      info.codecPrivate = NULL;
-      info.codecPrivateSize = 0;
-
-      const size_t buflen = static_cast<size_t>(size);
-
-      if (buflen) {
-        unsigned char* buf = SafeArrayAlloc<unsigned char>(1, buflen);
+  if ((fields.number < 0) || (fields.number > 127))
+    return E_FILE_FORMAT_INVALID;
 
-        if (buf == NULL)
-          return -1;
+  if ((fields.type < 0) || (fields.type > 254))
+    return E_FILE_FORMAT_INVALID;
 
-        const int status = pReader->Read(pos, static_cast<long>(buflen), buf);
+  if ((fields.lacing < 0) || (fields.lacing > 1))
+    return E_FILE_FORMAT_INVALID;
 
-        if (status) {
-          delete[] buf;
-          return status;
-        }
+  info.type = static_cast<long>(fields.type);
+  info.number = static_cast<long>(fields.number);
+  info.uid = fields.uid;
+  info.defaultDuration =
+      static_cast<unsigned long long>(fields.default_duration);
+  info.codecDelay = static_cast<unsigned long long>(fields.codec_delay);
+  info.seekPreRoll = static_cast<unsigned long long>(fields.seek_pre_roll);
 
-        info.codecPrivate = buf;
-        info.codecPrivateSize = buflen;
-      }
-    } else if (id == mkvmuxer::kMkvCodecName) {
-      const long status =
-          UnserializeString(pReader, pos, size, info.codecNameAsUTF8);
+  Track::Settings v;
+  v.start = fields.video.start;
+  v.size = fields.video.size;
 
-      if (status)
-        return status;
-    } else if (id == mkvmuxer::kMkvCodecDelay) {
-      info.codecDelay = UnserializeUInt(pReader, pos, size);
-    } else if (id == mkvmuxer::kMkvSeekPreRoll) {
-      info.seekPreRoll = UnserializeUInt(pReader, pos, size);
-    }
+  Track::Settings a;
+  a.start = fields.audio.start;
+  a.size = fields.audio.size;
 
-    pos += size;  // consume payload
-    if (pos > track_stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  Track::Settings e;  // content_encodings_settings;
+  e.start = fields.content_encodings.start;
+  e.size = fields.content_encodings.size;
 
-  if (pos != track_stop)
-    return E_FILE_FORMAT_INVALID;
+  const long long lacing = fields.lacing;
 
   if (info.number <= 0)  // not specified
     return E_FILE_FORMAT_INVALID;
@@ -5903,6 +6320,8 @@ long Cluster::Load(long long& pos, long& len) const {
   m_pos = new_pos;  // designates position just beyond timecode payload
   m_timecode = timecode;  // m_timecode >= 0 means we're partially loaded
 
+  CountCluster(m_pSegment);
+
   if (cluster_size >= 0)
     m_element_size = cluster_stop - m_element_start;
 
@@ -6099,6 +6518,47 @@ long Cluster::Parse(long long& pos, long& len) const {
   return 1;  // no more entries
 }
 
+long Cluster::ResolveElementSize(long long& pos, long& len) const {
+  if (m_timecode < 0) {
+    // Clusters without block entries cannot be loaded. They end where
+    // HasBlockEntries() stops looking, at the next Cluster or Cues element or
+    // at the end of their known size.
+    const long status = HasBlockEntries(
+        m_pSegment, m_element_start - m_pSegment->m_start, pos, len);
+
+    if (status < 0)  // error or underflow
+      return status;
+
+    if (status == 0) {
+      if (pos <= m_element_start)
+        return E_FILE_FORMAT_INVALID;
+
+      m_element_size = pos - m_element_start;
+      return 0;
+    }
+  }
+
+  long status = Load(pos, len);
+
+  if (status < 0)  // error or underflow
+    return status;
+
+  while (m_element_size < 0) {
+    status = Parse(pos, len);
+
+    if (status < 0)  // error or underflow
+      return status;
+
+    if (status > 0)  // no more entries
+      break;
+  }
+
+  if (m_element_size < 0)
+    return E_FILE_FORMAT_INVALID;
+
+  return 0;
+}
+
 long Cluster::ParseSimpleBlock(long long block_size, long long& pos,
                                long& len) {
   const long long block_start = pos;
@@ -6448,6 +6908,9 @@ Cluster* Cluster::Create(Segment* pSegment, long idx, long long off) {
   Cluster* const pCluster =
       new (std::nothrow) Cluster(pSegment, idx, element_start);
 
+  if (pCluster)
+    CountAllocation(pSegment);
+
   return pCluster;
 }
 
@@ -6596,11 +7059,11 @@ long Cluster::HasBlockEntries(
     if (size < 0)  // error
       return static_cast<long>(size);
 
+    pos += len;  // consume size field
+
     if (size == 0)
       return 0;  // cluster does not have entries
 
-    pos += len;  // consume size field
-
     // pos now points to start of payload
 
     const long long unknown_size = (1LL << (7 * len)) - 1;
@@ -6612,9 +7075,11 @@ long Cluster::HasBlockEntries(
       if ((segment_stop >= 0) && (cluster_stop > segment_stop))
         return E_FILE_FORMAT_INVALID;
 
-      if ((total >= 0) && (cluster_stop > total))
+      if ((total >= 0) && (cluster_stop > total)) {
         // return E_FILE_FORMAT_INVALID;  //too conservative
+        pos = cluster_stop;
         return 0;  // cluster does not have any entries
+      }
     }
   }
 
@@ -6795,6 +7260,8 @@ long Cluster::CreateBlock(long long id,
     if (m_entries == NULL)
       return -1;
 
+    CountAllocation(m_pSegment);
+
     m_entries_count = 0;
   } else {
     assert(m_entries);
@@ -6808,6 +7275,8 @@ long Cluster::CreateBlock(long long id,
       if (entries == NULL)
         return -1;
 
+      CountAllocation(m_pSegment);
+
       BlockEntry** src = m_entries;
       BlockEntry** const src_end = src + m_entries_count;
 
@@ -6921,6 +7390,8 @@ long Cluster::CreateBlockGroup(long long start_offset, long long size,
   if (pEntry == NULL)
     return -1;  // generic error
 
+  CountAllocation(m_pSegment);
+
   BlockGroup* const p = static_cast<BlockGroup*>(pEntry);
 
   const long status = p->Parse();
@@ -6952,6 +7423,8 @@ long Cluster::CreateSimpleBlock(long long st, long long sz) {
   if (pEntry == NULL)
     return -1;  // generic error
 
+  CountAllocation(m_pSegment);
+
   SimpleBlock* const p = static_cast<SimpleBlock*>(pEntry);
 
   const long status = p->Parse();
@@ -7339,6 +7812,8 @@ long Block::Parse(const Cluster* pCluster) {
 
   const int lacing = int(m_flags & 0x06) >> 1;
 
+  CountBlock(pCluster->m_pSegment, lacing);
+
   ++pos;  // consume flags byte
 
   if (lacing == 0) {  // no lacing
@@ -7350,6 +7825,8 @@ long Block::Parse(const Cluster* pCluster) {
     if (m_frames == NULL)
       return -1;
 
+    CountAllocation(pCluster->m_pSegment);
+
     Frame& f = m_frames[0];
     f.pos = pos;
 
@@ -7383,6 +7860,8 @@ long Block::Parse(const Cluster* pCluster) {
   if (m_frames == NULL)
     return -1;
 
+  CountAllocation(pCluster->m_pSegment);
+
   if (!m_frames)
     return E_FILE_FORMAT_INVALID;
 
@@ -28,6 +28,41 @@ class IMkvReader {
   virtual ~IMkvReader();
 };
 
+// Parser statistics collected by a Segment. Statistics are only gathered when
+// the library is built with MKVPARSER_ENABLE_STATS defined; otherwise
+// Segment::GetStats() returns NULL and no counting code is compiled in.
+// Times are in nanoseconds.
+struct SegmentStats {
+  // Call sites of IMkvReader::Read(). |kReadSize| covers every EBML unsigned
+  // integer read by ReadUInt(), including block track numbers, and
+  // |kReadLength| counts the peeks made by GetUIntLength().
+  enum ReadSite {
+    kReadId = 0,
+    kReadSize = 1,
+    kReadLength = 2,
+    kReadPayload = 3,
+    kReadSiteCount = 4
+  };
+
+  SegmentStats();
+  void Init();
+
+  long long read_calls[kReadSiteCount];
+  long long read_bytes[kReadSiteCount];
+
+  long long clusters_parsed;
+  long long blocks_parsed;
+  long long blocks_by_lacing[4];  // indexed by Block::Lacing
+
+  // Clusters, block entries, block frame arrays, cue points and the arrays
+  // indexing them.
+  long long allocations;
+
+  long long parse_headers_time;
+  long long load_cluster_time;
+  long long cues_load_time;
+};
+
 template <typename Type>
 Type* SafeArrayAlloc(unsigned long long num_elements,
                      unsigned long long element_size);
@@ -50,6 +85,14 @@ long ParseElementHeader(IMkvReader* pReader,
 bool Match(IMkvReader*, long long&, unsigned long, long long&);
 bool Match(IMkvReader*, long long&, unsigned long, unsigned char*&, size_t&);
 
+// Searches at most |max_bytes| bytes starting at |pos| for an EBML header: the
+// EBML ID followed by a valid size field and, when already available, a
+// payload that starts with an EBML header child. Returns the position of the
+// header, E_BUFFER_NOT_FULL when more data may still contain one, or
+// E_FILE_FORMAT_INVALID.
+long long FindEBMLHeader(IMkvReader* pReader, long long pos,
+                         long long max_bytes);
+
 void GetVersion(int& major, int& minor, int& build, int& revision);
 
 struct EBMLHeader {
@@ -919,6 +962,12 @@ class Cluster {
   long ParseSimpleBlock(long long, long long&, long&);
   long ParseBlockGroup(long long, long long&, long&);
 
+  // Loads the cluster and, when its size is unknown, parses its remaining
+  // block entries to find where it ends. Entries are recorded as they are
+  // parsed, so walking the cluster later does not parse them again. A cluster
+  // without block entries is not loaded; only its size is found.
+  long ResolveElementSize(long long& pos, long& len) const;
+
   long CreateBlock(long long id, long long pos, long long size,
                    long long discard_padding);
   long CreateBlockGroup(long long start_offset, long long size,
@@ -985,6 +1034,10 @@ class Segment {
   long ParseCues(long long cues_off,  // offset relative to start of segment
                  long long& parse_pos, long& parse_len);
 
+  // Returns the statistics gathered so far, or NULL when the library was
+  // built without MKVPARSER_ENABLE_STATS.
+  const SegmentStats* GetStats() const;
+
  private:
   long long m_pos;  // absolute file posn; what has been consumed so far
   Cluster* m_pUnknownSize;
@@ -1000,6 +1053,11 @@ class Segment {
   long m_clusterPreloadCount;  // number of entries for which m_index < 0
   long m_clusterSize;  // array size
 
+  // Reader that collects |*m_pStats| between the segment and the client's
+  // reader. Owned; both are NULL unless stats are enabled.
+  IMkvReader* m_pStatsReader;
+  SegmentStats* m_pStats;
+
   long DoLoadCluster(long long&, long&);
   long DoLoadClusterUnknownSize(long long&, long&);
   long DoParseNext(const Cluster*&, long long&, long&);
@@ -83,6 +83,8 @@ void MkvReader::Close() {
   }
 }
 
+FILE* MkvReader::GetFile() const { return m_file; }
+
 int MkvReader::Length(long long* total, long long* available) {
   if (m_file == NULL)
     return -1;
@@ -26,6 +26,9 @@ class MkvReader : public IMkvReader {
   virtual int Read(long long position, long length, unsigned char* buffer);
   virtual int Length(long long* total, long long* available);
 
+  // Returns the file being read, or NULL if none is open.
+  FILE* GetFile() const;
+
  private:
   MkvReader(const MkvReader&);
   MkvReader& operator=(const MkvReader&);
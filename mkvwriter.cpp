@@ -12,13 +12,58 @@
 #include <share.h>  // for _SH_DENYWR
 #endif
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
 #include <new>
 
+#include "mkvreader.hpp"
+
 namespace mkvmuxer {
 
-MkvWriter::MkvWriter() : file_(NULL), writer_owns_file_(true) {}
+#ifndef _WIN32
+namespace {
+
+// Vectored writes smaller than this go through the stdio buffer, which
+// combines them with the surrounding element writes.
+const uint64 kMinVectoredWriteSize = BUFSIZ;
+
+// Largest number of buffers passed to a single writev() call.
+const int32 kMaxVectoredWriteBuffers = 8;
+
+}  // namespace
+#endif
+
+MkvWriter::MkvWriter()
+    : file_(NULL),
+      writer_owns_file_(true),
+      position_(0),
+      kernel_copy_source_(NULL) {}
 
-MkvWriter::MkvWriter(FILE* fp) : file_(fp), writer_owns_file_(false) {}
+MkvWriter::MkvWriter(FILE* fp)
+    : file_(fp),
+      writer_owns_file_(false),
+      position_(0),
+      kernel_copy_source_(NULL) {
+  if (file_) {
+#ifdef _MSC_VER
+    const int64 position = _ftelli64(file_);
+#else
+    const int64 position = ftell(file_);
+#endif
+    // Streams such as pipes have no position; count from zero.
+    if (position > 0)
+      position_ = position;
+  }
+}
 
 MkvWriter::~MkvWriter() { Close(); }
 
@@ -33,10 +78,79 @@ int32 MkvWriter::Write(const void* buffer, uint32 length) {
     return -1;
 
   const size_t bytes_written = fwrite(buffer, 1, length, file_);
+  position_ += bytes_written;
 
   return (bytes_written == length) ? 0 : -1;
 }
 
+int32 MkvWriter::WriteV(const WriteBuffer* buffers, int32 count) {
+#ifdef _WIN32
+  return IMkvWriter::WriteV(buffers, count);
+#else
+  if (!file_ || buffers == NULL || count < 0)
+    return -1;
+
+  uint64 total_length = 0;
+  for (int32 i = 0; i < count; ++i)
+    total_length += buffers[i].length;
+
+  // Write to the descriptor directly only when the stream is our own; the
+  // client may still be using a stream passed to MkvWriter(FILE*).
+  if (!writer_owns_file_ || total_length < kMinVectoredWriteSize ||
+      count > kMaxVectoredWriteBuffers) {
+    return IMkvWriter::WriteV(buffers, count);
+  }
+
+  iovec iov[kMaxVectoredWriteBuffers];
+  int iov_count = 0;
+  for (int32 i = 0; i < count; ++i) {
+    if (buffers[i].length == 0)
+      continue;
+
+    if (buffers[i].data == NULL)
+      return -1;
+
+    iov[iov_count].iov_base = const_cast<void*>(buffers[i].data);
+    iov[iov_count].iov_len = buffers[i].length;
+    ++iov_count;
+  }
+
+  // Data already written through |file_| must reach the file first.
+  if (fflush(file_))
+    return -1;
+
+  const int fd = fileno(file_);
+  iovec* next = iov;
+  while (iov_count > 0) {
+    const ssize_t bytes_written = writev(fd, next, iov_count);
+
+    if (bytes_written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    position_ += bytes_written;
+
+    // Skip the buffers written out in full, and the written part of the
+    // first buffer that was not.
+    size_t remaining = static_cast<size_t>(bytes_written);
+    while (iov_count > 0 && remaining >= next->iov_len) {
+      remaining -= next->iov_len;
+      ++next;
+      --iov_count;
+    }
+
+    if (iov_count > 0) {
+      next->iov_base = static_cast<uint8*>(next->iov_base) + remaining;
+      next->iov_len -= remaining;
+    }
+  }
+
+  return 0;
+#endif
+}
+
 bool MkvWriter::Open(const char* filename) {
   if (filename == NULL)
     return false;
@@ -51,6 +165,7 @@ bool MkvWriter::Open(const char* filename) {
 #endif
   if (file_ == NULL)
     return false;
+  position_ = 0;
   return true;
 }
 
@@ -65,11 +180,7 @@ int64 MkvWriter::Position() const {
   if (!file_)
     return 0;
 
-#ifdef _MSC_VER
-  return _ftelli64(file_);
-#else
-  return ftell(file_);
-#endif
+  return position_;
 }
 
 int32 MkvWriter::Position(int64 position) {
@@ -77,9 +188,95 @@ int32 MkvWriter::Position(int64 position) {
     return -1;
 
 #ifdef _MSC_VER
-  return _fseeki64(file_, position, SEEK_SET);
+  const int32 status = _fseeki64(file_, position, SEEK_SET);
+#else
+  const int32 status = fseek(file_, position, SEEK_SET);
+#endif
+  if (status == 0)
+    position_ = position;
+
+  return status;
+}
+
+int64 MkvWriter::CopyFrom(mkvparser::IMkvReader* source, int64 start,
+                          int64 size) {
+  if (source == NULL || source != kernel_copy_source_)
+    return 0;
+
+  return CopyFromFile(kernel_copy_source_->GetFile(), start, size);
+}
+
+int64 MkvWriter::CopyFromFile(FILE* source, int64 start, int64 size) {
+#ifdef __linux__
+  if (!file_ || source == NULL || start < 0 || size <= 0)
+    return 0;
+
+  // Data already written through |file_| must reach the file first.
+  if (fflush(file_))
+    return -1;
+
+  const int in_fd = fileno(source);
+  const int out_fd = fileno(file_);
+  if (in_fd < 0 || out_fd < 0)
+    return 0;
+
+  // Largest number of octets passed to a single system call.
+  const int64 kMaxCopySize = 0x40000000;
+
+#ifdef __NR_copy_file_range
+  bool use_copy_file_range = true;
+#else
+  bool use_copy_file_range = false;
+#endif
+  off_t in_offset = start;
+  int64 copied = 0;
+
+  while (copied < size) {
+    const int64 remaining = size - copied;
+    const size_t length = static_cast<size_t>(
+        remaining > kMaxCopySize ? kMaxCopySize : remaining);
+    ssize_t status = -1;
+
+#ifdef __NR_copy_file_range
+    if (use_copy_file_range) {
+      off_t out_offset = position_;
+      status = syscall(__NR_copy_file_range, in_fd, &in_offset, out_fd,
+                       &out_offset, length, 0);
+
+      // Not supported by the kernel or between these file systems.
+      if (status < 0 && errno != EINTR)
+        use_copy_file_range = false;
+    }
+#endif
+
+    if (!use_copy_file_range) {
+      // sendfile() writes at the file offset of |out_fd|.
+      if (lseek(out_fd, position_, SEEK_SET) != position_)
+        break;
+      status = sendfile(out_fd, in_fd, &in_offset, length);
+    }
+
+    if (status < 0 && errno == EINTR)
+      continue;
+
+    // Stop at errors and at the end of |source|.
+    if (status <= 0)
+      break;
+
+    copied += status;
+    position_ += status;
+  }
+
+  // Leave the stream at the end of the copied data.
+  if (fseek(file_, position_, SEEK_SET))
+    return -1;
+
+  return copied;
 #else
-  return fseek(file_, position, SEEK_SET);
+  (void)source;
+  (void)start;
+  (void)size;
+  return 0;
 #endif
 }
 
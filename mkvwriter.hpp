@@ -14,6 +14,10 @@
 #include "mkvmuxer.hpp"
 #include "mkvmuxertypes.hpp"
 
+namespace mkvparser {
+class MkvReader;
+}  // end namespace
+
 namespace mkvmuxer {
 
 // Default implementation of the IMkvWriter interface on Windows.
@@ -28,8 +32,14 @@ class MkvWriter : public IMkvWriter {
   virtual int32 Position(int64 position);
   virtual bool Seekable() const;
   virtual int32 Write(const void* buffer, uint32 length);
+  virtual int32 WriteV(const WriteBuffer* buffers, int32 count);
   virtual void ElementStartNotify(uint64 element_id, int64 position);
 
+  // Copies with CopyFromFile() when |source| is the reader passed to
+  // set_kernel_copy_source(), and copies nothing otherwise.
+  virtual int64 CopyFrom(mkvparser::IMkvReader* source, int64 start,
+                         int64 size);
+
   // Creates and opens a file for writing. |filename| is the name of the file
   // to open. This function will overwrite the contents of |filename|. Returns
   // true on success.
@@ -38,11 +48,34 @@ class MkvWriter : public IMkvWriter {
   // Closes an opened file.
   void Close();
 
+  // Copies up to |size| octets of |source|, starting at offset |start|, to
+  // the current position, letting the kernel copy between the files with
+  // copy_file_range() or sendfile() on Linux. Returns the number of octets
+  // copied, which is less than |size| when the kernel cannot copy between
+  // the two files and the caller should copy the rest, or -1 if the output
+  // was left in an unknown state.
+  int64 CopyFromFile(FILE* source, int64 start, int64 size);
+
+  // Lets CopyFrom() have the kernel copy data read from |reader| straight
+  // from its file, bypassing both MkvReader::Read() and Write(). Kernel copies
+  // are off by default; pass NULL to turn them off again. |reader| is not
+  // owned and must outlive the copies.
+  void set_kernel_copy_source(const mkvparser::MkvReader* reader) {
+    kernel_copy_source_ = reader;
+  }
+
  private:
   // File handle to output file.
   FILE* file_;
   bool writer_owns_file_;
 
+  // Current position in |file_|, tracked here so that Position() does not
+  // need a system call.
+  int64 position_;
+
+  // Reader whose file CopyFrom() may copy with CopyFromFile(), or NULL.
+  const mkvparser::MkvReader* kernel_copy_source_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MkvWriter);
 };
 
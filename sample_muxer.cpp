@@ -53,6 +53,8 @@ void Usage() {
   printf("  -video_track_number <int>   >0 Changes the video track number\n");
   printf("  -chunking <string>          Chunk output\n");
   printf("  -copy_tags <int>            >0 Copies the tags\n");
+  printf("  -copy_blocks <int>          >0 copies blocks without decoding\n");
+  printf("                              frames (default)\n");
   printf("\n");
   printf("Video options:\n");
   printf("  -display_width <int>        Display width in pixels\n");
@@ -162,6 +164,7 @@ int main(int argc, char* argv[]) {
   int video_track_number = 0;  // 0 tells muxer to decide.
   bool chunking = false;
   bool copy_tags = false;
+  bool copy_blocks = true;
   const char* chunk_name = NULL;
 
   bool output_cues_block_number = true;
@@ -217,6 +220,8 @@ int main(int argc, char* argv[]) {
       chunk_name = argv[++i];
     } else if (!strcmp("-copy_tags", argv[i]) && i < argc_check) {
       copy_tags = strtol(argv[++i], &end, 10) == 0 ? false : true;
+    } else if (!strcmp("-copy_blocks", argv[i]) && i < argc_check) {
+      copy_blocks = strtol(argv[++i], &end, 10) == 0 ? false : true;
     } else if (!strcmp("-display_width", argv[i]) && i < argc_check) {
       display_width = strtol(argv[++i], &end, 10);
     } else if (!strcmp("-display_height", argv[i]) && i < argc_check) {
@@ -283,6 +288,8 @@ int main(int argc, char* argv[]) {
     printf("\n Filename is invalid or error while opening.\n");
     return EXIT_FAILURE;
   }
+  // Blocks and clusters copied from the input may be copied by the kernel.
+  writer.set_kernel_copy_source(&reader);
 
   // Set Segment element attributes
   mkvmuxer::Segment muxer_segment;
@@ -503,34 +510,43 @@ int main(int argc, char* argv[]) {
 
       if ((track_type == Track::kAudio && output_audio) ||
           (track_type == Track::kVideo && output_video)) {
-        const int frame_count = block->GetFrameCount();
+        const uint64 track_number =
+            track_type == Track::kAudio ? aud_track : vid_track;
 
-        for (int i = 0; i < frame_count; ++i) {
-          const mkvparser::Block::Frame& frame = block->GetFrame(i);
-
-          if (frame.len > data_len) {
-            delete[] data;
-            data = new unsigned char[frame.len];
-            if (!data)
-              return EXIT_FAILURE;
-            data_len = frame.len;
+        if (copy_blocks) {
+          if (!muxer_segment.CopyBlock(&reader, block, track_number, time_ns)) {
+            printf("\n Could not copy block.\n");
+            return EXIT_FAILURE;
           }
+        } else {
+          const int frame_count = block->GetFrameCount();
 
-          if (frame.Read(&reader, data))
-            return EXIT_FAILURE;
+          for (int i = 0; i < frame_count; ++i) {
+            const mkvparser::Block::Frame& frame = block->GetFrame(i);
 
-          mkvmuxer::Frame muxer_frame;
-          if (!muxer_frame.Init(data, frame.len))
-            return EXIT_FAILURE;
-          muxer_frame.set_track_number(track_type == Track::kAudio ? aud_track :
-                                                                     vid_track);
-          if (block->GetDiscardPadding())
-            muxer_frame.set_discard_padding(block->GetDiscardPadding());
-          muxer_frame.set_timestamp(time_ns);
-          muxer_frame.set_is_key(block->IsKey());
-          if (!muxer_segment.AddGenericFrame(&muxer_frame)) {
-            printf("\n Could not add frame.\n");
-            return EXIT_FAILURE;
+            if (frame.len > data_len) {
+              delete[] data;
+              data = new unsigned char[frame.len];
+              if (!data)
+                return EXIT_FAILURE;
+              data_len = frame.len;
+            }
+
+            if (frame.Read(&reader, data))
+              return EXIT_FAILURE;
+
+            mkvmuxer::Frame muxer_frame;
+            if (!muxer_frame.Init(data, frame.len))
+              return EXIT_FAILURE;
+            muxer_frame.set_track_number(track_number);
+            if (block->GetDiscardPadding())
+              muxer_frame.set_discard_padding(block->GetDiscardPadding());
+            muxer_frame.set_timestamp(time_ns);
+            muxer_frame.set_is_key(block->IsKey());
+            if (!muxer_segment.AddGenericFrame(&muxer_frame)) {
+              printf("\n Could not add frame.\n");
+              return EXIT_FAILURE;
+            }
           }
         }
       }
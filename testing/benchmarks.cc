@@ -0,0 +1,654 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Parser, muxer and webm2ts benchmarks over synthetic WebM files.
+//
+// Usage: benchmarks [iterations] [name filter]
+//
+// Each benchmark runs |iterations| times (default 5) and reports the median.
+// Results are printed one per line as:
+//   <corpus> <benchmark> <value> <unit>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mkvasyncwriter.hpp"
+#include "mkvbufferedwriter.hpp"
+#include "mkvdirectwriter.hpp"
+#include "mkvmemorywriter.hpp"
+#include "mkvmuxer.hpp"
+#include "mkvparser.hpp"
+#include "mkvreader.hpp"
+#include "mkvwriter.hpp"
+#include "vpxpes2ts.h"
+
+#include "testing/corpus_generator.h"
+#include "testing/test_util.h"
+
+namespace libwebm {
+namespace test {
+
+namespace {
+
+const int kSeeksPerIteration = 200;
+
+typedef std::chrono::steady_clock Clock;
+
+double SecondsSince(const Clock::time_point& start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+void Report(const CorpusOptions& corpus, const char* benchmark, double value,
+            const char* unit) {
+  std::printf("%-24s %-20s %14.3f %s\n", corpus.name.c_str(), benchmark,
+              value, unit);
+}
+
+// Deleter so a Segment can be held in a std::unique_ptr.
+struct SegmentDeleter {
+  void operator()(mkvparser::Segment* segment) const { delete segment; }
+};
+typedef std::unique_ptr<mkvparser::Segment, SegmentDeleter> SegmentPtr;
+
+// Opens |file_name| and parses the segment headers. Returns an empty pointer
+// on failure.
+SegmentPtr OpenSegment(mkvparser::MkvReader* reader,
+                       const std::string& file_name) {
+  if (reader->Open(file_name.c_str()))
+    return SegmentPtr();
+
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  if (ebml_header.Parse(reader, pos) < 0)
+    return SegmentPtr();
+
+  mkvparser::Segment* segment = nullptr;
+  if (mkvparser::Segment::CreateInstance(reader, pos, segment))
+    return SegmentPtr();
+
+  SegmentPtr segment_ptr(segment);
+  if (segment_ptr->ParseHeaders() != 0)
+    return SegmentPtr();
+  return segment_ptr;
+}
+
+// Walks every block of every cluster and reads each frame. Returns the number
+// of frame bytes read, or -1 on error.
+std::int64_t IterateSegment(mkvparser::MkvReader* reader,
+                            mkvparser::Segment* segment) {
+  std::vector<unsigned char> buffer;
+  std::int64_t bytes = 0;
+
+  const mkvparser::Cluster* cluster = segment->GetFirst();
+  while (cluster != nullptr && !cluster->EOS()) {
+    const mkvparser::BlockEntry* entry = nullptr;
+    if (cluster->GetFirst(entry) < 0)
+      return -1;
+
+    while (entry != nullptr && !entry->EOS()) {
+      const mkvparser::Block* const block = entry->GetBlock();
+      for (int i = 0; i < block->GetFrameCount(); ++i) {
+        const mkvparser::Block::Frame& frame = block->GetFrame(i);
+        if (buffer.size() < static_cast<std::size_t>(frame.len))
+          buffer.resize(frame.len);
+        if (frame.Read(reader, &buffer[0]))
+          return -1;
+        bytes += frame.len;
+      }
+      if (cluster->GetNext(entry, entry) < 0)
+        return -1;
+    }
+    cluster = segment->GetNext(cluster);
+  }
+  return bytes;
+}
+
+// Runs |iteration| |iterations| times; |iteration| returns the measured
+// value, or a negative value on error.
+bool Measure(int iterations, const std::function<double()>& iteration,
+             double* median) {
+  std::vector<double> values;
+  for (int i = 0; i < iterations; ++i) {
+    const double value = iteration();
+    if (value < 0)
+      return false;
+    values.push_back(value);
+  }
+  *median = Median(values);
+  return true;
+}
+
+bool BenchmarkMuxer(const CorpusOptions& corpus, int iterations) {
+  double frames_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus]() {
+        const TempFileDeleter output;
+        mkvmuxer::MkvWriter writer;
+        if (!writer.Open(output.name().c_str()))
+          return -1.0;
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(corpus, &writer);
+        const double seconds = SecondsSince(start);
+        writer.Close();
+        return frames < 0 ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok)
+    Report(corpus, "muxer", frames_per_second, "frames/s");
+  return ok;
+}
+
+// Passes the frames to the muxer in batches of one second of video.
+bool BenchmarkBatchMuxer(const CorpusOptions& corpus, int iterations) {
+  CorpusOptions options = corpus;
+  options.batch_frames = options.video_fps;
+  double frames_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&options]() {
+        const TempFileDeleter output;
+        mkvmuxer::MkvWriter writer;
+        if (!writer.Open(output.name().c_str()))
+          return -1.0;
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(options, &writer);
+        const double seconds = SecondsSince(start);
+        writer.Close();
+        return frames < 0 ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok)
+    Report(corpus, "muxer_batch", frames_per_second, "frames/s");
+  return ok;
+}
+
+bool BenchmarkBufferedMuxer(const CorpusOptions& corpus, int iterations) {
+  double frames_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus]() {
+        const TempFileDeleter output;
+        mkvmuxer::MkvWriter file_writer;
+        mkvmuxer::BufferedMkvWriter writer;
+        if (!file_writer.Open(output.name().c_str()) ||
+            !writer.Open(&file_writer)) {
+          return -1.0;
+        }
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(corpus, &writer);
+        const bool flushed = writer.Close();
+        const double seconds = SecondsSince(start);
+        file_writer.Close();
+        return (frames < 0 || !flushed) ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok)
+    Report(corpus, "muxer_buffered", frames_per_second, "frames/s");
+  return ok;
+}
+
+bool BenchmarkAsyncMuxer(const CorpusOptions& corpus, int iterations) {
+  double frames_per_second = 0;
+  double stall_milliseconds = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus, &stall_milliseconds]() {
+        const TempFileDeleter output;
+        mkvmuxer::MkvWriter file_writer;
+        mkvmuxer::AsyncMkvWriter writer;
+        if (!file_writer.Open(output.name().c_str()) ||
+            !writer.Open(&file_writer)) {
+          return -1.0;
+        }
+        // Only the muxer's thread is timed: the remaining writes complete in
+        // Close().
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(corpus, &writer);
+        const double seconds = SecondsSince(start);
+        const bool flushed = writer.Close();
+        file_writer.Close();
+        mkvmuxer::AsyncMkvWriter::Stats stats;
+        writer.GetStats(&stats);
+        stall_milliseconds = stats.stall_time / 1e6;
+        return (frames < 0 || !flushed) ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok) {
+    Report(corpus, "muxer_async", frames_per_second, "frames/s");
+    Report(corpus, "muxer_async_stall", stall_milliseconds, "ms");
+  }
+  return ok;
+}
+
+bool BenchmarkDirectMuxer(const CorpusOptions& corpus, int iterations) {
+  double frames_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus]() {
+        const TempFileDeleter output;
+        mkvmuxer::DirectMkvWriter writer;
+        if (!writer.Open(output.name().c_str()))
+          return -1.0;
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(corpus, &writer);
+        const bool closed = writer.Close();
+        const double seconds = SecondsSince(start);
+        return (frames < 0 || !closed) ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok)
+    Report(corpus, "muxer_direct", frames_per_second, "frames/s");
+  return ok;
+}
+
+bool BenchmarkMemoryMuxer(const CorpusOptions& corpus, int iterations) {
+  // Reuse the writer like a packager muxing one segment after another, so that
+  // the buffer is only allocated in the first iteration.
+  mkvmuxer::MemoryMkvWriter writer;
+  double frames_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus, &writer]() {
+        writer.Clear();
+        const Clock::time_point start = Clock::now();
+        const std::int64_t frames = GenerateCorpus(corpus, &writer);
+        const double seconds = SecondsSince(start);
+        return frames < 0 ? -1.0 : frames / seconds;
+      },
+      &frames_per_second);
+  if (ok)
+    Report(corpus, "muxer_memory", frames_per_second, "frames/s");
+  return ok;
+}
+
+bool BenchmarkCuesBeforeClusters(const CorpusOptions& corpus,
+                                 int iterations) {
+  double milliseconds = 0;
+  std::int64_t cue_count = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus, &cue_count]() {
+        // Only the copy that moves the cues in front of the clusters is
+        // timed.
+        const TempFileDeleter input;
+        const TempFileDeleter output;
+        mkvmuxer::Segment segment;
+        mkvmuxer::MkvWriter writer;
+        if (!writer.Open(input.name().c_str()))
+          return -1.0;
+        const std::int64_t frames = GenerateCorpus(corpus, &writer, &segment);
+        writer.Close();
+        if (frames < 0)
+          return -1.0;
+        cue_count = segment.GetCues()->cue_entries_size();
+
+        mkvparser::MkvReader reader;
+        if (reader.Open(input.name().c_str()) ||
+            !writer.Open(output.name().c_str())) {
+          return -1.0;
+        }
+        writer.set_kernel_copy_source(&reader);
+        const Clock::time_point start = Clock::now();
+        const bool moved = segment.CopyAndMoveCuesBeforeClusters(&reader,
+                                                                 &writer);
+        const double seconds = SecondsSince(start);
+        writer.Close();
+        return moved ? seconds * 1000 : -1.0;
+      },
+      &milliseconds);
+  if (ok) {
+    Report(corpus, "cues_move", milliseconds, "ms");
+    Report(corpus, "cues_move_per_cue", milliseconds * 1e6 / cue_count,
+           "ns/cue");
+  }
+  return ok;
+}
+
+bool BenchmarkCuesFirst(const CorpusOptions& corpus, int iterations) {
+  // Time to produce the file with Cues before Clusters, either by copying it
+  // or by writing the Cues into space reserved up front.
+  for (const bool reserve_cues : {false, true}) {
+    CorpusOptions options = corpus;
+    options.reserve_cues = reserve_cues;
+    double milliseconds = 0;
+    const bool ok = Measure(
+        iterations,
+        [&options]() {
+          const TempFileDeleter output;
+          const Clock::time_point start = Clock::now();
+          if (!GenerateCorpusFile(options, output.name()))
+            return -1.0;
+          return SecondsSince(start) * 1000;
+        },
+        &milliseconds);
+    if (!ok)
+      return false;
+    Report(corpus, reserve_cues ? "cues_first_reserved" : "cues_first_copy",
+           milliseconds, "ms");
+  }
+  return true;
+}
+
+// Forwards reads to another reader, so that ChunkedCopy() copies through its
+// buffer instead of letting the kernel copy the file.
+class ForwardingMkvReader : public mkvparser::IMkvReader {
+ public:
+  explicit ForwardingMkvReader(mkvparser::IMkvReader* reader)
+      : reader_(reader) {}
+
+  int Read(long long position, long length, unsigned char* buffer) override {
+    return reader_->Read(position, length, buffer);
+  }
+  int Length(long long* total, long long* available) override {
+    return reader_->Length(total, available);
+  }
+
+ private:
+  mkvparser::IMkvReader* const reader_;
+};
+
+bool BenchmarkChunkedCopy(const CorpusOptions& corpus,
+                          const std::string& file_name, int iterations) {
+  const std::int64_t size = GetFileSize(file_name);
+  for (const bool buffered : {false, true}) {
+    double megabytes_per_second = 0;
+    const bool ok = Measure(
+        iterations,
+        [&file_name, size, buffered]() {
+          const TempFileDeleter output;
+          mkvparser::MkvReader reader;
+          mkvmuxer::MkvWriter writer;
+          if (reader.Open(file_name.c_str()) ||
+              !writer.Open(output.name().c_str())) {
+            return -1.0;
+          }
+          writer.set_kernel_copy_source(&reader);
+          ForwardingMkvReader forwarding_reader(&reader);
+          mkvparser::IMkvReader* const source =
+              buffered ? static_cast<mkvparser::IMkvReader*>(&forwarding_reader)
+                       : &reader;
+          const Clock::time_point start = Clock::now();
+          const bool copied = mkvmuxer::ChunkedCopy(source, &writer, 0, size);
+          writer.Close();
+          const double seconds = SecondsSince(start);
+          return copied ? size / seconds / (1024 * 1024) : -1.0;
+        },
+        &megabytes_per_second);
+    if (!ok)
+      return false;
+    Report(corpus, buffered ? "chunked_copy_buffered" : "chunked_copy",
+           megabytes_per_second, "MiB/s");
+  }
+  return true;
+}
+
+bool BenchmarkParserOpen(const CorpusOptions& corpus,
+                         const std::string& file_name, int iterations) {
+  double milliseconds = 0;
+  const bool ok = Measure(
+      iterations,
+      [&file_name]() {
+        mkvparser::MkvReader reader;
+        const Clock::time_point start = Clock::now();
+        const SegmentPtr segment = OpenSegment(&reader, file_name);
+        const double seconds = SecondsSince(start);
+        return segment ? seconds * 1000 : -1.0;
+      },
+      &milliseconds);
+  if (ok)
+    Report(corpus, "parser_open", milliseconds, "ms");
+  return ok;
+}
+
+bool BenchmarkParserIterate(const CorpusOptions& corpus,
+                            const std::string& file_name, int iterations) {
+  double megabytes_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&file_name]() {
+        mkvparser::MkvReader reader;
+        const Clock::time_point start = Clock::now();
+        const SegmentPtr segment = OpenSegment(&reader, file_name);
+        if (!segment || segment->Load() < 0)
+          return -1.0;
+        const std::int64_t bytes = IterateSegment(&reader, segment.get());
+        const double seconds = SecondsSince(start);
+        return bytes < 0 ? -1.0 : bytes / seconds / (1024 * 1024);
+      },
+      &megabytes_per_second);
+  if (ok)
+    Report(corpus, "parser_iterate", megabytes_per_second, "MiB/s");
+  return ok;
+}
+
+// Seeks the first track to |kSeeksPerIteration| pseudo random times, through
+// the Cues when present and through Track::Seek otherwise. Each iteration
+// uses a freshly loaded segment so that lazily parsed clusters are counted.
+bool BenchmarkParserSeek(const CorpusOptions& corpus,
+                         const std::string& file_name, int iterations) {
+  double microseconds = 0;
+  const bool ok = Measure(
+      iterations,
+      [&corpus, &file_name]() {
+        mkvparser::MkvReader reader;
+        const SegmentPtr segment = OpenSegment(&reader, file_name);
+        if (!segment || segment->Load() < 0)
+          return -1.0;
+
+        const mkvparser::Track* const track =
+            segment->GetTracks()->GetTrackByIndex(0);
+        const mkvparser::Cues* const cues = segment->GetCues();
+        if (track == nullptr)
+          return -1.0;
+        if (cues != nullptr) {
+          while (!cues->DoneParsing())
+            cues->LoadCuePoint();
+        }
+
+        const long long duration_ns =
+            static_cast<long long>(corpus.duration_ms) * 1000000;
+        std::uint32_t state = corpus.seed;
+        const Clock::time_point start = Clock::now();
+        for (int i = 0; i < kSeeksPerIteration; ++i) {
+          state = state * 1664525 + 1013904223;
+          const long long time_ns = (state >> 8) % duration_ns;
+          const mkvparser::BlockEntry* entry = nullptr;
+          if (cues != nullptr && cues->GetCount() > 0) {
+            const mkvparser::CuePoint* cue_point = nullptr;
+            const mkvparser::CuePoint::TrackPosition* position = nullptr;
+            if (cues->Find(time_ns, track, cue_point, position))
+              entry = cues->GetBlock(cue_point, position);
+          } else if (track->Seek(time_ns, entry) < 0) {
+            return -1.0;
+          }
+          if (entry == nullptr)
+            return -1.0;
+        }
+        return SecondsSince(start) * 1e6 / kSeeksPerIteration;
+      },
+      &microseconds);
+  if (ok)
+    Report(corpus, "parser_seek", microseconds, "us/seek");
+  return ok;
+}
+
+bool BenchmarkWebm2Ts(const CorpusOptions& corpus,
+                      const std::string& file_name, int iterations) {
+  const double input_megabytes =
+      static_cast<double>(GetFileSize(file_name)) / (1024 * 1024);
+  double megabytes_per_second = 0;
+  const bool ok = Measure(
+      iterations,
+      [&file_name, input_megabytes]() {
+        const TempFileDeleter output;
+        VpxPes2Ts converter(file_name, output.name());
+        const Clock::time_point start = Clock::now();
+        if (!converter.ConvertToFile())
+          return -1.0;
+        return input_megabytes / SecondsSince(start);
+      },
+      &megabytes_per_second);
+  if (ok)
+    Report(corpus, "webm2ts", megabytes_per_second, "MiB/s");
+  return ok;
+}
+
+std::vector<CorpusOptions> GetCorpora() {
+  std::vector<CorpusOptions> corpora;
+
+  CorpusOptions video;
+  video.name = "video_1s_clusters";
+  video.duration_ms = 120000;
+  corpora.push_back(video);
+
+  CorpusOptions av = video;
+  av.name = "av_5s_clusters";
+  av.audio_tracks = 1;
+  av.keyframe_interval = 150;
+  av.seed = 2;
+  corpora.push_back(av);
+
+  CorpusOptions block_groups = av;
+  block_groups.name = "av_block_groups";
+  block_groups.block_groups = true;
+  block_groups.seed = 3;
+  corpora.push_back(block_groups);
+
+  CorpusOptions small_clusters = av;
+  small_clusters.name = "av_64k_clusters";
+  small_clusters.max_cluster_size = 64 * 1024;
+  small_clusters.keyframe_interval = 300;
+  small_clusters.seed = 4;
+  corpora.push_back(small_clusters);
+
+  CorpusOptions dense_cues = video;
+  dense_cues.name = "video_dense_cues";
+  dense_cues.keyframe_interval = 3;
+  dense_cues.video_frame_size = 1024;
+  dense_cues.cues_before_clusters = true;
+  dense_cues.seed = 5;
+  corpora.push_back(dense_cues);
+
+  // One cluster, and so one cue point, per frame: 100k cue points.
+  CorpusOptions many_cues = video;
+  many_cues.name = "video_100k_cues";
+  many_cues.duration_ms = 100000 * 1000 / 30;
+  many_cues.keyframe_interval = 1;
+  many_cues.video_frame_size = 16;
+  many_cues.cues_before_clusters = true;
+  many_cues.seed = 9;
+  corpora.push_back(many_cues);
+
+  CorpusOptions audio = video;
+  audio.name = "audio_only";
+  audio.video_tracks = 0;
+  audio.audio_tracks = 1;
+  audio.duration_ms = 600000;
+  audio.seed = 10;
+  corpora.push_back(audio);
+
+  CorpusOptions laced_audio = audio;
+  laced_audio.name = "audio_laced";
+  laced_audio.max_laced_frames = 8;
+  corpora.push_back(laced_audio);
+
+  CorpusOptions multi_track = av;
+  multi_track.name = "multi_track";
+  multi_track.video_tracks = 2;
+  multi_track.audio_tracks = 4;
+  multi_track.seed = 6;
+  corpora.push_back(multi_track);
+
+  CorpusOptions no_cues = av;
+  no_cues.name = "av_no_cues";
+  no_cues.output_cues = false;
+  no_cues.seed = 7;
+  corpora.push_back(no_cues);
+
+  CorpusOptions live = av;
+  live.name = "av_live";
+  live.live = true;
+  live.seed = 8;
+  corpora.push_back(live);
+
+  return corpora;
+}
+
+}  // namespace
+
+int RunBenchmarks(int iterations, const char* filter) {
+  int failures = 0;
+
+  for (const CorpusOptions& corpus : GetCorpora()) {
+    if (filter != nullptr && corpus.name.find(filter) == std::string::npos)
+      continue;
+
+    const TempFileDeleter corpus_file;
+    if (!GenerateCorpusFile(corpus, corpus_file.name())) {
+      std::fprintf(stderr, "%s: corpus generation failed.\n",
+                   corpus.name.c_str());
+      ++failures;
+      continue;
+    }
+
+    const std::string& file_name = corpus_file.name();
+    bool ok = BenchmarkMuxer(corpus, iterations);
+    ok = BenchmarkBatchMuxer(corpus, iterations) && ok;
+    ok = BenchmarkBufferedMuxer(corpus, iterations) && ok;
+    ok = BenchmarkMemoryMuxer(corpus, iterations) && ok;
+    ok = BenchmarkAsyncMuxer(corpus, iterations) && ok;
+    ok = BenchmarkDirectMuxer(corpus, iterations) && ok;
+    ok = BenchmarkChunkedCopy(corpus, file_name, iterations) && ok;
+    ok = BenchmarkParserOpen(corpus, file_name, iterations) && ok;
+    ok = BenchmarkParserIterate(corpus, file_name, iterations) && ok;
+    ok = BenchmarkParserSeek(corpus, file_name, iterations) && ok;
+    if (corpus.video_tracks > 0)
+      ok = BenchmarkWebm2Ts(corpus, file_name, iterations) && ok;
+    if (corpus.cues_before_clusters && corpus.output_cues) {
+      ok = BenchmarkCuesBeforeClusters(corpus, iterations) && ok;
+      ok = BenchmarkCuesFirst(corpus, iterations) && ok;
+    }
+
+    if (!ok) {
+      std::fprintf(stderr, "%s: benchmark failed.\n", corpus.name.c_str());
+      ++failures;
+    }
+  }
+
+  return failures;
+}
+
+}  // namespace test
+}  // namespace libwebm
+
+int main(int argc, char* argv[]) {
+  int iterations = 5;
+  if (argc > 1)
+    iterations = std::atoi(argv[1]);
+  if (iterations < 1) {
+    std::fprintf(stderr, "Usage: %s [iterations] [name filter]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char* const filter = argc > 2 ? argv[2] : nullptr;
+  return libwebm::test::RunBenchmarks(iterations, filter) == 0 ? EXIT_SUCCESS
+                                                              : EXIT_FAILURE;
+}
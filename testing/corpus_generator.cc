@@ -0,0 +1,301 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "testing/corpus_generator.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "mkvmuxer.hpp"
+#include "mkvreader.hpp"
+#include "mkvwriter.hpp"
+
+#include "testing/test_util.h"
+
+namespace libwebm {
+namespace test {
+
+namespace {
+
+const std::uint64_t kNanosecondsPerMillisecond = 1000000;
+
+// Small deterministic PRNG (xorshift32); std:: engines are not guaranteed to
+// produce the same sequence across standard library implementations.
+class Random {
+ public:
+  explicit Random(std::uint32_t seed) : state_(seed ? seed : 0x9E3779B9) {}
+
+  std::uint32_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 17;
+    state_ ^= state_ << 5;
+    return state_;
+  }
+
+  // Returns a value in [size / 2, size * 3 / 2].
+  std::size_t FrameSize(std::size_t size) {
+    const std::size_t low = size / 2;
+    const std::size_t size_range = size + 1;
+    return size > 1 ? low + Next() % size_range : 1;
+  }
+
+ private:
+  std::uint32_t state_;
+};
+
+// Forwards writes to another writer while reporting itself as not seekable,
+// as a live stream sink would.
+class NonSeekableWriter : public mkvmuxer::IMkvWriter {
+ public:
+  explicit NonSeekableWriter(mkvmuxer::IMkvWriter* writer) : writer_(writer) {}
+
+  mkvmuxer::int32 Write(const void* buf, mkvmuxer::uint32 len) override {
+    return writer_->Write(buf, len);
+  }
+  mkvmuxer::int64 Position() const override { return writer_->Position(); }
+  mkvmuxer::int32 Position(mkvmuxer::int64) override { return -1; }
+  bool Seekable() const override { return false; }
+  void ElementStartNotify(mkvmuxer::uint64 element_id,
+                          mkvmuxer::int64 position) override {
+    writer_->ElementStartNotify(element_id, position);
+  }
+  bool ElementStartNotifyEnabled() const override {
+    return writer_->ElementStartNotifyEnabled();
+  }
+
+ private:
+  mkvmuxer::IMkvWriter* const writer_;
+};
+
+struct TrackState {
+  std::uint64_t number = 0;
+  bool is_video = false;
+  std::uint64_t frame_duration_ns = 0;
+  std::uint64_t next_timestamp_ns = 0;
+  std::int64_t frame_index = 0;
+};
+
+bool MuxCorpus(const CorpusOptions& options, mkvmuxer::IMkvWriter* writer,
+               mkvmuxer::Segment* segment, std::int64_t* frame_count) {
+  if (options.video_tracks < 0 || options.audio_tracks < 0 ||
+      options.video_tracks + options.audio_tracks < 1 ||
+      options.video_fps <= 0 || options.audio_frame_ms <= 0 ||
+      options.keyframe_interval <= 0 || options.batch_frames < 0) {
+    return false;
+  }
+
+  if (!segment->Init(writer))
+    return false;
+
+  segment->set_mode(options.live ? mkvmuxer::Segment::kLive
+                                 : mkvmuxer::Segment::kFile);
+  segment->OutputCues(options.output_cues && !options.live);
+  if (options.max_cluster_duration_ms > 0) {
+    segment->set_max_cluster_duration(options.max_cluster_duration_ms *
+                                      kNanosecondsPerMillisecond);
+  }
+  if (options.max_cluster_size > 0)
+    segment->set_max_cluster_size(options.max_cluster_size);
+
+  mkvmuxer::SegmentInfo* const info = segment->GetSegmentInfo();
+  info->set_writing_app(kAppString);
+  info->set_muxing_app(kAppString);
+
+  std::vector<TrackState> tracks;
+  for (int i = 0; i < options.video_tracks; ++i) {
+    TrackState track;
+    track.number = segment->AddVideoTrack(kWidth, kHeight, 0);
+    if (track.number == 0)
+      return false;
+    track.is_video = true;
+    track.frame_duration_ns = 1000000000ULL / options.video_fps;
+    tracks.push_back(track);
+  }
+  for (int i = 0; i < options.audio_tracks; ++i) {
+    TrackState track;
+    track.number = segment->AddAudioTrack(48000, kChannels, 0);
+    if (track.number == 0)
+      return false;
+    mkvmuxer::AudioTrack* const audio_track =
+        static_cast<mkvmuxer::AudioTrack*>(
+            segment->GetTrackByNumber(track.number));
+    if (!audio_track->SetMaxLacedFrames(options.max_laced_frames))
+      return false;
+    track.frame_duration_ns =
+        options.audio_frame_ms * kNanosecondsPerMillisecond;
+    // Laced frames are only timed through DefaultDuration.
+    if (options.max_laced_frames > 1)
+      audio_track->set_default_duration(track.frame_duration_ns);
+    tracks.push_back(track);
+  }
+
+  if (options.output_cues && !options.live && options.video_tracks > 0 &&
+      !segment->CuesTrack(tracks[0].number)) {
+    return false;
+  }
+
+  const std::uint64_t end_ns =
+      options.duration_ms * kNanosecondsPerMillisecond;
+
+  if (options.cues_before_clusters && options.reserve_cues &&
+      options.output_cues && !options.live && options.video_tracks > 0) {
+    // One cue point per cluster, and a cluster per video key frame.
+    const std::uint64_t cue_interval_ns =
+        tracks[0].frame_duration_ns * options.keyframe_interval;
+    if (!segment->ReserveCuesSpace(
+            segment->EstimateCuesSize(end_ns, cue_interval_ns))) {
+      return false;
+    }
+  }
+  const std::size_t max_frame_size =
+      (options.video_frame_size > options.audio_frame_size
+           ? options.video_frame_size
+           : options.audio_frame_size) * 3 / 2 + 1;
+
+  Random random(options.seed);
+  std::vector<std::uint8_t> data(max_frame_size);
+  for (std::size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<std::uint8_t>(random.Next());
+
+  // Frames of the current batch, or the frame being added when not batching.
+  const int batch_capacity =
+      options.batch_frames > 0 ? options.batch_frames : 1;
+  std::unique_ptr<mkvmuxer::Frame[]> frames(
+      new mkvmuxer::Frame[batch_capacity]);
+  std::vector<const mkvmuxer::Frame*> batch;
+
+  *frame_count = 0;
+
+  for (;;) {
+    // Emit frames in timestamp order; ties go to the lowest track number.
+    TrackState* next = nullptr;
+    for (TrackState& track : tracks) {
+      if (track.next_timestamp_ns < end_ns &&
+          (next == nullptr ||
+           track.next_timestamp_ns < next->next_timestamp_ns)) {
+        next = &track;
+      }
+    }
+    if (next == nullptr) {
+      if (!batch.empty() &&
+          !segment->AddFrames(batch.data(), static_cast<int>(batch.size()))) {
+        return false;
+      }
+      break;
+    }
+
+    const std::size_t size = random.FrameSize(
+        next->is_video ? options.video_frame_size : options.audio_frame_size);
+    const std::size_t offset = random.Next() % (data.size() - size + 1);
+    const bool is_key =
+        !next->is_video || next->frame_index % options.keyframe_interval == 0;
+
+    mkvmuxer::Frame& frame = frames[batch.size()];
+    frame.Reset();
+    if (!frame.Init(&data[offset], size))
+      return false;
+    frame.set_track_number(next->number);
+    frame.set_timestamp(next->next_timestamp_ns);
+    frame.set_is_key(is_key);
+    if (options.block_groups && next->is_video && !is_key)
+      frame.set_duration(next->frame_duration_ns);
+
+    if (options.batch_frames > 0) {
+      batch.push_back(&frame);
+      if (static_cast<int>(batch.size()) == options.batch_frames) {
+        if (!segment->AddFrames(batch.data(), options.batch_frames))
+          return false;
+        batch.clear();
+      }
+    } else if (!segment->AddGenericFrame(&frame)) {
+      return false;
+    }
+
+    ++*frame_count;
+    ++next->frame_index;
+    next->next_timestamp_ns += next->frame_duration_ns;
+  }
+
+  return segment->Finalize();
+}
+
+}  // namespace
+
+std::int64_t GenerateCorpus(const CorpusOptions& options,
+                            mkvmuxer::IMkvWriter* writer) {
+  mkvmuxer::Segment segment;
+  return GenerateCorpus(options, writer, &segment);
+}
+
+std::int64_t GenerateCorpus(const CorpusOptions& options,
+                            mkvmuxer::IMkvWriter* writer,
+                            mkvmuxer::Segment* segment) {
+  if (writer == nullptr || segment == nullptr)
+    return -1;
+
+  NonSeekableWriter live_writer(writer);
+  if (options.live)
+    writer = &live_writer;
+
+  std::int64_t frame_count = 0;
+  if (!MuxCorpus(options, writer, segment, &frame_count))
+    return -1;
+  return frame_count;
+}
+
+bool GenerateCorpusFile(const CorpusOptions& options,
+                        const std::string& file_name) {
+  mkvmuxer::MkvWriter writer;
+  mkvmuxer::Segment segment;
+  std::int64_t frame_count = 0;
+
+  if (options.live || !options.cues_before_clusters) {
+    if (!writer.Open(file_name.c_str()))
+      return false;
+    NonSeekableWriter live_writer(&writer);
+    mkvmuxer::IMkvWriter* const output =
+        options.live ? static_cast<mkvmuxer::IMkvWriter*>(&live_writer)
+                     : &writer;
+    const bool ok = MuxCorpus(options, output, &segment, &frame_count);
+    writer.Close();
+    return ok;
+  }
+
+  // With reserved space the file is muxed in one pass, unless the Cues turn
+  // out not to fit. Otherwise mux to a temporary file and copy it with the
+  // Cues moved in front.
+  const TempFileDeleter temp_file;
+  const std::string& mux_name =
+      options.reserve_cues ? file_name : temp_file.name();
+  if (!writer.Open(mux_name.c_str()))
+    return false;
+  const bool muxed = MuxCorpus(options, &writer, &segment, &frame_count);
+  writer.Close();
+  if (!muxed)
+    return false;
+  if (segment.cues_position() == mkvmuxer::Segment::kBeforeClusters)
+    return true;
+
+  const std::string& copy_name =
+      options.reserve_cues ? temp_file.name() : file_name;
+  mkvparser::MkvReader reader;
+  if (reader.Open(mux_name.c_str()))
+    return false;
+  if (!writer.Open(copy_name.c_str()))
+    return false;
+  const bool ok = segment.CopyAndMoveCuesBeforeClusters(&reader, &writer);
+  reader.Close();
+  writer.Close();
+  if (ok && options.reserve_cues)
+    return std::rename(copy_name.c_str(), file_name.c_str()) == 0;
+  return ok;
+}
+
+}  // namespace test
+}  // namespace libwebm
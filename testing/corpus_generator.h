@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef LIBWEBM_TESTING_CORPUS_GENERATOR_H_
+#define LIBWEBM_TESTING_CORPUS_GENERATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace mkvmuxer {
+class IMkvWriter;
+class Segment;
+}  // namespace mkvmuxer
+
+namespace libwebm {
+namespace test {
+
+// Describes a synthetic WebM file. Files are produced with mkvmuxer from a
+// seeded pseudo random frame size/content sequence, so the same options always
+// produce the same bytes.
+struct CorpusOptions {
+  std::string name;
+
+  int video_tracks = 1;
+  int audio_tracks = 0;
+
+  std::uint64_t duration_ms = 10000;
+  int video_fps = 30;
+  int audio_frame_ms = 20;
+
+  // Frame sizes are drawn uniformly from [size / 2, size * 3 / 2].
+  std::size_t video_frame_size = 4096;
+  std::size_t audio_frame_size = 160;
+
+  // Every |keyframe_interval|-th video frame is a key frame. The muxer starts
+  // a cluster on each video key frame, and writes one cue per cluster, so this
+  // also sets the cluster and cue density.
+  int keyframe_interval = 30;
+
+  // Muxer cluster limits; 0 leaves the muxer default in place.
+  std::uint64_t max_cluster_duration_ms = 0;
+  std::uint64_t max_cluster_size = 0;
+
+  // Write video inter frames as BlockGroups (with ReferenceBlock and
+  // BlockDuration) instead of SimpleBlocks.
+  bool block_groups = false;
+
+  // Pass frames to the muxer in batches of this many with
+  // Segment::AddFrames(); 0 adds them one at a time.
+  int batch_frames = 0;
+
+  // Lace up to this many consecutive audio frames of a track into one
+  // SimpleBlock; 0 writes one frame per block.
+  int max_laced_frames = 0;
+
+  bool output_cues = true;
+  bool cues_before_clusters = false;
+
+  // With |cues_before_clusters|, reserve space for the Cues in front of the
+  // Clusters instead of moving them there with a second copy of the file.
+  bool reserve_cues = false;
+
+  // Mux in live mode through a non-seekable writer, so that the segment and
+  // every cluster are written with unknown sizes, as in live recordings.
+  // Cues are not written in this mode.
+  bool live = false;
+
+  std::uint32_t seed = 1;
+};
+
+// Muxes the file described by |options| into |writer|. Returns the number of
+// frames written, or -1 on error.
+std::int64_t GenerateCorpus(const CorpusOptions& options,
+                            mkvmuxer::IMkvWriter* writer);
+
+// As above, muxing with |segment|, which is left finalized so that it can be
+// passed to Segment::CopyAndMoveCuesBeforeClusters() afterwards.
+std::int64_t GenerateCorpus(const CorpusOptions& options,
+                            mkvmuxer::IMkvWriter* writer,
+                            mkvmuxer::Segment* segment);
+
+// Writes the file described by |options| to |file_name|. Returns true on
+// success.
+bool GenerateCorpusFile(const CorpusOptions& options,
+                        const std::string& file_name);
+
+}  // namespace test
+}  // namespace libwebm
+
+#endif  // LIBWEBM_TESTING_CORPUS_GENERATOR_H_
@@ -5,24 +5,41 @@
 // tree. An additional intellectual property rights grant can be found
 // in the file PATENTS.  All contributing project authors may
 // be found in the AUTHORS file in the root of the source tree.
+#include <algorithm>
 #include <array>
 #include <cstddef>
+#include <cstdio>
 #include <initializer_list>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
 
+#include "mkvasyncwriter.hpp"
+#include "mkvbufferedwriter.hpp"
+#include "mkvdirectwriter.hpp"
+#include "mkvencryptor.hpp"
+#include "mkvmemorywriter.hpp"
 #include "mkvmuxer.hpp"
+#include "mkvparser.hpp"
 #include "mkvreader.hpp"
 #include "mkvwriter.hpp"
+#include "webmids.hpp"
 
 #include "common/libwebm_utils.h"
 #include "testing/test_util.h"
 
+using ::mkvmuxer::AesCtrCipher;
+using ::mkvmuxer::AsyncMkvWriter;
 using ::mkvmuxer::AudioTrack;
+using ::mkvmuxer::BufferedMkvWriter;
 using ::mkvmuxer::Chapter;
+using ::mkvmuxer::DirectMkvWriter;
 using ::mkvmuxer::Frame;
+using ::mkvmuxer::FrameEncryptor;
+using ::mkvmuxer::MemoryMkvWriter;
 using ::mkvmuxer::MkvWriter;
 using ::mkvmuxer::Segment;
 using ::mkvmuxer::SegmentInfo;
@@ -567,6 +584,1879 @@ TEST_F(MuxerTest, BlockWithDiscardPadding) {
   EXPECT_TRUE(CompareFiles(GetTestFilePath("discard_padding.webm"), filename_));
 }
 
+TEST_F(MuxerTest, BufferedWriter) {
+  // Small buffers force flushes and seeks outside the buffered data, the
+  // default buffer holds the whole file.
+  const std::uint32_t kBufferSizes[] = {16, 256,
+                                        BufferedMkvWriter::kDefaultBufferSize};
+
+  for (const std::uint32_t buffer_size : kBufferSizes) {
+    const TempFileDeleter output;
+    MkvWriter file_writer;
+    ASSERT_TRUE(file_writer.Open(output.name().c_str()));
+    BufferedMkvWriter writer;
+    ASSERT_TRUE(writer.Open(&file_writer, buffer_size));
+
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    SegmentInfo* const info = segment.GetSegmentInfo();
+    info->set_writing_app(kAppString);
+    info->set_muxing_app(kAppString);
+    segment.OutputCues(true);
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 0, true));
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 2000000, false));
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 4000000, false));
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 6000000, true));
+    EXPECT_TRUE(segment.AddCuePoint(4000000, kVideoTrackNumber));
+    EXPECT_TRUE(segment.Finalize());
+
+    EXPECT_TRUE(writer.Close());
+    file_writer.Close();
+
+    EXPECT_TRUE(CompareFiles(GetTestFilePath("output_cues.webm"),
+                             output.name()))
+        << "buffer_size: " << buffer_size;
+  }
+}
+
+TEST_F(MuxerTest, MemoryWriter) {
+  MemoryMkvWriter writer;
+
+  Segment segment;
+  ASSERT_TRUE(segment.Init(&writer));
+  SegmentInfo* const info = segment.GetSegmentInfo();
+  info->set_writing_app(kAppString);
+  info->set_muxing_app(kAppString);
+  segment.OutputCues(true);
+  ASSERT_EQ(kVideoTrackNumber,
+            segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+  segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+
+  EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber, 0,
+                               true));
+  EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                               2000000, false));
+  EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                               4000000, false));
+  EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                               6000000, true));
+  EXPECT_TRUE(segment.AddCuePoint(4000000, kVideoTrackNumber));
+  EXPECT_TRUE(segment.Finalize());
+
+  const std::vector<std::uint8_t> expected =
+      ReadFileBytes(GetTestFilePath("output_cues.webm"));
+  ASSERT_EQ(expected.size(), writer.size());
+  EXPECT_EQ(expected.size(), static_cast<std::size_t>(writer.Position()));
+
+  mkvmuxer::uint64 length = 0;
+  std::unique_ptr<mkvmuxer::uint8[]> data(writer.Release(&length));
+  ASSERT_TRUE(data != nullptr);
+  ASSERT_EQ(expected.size(), length);
+  EXPECT_TRUE(std::equal(expected.begin(), expected.end(), data.get()));
+
+  EXPECT_EQ(0u, writer.size());
+  EXPECT_EQ(0, writer.Position());
+  EXPECT_TRUE(writer.Release(&length) == nullptr);
+  EXPECT_EQ(0u, length);
+}
+
+// Fails every write once |limit| octets have been written.
+class FailingMkvWriter : public MkvWriter {
+ public:
+  explicit FailingMkvWriter(std::int64_t limit) : limit_(limit) {}
+
+  mkvmuxer::int32 Write(const void* buffer, mkvmuxer::uint32 length) override {
+    if (Position() + length > limit_)
+      return -1;
+    return MkvWriter::Write(buffer, length);
+  }
+
+ private:
+  const std::int64_t limit_;
+};
+
+TEST_F(MuxerTest, AsyncWriter) {
+  // Small buffers force the muxer to wait for the I/O thread and seek-back
+  // patches outside the buffer being filled, the default buffers hold the
+  // whole file.
+  const std::uint32_t kBufferSizes[] = {16, 256,
+                                        AsyncMkvWriter::kDefaultBufferSize};
+  const int kBufferCounts[] = {2, AsyncMkvWriter::kDefaultBufferCount};
+
+  for (const std::uint32_t buffer_size : kBufferSizes) {
+    for (const int buffer_count : kBufferCounts) {
+      const TempFileDeleter output;
+      MkvWriter file_writer;
+      ASSERT_TRUE(file_writer.Open(output.name().c_str()));
+      AsyncMkvWriter writer;
+      ASSERT_TRUE(writer.Open(&file_writer, buffer_size, buffer_count));
+
+      Segment segment;
+      ASSERT_TRUE(segment.Init(&writer));
+      SegmentInfo* const info = segment.GetSegmentInfo();
+      info->set_writing_app(kAppString);
+      info->set_muxing_app(kAppString);
+      segment.OutputCues(true);
+      ASSERT_EQ(kVideoTrackNumber,
+                segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+      segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+
+      EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                   kVideoTrackNumber, 0, true));
+      EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                   kVideoTrackNumber, 2000000, false));
+      EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                   kVideoTrackNumber, 4000000, false));
+      EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                   kVideoTrackNumber, 6000000, true));
+      EXPECT_TRUE(segment.AddCuePoint(4000000, kVideoTrackNumber));
+      EXPECT_TRUE(segment.Finalize());
+
+      EXPECT_TRUE(writer.Close());
+      const std::int64_t file_size = file_writer.Position();
+      file_writer.Close();
+
+      EXPECT_TRUE(
+          CompareFiles(GetTestFilePath("output_cues.webm"), output.name()))
+          << "buffer_size: " << buffer_size
+          << " buffer_count: " << buffer_count;
+
+      AsyncMkvWriter::Stats stats;
+      writer.GetStats(&stats);
+      EXPECT_GT(stats.buffers_written, 0u);
+      EXPECT_GE(stats.bytes_written, static_cast<std::uint64_t>(file_size));
+      EXPECT_GT(stats.max_queue_depth, 0);
+      EXPECT_GE(stats.write_time, stats.max_write_time);
+      if (buffer_size == 16) {
+        EXPECT_GT(stats.seeks, 0u);
+      }
+    }
+  }
+
+  // Write errors on the I/O thread are reported to the muxer.
+  const TempFileDeleter output;
+  FailingMkvWriter file_writer(100);
+  ASSERT_TRUE(file_writer.Open(output.name().c_str()));
+  AsyncMkvWriter writer;
+  ASSERT_TRUE(writer.Open(&file_writer, 64, 2));
+  std::uint8_t data[64] = {};
+  EXPECT_EQ(0, writer.Write(data, sizeof(data)));
+  EXPECT_EQ(0, writer.Write(data, sizeof(data)));
+  EXPECT_FALSE(writer.Flush());
+  EXPECT_NE(0, writer.Write(data, sizeof(data)));
+  EXPECT_FALSE(writer.Close());
+  file_writer.Close();
+}
+
+TEST_F(MuxerTest, DirectWriter) {
+  // Muxes enough frames to fill the smallest buffer several times over, so
+  // that cluster sizes, the SeekHead and the segment size are patched into
+  // blocks that have already been written out.
+  const int kNumFrames = 200;
+  const std::uint64_t kFrameDuration = 33000000;
+  const auto mux = [this](mkvmuxer::IMkvWriter* writer) {
+    Segment segment;
+    ASSERT_TRUE(segment.Init(writer));
+    SegmentInfo* const info = segment.GetSegmentInfo();
+    info->set_writing_app(kAppString);
+    info->set_muxing_app(kAppString);
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+    for (int i = 0; i < kNumFrames; ++i) {
+      ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                   kVideoTrackNumber, i * kFrameDuration,
+                                   i % 30 == 0));
+    }
+    ASSERT_TRUE(segment.Finalize());
+  };
+
+  const TempFileDeleter expected;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(expected.name().c_str()));
+    mux(&writer);
+    writer.Close();
+  }
+
+  const std::uint32_t kBufferSizes[] = {DirectMkvWriter::kAlignment,
+                                        DirectMkvWriter::kDefaultBufferSize};
+  for (const std::uint32_t buffer_size : kBufferSizes) {
+    const TempFileDeleter output;
+    DirectMkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str(), buffer_size));
+    mux(&writer);
+    EXPECT_TRUE(writer.Close());
+    EXPECT_TRUE(CompareFiles(expected.name(), output.name()))
+        << "buffer_size: " << buffer_size;
+  }
+}
+
+// Forwards reads to another reader, so that ChunkedCopy() does not let the
+// kernel copy the file.
+class ForwardingMkvReader : public mkvparser::IMkvReader {
+ public:
+  explicit ForwardingMkvReader(mkvparser::IMkvReader* reader)
+      : reader_(reader) {}
+
+  int Read(long long position, long length, unsigned char* buffer) override {
+    return reader_->Read(position, length, buffer);
+  }
+  int Length(long long* total, long long* available) override {
+    return reader_->Length(total, available);
+  }
+
+ private:
+  mkvparser::IMkvReader* const reader_;
+};
+
+TEST_F(MuxerTest, ChunkedCopy) {
+  const std::string input = GetTestFilePath("output_cues.webm");
+  mkvparser::MkvReader reader;
+  ASSERT_EQ(0, reader.Open(input.c_str()));
+  long long length = 0;
+  ASSERT_EQ(0, reader.Length(&length, nullptr));
+  ForwardingMkvReader forwarding_reader(&reader);
+
+  // Copies from the kernel copy source are done by the kernel, others through
+  // a buffer.
+  for (mkvparser::IMkvReader* source :
+       {static_cast<mkvparser::IMkvReader*>(&reader),
+        static_cast<mkvparser::IMkvReader*>(&forwarding_reader)}) {
+    const TempFileDeleter output;
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+    writer.set_kernel_copy_source(&reader);
+    EXPECT_TRUE(mkvmuxer::ChunkedCopy(source, &writer, 0, 100));
+    EXPECT_TRUE(mkvmuxer::ChunkedCopy(source, &writer, 100, length - 100));
+    EXPECT_EQ(length, writer.Position());
+    writer.Close();
+    EXPECT_TRUE(CompareFiles(input, output.name()));
+  }
+
+  // Read and write errors are reported.
+  const TempFileDeleter output;
+  MkvWriter writer;
+  ASSERT_TRUE(writer.Open(output.name().c_str()));
+  EXPECT_FALSE(mkvmuxer::ChunkedCopy(&reader, &writer, 0, length + 1));
+  writer.Close();
+
+  FailingMkvWriter failing_writer(100);
+  ASSERT_TRUE(failing_writer.Open(output.name().c_str()));
+  EXPECT_FALSE(mkvmuxer::ChunkedCopy(&reader, &failing_writer, 0, length));
+  failing_writer.Close();
+}
+
+TEST_F(MuxerTest, ReservedCuesSpace) {
+  const int kNumFrames = 300;
+  const std::uint64_t kFrameDuration = 33000000;
+  const std::uint64_t kKeyFrameInterval = 30;
+
+  // The estimate fits; a reservation that is too small falls back to writing
+  // the Cues after the Clusters.
+  for (const bool large_enough : {true, false}) {
+    const TempFileDeleter output;
+    Segment segment;
+    {
+      MkvWriter writer;
+      ASSERT_TRUE(writer.Open(output.name().c_str()));
+      ASSERT_TRUE(segment.Init(&writer));
+      EXPECT_FALSE(segment.ReserveCuesSpace(1));
+      const std::uint64_t reserve_size =
+          large_enough
+              ? segment.EstimateCuesSize(kNumFrames * kFrameDuration,
+                                         kKeyFrameInterval * kFrameDuration)
+              : 20;
+      ASSERT_TRUE(segment.ReserveCuesSpace(reserve_size));
+      ASSERT_EQ(kVideoTrackNumber,
+                segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+      for (int i = 0; i < kNumFrames; ++i) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, i * kFrameDuration,
+                                     i % kKeyFrameInterval == 0));
+      }
+      ASSERT_TRUE(segment.Finalize());
+      EXPECT_FALSE(segment.ReserveCuesSpace(reserve_size));
+      writer.Close();
+    }
+    EXPECT_EQ(large_enough ? Segment::kBeforeClusters : Segment::kAfterClusters,
+              segment.cues_position());
+
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+
+    const mkvparser::Cues* const cues = parser_segment->GetCues();
+    ASSERT_TRUE(cues != nullptr);
+    const mkvparser::Cluster* const first_cluster = parser_segment->GetFirst();
+    ASSERT_TRUE(first_cluster != nullptr && !first_cluster->EOS());
+    EXPECT_EQ(large_enough,
+              cues->m_element_start < first_cluster->m_element_start);
+
+    // Every cue point refers to a cluster starting with its key frame.
+    const mkvparser::Track* const track =
+        parser_segment->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+    while (!cues->DoneParsing())
+      cues->LoadCuePoint();
+    int cue_count = 0;
+    for (const mkvparser::CuePoint* cue = cues->GetFirst(); cue != nullptr;
+         cue = cues->GetNext(cue)) {
+      const mkvparser::BlockEntry* const entry =
+          cues->GetBlock(cue, cue->Find(track));
+      ASSERT_TRUE(entry != nullptr);
+      EXPECT_EQ(cue->GetTime(parser_segment.get()),
+                entry->GetBlock()->GetTime(entry->GetCluster()));
+      ++cue_count;
+    }
+    EXPECT_EQ(kNumFrames / kKeyFrameInterval, cue_count);
+
+    if (!large_enough) {
+      // The copy still moves the Cues in front.
+      const TempFileDeleter moved;
+      MkvWriter moved_writer;
+      ASSERT_TRUE(moved_writer.Open(moved.name().c_str()));
+      EXPECT_TRUE(segment.CopyAndMoveCuesBeforeClusters(&reader,
+                                                        &moved_writer));
+      moved_writer.Close();
+    }
+  }
+}
+
+// Records the element start notifications it receives.
+class NotifyingMkvWriter : public MkvWriter {
+ public:
+  explicit NotifyingMkvWriter(bool enabled) : enabled_(enabled) {}
+
+  void ElementStartNotify(mkvmuxer::uint64 element_id,
+                          mkvmuxer::int64 position) override {
+    elements_.push_back(std::make_pair(element_id, position));
+  }
+  bool ElementStartNotifyEnabled() const override { return enabled_; }
+
+  const std::vector<std::pair<mkvmuxer::uint64, mkvmuxer::int64>>& elements()
+      const {
+    return elements_;
+  }
+
+ private:
+  const bool enabled_;
+  std::vector<std::pair<mkvmuxer::uint64, mkvmuxer::int64>> elements_;
+};
+
+TEST_F(MuxerTest, ElementStartNotify) {
+  for (const bool enabled : {false, true}) {
+    const TempFileDeleter output;
+    NotifyingMkvWriter writer(enabled);
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 0, true));
+    // A BlockGroup, whose child elements are serialized together.
+    EXPECT_TRUE(segment.AddFrameWithAdditional(
+        dummy_data_, kFrameLength, dummy_data_, kFrameLength, 1,
+        kVideoTrackNumber, 2000000, false));
+    EXPECT_TRUE(segment.Finalize());
+    writer.Close();
+
+    if (!enabled) {
+      EXPECT_TRUE(writer.elements().empty());
+      continue;
+    }
+    ASSERT_FALSE(writer.elements().empty());
+    EXPECT_EQ(mkvmuxer::kMkvEBML, writer.elements().front().first);
+
+    // Every notification must point at the ID of its element, except for the
+    // Void elements that are later overwritten by the SeekHead.
+    const std::vector<std::uint8_t> data = ReadFileBytes(output.name());
+    bool found_block_additional = false;
+    for (const auto& element : writer.elements()) {
+      const mkvmuxer::uint64 id = element.first;
+      if (id == mkvmuxer::kMkvVoid)
+        continue;
+      std::size_t id_size = 0;
+      while (id >> (8 * id_size))
+        ++id_size;
+      ASSERT_LE(element.second + id_size, data.size());
+      mkvmuxer::uint64 stored_id = 0;
+      for (std::size_t i = 0; i < id_size; ++i)
+        stored_id = (stored_id << 8) | data[element.second + i];
+      EXPECT_EQ(id, stored_id) << "position: " << element.second;
+      if (id == mkvmuxer::kMkvBlockAdditional)
+        found_block_additional = true;
+    }
+    EXPECT_TRUE(found_block_additional);
+  }
+}
+
+// Forces the default, sequential IMkvWriter::WriteV().
+class SequentialMkvWriter : public MkvWriter {
+ public:
+  mkvmuxer::int32 WriteV(const mkvmuxer::WriteBuffer* buffers,
+                         mkvmuxer::int32 count) override {
+    return IMkvWriter::WriteV(buffers, count);
+  }
+};
+
+TEST_F(MuxerTest, VectoredWrite) {
+  // Frames large enough for MkvWriter to gather them with writev().
+  const std::vector<std::uint8_t> frame_data(3 * BUFSIZ, 0x5a);
+  const std::vector<std::uint8_t> additional_data(BUFSIZ, 0xa5);
+
+  auto mux = [&frame_data, &additional_data](MkvWriter* writer) {
+    Segment segment;
+    ASSERT_TRUE(segment.Init(writer));
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+
+    EXPECT_TRUE(segment.AddFrame(frame_data.data(), frame_data.size(),
+                                 kVideoTrackNumber, 0, true));
+    EXPECT_TRUE(segment.AddFrameWithAdditional(
+        frame_data.data(), frame_data.size(), additional_data.data(),
+        additional_data.size(), 1, kVideoTrackNumber, 2000000, false));
+    EXPECT_TRUE(segment.AddFrameWithDiscardPadding(
+        frame_data.data(), frame_data.size(), 12345, kVideoTrackNumber,
+        4000000, false));
+    EXPECT_TRUE(segment.AddFrame(frame_data.data(), frame_data.size(),
+                                 kVideoTrackNumber, 6000000, true));
+    EXPECT_TRUE(segment.Finalize());
+  };
+
+  std::unique_ptr<MkvWriter> writers[] = {
+      std::unique_ptr<MkvWriter>(new MkvWriter()),
+      std::unique_ptr<MkvWriter>(new SequentialMkvWriter())};
+  const TempFileDeleter outputs[3];
+
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(writers[i]->Open(outputs[i].name().c_str()));
+    mux(writers[i].get());
+    writers[i]->Close();
+  }
+  EXPECT_TRUE(CompareFiles(outputs[0].name(), outputs[1].name()));
+
+  // Streams owned by the client are written through stdio, so data the
+  // client writes around the muxer's stays in order.
+  FILE* const file = fopen(outputs[2].name().c_str(), "wb");
+  ASSERT_NE(nullptr, file);
+  {
+    MkvWriter writer(file);
+    mux(&writer);
+  }
+  ASSERT_EQ(0, fclose(file));
+  EXPECT_TRUE(CompareFiles(outputs[0].name(), outputs[2].name()));
+}
+
+// Frame data shared with mkvmuxer::Frame through its borrow callbacks.
+struct RefCountedBuffer {
+  static void Retain(void* opaque) {
+    ++static_cast<RefCountedBuffer*>(opaque)->references;
+  }
+  static void Release(void* opaque) {
+    --static_cast<RefCountedBuffer*>(opaque)->references;
+  }
+
+  std::uint8_t data[kFrameLength];
+  int references;
+};
+
+TEST_F(MuxerTest, BorrowedFrames) {
+  const int kNumFrames = 4;
+  RefCountedBuffer buffers[kNumFrames];
+  const TempFileDeleter outputs[2];
+
+  for (const bool borrow : {false, true}) {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(outputs[borrow].name().c_str()));
+
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 0, true));
+
+    // Audio frames are held back while video is present; the queued frames
+    // must keep a reference instead of copying the data.
+    for (int i = 0; i < kNumFrames; ++i) {
+      RefCountedBuffer& buffer = buffers[i];
+      memset(buffer.data, i, kFrameLength);
+      buffer.references = 1;  // Handed over to |frame| when borrowing.
+
+      Frame frame;
+      if (borrow) {
+        ASSERT_TRUE(frame.Borrow(buffer.data, kFrameLength,
+                                 RefCountedBuffer::Retain,
+                                 RefCountedBuffer::Release, &buffer));
+      } else {
+        ASSERT_TRUE(frame.Init(buffer.data, kFrameLength));
+      }
+      frame.set_track_number(kAudioTrackNumber);
+      frame.set_timestamp(i * 1000000);
+      frame.set_is_key(true);
+      EXPECT_TRUE(segment.AddGenericFrame(&frame));
+    }
+    if (borrow) {
+      for (const RefCountedBuffer& buffer : buffers)
+        EXPECT_EQ(1, buffer.references);
+    }
+
+    EXPECT_TRUE(segment.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber,
+                                 5000000, false));
+    EXPECT_TRUE(segment.Finalize());
+    writer.Close();
+
+    if (borrow) {
+      for (const RefCountedBuffer& buffer : buffers)
+        EXPECT_EQ(0, buffer.references);
+    }
+  }
+
+  EXPECT_TRUE(CompareFiles(outputs[0].name(), outputs[1].name()));
+}
+
+TEST_F(MuxerTest, BorrowFrom) {
+  RefCountedBuffer buffer;
+  buffer.references = 1;
+  const std::uint8_t kAdditional[] = {1, 2, 3};
+  const mkvmuxer::uint32 kPartitions[] = {2, 5};
+
+  Frame frame;
+  ASSERT_TRUE(frame.Borrow(buffer.data, kFrameLength, RefCountedBuffer::Retain,
+                           RefCountedBuffer::Release, &buffer));
+  ASSERT_TRUE(frame.AddAdditionalData(kAdditional, sizeof(kAdditional), 2));
+  ASSERT_TRUE(frame.SetEncryptionPartitions(kPartitions, 2));
+  frame.set_duration(1000);
+  frame.set_track_number(kVideoTrackNumber);
+  frame.set_timestamp(2000);
+  frame.set_discard_padding(300);
+  frame.set_reference_block_timestamp(1500);
+  frame.set_encrypted(false);
+
+  {
+    Frame borrowed;
+    ASSERT_TRUE(borrowed.BorrowFrom(frame));
+    EXPECT_EQ(frame.frame(), borrowed.frame());
+    EXPECT_EQ(frame.length(), borrowed.length());
+    EXPECT_EQ(frame.additional(), borrowed.additional());
+    EXPECT_EQ(frame.additional_length(), borrowed.additional_length());
+    EXPECT_EQ(frame.add_id(), borrowed.add_id());
+    EXPECT_EQ(frame.duration(), borrowed.duration());
+    EXPECT_EQ(frame.is_key(), borrowed.is_key());
+    EXPECT_EQ(frame.track_number(), borrowed.track_number());
+    EXPECT_EQ(frame.timestamp(), borrowed.timestamp());
+    EXPECT_EQ(frame.discard_padding(), borrowed.discard_padding());
+    EXPECT_TRUE(borrowed.reference_block_timestamp_set());
+    EXPECT_EQ(frame.reference_block_timestamp(),
+              borrowed.reference_block_timestamp());
+    EXPECT_FALSE(borrowed.encrypted());
+    ASSERT_EQ(2, borrowed.encryption_partition_count());
+    EXPECT_EQ(kPartitions[0], borrowed.encryption_partitions()[0]);
+    EXPECT_EQ(kPartitions[1], borrowed.encryption_partitions()[1]);
+    // The data is not retained, and so is not released either.
+    EXPECT_EQ(1, buffer.references);
+  }
+  EXPECT_EQ(1, buffer.references);
+  frame.Reset();
+  EXPECT_EQ(0, buffer.references);
+}
+
+TEST_F(MuxerTest, QueuedAudioFrames) {
+  // Audio frames are held back between video frames. Enough of them are queued
+  // and written out to wrap around the frame queue and reuse pooled frames.
+  const std::uint64_t kVideoFrameDuration = 33000000;
+  const std::uint64_t kAudioFrameDuration = 20000000;
+  const int kNumAudioFrames = 150;
+  const TempFileDeleter output;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+
+    std::uint64_t video_timestamp = 0;
+    int video_frame = 0;
+    for (int i = 0; i < kNumAudioFrames; ++i) {
+      const std::uint64_t audio_timestamp = i * kAudioFrameDuration;
+      while (video_timestamp <= audio_timestamp) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, video_timestamp,
+                                     video_frame % 30 == 0));
+        ++video_frame;
+        video_timestamp += kVideoFrameDuration;
+      }
+      // The audio frame size varies so that pooled frames get reused with
+      // both smaller and larger payloads.
+      const std::vector<std::uint8_t> audio(1 + i % 7,
+                                            static_cast<std::uint8_t>(i));
+      ASSERT_TRUE(segment.AddFrame(audio.data(), audio.size(),
+                                   kAudioTrackNumber, audio_timestamp, true));
+    }
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+  }
+
+  mkvparser::MkvReader reader;
+  std::unique_ptr<mkvparser::Segment> parser_segment;
+  ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+
+  int audio_frames = 0;
+  for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+       cluster != nullptr && !cluster->EOS();
+       cluster = parser_segment->GetNext(cluster)) {
+    const mkvparser::BlockEntry* entry = nullptr;
+    ASSERT_EQ(0, cluster->GetFirst(entry));
+    while (entry != nullptr && !entry->EOS()) {
+      const mkvparser::Block* const block = entry->GetBlock();
+      if (block->GetTrackNumber() == kAudioTrackNumber) {
+        const mkvparser::Block::Frame& frame = block->GetFrame(0);
+        ASSERT_EQ(1 + audio_frames % 7, frame.len);
+        std::vector<unsigned char> data(frame.len);
+        ASSERT_EQ(0, frame.Read(&reader, data.data()));
+        for (const unsigned char value : data)
+          ASSERT_EQ(static_cast<unsigned char>(audio_frames), value);
+        EXPECT_EQ(static_cast<long long>(audio_frames * kAudioFrameDuration),
+                  block->GetTime(cluster));
+        ++audio_frames;
+      }
+      ASSERT_EQ(0, cluster->GetNext(entry, entry));
+    }
+  }
+  EXPECT_EQ(kNumAudioFrames, audio_frames);
+}
+
+TEST_F(MuxerTest, TrackLookup) {
+  EXPECT_TRUE(SegmentInit(false));
+  const int kNumAudioTracks = 40;
+
+  ASSERT_EQ(kVideoTrackNumber,
+            segment_.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+  EXPECT_EQ(0, segment_.AddAudioTrack(kSampleRate, kChannels,
+                                      kVideoTrackNumber));  // Duplicate.
+  EXPECT_EQ(0, segment_.AddAudioTrack(kSampleRate, kChannels,
+                                      mkvmuxer::kMaxTrackNumber + 1));
+
+  // Automatically numbered tracks take the lowest free numbers.
+  std::vector<std::uint64_t> audio_tracks;
+  for (int i = 0; i < kNumAudioTracks; ++i) {
+    const std::uint64_t number =
+        segment_.AddAudioTrack(kSampleRate, kChannels, 0);
+    ASSERT_NE(0u, number);
+    EXPECT_EQ(kVideoTrackNumber + 1 + i, number);
+    audio_tracks.push_back(number);
+  }
+
+  const mkvmuxer::Track* const video_track =
+      segment_.GetTrackByNumber(kVideoTrackNumber);
+  ASSERT_TRUE(video_track != nullptr);
+  EXPECT_EQ(kVideoTrackNumber, video_track->number());
+  for (const std::uint64_t number : audio_tracks) {
+    const mkvmuxer::Track* const track = segment_.GetTrackByNumber(number);
+    ASSERT_TRUE(track != nullptr);
+    EXPECT_EQ(number, track->number());
+    EXPECT_EQ(mkvmuxer::Tracks::kAudio, track->type());
+  }
+  EXPECT_TRUE(segment_.GetTrackByNumber(0) == nullptr);
+  EXPECT_TRUE(segment_.GetTrackByNumber(kNumAudioTracks + 2) == nullptr);
+  EXPECT_TRUE(segment_.GetTrackByNumber(1000) == nullptr);
+
+  EXPECT_TRUE(
+      segment_.AddFrame(dummy_data_, kFrameLength, kVideoTrackNumber, 0, true));
+  EXPECT_TRUE(segment_.AddFrame(dummy_data_, kFrameLength,
+                                audio_tracks.back(), 0, true));
+  EXPECT_FALSE(segment_.AddFrame(dummy_data_, kFrameLength,
+                                 kNumAudioTracks + 2, 0, true));
+  EXPECT_TRUE(segment_.Finalize());
+}
+
+class NonSeekableMkvWriter : public MkvWriter {
+ public:
+  mkvmuxer::int32 Position(mkvmuxer::int64 position) override {
+    ++seeks_;
+    return MkvWriter::Position(position);
+  }
+  mkvmuxer::int64 Position() const override { return MkvWriter::Position(); }
+  bool Seekable() const override { return false; }
+
+  int seeks() const { return seeks_; }
+
+ private:
+  int seeks_ = 0;
+};
+
+TEST_F(MuxerTest, BufferedClusters) {
+  const int kNumFrames = 40;
+  const std::uint64_t kFrameDuration = 33000000;
+  for (const Segment::Mode mode : {Segment::kFile, Segment::kLive}) {
+    const TempFileDeleter output;
+    {
+      NonSeekableMkvWriter writer;
+      ASSERT_TRUE(writer.Open(output.name().c_str()));
+      Segment segment;
+      ASSERT_TRUE(segment.Init(&writer));
+      segment.set_mode(mode);
+      segment.set_buffer_clusters(true);
+      EXPECT_TRUE(segment.buffer_clusters());
+      ASSERT_EQ(kVideoTrackNumber,
+                segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+      for (int i = 0; i < kNumFrames; ++i) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, i * kFrameDuration,
+                                     i % 10 == 0));
+        if (i % 10 == 9)
+          segment.ForceNewClusterOnNextFrame();
+      }
+      ASSERT_TRUE(segment.Finalize());
+      EXPECT_EQ(0, writer.seeks());
+      writer.Close();
+    }
+
+    const std::vector<std::uint8_t> bytes = ReadFileBytes(output.name());
+
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+
+    EXPECT_EQ(4u, parser_segment->GetCount());
+    int frames = 0;
+    for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+         cluster != nullptr && !cluster->EOS();
+         cluster = parser_segment->GetNext(cluster)) {
+      // The cluster size is known: the first octet after the 4 octet ID is
+      // not the start of the 8 octet "unknown" size.
+      const std::size_t size_start =
+          static_cast<std::size_t>(cluster->m_element_start) + 4;
+      ASSERT_LT(size_start, bytes.size());
+      EXPECT_NE(0x01, bytes[size_start]);
+      const mkvparser::BlockEntry* entry = nullptr;
+      ASSERT_EQ(0, cluster->GetFirst(entry));
+      while (entry != nullptr && !entry->EOS()) {
+        ++frames;
+        ASSERT_EQ(0, cluster->GetNext(entry, entry));
+      }
+      EXPECT_EQ(10, cluster->GetEntryCount());
+    }
+    EXPECT_EQ(kNumFrames, frames);
+
+    const mkvparser::Cues* const cues = parser_segment->GetCues();
+    if (mode == Segment::kFile) {
+      ASSERT_TRUE(cues != nullptr);
+      while (!cues->DoneParsing())
+        cues->LoadCuePoint();
+      EXPECT_EQ(4, cues->GetCount());
+    } else {
+      EXPECT_TRUE(cues == nullptr);
+    }
+  }
+}
+
+TEST_F(MuxerTest, AudioLacing) {
+  // Sizes chosen for fixed, Xiph, EBML and Xiph lacing, with a cluster
+  // boundary in the middle of the last lace.
+  const std::uint64_t kFrameSizes[] = {40,   40,   40,   40,  10,  20,
+                                       30,   40,   1000, 1001, 1002, 1003,
+                                       500,  10,   500,  10};
+  const int kNumFrames = sizeof(kFrameSizes) / sizeof(kFrameSizes[0]);
+  const std::uint64_t kFrameDuration = 20000000;
+  const mkvparser::Block::Lacing kLacing[] = {
+      mkvparser::Block::kLacingFixed, mkvparser::Block::kLacingXiph,
+      mkvparser::Block::kLacingEbml, mkvparser::Block::kLacingXiph,
+      mkvparser::Block::kLacingXiph};
+  const int kBlockFrames[] = {4, 4, 4, 2, 2};
+
+  std::vector<std::vector<std::uint8_t>> frames;
+  for (int i = 0; i < kNumFrames; ++i) {
+    frames.emplace_back(kFrameSizes[i]);
+    for (std::size_t j = 0; j < frames[i].size(); ++j)
+      frames[i][j] = static_cast<std::uint8_t>(i + j);
+  }
+
+  const TempFileDeleter output;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    AudioTrack* const track = static_cast<AudioTrack*>(
+        segment.GetTrackByNumber(kAudioTrackNumber));
+    EXPECT_FALSE(track->SetMaxLacedFrames(mkvmuxer::kMaxLacedFrames + 1));
+    ASSERT_TRUE(track->SetMaxLacedFrames(4));
+    track->set_default_duration(kFrameDuration);
+    for (int i = 0; i < kNumFrames; ++i) {
+      ASSERT_TRUE(segment.AddFrame(frames[i].data(), frames[i].size(),
+                                   kAudioTrackNumber, i * kFrameDuration,
+                                   true));
+      if (i == 13)
+        segment.ForceNewClusterOnNextFrame();
+    }
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+  }
+
+  mkvparser::MkvReader reader;
+  std::unique_ptr<mkvparser::Segment> parser_segment;
+  ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+  EXPECT_EQ(2u, parser_segment->GetCount());
+
+  int block_index = 0;
+  int frame_index = 0;
+  for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+       cluster != nullptr && !cluster->EOS();
+       cluster = parser_segment->GetNext(cluster)) {
+    const mkvparser::BlockEntry* entry = nullptr;
+    ASSERT_EQ(0, cluster->GetFirst(entry));
+    while (entry != nullptr && !entry->EOS()) {
+      ASSERT_LT(block_index, 5);
+      const mkvparser::Block* const block = entry->GetBlock();
+      EXPECT_EQ(kLacing[block_index], block->GetLacing());
+      ASSERT_EQ(kBlockFrames[block_index], block->GetFrameCount());
+      EXPECT_EQ(static_cast<long long>(frame_index * kFrameDuration),
+                block->GetTime(cluster));
+      EXPECT_TRUE(block->IsKey());
+
+      for (int i = 0; i < block->GetFrameCount(); ++i, ++frame_index) {
+        const mkvparser::Block::Frame& frame = block->GetFrame(i);
+        ASSERT_EQ(static_cast<long>(frames[frame_index].size()), frame.len);
+        std::vector<std::uint8_t> data(frame.len);
+        ASSERT_EQ(0, frame.Read(&reader, data.data()));
+        EXPECT_TRUE(data == frames[frame_index]) << "frame " << frame_index;
+      }
+      ++block_index;
+      ASSERT_EQ(0, cluster->GetNext(entry, entry));
+    }
+  }
+  EXPECT_EQ(5, block_index);
+  EXPECT_EQ(kNumFrames, frame_index);
+}
+
+TEST_F(MuxerTest, AudioLacingTimestamps) {
+  const std::uint64_t kFrameDuration = 20000000;
+  // The frame after the third one is late, which ends the first lace.
+  const std::uint64_t kTimestamps[] = {0, 1, 2, 4, 5};
+  const int kNumFrames = sizeof(kTimestamps) / sizeof(kTimestamps[0]);
+
+  for (const std::uint64_t default_duration : {std::uint64_t{0},
+                                               kFrameDuration}) {
+    const TempFileDeleter output;
+    {
+      MkvWriter writer;
+      ASSERT_TRUE(writer.Open(output.name().c_str()));
+      Segment segment;
+      ASSERT_TRUE(segment.Init(&writer));
+      ASSERT_EQ(kAudioTrackNumber, segment.AddAudioTrack(kSampleRate, kChannels,
+                                                         kAudioTrackNumber));
+      AudioTrack* const track = static_cast<AudioTrack*>(
+          segment.GetTrackByNumber(kAudioTrackNumber));
+      ASSERT_TRUE(track->SetMaxLacedFrames(4));
+      track->set_default_duration(default_duration);
+      for (int i = 0; i < kNumFrames; ++i) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kAudioTrackNumber,
+                                     kTimestamps[i] * kFrameDuration, true));
+      }
+      ASSERT_TRUE(segment.Finalize());
+      writer.Close();
+    }
+
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+
+    std::vector<int> block_frames;
+    std::vector<long long> block_times;
+    for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+         cluster != nullptr && !cluster->EOS();
+         cluster = parser_segment->GetNext(cluster)) {
+      const mkvparser::BlockEntry* entry = nullptr;
+      ASSERT_EQ(0, cluster->GetFirst(entry));
+      while (entry != nullptr && !entry->EOS()) {
+        block_frames.push_back(entry->GetBlock()->GetFrameCount());
+        block_times.push_back(entry->GetBlock()->GetTime(cluster));
+        ASSERT_EQ(0, cluster->GetNext(entry, entry));
+      }
+    }
+    // Without a DefaultDuration every frame gets its own block.
+    if (default_duration == 0) {
+      EXPECT_EQ(std::vector<int>(kNumFrames, 1), block_frames);
+    } else {
+      EXPECT_EQ(std::vector<int>({3, 2}), block_frames);
+      EXPECT_EQ(std::vector<long long>(
+                    {0, static_cast<long long>(4 * kFrameDuration)}),
+                block_times);
+    }
+  }
+}
+
+// Counts the calls made to the writer; WriteV() counts as one call.
+class CountingMkvWriter : public MkvWriter {
+ public:
+  mkvmuxer::int32 Write(const void* buffer, mkvmuxer::uint32 length) override {
+    if (!in_write_v_)
+      ++calls_;
+    return MkvWriter::Write(buffer, length);
+  }
+  mkvmuxer::int32 WriteV(const mkvmuxer::WriteBuffer* buffers,
+                         mkvmuxer::int32 count) override {
+    ++calls_;
+    in_write_v_ = true;
+    const mkvmuxer::int32 status = MkvWriter::WriteV(buffers, count);
+    in_write_v_ = false;
+    return status;
+  }
+
+  int calls() const { return calls_; }
+
+ private:
+  bool in_write_v_ = false;
+  int calls_ = 0;
+};
+
+TEST_F(MuxerTest, AddFrames) {
+  const int kNumFrames = 100;
+  const int kBatchSize = 8;
+  const std::uint64_t kFrameDuration = 33000000;
+
+  // Interleaved video and audio, with video inter frames alternating
+  // between SimpleBlocks and BlockGroups that need a reference block.
+  std::vector<std::unique_ptr<Frame>> frames;
+  for (int i = 0; i < kNumFrames; ++i) {
+    const bool video = i % 2 == 0;
+    std::unique_ptr<Frame> frame(new Frame());
+    ASSERT_TRUE(frame->Init(dummy_data_, kFrameLength));
+    frame->set_track_number(video ? kVideoTrackNumber : kAudioTrackNumber);
+    frame->set_timestamp((i / 2) * kFrameDuration + (video ? 0 : 1000000));
+    frame->set_is_key(!video || i % 30 == 0);
+    if (video && i % 4 == 2)
+      frame->set_duration(kFrameDuration);
+    frames.push_back(std::move(frame));
+  }
+
+  const auto mux = [this, &frames](bool batch, CountingMkvWriter* writer) {
+    Segment segment;
+    ASSERT_TRUE(segment.Init(writer));
+    SegmentInfo* const info = segment.GetSegmentInfo();
+    info->set_writing_app(kAppString);
+    info->set_muxing_app(kAppString);
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    segment.GetTrackByNumber(kAudioTrackNumber)->set_uid(kAudioTrackNumber);
+
+    if (batch) {
+      std::vector<const Frame*> pointers;
+      for (const std::unique_ptr<Frame>& frame : frames)
+        pointers.push_back(frame.get());
+      for (std::size_t i = 0; i < pointers.size(); i += kBatchSize) {
+        const int count = static_cast<int>(
+            std::min<std::size_t>(kBatchSize, pointers.size() - i));
+        ASSERT_TRUE(segment.AddFrames(&pointers[i], count));
+      }
+    } else {
+      for (const std::unique_ptr<Frame>& frame : frames)
+        ASSERT_TRUE(segment.AddGenericFrame(frame.get()));
+    }
+    ASSERT_TRUE(segment.Finalize());
+  };
+
+  const TempFileDeleter expected;
+  CountingMkvWriter single_writer;
+  ASSERT_TRUE(single_writer.Open(expected.name().c_str()));
+  mux(false, &single_writer);
+  single_writer.Close();
+
+  const TempFileDeleter output;
+  CountingMkvWriter batch_writer;
+  ASSERT_TRUE(batch_writer.Open(output.name().c_str()));
+  mux(true, &batch_writer);
+  batch_writer.Close();
+
+  EXPECT_TRUE(CompareFiles(expected.name(), output.name()));
+  // Each batch goes out in one call per cluster rather than one per block.
+  EXPECT_LT(batch_writer.calls(), single_writer.calls() - kNumFrames / 2);
+
+  // A batch out of timestamp order is rejected without adding any frame.
+  const TempFileDeleter rejected;
+  MkvWriter writer;
+  ASSERT_TRUE(writer.Open(rejected.name().c_str()));
+  Segment segment;
+  ASSERT_TRUE(segment.Init(&writer));
+  ASSERT_EQ(kVideoTrackNumber,
+            segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+  const Frame* const unordered[] = {frames[2].get(), frames[0].get()};
+  EXPECT_FALSE(segment.AddFrames(unordered, 2));
+  EXPECT_TRUE(segment.AddGenericFrame(frames[0].get()));
+  EXPECT_TRUE(segment.Finalize());
+  writer.Close();
+}
+
+TEST_F(MuxerTest, SegmentStats) {
+  // Video with additional data in every tenth frame, so that some blocks are
+  // BlockGroups, and laced audio that is queued between video frames.
+  const std::uint64_t kVideoFrameDuration = 33000000;
+  const std::uint64_t kAudioFrameDuration = 20000000;
+  const int kNumVideoFrames = 90;
+  const std::uint8_t kAdditional[] = {1, 2, 3, 4, 5, 6, 7, 8};
+  const TempFileDeleter output;
+  std::uint64_t frame_bytes = 0;
+  int frames_added = 0;
+  std::unique_ptr<mkvmuxer::SegmentStats> stats;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    segment.set_max_cluster_duration(1000000000);
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    AudioTrack* const audio_track = static_cast<AudioTrack*>(
+        segment.GetTrackByNumber(kAudioTrackNumber));
+    ASSERT_TRUE(audio_track->SetMaxLacedFrames(4));
+    audio_track->set_default_duration(kAudioFrameDuration);
+    ASSERT_TRUE(segment.ReserveCuesSpace(segment.EstimateCuesSize(
+        kNumVideoFrames * kVideoFrameDuration, 1000000000)));
+
+    std::uint64_t audio_timestamp = 0;
+    for (int i = 0; i < kNumVideoFrames; ++i) {
+      const std::uint64_t video_timestamp = i * kVideoFrameDuration;
+      while (audio_timestamp < video_timestamp) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength / 2,
+                                     kAudioTrackNumber, audio_timestamp,
+                                     true));
+        frame_bytes += kFrameLength / 2;
+        ++frames_added;
+        audio_timestamp += kAudioFrameDuration;
+      }
+
+      if (i % 10 == 5) {
+        ASSERT_TRUE(segment.AddFrameWithAdditional(
+            dummy_data_, kFrameLength, kAdditional, sizeof(kAdditional), 1,
+            kVideoTrackNumber, video_timestamp, false));
+        frame_bytes += kFrameLength + sizeof(kAdditional);
+      } else {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, video_timestamp,
+                                     i % 30 == 0));
+        frame_bytes += kFrameLength;
+      }
+      ++frames_added;
+    }
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+
+    if (segment.GetStats() != nullptr)
+      stats.reset(new mkvmuxer::SegmentStats(*segment.GetStats()));
+  }
+
+#ifdef MKVMUXER_ENABLE_STATS
+  ASSERT_TRUE(stats != nullptr);
+
+  mkvparser::MkvReader reader;
+  std::unique_ptr<mkvparser::Segment> parser_segment;
+  ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+  long long file_size = 0;
+  long long available = 0;
+  ASSERT_EQ(0, reader.Length(&file_size, &available));
+
+  long long blocks = 0;
+  long long frames = 0;
+  long long cluster_bytes = 0;
+  long long min_cluster_size = 0;
+  long long max_cluster_size = 0;
+  for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+       cluster != nullptr && !cluster->EOS();
+       cluster = parser_segment->GetNext(cluster)) {
+    const mkvparser::BlockEntry* entry = nullptr;
+    ASSERT_EQ(0, cluster->GetFirst(entry));
+    while (entry != nullptr && !entry->EOS()) {
+      ++blocks;
+      frames += entry->GetBlock()->GetFrameCount();
+      ASSERT_EQ(0, cluster->GetNext(entry, entry));
+    }
+    const long long size = cluster->GetElementSize();
+    if (cluster_bytes == 0 || size < min_cluster_size)
+      min_cluster_size = size;
+    max_cluster_size = std::max(max_cluster_size, size);
+    cluster_bytes += size;
+  }
+
+  std::uint64_t total_bytes = 0;
+  for (const std::uint64_t bytes : stats->bytes)
+    total_bytes += bytes;
+  EXPECT_EQ(static_cast<std::uint64_t>(file_size), total_bytes);
+
+  using mkvmuxer::SegmentStats;
+  EXPECT_EQ(frame_bytes, stats->bytes[SegmentStats::kFrameData]);
+  EXPECT_GT(stats->bytes[SegmentStats::kBlockGroupElements], 0u);
+  EXPECT_EQ(static_cast<std::uint64_t>(cluster_bytes),
+            stats->bytes[SegmentStats::kBlockHeaders] +
+                stats->bytes[SegmentStats::kBlockGroupElements] +
+                stats->bytes[SegmentStats::kFrameData] +
+                stats->bytes[SegmentStats::kClusterHeaders]);
+  EXPECT_EQ(static_cast<std::uint64_t>(
+                parser_segment->GetCues()->m_element_size),
+            stats->bytes[SegmentStats::kCues]);
+  EXPECT_EQ(static_cast<std::uint64_t>(
+                parser_segment->GetSeekHead()->m_element_size),
+            stats->bytes[SegmentStats::kSeekHead]);
+  EXPECT_GT(stats->bytes[SegmentStats::kVoid], 0u);
+
+  EXPECT_EQ(static_cast<std::uint64_t>(parser_segment->GetCount()),
+            stats->clusters);
+  EXPECT_EQ(static_cast<std::uint64_t>(blocks), stats->blocks);
+  EXPECT_EQ(static_cast<std::uint64_t>(frames), stats->frames);
+  EXPECT_EQ(static_cast<std::uint64_t>(frames_added), stats->frames);
+  EXPECT_LT(stats->blocks, stats->frames);
+  EXPECT_LE(stats->min_cluster_frames, stats->max_cluster_frames);
+  EXPECT_LE(stats->min_cluster_blocks, stats->max_cluster_blocks);
+  EXPECT_EQ(static_cast<std::uint64_t>(min_cluster_size),
+            stats->min_cluster_size);
+  EXPECT_EQ(static_cast<std::uint64_t>(max_cluster_size),
+            stats->max_cluster_size);
+  EXPECT_GT(stats->min_cluster_duration, 0u);
+  EXPECT_LE(stats->max_cluster_duration, 1000000000u);
+  EXPECT_EQ(static_cast<std::uint64_t>(parser_segment->GetDuration()),
+            stats->total_cluster_duration);
+
+  EXPECT_GT(stats->max_queued_frames, 0u);
+  EXPECT_EQ(static_cast<std::uint64_t>(frames_added),
+            stats->queued_frames_samples);
+
+  // One size update per cluster, then the duration, the Cues, the SeekHead
+  // and the segment size.
+  EXPECT_EQ(stats->clusters + 4, stats->seek_backs);
+#else
+  EXPECT_TRUE(stats == nullptr);
+#endif
+}
+
+// Collects the chunks handed out by a Segment.
+class ChunkCollector : public mkvmuxer::IMkvChunkSink {
+ public:
+  struct Chunk {
+    ChunkKind kind;
+    int index;
+    std::vector<std::uint8_t> data;
+    std::uint64_t start_time;
+    std::uint64_t end_time;
+  };
+
+  bool OnChunk(ChunkKind kind, mkvmuxer::int32 index,
+               const mkvmuxer::uint8* data, mkvmuxer::uint64 size,
+               mkvmuxer::uint64 start_time,
+               mkvmuxer::uint64 end_time) override {
+    chunks_.push_back(
+        {kind, index, std::vector<std::uint8_t>(data, data + size),
+         start_time, end_time});
+    return true;
+  }
+
+  const std::vector<Chunk>& chunks() const { return chunks_; }
+
+ private:
+  std::vector<Chunk> chunks_;
+};
+
+TEST_F(MuxerTest, ChunkSink) {
+  const std::uint64_t kFrameDuration = 33000000;
+  const int kNumFrames = 100;
+
+  for (const Segment::Mode mode : {Segment::kLive, Segment::kFile}) {
+    ChunkCollector sink;
+    {
+      MemoryMkvWriter writer;
+      Segment segment;
+      ASSERT_TRUE(segment.Init(&writer));
+      segment.set_mode(mode);
+      ASSERT_EQ(kVideoTrackNumber,
+                segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+      ASSERT_TRUE(segment.SetChunkSink(&sink));
+      EXPECT_FALSE(segment.SetChunking(true, "unused"));
+
+      for (int i = 0; i < kNumFrames; ++i) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, i * kFrameDuration,
+                                     i % 30 == 0));
+        // A cluster chunk is handed out as soon as the next cluster starts.
+        if (i == 30) {
+          EXPECT_FALSE(sink.chunks().empty());
+        }
+      }
+      ASSERT_TRUE(segment.Finalize());
+      EXPECT_EQ(0u, writer.size());
+    }
+
+    // The header comes first in |kLive| mode and last in |kFile| mode, once
+    // the segment size is known.
+    const std::vector<ChunkCollector::Chunk>& chunks = sink.chunks();
+    const int kNumClusters = 4;
+    ASSERT_EQ(static_cast<std::size_t>(kNumClusters + 1 +
+                                       (mode == Segment::kFile ? 1 : 0)),
+              chunks.size());
+    const std::size_t header_index =
+        (mode == Segment::kLive) ? 0 : chunks.size() - 1;
+    EXPECT_EQ(mkvmuxer::IMkvChunkSink::kHeader, chunks[header_index].kind);
+
+    std::vector<std::uint8_t> webm = chunks[header_index].data;
+    int cluster_index = 0;
+    std::uint64_t cluster_start = 0;
+    for (const ChunkCollector::Chunk& chunk : chunks) {
+      if (chunk.kind != mkvmuxer::IMkvChunkSink::kCluster)
+        continue;
+      EXPECT_EQ(cluster_index, chunk.index);
+      EXPECT_EQ(cluster_start, chunk.start_time);
+      EXPECT_EQ(std::min<std::uint64_t>(30 * (cluster_index + 1),
+                                        kNumFrames - 1) *
+                    kFrameDuration,
+                chunk.end_time);
+      cluster_start = chunk.end_time;
+      webm.insert(webm.end(), chunk.data.begin(), chunk.data.end());
+      ++cluster_index;
+    }
+    EXPECT_EQ(kNumClusters, cluster_index);
+
+    if (mode == Segment::kFile) {
+      const ChunkCollector::Chunk& cues = chunks[chunks.size() - 2];
+      EXPECT_EQ(mkvmuxer::IMkvChunkSink::kCues, cues.kind);
+      EXPECT_EQ(kNumClusters, cues.index);
+      webm.insert(webm.end(), cues.data.begin(), cues.data.end());
+    }
+
+    // The chunks put together make up the whole WebM file.
+    const TempFileDeleter output;
+    {
+      const FilePtr file(std::fopen(output.name().c_str(), "wb"),
+                         FILEDeleter());
+      ASSERT_TRUE(file != nullptr);
+      ASSERT_EQ(webm.size(),
+                std::fwrite(webm.data(), 1, webm.size(), file.get()));
+    }
+
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+    EXPECT_EQ(kNumClusters, parser_segment->GetCount());
+
+    int frames = 0;
+    for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+         cluster != nullptr && !cluster->EOS();
+         cluster = parser_segment->GetNext(cluster)) {
+      const mkvparser::BlockEntry* entry = nullptr;
+      ASSERT_EQ(0, cluster->GetFirst(entry));
+      while (entry != nullptr && !entry->EOS()) {
+        EXPECT_EQ(static_cast<long long>(frames * kFrameDuration),
+                  entry->GetBlock()->GetTime(cluster));
+        ++frames;
+        ASSERT_EQ(0, cluster->GetNext(entry, entry));
+      }
+    }
+    EXPECT_EQ(kNumFrames, frames);
+
+    if (mode == Segment::kFile) {
+      const mkvparser::Cues* const cues = parser_segment->GetCues();
+      ASSERT_TRUE(cues != nullptr);
+      while (!cues->DoneParsing())
+        cues->LoadCuePoint();
+      EXPECT_EQ(kNumClusters, cues->GetCount());
+    }
+  }
+}
+
+TEST_F(MuxerTest, BoundedCues) {
+  const int kNumFrames = 300;
+  const std::uint64_t kFrameDuration = 33000000;
+  const int kKeyFrameInterval = 10;
+
+  // Cues kept in memory and Cues moved to a temporary file give the same
+  // output, with the Cues after or before the Clusters.
+  const auto mux = [this](int max_cues_in_memory, const std::string& name,
+                          const std::string& moved_name) {
+    Segment segment;
+    {
+      MkvWriter writer;
+      ASSERT_TRUE(writer.Open(name.c_str()));
+      ASSERT_TRUE(segment.Init(&writer));
+      SegmentInfo* const info = segment.GetSegmentInfo();
+      info->set_writing_app(kAppString);
+      info->set_muxing_app(kAppString);
+      ASSERT_TRUE(segment.GetCues()->SetMaxCuesInMemory(max_cues_in_memory));
+      EXPECT_EQ(max_cues_in_memory, segment.GetCues()->max_cues_in_memory());
+      ASSERT_EQ(kVideoTrackNumber,
+                segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+      segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+      for (int i = 0; i < kNumFrames; ++i) {
+        ASSERT_TRUE(segment.AddFrame(dummy_data_, kFrameLength,
+                                     kVideoTrackNumber, i * kFrameDuration,
+                                     i % kKeyFrameInterval == 0));
+      }
+      ASSERT_TRUE(segment.Finalize());
+      writer.Close();
+    }
+    const mkvmuxer::Cues* const cues = segment.GetCues();
+    EXPECT_EQ(kNumFrames / kKeyFrameInterval, cues->cue_entries_size());
+    EXPECT_FALSE(cues->GetCue(cues->cue_entries_size(), nullptr));
+
+    // GetCue() reads spilled cue points back; GetCueByIndex() only returns
+    // the ones in memory.
+    for (int i = 0; i < cues->cue_entries_size(); ++i) {
+      mkvmuxer::CuePoint cue;
+      ASSERT_TRUE(cues->GetCue(i, &cue));
+      EXPECT_EQ(i * kKeyFrameInterval * kFrameDuration / 1000000, cue.time());
+      const mkvmuxer::CuePoint* const cue_in_memory = cues->GetCueByIndex(i);
+      if (cue_in_memory) {
+        EXPECT_EQ(cue.cluster_pos(), cue_in_memory->cluster_pos());
+        EXPECT_TRUE(max_cues_in_memory == 0 ||
+                    cues->cue_entries_size() - i <= max_cues_in_memory);
+      } else {
+        EXPECT_GT(max_cues_in_memory, 0);
+      }
+    }
+
+    mkvparser::MkvReader reader;
+    ASSERT_EQ(0, reader.Open(name.c_str()));
+    MkvWriter moved_writer;
+    ASSERT_TRUE(moved_writer.Open(moved_name.c_str()));
+    EXPECT_TRUE(segment.CopyAndMoveCuesBeforeClusters(&reader, &moved_writer));
+    moved_writer.Close();
+    reader.Close();
+  };
+
+  const TempFileDeleter expected;
+  const TempFileDeleter expected_moved;
+  mux(0, expected.name(), expected_moved.name());
+
+  const TempFileDeleter output;
+  const TempFileDeleter output_moved;
+  mux(4, output.name(), output_moved.name());
+
+  EXPECT_TRUE(CompareFiles(expected.name(), output.name()));
+  EXPECT_TRUE(CompareFiles(expected_moved.name(), output_moved.name()));
+
+  // The moved Cues still point at the keyframes.
+  mkvparser::MkvReader reader;
+  std::unique_ptr<mkvparser::Segment> parser_segment;
+  ASSERT_TRUE(ParseWebmFile(output_moved.name(), &reader, &parser_segment));
+  const mkvparser::Cues* const cues = parser_segment->GetCues();
+  ASSERT_TRUE(cues != nullptr);
+  const mkvparser::Track* const track =
+      parser_segment->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  while (!cues->DoneParsing())
+    cues->LoadCuePoint();
+  int cue_count = 0;
+  for (const mkvparser::CuePoint* cue = cues->GetFirst(); cue != nullptr;
+       cue = cues->GetNext(cue)) {
+    const mkvparser::BlockEntry* const entry =
+        cues->GetBlock(cue, cue->Find(track));
+    ASSERT_TRUE(entry != nullptr);
+    EXPECT_TRUE(entry->GetBlock()->IsKey());
+    EXPECT_EQ(cue_count * kKeyFrameInterval * kFrameDuration,
+              static_cast<std::uint64_t>(entry->GetBlock()->GetTime(
+                  entry->GetCluster())));
+    ++cue_count;
+  }
+  EXPECT_EQ(kNumFrames / kKeyFrameInterval, cue_count);
+  reader.Close();
+}
+
+TEST_F(MuxerTest, CuesOwnership) {
+  // AddCue() takes ownership of the cue points, which stay where they are.
+  mkvmuxer::Cues cues;
+  mkvmuxer::CuePoint* const first = new mkvmuxer::CuePoint();
+  first->set_time(1);
+  ASSERT_TRUE(cues.AddCue(first));
+  for (int i = 0; i < 10; ++i) {
+    mkvmuxer::CuePoint cue;
+    cue.set_time(i + 2);
+    ASSERT_TRUE(cues.AddCueCopy(cue));
+  }
+  EXPECT_EQ(first, cues.GetCueByIndex(0));
+  first->set_time(100);
+  mkvmuxer::CuePoint cue;
+  ASSERT_TRUE(cues.GetCue(0, &cue));
+  EXPECT_EQ(100u, cue.time());
+  EXPECT_FALSE(cues.AddCue(nullptr));
+
+  // The memory limit is set before any cue point is added, and then only
+  // takes copies.
+  EXPECT_FALSE(cues.SetMaxCuesInMemory(4));
+  mkvmuxer::Cues bounded_cues;
+  EXPECT_FALSE(bounded_cues.SetMaxCuesInMemory(-1));
+  ASSERT_TRUE(bounded_cues.SetMaxCuesInMemory(4));
+  std::unique_ptr<mkvmuxer::CuePoint> rejected(new mkvmuxer::CuePoint());
+  EXPECT_FALSE(bounded_cues.AddCue(rejected.get()));
+  for (int i = 0; i < 10; ++i) {
+    cue.set_time(i);
+    ASSERT_TRUE(bounded_cues.AddCueCopy(cue));
+  }
+  EXPECT_EQ(10, bounded_cues.cue_entries_size());
+  EXPECT_EQ(nullptr, bounded_cues.GetCueByIndex(0));
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(bounded_cues.GetCue(i, &cue));
+    EXPECT_EQ(static_cast<mkvmuxer::uint64>(i), cue.time());
+  }
+}
+
+TEST_F(MuxerTest, CopyBlock) {
+  // Remuxes the test file with the frames moved one second later and the
+  // tracks renumbered, either copying the blocks or adding their frames.
+  const std::uint64_t kOffset = 1000000000;
+  const auto remux = [](bool copy_blocks, const std::string& output_name) {
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(GetTestFilePath("bbb_480p_vp9_opus_1second.webm"),
+                              &reader, &parser_segment));
+
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output_name.c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    SegmentInfo* const info = segment.GetSegmentInfo();
+    info->set_writing_app(kAppString);
+    info->set_muxing_app(kAppString);
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+    segment.GetTrackByNumber(kVideoTrackNumber)->set_uid(kVideoTrackNumber);
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    segment.GetTrackByNumber(kAudioTrackNumber)->set_uid(kAudioTrackNumber);
+
+    const mkvparser::Tracks* const tracks = parser_segment->GetTracks();
+    for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+         cluster != nullptr && !cluster->EOS();
+         cluster = parser_segment->GetNext(cluster)) {
+      const mkvparser::BlockEntry* entry = nullptr;
+      ASSERT_EQ(0, cluster->GetFirst(entry));
+      while (entry != nullptr && !entry->EOS()) {
+        const mkvparser::Block* const block = entry->GetBlock();
+        const bool video =
+            tracks->GetTrackByNumber(block->GetTrackNumber())->GetType() ==
+            mkvparser::Track::kVideo;
+        const std::uint64_t track_number =
+            video ? kVideoTrackNumber : kAudioTrackNumber;
+        const std::uint64_t timestamp = block->GetTime(cluster) + kOffset;
+
+        if (copy_blocks) {
+          ASSERT_TRUE(
+              segment.CopyBlock(&reader, block, track_number, timestamp));
+        } else {
+          for (int i = 0; i < block->GetFrameCount(); ++i) {
+            const mkvparser::Block::Frame& block_frame = block->GetFrame(i);
+            std::vector<std::uint8_t> data(block_frame.len);
+            ASSERT_EQ(0, block_frame.Read(&reader, data.data()));
+            Frame frame;
+            ASSERT_TRUE(frame.Init(data.data(), data.size()));
+            frame.set_track_number(track_number);
+            frame.set_timestamp(timestamp);
+            frame.set_is_key(block->IsKey());
+            frame.set_discard_padding(block->GetDiscardPadding());
+            ASSERT_TRUE(segment.AddGenericFrame(&frame));
+          }
+        }
+        ASSERT_EQ(0, cluster->GetNext(entry, entry));
+      }
+    }
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+  };
+
+  const TempFileDeleter expected;
+  remux(false, expected.name());
+  const TempFileDeleter output;
+  remux(true, output.name());
+  EXPECT_TRUE(CompareFiles(expected.name(), output.name()));
+
+  // Laced blocks are copied with their lacing, unless the output track is
+  // laced by the muxer.
+  const std::uint64_t kFrameDuration = 20000000;
+  const int kNumFrames = 12;
+  std::vector<std::vector<std::uint8_t>> frames;
+  for (int i = 0; i < kNumFrames; ++i)
+    frames.emplace_back(10 + i * 3, static_cast<std::uint8_t>(i));
+
+  const auto write_laced = [&](int max_laced_frames, const std::string& name) {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(name.c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kAudioTrackNumber,
+              segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber));
+    AudioTrack* const track = static_cast<AudioTrack*>(
+        segment.GetTrackByNumber(kAudioTrackNumber));
+    ASSERT_TRUE(track->SetMaxLacedFrames(max_laced_frames));
+    track->set_default_duration(kFrameDuration);
+    for (int i = 0; i < kNumFrames; ++i) {
+      ASSERT_TRUE(segment.AddFrame(frames[i].data(), frames[i].size(),
+                                   kAudioTrackNumber, i * kFrameDuration,
+                                   true));
+    }
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+  };
+
+  const TempFileDeleter laced;
+  write_laced(4, laced.name());
+
+  for (const int max_laced_frames : {1, 3}) {
+    const TempFileDeleter copied;
+    {
+      mkvparser::MkvReader reader;
+      std::unique_ptr<mkvparser::Segment> parser_segment;
+      ASSERT_TRUE(ParseWebmFile(laced.name(), &reader, &parser_segment));
+
+      MkvWriter writer;
+      ASSERT_TRUE(writer.Open(copied.name().c_str()));
+      Segment segment;
+      ASSERT_TRUE(segment.Init(&writer));
+      ASSERT_EQ(kAudioTrackNumber, segment.AddAudioTrack(kSampleRate, kChannels,
+                                                         kAudioTrackNumber));
+      AudioTrack* const track = static_cast<AudioTrack*>(
+          segment.GetTrackByNumber(kAudioTrackNumber));
+      ASSERT_TRUE(track->SetMaxLacedFrames(max_laced_frames));
+      track->set_default_duration(kFrameDuration);
+      for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+           cluster != nullptr && !cluster->EOS();
+           cluster = parser_segment->GetNext(cluster)) {
+        const mkvparser::BlockEntry* entry = nullptr;
+        ASSERT_EQ(0, cluster->GetFirst(entry));
+        while (entry != nullptr && !entry->EOS()) {
+          const mkvparser::Block* const block = entry->GetBlock();
+          ASSERT_TRUE(segment.CopyBlock(&reader, block, kAudioTrackNumber,
+                                        block->GetTime(cluster)));
+          ASSERT_EQ(0, cluster->GetNext(entry, entry));
+        }
+      }
+      ASSERT_TRUE(segment.Finalize());
+      writer.Close();
+    }
+
+    mkvparser::MkvReader reader;
+    std::unique_ptr<mkvparser::Segment> parser_segment;
+    ASSERT_TRUE(ParseWebmFile(copied.name(), &reader, &parser_segment));
+
+    // Copied blocks keep four frames each, re-laced ones get three.
+    const int block_frames = max_laced_frames == 1 ? 4 : 3;
+    int frame_index = 0;
+    for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+         cluster != nullptr && !cluster->EOS();
+         cluster = parser_segment->GetNext(cluster)) {
+      const mkvparser::BlockEntry* entry = nullptr;
+      ASSERT_EQ(0, cluster->GetFirst(entry));
+      while (entry != nullptr && !entry->EOS()) {
+        const mkvparser::Block* const block = entry->GetBlock();
+        ASSERT_EQ(block_frames, block->GetFrameCount());
+        // Re-laced frames keep the timestamps of the source lace.
+        EXPECT_EQ(static_cast<long long>(frame_index * kFrameDuration),
+                  block->GetTime(cluster));
+        for (int i = 0; i < block->GetFrameCount(); ++i, ++frame_index) {
+          const mkvparser::Block::Frame& frame = block->GetFrame(i);
+          std::vector<std::uint8_t> data(frame.len);
+          ASSERT_EQ(0, frame.Read(&reader, data.data()));
+          EXPECT_TRUE(data == frames[frame_index]) << "frame " << frame_index;
+        }
+        ASSERT_EQ(0, cluster->GetNext(entry, entry));
+      }
+    }
+    EXPECT_EQ(kNumFrames, frame_index);
+  }
+}
+
+TEST_F(MuxerTest, AesCtrCipher) {
+  // CTR-AES128.Encrypt from NIST SP 800-38A, F.5.1.
+  const std::uint8_t kKey[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                               0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+  const std::uint8_t kCounter[] = {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5,
+                                   0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb,
+                                   0xfc, 0xfd, 0xfe, 0xff};
+  const std::uint8_t kPlaintext[] = {
+      0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e,
+      0x11, 0x73, 0x93, 0x17, 0x2a, 0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03,
+      0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51, 0x30,
+      0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19,
+      0x1a, 0x0a, 0x52, 0xef, 0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b,
+      0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+  const std::uint8_t kCiphertext[] = {
+      0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68,
+      0x64, 0x99, 0x0d, 0xb6, 0xce, 0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70,
+      0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff, 0x5a,
+      0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02,
+      0x0d, 0xb0, 0x3e, 0xab, 0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03,
+      0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee};
+  const std::size_t kSize = sizeof(kPlaintext);
+
+  // AES-128 example from FIPS-197, Appendix C.1. The key stream of a counter
+  // block is its encryption.
+  const std::uint8_t kFipsKey[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+                                   0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+                                   0x0c, 0x0d, 0x0e, 0x0f};
+  const std::uint8_t kFipsPlaintext[] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55,
+                                         0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb,
+                                         0xcc, 0xdd, 0xee, 0xff};
+  const std::uint8_t kFipsCiphertext[] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b,
+                                          0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80,
+                                          0x70, 0xb4, 0xc5, 0x5a};
+
+  AesCtrCipher cipher;
+  EXPECT_FALSE(cipher.Init(kKey, sizeof(kKey) - 1));
+  EXPECT_FALSE(cipher.Init(nullptr, sizeof(kKey)));
+  ASSERT_TRUE(cipher.Init(kKey, sizeof(kKey)));
+
+  AesCtrCipher fips_cipher;
+  ASSERT_TRUE(fips_cipher.Init(kFipsKey, sizeof(kFipsKey)));
+
+  // Both implementations, where AES-NI is available.
+  for (const bool hardware : {false, true}) {
+    cipher.set_hardware_enabled(hardware);
+    fips_cipher.set_hardware_enabled(hardware);
+
+    std::uint8_t output[kSize];
+    cipher.Process(kCounter, 0, kPlaintext, output, kSize);
+    EXPECT_TRUE(std::equal(output, output + kSize, kCiphertext));
+
+    // Decryption, in place.
+    cipher.Process(kCounter, 0, output, output, kSize);
+    EXPECT_TRUE(std::equal(output, output + kSize, kPlaintext));
+
+    // Any split of the stream gives the same result.
+    for (const std::size_t split : {1, 7, 15, 16, 17, 33, 63}) {
+      std::fill(output, output + kSize, 0);
+      cipher.Process(kCounter, 0, kPlaintext, output, split);
+      cipher.Process(kCounter, split, kPlaintext + split, output + split,
+                     kSize - split);
+      EXPECT_TRUE(std::equal(output, output + kSize, kCiphertext))
+          << "split " << split;
+    }
+
+    const std::uint8_t zeros[16] = {0};
+    cipher.Process(kCounter, 0, kPlaintext, output, kSize);
+    fips_cipher.Process(kFipsPlaintext, 0, zeros, output, sizeof(zeros));
+    EXPECT_TRUE(std::equal(output, output + sizeof(zeros), kFipsCiphertext));
+  }
+
+  // The implementations agree on long runs of blocks, and the block counter
+  // wraps around within the last 8 octets of the counter block.
+  std::uint8_t counter[16];
+  std::fill(counter, counter + 8, 0x5a);
+  std::fill(counter + 8, counter + 16, 0xff);
+  std::vector<std::uint8_t> input(1000);
+  for (std::size_t i = 0; i < input.size(); ++i)
+    input[i] = static_cast<std::uint8_t>(i * 7);
+  std::vector<std::uint8_t> portable(input.size());
+  std::vector<std::uint8_t> hardware(input.size());
+  cipher.set_hardware_enabled(false);
+  cipher.Process(counter, 5, input.data(), portable.data(), input.size());
+  cipher.set_hardware_enabled(true);
+  cipher.Process(counter, 5, input.data(), hardware.data(), input.size());
+  EXPECT_TRUE(portable == hardware);
+
+  // The second block of the stream, which starts 11 octets into |input|,
+  // uses a counter of 0.
+  std::uint8_t second_counter[16];
+  std::fill(second_counter, second_counter + 8, 0x5a);
+  std::fill(second_counter + 8, second_counter + 16, 0x00);
+  std::uint8_t second_block[16];
+  cipher.Process(second_counter, 0, input.data() + 11, second_block, 16);
+  EXPECT_TRUE(std::equal(second_block, second_block + 16,
+                         portable.begin() + 11));
+}
+
+TEST_F(MuxerTest, EncryptedFrames) {
+  const std::uint8_t kKey[] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                               0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+  const std::string kKeyId = "webm-key-id";
+  const std::uint64_t kIv = 0x0102030405060708ULL;
+  const std::uint64_t kFrameDuration = 33000000;
+  const std::size_t kFrameSize = 40;
+  const std::vector<std::uint32_t> kPartitions = {4, 12, 20, 30};
+
+  std::vector<std::vector<std::uint8_t>> frames;
+  for (int i = 0; i < 3; ++i) {
+    frames.emplace_back(kFrameSize);
+    for (std::size_t j = 0; j < kFrameSize; ++j)
+      frames[i][j] = static_cast<std::uint8_t>(i * 64 + j);
+  }
+
+  const TempFileDeleter output;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(output.name().c_str()));
+    Segment segment;
+    ASSERT_TRUE(segment.Init(&writer));
+    ASSERT_EQ(kVideoTrackNumber,
+              segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber));
+
+    const std::uint8_t* const key_id =
+        reinterpret_cast<const std::uint8_t*>(kKeyId.data());
+    EXPECT_FALSE(segment.SetTrackEncryption(kVideoTrackNumber, key_id,
+                                            kKeyId.size(), kKey,
+                                            sizeof(kKey) - 1));
+    EXPECT_FALSE(segment.SetTrackEncryption(kVideoTrackNumber + 1, key_id,
+                                            kKeyId.size(), kKey,
+                                            sizeof(kKey)));
+    ASSERT_TRUE(segment.SetTrackEncryption(kVideoTrackNumber, key_id,
+                                           kKeyId.size(), kKey, sizeof(kKey)));
+    EXPECT_FALSE(segment.SetTrackEncryption(kVideoTrackNumber, key_id,
+                                            kKeyId.size(), kKey,
+                                            sizeof(kKey)));
+    FrameEncryptor* const encryptor =
+        segment.GetTrackByNumber(kVideoTrackNumber)->encryptor();
+    ASSERT_NE(nullptr, encryptor);
+
+    // Keys start from random IVs; the test sets its own to know the output.
+    mkvmuxer::uint64 random_ivs[2] = {0, 0};
+    ASSERT_TRUE(FrameEncryptor::GenerateIv(&random_ivs[0]));
+    ASSERT_TRUE(FrameEncryptor::GenerateIv(&random_ivs[1]));
+    EXPECT_NE(random_ivs[0], random_ivs[1]);
+    encryptor->set_next_iv(kIv);
+
+    // A whole frame, a partitioned one and one in the clear.
+    for (int i = 0; i < 3; ++i) {
+      Frame frame;
+      ASSERT_TRUE(frame.Init(frames[i].data(), frames[i].size()));
+      frame.set_track_number(kVideoTrackNumber);
+      frame.set_timestamp(i * kFrameDuration);
+      frame.set_is_key(i == 0);
+      if (i == 1) {
+        EXPECT_FALSE(frame.SetEncryptionPartitions(nullptr, 1));
+        ASSERT_TRUE(frame.SetEncryptionPartitions(
+            kPartitions.data(), static_cast<int>(kPartitions.size())));
+      }
+      if (i == 2)
+        frame.set_encrypted(false);
+      ASSERT_TRUE(segment.AddGenericFrame(&frame));
+    }
+    EXPECT_EQ(kIv + 2, encryptor->next_iv());
+
+    // Partitions beyond the end of the frame are rejected.
+    Frame frame;
+    ASSERT_TRUE(frame.Init(frames[0].data(), frames[0].size()));
+    frame.set_track_number(kVideoTrackNumber);
+    frame.set_timestamp(3 * kFrameDuration);
+    const std::uint32_t kBadPartition = kFrameSize + 1;
+    ASSERT_TRUE(frame.SetEncryptionPartitions(&kBadPartition, 1));
+    EXPECT_FALSE(segment.AddGenericFrame(&frame));
+
+    EXPECT_FALSE(segment.SetTrackEncryption(kVideoTrackNumber, key_id,
+                                            kKeyId.size(), kKey,
+                                            sizeof(kKey)));
+    ASSERT_TRUE(segment.Finalize());
+    writer.Close();
+  }
+
+  mkvparser::MkvReader reader;
+  std::unique_ptr<mkvparser::Segment> parser_segment;
+  ASSERT_TRUE(ParseWebmFile(output.name(), &reader, &parser_segment));
+
+  const mkvparser::Track* const track =
+      parser_segment->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  ASSERT_NE(nullptr, track);
+  ASSERT_EQ(1u, track->GetContentEncodingCount());
+  const mkvparser::ContentEncoding::ContentEncryption* const encryption =
+      track->GetContentEncodingByIndex(0)->GetEncryptionByIndex(0);
+  ASSERT_NE(nullptr, encryption);
+  EXPECT_EQ(kKeyId, std::string(reinterpret_cast<char*>(encryption->key_id),
+                                static_cast<std::size_t>(
+                                    encryption->key_id_len)));
+
+  AesCtrCipher cipher;
+  ASSERT_TRUE(cipher.Init(kKey, sizeof(kKey)));
+
+  std::vector<std::vector<std::uint8_t>> blocks;
+  for (const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+       cluster != nullptr && !cluster->EOS();
+       cluster = parser_segment->GetNext(cluster)) {
+    const mkvparser::BlockEntry* entry = nullptr;
+    ASSERT_EQ(0, cluster->GetFirst(entry));
+    while (entry != nullptr && !entry->EOS()) {
+      const mkvparser::Block::Frame& frame = entry->GetBlock()->GetFrame(0);
+      blocks.emplace_back(frame.len);
+      ASSERT_EQ(0, frame.Read(&reader, blocks.back().data()));
+      ASSERT_EQ(0, cluster->GetNext(entry, entry));
+    }
+  }
+  ASSERT_EQ(3u, blocks.size());
+
+  // Signal byte, IV, and the counter block made of the IV.
+  const auto check_header = [&](const std::vector<std::uint8_t>& block,
+                                std::uint8_t signal, std::uint64_t iv,
+                                std::uint8_t* counter) {
+    ASSERT_GE(block.size(), 9u);
+    EXPECT_EQ(signal, block[0]);
+    std::fill(counter, counter + 16, 0);
+    for (int i = 0; i < 8; ++i)
+      counter[i] = static_cast<std::uint8_t>(iv >> (56 - 8 * i));
+    EXPECT_TRUE(std::equal(counter, counter + 8, block.begin() + 1));
+  };
+
+  // Whole frame.
+  std::uint8_t counter[16];
+  check_header(blocks[0], 0x01, kIv, counter);
+  ASSERT_EQ(1 + 8 + kFrameSize, blocks[0].size());
+  std::vector<std::uint8_t> decrypted(kFrameSize);
+  cipher.Process(counter, 0, blocks[0].data() + 9, decrypted.data(),
+                 kFrameSize);
+  EXPECT_TRUE(decrypted == frames[0]);
+  EXPECT_FALSE(std::equal(frames[0].begin(), frames[0].end(),
+                          blocks[0].begin() + 9));
+
+  // Partitioned frame: the odd partitions are encrypted as one stream.
+  check_header(blocks[1], 0x03, kIv + 1, counter);
+  const std::size_t header_size = 1 + 8 + 1 + 4 * kPartitions.size();
+  ASSERT_EQ(header_size + kFrameSize, blocks[1].size());
+  EXPECT_EQ(kPartitions.size(), blocks[1][9]);
+  for (std::size_t i = 0; i < kPartitions.size(); ++i) {
+    const std::uint8_t* const offset = &blocks[1][10 + 4 * i];
+    EXPECT_EQ(kPartitions[i], (static_cast<std::uint32_t>(offset[0]) << 24) |
+                                  (offset[1] << 16) | (offset[2] << 8) |
+                                  offset[3]);
+  }
+  const std::uint8_t* const data = blocks[1].data() + header_size;
+  std::uint64_t stream_offset = 0;
+  std::size_t start = 0;
+  for (std::size_t i = 0; i <= kPartitions.size(); ++i) {
+    const std::size_t end =
+        i < kPartitions.size() ? kPartitions[i] : kFrameSize;
+    std::vector<std::uint8_t> partition(data + start, data + end);
+    if (i % 2 == 1) {
+      EXPECT_FALSE(std::equal(partition.begin(), partition.end(),
+                              frames[1].begin() + start));
+      cipher.Process(counter, stream_offset, partition.data(),
+                     partition.data(), partition.size());
+      stream_offset += partition.size();
+    }
+    EXPECT_TRUE(std::equal(partition.begin(), partition.end(),
+                           frames[1].begin() + start))
+        << "partition " << i;
+    start = end;
+  }
+
+  // Clear frame.
+  ASSERT_EQ(1 + kFrameSize, blocks[2].size());
+  EXPECT_EQ(0, blocks[2][0]);
+  EXPECT_TRUE(std::equal(frames[2].begin(), frames[2].end(),
+                         blocks[2].begin() + 1));
+}
+
 }  // namespace test
 }  // namespace libwebm
 
@@ -10,7 +10,11 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "mkvparser.hpp"
 #include "mkvreader.hpp"
@@ -27,6 +31,7 @@ using ::mkvparser::Cues;
 using ::mkvparser::MkvReader;
 using ::mkvparser::Segment;
 using ::mkvparser::SegmentInfo;
+using ::mkvparser::SegmentStats;
 using ::mkvparser::Track;
 using ::mkvparser::Tracks;
 using ::mkvparser::VideoTrack;
@@ -564,6 +569,162 @@ TEST_F(ParserTest, StereoModeParsedCorrectly) {
   EXPECT_EQ(144, video_track->GetDisplayHeight());
 }
 
+TEST_F(ParserTest, SegmentStats) {
+  ASSERT_TRUE(CreateAndLoadSegment("output_cues.webm"));
+  const Cues* const cues = segment_->GetCues();
+  ASSERT_TRUE(cues != NULL);
+  while (!cues->DoneParsing()) {
+    cues->LoadCuePoint();
+  }
+
+  long block_count = 0;
+  const Cluster* cluster = segment_->GetFirst();
+  while (cluster != NULL && !cluster->EOS()) {
+    const BlockEntry* block_entry;
+    EXPECT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      ++block_count;
+      EXPECT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+    cluster = segment_->GetNext(cluster);
+  }
+
+  const SegmentStats* const stats = segment_->GetStats();
+#ifdef MKVPARSER_ENABLE_STATS
+  ASSERT_TRUE(stats != NULL);
+  EXPECT_GT(stats->read_calls[SegmentStats::kReadId], 0);
+  EXPECT_GT(stats->read_calls[SegmentStats::kReadSize], 0);
+  EXPECT_GT(stats->read_calls[SegmentStats::kReadPayload], 0);
+  EXPECT_GE(stats->read_bytes[SegmentStats::kReadPayload],
+            stats->read_calls[SegmentStats::kReadPayload]);
+  EXPECT_EQ(static_cast<long long>(segment_->GetCount()),
+            stats->clusters_parsed);
+  EXPECT_EQ(block_count, stats->blocks_parsed);
+  EXPECT_EQ(stats->blocks_parsed,
+            stats->blocks_by_lacing[Block::kLacingNone]);
+  EXPECT_GT(stats->allocations, stats->blocks_parsed);
+#else
+  EXPECT_TRUE(stats == NULL);
+#endif
+}
+
+TEST_F(ParserTest, LeadingJunk) {
+  const std::vector<std::uint8_t> webm =
+      ReadFileBytes(GetTestFilePath("segment_info.webm"));
+  ASSERT_FALSE(webm.empty());
+
+  // Junk containing stray EBML ID bytes, including a complete ID followed by
+  // an invalid size field.
+  std::vector<char> junk(300, 0x1A);
+  const char kFakeHeader[] = {0x1A, 0x45, static_cast<char>(0xDF),
+                              static_cast<char>(0xA3), 0x00};
+  std::memcpy(&junk[100], kFakeHeader, sizeof(kFakeHeader));
+
+  const TempFileDeleter temp_file;
+  {
+    std::ofstream output(temp_file.name().c_str(), std::ios::binary);
+    output.write(&junk[0], junk.size());
+    output.write(reinterpret_cast<const char*>(webm.data()), webm.size());
+  }
+
+  ASSERT_EQ(0, reader_.Open(temp_file.name().c_str()));
+  is_reader_open_ = true;
+
+  EXPECT_EQ(static_cast<long long>(junk.size()),
+            mkvparser::FindEBMLHeader(&reader_, 0, 1024));
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            mkvparser::FindEBMLHeader(&reader_, 0, 200));
+
+  mkvparser::EBMLHeader ebml_header;
+  pos_ = 0;
+  ASSERT_EQ(0, ebml_header.Parse(&reader_, pos_));
+  EXPECT_STREQ("webm", ebml_header.m_docType);
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+  ASSERT_GE(segment_->Load(), 0);
+  EXPECT_STREQ(kAppString, segment_->GetInfo()->GetMuxingAppAsUTF8());
+}
+
+TEST_F(ParserTest, UnknownSizeClusters) {
+  // Muxed in live mode to a non-seekable writer: the segment and its clusters
+  // have unknown sizes.
+  ASSERT_TRUE(CreateAndLoadSegment("unknown_size_clusters.webm"));
+  ASSERT_EQ(3, segment_->GetCount());
+
+  const Cluster* clusters[3];
+  const Cluster* cluster = segment_->GetFirst();
+  int block_count = 0;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(cluster != NULL && !cluster->EOS());
+    EXPECT_GT(cluster->GetElementSize(), 0);
+    EXPECT_GT(cluster->GetEntryCount(), 0);
+    clusters[i] = cluster;
+
+    const BlockEntry* block_entry = NULL;
+    EXPECT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      ++block_count;
+      EXPECT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+    cluster = segment_->GetNext(cluster);
+  }
+  EXPECT_EQ(60, block_count);
+  EXPECT_TRUE(cluster->EOS());
+
+  // Walk from a preloaded cluster in a segment that has not loaded any.
+  Segment* segment = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment));
+  std::unique_ptr<Segment> preload_segment(segment);
+  ASSERT_EQ(0, preload_segment->ParseHeaders());
+
+  const Cluster* const preloaded =
+      preload_segment->FindOrPreloadCluster(clusters[1]->GetPosition());
+  ASSERT_TRUE(preloaded != NULL && !preloaded->EOS());
+
+  const Cluster* next = preload_segment->GetNext(preloaded);
+  ASSERT_TRUE(next != NULL && !next->EOS());
+  EXPECT_EQ(clusters[2]->GetPosition(), next->GetPosition());
+  EXPECT_EQ(clusters[1]->GetElementSize(), preloaded->GetElementSize());
+  EXPECT_EQ(clusters[1]->GetEntryCount(), preloaded->GetEntryCount());
+
+  const Cluster* parsed_next = NULL;
+  long long pos = 0;
+  long len = 0;
+  ASSERT_EQ(0, preload_segment->ParseNext(preloaded, parsed_next, pos, len));
+  EXPECT_EQ(next, parsed_next);
+
+  // An empty cluster of unknown size in front of the last one is skipped.
+  const unsigned char kEmptyCluster[] = {0x1f, 0x43, 0xb6, 0x75, 0x01, 0xff,
+                                         0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                         0xe7, 0x81, 0x00};
+  std::vector<std::uint8_t> data = ReadFileBytes(filename_);
+  data.insert(data.begin() + clusters[2]->m_element_start,
+              std::begin(kEmptyCluster), std::end(kEmptyCluster));
+
+  const TempFileDeleter output;
+  {
+    std::ofstream output_stream(output.name().c_str(), std::ios::binary);
+    output_stream.write(reinterpret_cast<const char*>(data.data()),
+                        data.size());
+    ASSERT_TRUE(output_stream.good());
+  }
+
+  MkvReader reader;
+  ASSERT_EQ(0, reader.Open(output.name().c_str()));
+  ASSERT_EQ(0, Segment::CreateInstance(&reader, pos_, segment));
+  std::unique_ptr<Segment> empty_cluster_segment(segment);
+  ASSERT_EQ(0, empty_cluster_segment->ParseHeaders());
+
+  const Cluster* const first =
+      empty_cluster_segment->FindOrPreloadCluster(clusters[1]->GetPosition());
+  ASSERT_TRUE(first != NULL && !first->EOS());
+  next = empty_cluster_segment->GetNext(first);
+  ASSERT_TRUE(next != NULL && !next->EOS());
+  EXPECT_EQ(clusters[2]->GetPosition() +
+                static_cast<long long>(sizeof(kEmptyCluster)),
+            next->GetPosition());
+  EXPECT_EQ(clusters[2]->GetTimeCode(), next->GetTimeCode());
+}
+
 }  // namespace test
 }  // namespace libwebm
 
@@ -16,7 +16,9 @@
 #include <fstream>
 #include <ios>
 #include <memory>
+#include <iterator>
 #include <string>
+#include <vector>
 
 #include "common/libwebm_utils.h"
 
@@ -79,6 +81,29 @@ std::uint64_t GetFileSize(const std::string& file_name) {
   return file_size;
 }
 
+std::vector<std::uint8_t> ReadFileBytes(const std::string& file_name) {
+  std::ifstream file(file_name.c_str(), std::ios::binary);
+  return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(file)),
+                                   std::istreambuf_iterator<char>());
+}
+
+bool ParseWebmFile(const std::string& file_name, mkvparser::MkvReader* reader,
+                   std::unique_ptr<mkvparser::Segment>* segment) {
+  if (!reader || !segment || reader->Open(file_name.c_str()))
+    return false;
+
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  if (ebml_header.Parse(reader, pos))
+    return false;
+
+  mkvparser::Segment* segment_ptr = nullptr;
+  if (mkvparser::Segment::CreateInstance(reader, pos, segment_ptr))
+    return false;
+  segment->reset(segment_ptr);
+  return segment_ptr->Load() == 0;
+}
+
 TempFileDeleter::TempFileDeleter() {
   file_name_ = GetTempFileName();
 }
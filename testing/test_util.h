@@ -9,7 +9,12 @@
 #define LIBWEBM_TESTING_TEST_UTIL_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "mkvparser.hpp"
+#include "mkvreader.hpp"
 
 namespace libwebm {
 namespace test {
@@ -57,6 +62,16 @@ std::string GetTempFileName();
 // Returns size of file specified by |file_name|, or 0 upon failure.
 std::uint64_t GetFileSize(const std::string& file_name);
 
+// Returns the contents of the file specified by |file_name|, or an empty
+// vector upon failure.
+std::vector<std::uint8_t> ReadFileBytes(const std::string& file_name);
+
+// Opens the file specified by |file_name| with |reader|, parses its EBML
+// header and loads the segment that follows into |segment|. Returns true on
+// success.
+bool ParseWebmFile(const std::string& file_name, mkvparser::MkvReader* reader,
+                   std::unique_ptr<mkvparser::Segment>* segment);
+
 // Manages life of temporary file specified at time of construction. Deletes
 // file upon destruction.
 class TempFileDeleter {
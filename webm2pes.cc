@@ -450,19 +450,6 @@ bool Webm2Pes::WritePesPacket(const mkvparser::Block::Frame& vpx_frame,
     return false;
   }
 
-  ///
-  /// TODO: DEBUG/REMOVE
-  ///
-  printf("-FRAME TOTAL LENGTH %ld--\n", vpx_frame.len);
-  for (const Range& frame_range : frame_ranges) {
-    printf("--frame range: off:%lu len:%lu\n", frame_range.offset,
-           frame_range.length);
-  }
-  for (const Range& payload_range : packet_payload_ranges) {
-    printf("---payload range: off:%lu len:%lu\n", payload_range.offset,
-           payload_range.length);
-  }
-
   const std::int64_t khz90_pts = NanosecondsTo90KhzTicks(nanosecond_pts);
   header.optional_header.SetPtsBits(khz90_pts);
 